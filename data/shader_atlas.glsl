@@ -7,8 +7,11 @@ phong phong.vs phong.fs
 phong_multipass_ambient phong.vs phong_multipass_ambient.fs
 phong_multipass_light phong.vs phong_multipass_light.fs
 plain basic.vs plain.fs
+plain_mdi multidraw.vs plain.fs
 compute test.cs
-gbuffer_fill basic.vs gbuffer_fill.fs
+gbuffer_fill basic.vs gbuffer_fill.fs USE_ALBEDO_TEXTURE,ALPHA_MASK
+@gbuffer_fill_mdi multidraw.vs gbuffer_fill.fs USE_ALBEDO_TEXTURE,ALPHA_MASK,USE_NORMALMAP_TEXTURE
+@gbuffer_fill basic.vs gbuffer_fill.fs USE_ALBEDO_TEXTURE,ALPHA_MASK,USE_NORMALMAP_TEXTURE
 phong_deferred quad.vs deferred_single.fs
 light_volume light_volume.vs light_volume.fs
 deferred_ambient quad.vs deferred_ambient.fs
@@ -55,6 +58,8 @@ out vec3 v_bitangent;
 
 uniform float u_time;
 
+#include "vertex_decode"
+
 void main()
 {	
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
@@ -63,7 +68,7 @@ void main()
 	v_bitangent = (u_model * vec4( a_bitangent, 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
+	v_position = decodePosition( a_vertex );
 	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
 	//store the color in the varying var to use it from the pixel shader
@@ -245,14 +250,16 @@ out vec3 v_world_position;
 out vec3 v_normal;
 out vec2 v_uv;
 
+#include "vertex_decode"
+
 void main()
 {	
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
 	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
-	v_world_position = (u_model * vec4( a_vertex, 1.0) ).xyz;
+	v_position = decodePosition( a_vertex );
+	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
 	//store the texture coordinates
 	v_uv = a_coord;
@@ -262,6 +269,48 @@ void main()
 }
 
 
+\multidraw.vs
+
+#version 430 core
+
+//geometry from the MegaBuffer, see MegaBuffer::render
+layout(location = 0) in vec3 a_vertex;
+layout(location = 1) in vec3 a_normal;
+layout(location = 2) in vec2 a_coord;
+layout(location = 7) in uint a_draw_id; //instanced, equals the base_instance of the command
+
+layout(std430, binding = 0) readonly buffer DrawModels {
+	mat4 u_models[];
+};
+
+uniform vec3 u_camera_pos;
+
+uniform mat4 u_viewprojection;
+
+//this will store the color for the pixel shader
+out vec3 v_position;
+out vec3 v_world_position;
+out vec3 v_normal;
+out vec2 v_uv;
+
+void main()
+{	
+	mat4 model = u_models[a_draw_id];
+
+	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
+	v_normal = (model * vec4( a_normal, 0.0) ).xyz;
+	
+	//calcule the vertex in object space
+	v_position = a_vertex;
+	v_world_position = (model * vec4( v_position, 1.0) ).xyz;
+	
+	//store the texture coordinates
+	v_uv = a_coord;
+
+	//calcule the position of the vertex using the matrices
+	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
+}
+
 \phong.vs
 
 #version 330 core
@@ -282,13 +331,15 @@ out vec2 v_uv;
 out vec4 v_color;
 out vec3 v_camera_position;
 
+#include "vertex_decode"
+
 void main()
 {
     // Calculate the normal in world space
     v_normal = normalize((u_model * vec4(a_normal, 0.0)).xyz);
     
     // Calculate the vertex in object space
-    v_position = a_vertex;
+    v_position = decodePosition(a_vertex);
     v_world_position = (u_model * vec4(v_position, 1.0)).xyz;
     
     // Store the color and texture coordinates
@@ -609,25 +660,58 @@ layout(location = 1) out vec4 gbuffer_normal;
 layout(location = 2) out vec3 u_screen_position;
 
 uniform sampler2D u_color_texture;
+uniform sampler2D u_normal_texture;
 uniform sampler2D u_metallic_roughness_texture;
 uniform vec4 u_color;
 uniform float u_alpha_cutoff;
 
+#ifdef USE_NORMALMAP_TEXTURE
+// Base tangent a partir de les derivades de posicio i uv (multidraw.vs no envia tangents)
+mat3 cotangent_frame(vec3 N, vec3 p, vec2 uv)
+{
+    vec3 dp1 = dFdx(p);
+    vec3 dp2 = dFdy(p);
+    vec2 duv1 = dFdx(uv);
+    vec2 duv2 = dFdy(uv);
+    vec3 dp2perp = cross(dp2, N);
+    vec3 dp1perp = cross(N, dp1);
+    vec3 T = dp2perp * duv1.x + dp1perp * duv2.x;
+    vec3 B = dp2perp * duv1.y + dp1perp * duv2.y;
+    float invmax = inversesqrt(max(max(dot(T, T), dot(B, B)), 1e-12));
+    return mat3(T * invmax, B * invmax, N);
+}
+#endif
+
 void main()
 {
+#ifdef USE_ALBEDO_TEXTURE
     vec4 tex_color = texture(u_color_texture, v_uv);
+#else
+    vec4 tex_color = vec4(1.0);
+#endif
     vec3 final_color = tex_color.rgb * u_color.rgb;
 
     // Opcional: alpha masking per a objectes amb textures transparents
+    // (sense ALPHA_MASK no hi ha discard i el test de profunditat es pot fer abans del shader)
+#ifdef ALPHA_MASK
     float alpha = tex_color.a * u_color.a;
     if(alpha < u_alpha_cutoff)
         discard;
+#endif
 
     // Output cap al G-Buffer
     gbuffer_albedo = vec4(final_color, 1.0);
 
+    vec3 N = normalize(v_normal);
+#ifdef USE_NORMALMAP_TEXTURE
+    // Els normal maps en BC5 nomes guarden XY, Z es reconstrueix
+    vec2 xy = texture(u_normal_texture, v_uv).rg * 2.0 - 1.0;
+    vec3 normal_ts = vec3(xy, sqrt(max(0.0, 1.0 - xy.x * xy.x - xy.y * xy.y)));
+    N = normalize(cotangent_frame(N, v_world_position, v_uv) * normal_ts);
+#endif
+
     // Encode normal a [0,1] per emmagatzemar-la com a textura
-    vec3 encoded_normal = normalize(v_normal) * 0.5 + 0.5;
+    vec3 encoded_normal = N * 0.5 + 0.5;
     gbuffer_normal = vec4(encoded_normal, 1.0);
 
     u_screen_position = v_world_position;
@@ -824,9 +908,11 @@ uniform vec3 u_camera_pos;
 out vec3 v_world_position;     
 out vec3 v_normal;              
 
+#include "vertex_decode"
+
 void main()
 {
-    v_world_position = (u_model * vec4(a_vertex, 1.0)).xyz;
+    v_world_position = (u_model * vec4(decodePosition(a_vertex), 1.0)).xyz;
     
     v_normal = normalize((u_model * vec4(a_normal, 0.0)).xyz);
     
@@ -932,12 +1018,36 @@ uniform vec3 u_camera_position;
 // Ambient light
 uniform vec3 u_ambient_light;
 
+// Irradiance volume: 9 slabs of u_irradiance_dims.z slices, one per SH coefficient
+uniform int u_use_irradiance;
+uniform sampler3D u_irradiance_texture;
+uniform mat4 u_irradiance_inverse_model;
+uniform vec3 u_irradiance_dims;
+
 uniform vec2 u_res_inv;
 
 out vec4 FragColor;
 
 #include "PBR_functions"
 
+vec3 sampleIrradiance(vec3 world_pos, vec3 N) {
+    vec3 local = (u_irradiance_inverse_model * vec4(world_pos, 1.0)).xyz + 0.5;
+    if (any(lessThan(local, vec3(0.0))) || any(greaterThan(local, vec3(1.0))))
+        return u_ambient_light;
+
+    // between the centers of the first and last texels, so slabs are never mixed
+    vec3 coord = local * (u_irradiance_dims - 1.0) + 0.5;
+    vec2 uv = coord.xy / u_irradiance_dims.xy;
+    vec3 c[9];
+    for (int i = 0; i < 9; ++i)
+        c[i] = texture(u_irradiance_texture, vec3(uv, (coord.z + float(i) * u_irradiance_dims.z) / (9.0 * u_irradiance_dims.z))).rgb;
+
+    vec3 irradiance = c[0] + c[1] * N.y + c[2] * N.z + c[3] * N.x
+        + c[4] * N.x * N.y + c[5] * N.y * N.z + c[6] * (3.0 * N.z * N.z - 1.0)
+        + c[7] * N.x * N.z + c[8] * (N.x * N.x - N.y * N.y);
+    return max(irradiance, vec3(0.0));
+}
+
 
 vec3 reconstructPosition(vec2 uv, float depth) {
     float z = depth * 2.0 - 1.0;
@@ -964,12 +1074,30 @@ void main() {
     vec3 kS = fresnelSchlick(1.0, F0); // full reflection
     vec3 kD = (1.0 - kS) * (1.0 - metalness);
 
-    vec3 ambient = u_ambient_light * albedo * kD;
+    vec3 ambient_light = u_ambient_light;
+    if (u_use_irradiance == 1)
+    {
+        vec3 N = normalize(normal_metal.rgb * 2.0 - 1.0);
+        ambient_light = sampleIrradiance(reconstructPosition(uv, depth), N);
+    }
+    vec3 ambient = ambient_light * albedo * kD;
 
     FragColor = vec4(ambient, 1.0);
 }
 
 
+\vertex_decode
+
+// Meshes uploaded with Mesh::use_packed_vertices store the position as 16 bits normalized inside its AABB
+// (normals 10:10:10:2 and half float uvs are expanded by the hardware), for regular meshes offset is 0 and scale is 1
+uniform vec3 u_vertex_dequant_offset;
+uniform vec3 u_vertex_dequant_scale;
+
+vec3 decodePosition(vec3 a_position)
+{
+	return u_vertex_dequant_offset + a_position * u_vertex_dequant_scale;
+}
+
 \PBR_functions
 
 // PBR_functions.glsl
@@ -1153,9 +1281,12 @@ uniform mat4 u_prev_mvp;
 out vec4 v_current_pos;
 out vec4 v_prev_pos;
 
+#include "vertex_decode"
+
 void main() {
-    vec4 world_pos = u_model * vec4(a_vertex, 1.0);
-    vec4 prev_world_pos = u_prev_model * vec4(a_vertex, 1.0);
+    vec3 position = decodePosition(a_vertex);
+    vec4 world_pos = u_model * vec4(position, 1.0);
+    vec4 prev_world_pos = u_prev_model * vec4(position, 1.0);
     
     // Posiciones en clip space
     v_current_pos = u_view_projection * world_pos;
@@ -6,6 +6,7 @@
 
 #include "editor.h"
 #include "pipeline/light.h"
+#include "pipeline/irradiance.h"
 
 std::vector<vec3> debug_points; //useful
 
@@ -22,6 +23,7 @@ Application::Application()
 	REGISTER_ENTITY_TYPE(SCN::PrefabEntity);
 	//add here your own entities
 	REGISTER_ENTITY_TYPE(SCN::LightEntity);
+	REGISTER_ENTITY_TYPE(SCN::IrradianceVolumeEntity);
 	//...
 
 	// Create camera
@@ -72,11 +74,11 @@ void Application::render(void)
 		GFX::drawGrid();
 
 		//render debug points 
-		glDisable(GL_DEPTH_TEST);
+		GFX::setGPUState(GFX::getGPUState() & ~GFX_STATE_DEPTH_TEST_MASK);
 		GFX::drawPoints(debug_points, Vector4f(1, 1, 0, 1),4);
 	}
 
-	glDisable(GL_DEPTH_TEST);
+	GFX::setGPUState(GFX::getGPUState() & ~GFX_STATE_DEPTH_TEST_MASK);
 	//render anything in the gui after this
 }
 
@@ -122,6 +124,14 @@ void Application::update(double seconds_elapsed)
 	{
 		Input::centerMouse();
 	}
+	//shaders edited in the atlas or its includes
+	GFX::Shader::UpdateHotReload();
+
+	//delete the unused assets over the budgets, prefabs first as they release meshes and materials, and these the textures
+	SCN::Prefab::sPrefabsLoaded.trim();
+	SCN::Material::sMaterials.trim();
+	GFX::Mesh::sMeshesLoaded.trim();
+	GFX::Texture::sTexturesLoaded.trim();
 }
 
 //called to render the GUI from
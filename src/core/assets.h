@@ -0,0 +1,215 @@
+#pragma once
+
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "math.h"
+
+namespace CORE {
+
+	//Registry of the loaded assets of one type (textures, meshes, materials, prefabs).
+	//Assets are found by name (usually the path) or by the hash of the data they were made from, both are
+	//hashed lookups. Several names can point to the same asset, so identical payloads are loaded only once.
+	//Owners call addRef/release. When the references of an asset drop to zero it goes to a LRU list and the
+	//least recently released ones are deleted once the unused bytes exceed the budget. Assets that never
+	//got a reference are not owned by the registry and are never deleted by it.
+	template<class T> class AssetRegistry {
+	public:
+		struct sInfo {
+			std::vector<std::string> names;
+			uint64 hash; //0 if unknown
+			int refs;
+			bool counted; //has been referenced at least once
+			size_t bytes;
+			typename std::list<T*>::iterator lru; //position in unused, only when counted and refs is 0
+		};
+
+		size_t budget; //bytes of unused assets kept around, 0 keeps all of them
+
+		AssetRegistry(size_t budget = 0) : budget(budget), total_bytes(0), unused_bytes(0) {}
+
+		T* find(const std::string& name)
+		{
+			auto it = by_name.find(name);
+			return it != by_name.end() ? it->second : nullptr;
+		}
+
+		T* findByHash(uint64 hash)
+		{
+			auto it = by_hash.find(hash);
+			return (hash && it != by_hash.end()) ? it->second : nullptr;
+		}
+
+		//registers the asset with a new name (empty for hash only), the previous asset with that name is forgotten
+		void add(const std::string& name, T* asset, uint64 hash = 0)
+		{
+			sInfo& info = getInfo(asset);
+			if (name.size())
+			{
+				T* previous = find(name);
+				if (previous != asset)
+				{
+					if (previous)
+						removeName(previous, name);
+					by_name[name] = asset;
+					info.names.push_back(name);
+				}
+			}
+			setHash(asset, hash);
+		}
+
+		void setHash(T* asset, uint64 hash)
+		{
+			if (!hash)
+				return;
+			sInfo& info = getInfo(asset);
+			eraseHash(asset, info.hash);
+			info.hash = hash;
+			by_hash[hash] = asset;
+		}
+
+		//memory used by the asset, counted in the budget when unused
+		void setBytes(T* asset, size_t bytes)
+		{
+			auto it = infos.find(asset);
+			if (it == infos.end())
+				return;
+			sInfo& info = it->second;
+			total_bytes += bytes - info.bytes;
+			if (isUnused(info))
+				unused_bytes += bytes - info.bytes;
+			info.bytes = bytes;
+		}
+
+		//forgets the asset (it is being deleted), nothing happens if it is not registered
+		void remove(T* asset)
+		{
+			auto it = infos.find(asset);
+			if (it == infos.end())
+				return;
+			sInfo& info = it->second;
+			for (const std::string& name : info.names)
+				by_name.erase(name);
+			eraseHash(asset, info.hash);
+			if (isUnused(info))
+			{
+				unused.erase(info.lru);
+				unused_bytes -= info.bytes;
+			}
+			total_bytes -= info.bytes;
+			infos.erase(it);
+		}
+
+		void addRef(T* asset)
+		{
+			if (!asset)
+				return;
+			sInfo& info = getInfo(asset);
+			if (isUnused(info))
+			{
+				unused.erase(info.lru);
+				unused_bytes -= info.bytes;
+			}
+			info.refs++;
+			info.counted = true;
+		}
+
+		void release(T* asset)
+		{
+			if (!asset)
+				return;
+			auto it = infos.find(asset);
+			if (it == infos.end() || it->second.refs <= 0)
+				return;
+			sInfo& info = it->second;
+			if (--info.refs)
+				return;
+			info.lru = unused.insert(unused.end(), asset);
+			unused_bytes += info.bytes;
+		}
+
+		int getRefs(T* asset)
+		{
+			auto it = infos.find(asset);
+			return it != infos.end() ? it->second.refs : 0;
+		}
+
+		//deletes the least recently released assets until the unused ones fit in the budget
+		int trim()
+		{
+			int num = 0;
+			while (budget && unused_bytes > budget && unused.size())
+			{
+				T* asset = unused.front();
+				remove(asset);
+				delete asset;
+				num++;
+			}
+			return num;
+		}
+
+		void getAll(std::vector<T*>& assets)
+		{
+			assets.reserve(assets.size() + infos.size());
+			for (auto& it : infos)
+				assets.push_back(it.first);
+		}
+
+		void clear()
+		{
+			by_name.clear();
+			by_hash.clear();
+			infos.clear();
+			unused.clear();
+			total_bytes = unused_bytes = 0;
+		}
+
+		//stats
+		int size() { return (int)infos.size(); }
+		int getNumUnused() { return (int)unused.size(); }
+		size_t getBytes() { return total_bytes; }
+		size_t getUnusedBytes() { return unused_bytes; }
+
+	private:
+		std::unordered_map<std::string, T*> by_name;
+		std::unordered_map<uint64, T*> by_hash;
+		std::unordered_map<T*, sInfo> infos;
+		std::list<T*> unused; //front is the least recently released
+		size_t total_bytes;
+		size_t unused_bytes;
+
+		bool isUnused(const sInfo& info) { return info.counted && info.refs == 0; }
+
+		sInfo& getInfo(T* asset)
+		{
+			auto it = infos.find(asset);
+			if (it != infos.end())
+				return it->second;
+			sInfo& info = infos[asset];
+			info.hash = 0;
+			info.refs = 0;
+			info.counted = false;
+			info.bytes = 0;
+			return info;
+		}
+
+		//another asset may have taken the hash since
+		void eraseHash(T* asset, uint64 hash)
+		{
+			auto it = by_hash.find(hash);
+			if (it != by_hash.end() && it->second == asset)
+				by_hash.erase(it);
+		}
+
+		void removeName(T* asset, const std::string& name)
+		{
+			by_name.erase(name);
+			std::vector<std::string>& names = infos[asset].names;
+			names.erase(std::remove(names.begin(), names.end(), name), names.end());
+		}
+	};
+
+};
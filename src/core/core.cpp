@@ -6,6 +6,9 @@
 
 #include "../gfx/gfx.h" //check errors
 #include "../gfx/texture.h" //??
+#include "../gfx/uploadmanager.h"
+#include "../gfx/texturestreamer.h"
+#include "../gfx/shader.h"
 #include "../utils/utils.h" //cleanPath
 
 #ifdef WIN32
@@ -49,6 +52,7 @@ void CORE::init()
 	SDL_Init(SDL_INIT_JOYSTICK | SDL_INIT_GAMEPAD | SDL_INIT_TIMER  | SDL_INIT_EVENTS | SDL_INIT_VIDEO);
 	Input::init();
 	TaskManager::background.startThread();
+	TaskManager::decoding.startThread(std::max(1, (int)std::thread::hardware_concurrency() - 1));
 }
 
 //create a window using SDL
@@ -158,7 +162,6 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 	long start_time = CORE::getTime();
 	long now = start_time;
 	long frames_this_second = 0;
-	int history_pos = 0;
 
 	memset(GFX::gpu_frame_microseconds_history, 0, sizeof(GFX::gpu_frame_microseconds_history));
 	GFX::GPUQuery gputime(GL_TIME_ELAPSED);
@@ -170,8 +173,8 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		if (gputime.isReady())
 		{
 			GFX::gpu_frame_microseconds = gputime.value / 1000;
-			GFX::gpu_frame_microseconds_history[history_pos] = GFX::gpu_frame_microseconds;
-			history_pos = (history_pos + 1) % GPU_FRAME_HISTORY_SIZE;
+			GFX::gpu_frame_microseconds_history[GFX::gpu_frame_history_pos] = GFX::gpu_frame_microseconds;
+			GFX::gpu_frame_history_pos = (GFX::gpu_frame_history_pos + 1) % GPU_FRAME_HISTORY_SIZE;
 		}
 		gputime.start();
 
@@ -276,6 +279,12 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 		//execute a task in the main task manager (blocking)
 		TaskManager::foreground.fetchTask();
 
+		//stream the queued buffers and textures within the frame budget
+		GFX::UploadManager::get()->update();
+
+		//load and evict the mips requested while rendering
+		GFX::TextureStreamer::get()->update();
+
 		//check errors in opengl only when working in debug
 #ifdef _DEBUG
 		GFX::checkGLErrors();
@@ -285,6 +294,9 @@ void CORE::mainLoop(CORE::Window* window, BaseApplication* app)
 
 void CORE::destroy()
 {
+	//drops the stale programs appended during the run
+	GFX::Shader::SaveBinaryCache();
+
 	// Cleanup
 #ifndef SKIP_IMGUI
 	ImGui_ImplOpenGL3_Shutdown();
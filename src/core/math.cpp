@@ -1452,6 +1452,62 @@ int planeBoxOverlap( const Vector4f& plane, const Vector3f& center, const Vector
 	return CLIP_INSIDE;
 }
 
+uint16 floatToHalf(float f)
+{
+	uint32 x;
+	memcpy(&x, &f, sizeof(float));
+	uint32 sign = (x >> 16) & 0x8000;
+	int exponent = (int)((x >> 23) & 0xFF) - 127 + 15;
+	uint32 mantissa = x & 0x7FFFFF;
+
+	if (exponent >= 31) //overflow, inf or nan
+		return (uint16)(sign | 0x7C00 | (((x & 0x7FFFFFFF) > 0x7F800000) ? 0x200 : 0));
+	if (exponent <= 0) //denormal or zero
+	{
+		if (exponent < -10)
+			return (uint16)sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32 half = (mantissa >> shift) + ((mantissa >> (shift - 1)) & 1); //round
+		return (uint16)(sign | half);
+	}
+	uint32 half = sign | (exponent << 10) | (mantissa >> 13);
+	half += (mantissa >> 12) & 1; //round to nearest, carry goes into the exponent
+	return (uint16)half;
+}
+
+float halfToFloat(uint16 h)
+{
+	uint32 sign = (uint32)(h & 0x8000) << 16;
+	uint32 exponent = (h >> 10) & 0x1F;
+	uint32 mantissa = h & 0x3FF;
+	uint32 x;
+
+	if (exponent == 0)
+	{
+		if (mantissa == 0)
+			x = sign;
+		else //denormal, normalize it
+		{
+			exponent = 127 - 15 + 1;
+			while (!(mantissa & 0x400))
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			x = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+		}
+	}
+	else if (exponent == 31)
+		x = sign | 0x7F800000 | (mantissa << 13);
+	else
+		x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+
+	float f;
+	memcpy(&f, &x, sizeof(float));
+	return f;
+}
+
 float signedDistanceToPlane( const Vector4f& plane, const Vector3f& point )
 {
 	return dot(plane.xyz(), point) + plane.w;
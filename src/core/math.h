@@ -418,6 +418,10 @@ inline Vector3f reflect(const Vector3f& I, const Vector3f& N) { return I - N * 2
 //value between 0 and 1
 inline float random(float range = 1.0f, int offset = 0) { return ((rand() % 1000) / (1000.0f)) * range + offset; }
 
+//half float (16 bits) conversion, used to pack vertex data
+uint16 floatToHalf(float f);
+float halfToFloat(uint16 h);
+
 std::ostream& operator << (std::ostream& os, const Vector3f& v);
 std::ostream& operator << (std::ostream& os, const Vector4f& v);
 
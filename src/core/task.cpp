@@ -3,14 +3,16 @@
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
+#include <atomic>
+#include <algorithm>
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
+TaskManager TaskManager::decoding;
 
 TaskManager::TaskManager()
 {
 	must_loop = false;
-	_thread = NULL;
 }
 
 void TaskManager::loop()
@@ -41,8 +43,19 @@ void TaskManager::fetchTask()
 		const std::lock_guard<std::mutex> lock(tasks_mutex);
 		if (pending_tasks.empty())
 			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
+		auto best = pending_tasks.begin();
+		float best_priority = (*best)->getPriority();
+		for (auto it = std::next(best); it != pending_tasks.end(); ++it)
+		{
+			float priority = (*it)->getPriority();
+			if (priority > best_priority)
+			{
+				best = it;
+				best_priority = priority;
+			}
+		}
+		task = *best;
+		pending_tasks.erase(best);
 		//unlock after finishing scope
 	}
 	catch (std::logic_error&) {
@@ -63,11 +76,12 @@ void thread_loop_func(TaskManager* manager)
 	//join?
 }
 
-void TaskManager::startThread()
+void TaskManager::startThread(int num_threads)
 {
-	assert(!_thread && "TaskManager already in a thread");
+	assert(threads.empty() && "TaskManager already in a thread");
 	must_loop = true;
-	_thread = new std::thread(thread_loop_func, this);
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(thread_loop_func, this));
 }
 
 void TaskManager::addTask(Task* task)
@@ -76,4 +90,28 @@ void TaskManager::addTask(Task* task)
 	const std::lock_guard<std::mutex> lock(tasks_mutex);
 	pending_tasks.push_back(task);
 	//release pending_tasks automatically
-}
\ No newline at end of file
+}
+
+void parallelFor(int count, std::function<void(int)> func, int num_threads)
+{
+	if (count <= 0)
+		return;
+	if (num_threads <= 0)
+		num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+	num_threads = std::min(num_threads, count);
+
+	//every thread (including the caller) grabs the next index until there are none left
+	std::atomic<int> next_index(0);
+	auto worker = [&]() {
+		int i;
+		while ((i = next_index++) < count)
+			func(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < num_threads; ++i)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (auto& t : threads)
+		t.join();
+}
@@ -14,6 +14,7 @@ public:
 	Task(std::function<void()> func) { callback = func; };
 	virtual ~Task() {};
 	virtual void onExecute() { if (callback) callback(); }
+	virtual float getPriority() { return 0; } //tasks with higher priority are fetched first
 };
 
 class TaskManager {
@@ -21,14 +22,19 @@ public:
 	std::list<Task*> pending_tasks;
 	std::mutex tasks_mutex;  // protects pending_tasks
 	bool must_loop;
-	std::thread* _thread;
+	std::vector<std::thread*> threads;
 
 	static TaskManager foreground;
 	static TaskManager background;
+	static TaskManager decoding; //one thread per core, for CPU heavy jobs like decoding images
 
 	TaskManager();
 	void addTask(Task* task);
 	void fetchTask();
 	void loop();
-	void startThread();
-};
\ No newline at end of file
+	void startThread(int num_threads = 1); //all the threads fetch from the same list
+};
+
+//runs func(i) for every i in [0,count) splitting the work between several threads, returns when all are done
+//func must not call OpenGL, only the main thread owns the context
+void parallelFor(int count, std::function<void(int)> func, int num_threads = 0);
@@ -37,6 +37,7 @@ void UI::init()
 	style.Colors[ImGuiCol_FrameBgActive] = ImVec4(.3f, .3f, .3f, 1);
 
 	icons = GFX::Texture::Get("data/textures/icons.png");
+	GFX::Texture::sTexturesLoaded.addRef(icons); //never released, the registry must not delete it
 #endif
 }
 
@@ -1,6 +1,7 @@
 
 #include "litengine.h"
 #include "editor.h"
+#include "gfx/sphericalharmonics.h"
 
 long mouse_press_time = 0;
 
@@ -103,6 +104,23 @@ void SceneEditor::render(Camera* camera)
 			ImGui::MenuItem("Textures", "F4", &show_textures);
 			ImGui::EndMenu();
 		}
+
+		if (ImGui::BeginMenu("Tools"))
+		{
+			//results in the console
+			if (ImGui::MenuItem("Benchmark Image Decoding"))
+			{
+				std::string result = CORE::openFileDialog();
+				if (result.size())
+					Image::benchmarkDecoding(result.c_str());
+			}
+			if (ImGui::MenuItem("Benchmark Spherical Harmonics"))
+			{
+				benchmarkSH(10, 1);
+				benchmarkSH(10, 0);
+			}
+			ImGui::EndMenu();
+		}
 		ImGui::EndMainMenuBar();
 
 	}
@@ -228,6 +246,7 @@ void SceneEditor::render(Camera* camera)
 		{
 		case SCN::eEntityType::PREFAB: inspectEntity((SCN::PrefabEntity*)ent); break;
 		case SCN::eEntityType::LIGHT: inspectEntity((SCN::LightEntity*)ent); break;
+		case SCN::eEntityType::IRRADIANCE_VOLUME: inspectEntity((SCN::IrradianceVolumeEntity*)ent); break;
 		case SCN::eEntityType::NONE: inspectEntity((SCN::UnknownEntity*)ent); break;
 		default: inspectEntity(ent); break;
 		}
@@ -372,6 +391,29 @@ void SceneEditor::inspectEntity(SCN::LightEntity* entity)
 #endif
 }
 
+void SceneEditor::inspectEntity(SCN::IrradianceVolumeEntity* entity)
+{
+#ifndef SKIP_IMGUI
+	this->inspectEntity((SCN::BaseEntity*)entity);
+
+	ImGui::Separator();
+	if (entity->baking)
+	{
+		ImGui::Text("Baking %d/%d probes", entity->baked_probes, entity->getNumProbes());
+		return;
+	}
+
+	ImGui::DragInt3("dims", entity->dims, 0.1f, 1, 64);
+	ImGui::SliderInt("cubemap_size", &entity->cubemap_size, 8, 128);
+	ImGui::SliderInt("probes_per_frame", &entity->probes_per_frame, 1, 64);
+	ImGui::DragFloat("near_distance", &entity->near_distance, 0.1f, 0.001f, 10000.0f);
+	ImGui::DragFloat("far_distance", &entity->far_distance, 1.0f, 0.0f, 10000.0f);
+	if (ImGui::Button("Bake"))
+		entity->startBake();
+	if (entity->texture)
+		ImGui::Text("%d probes baked: %s", (int)entity->probes.size(), entity->filename.c_str());
+#endif
+}
 
 void SceneEditor::inspectEntity( SCN::UnknownEntity* entity )
 {
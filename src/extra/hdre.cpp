@@ -2,7 +2,19 @@
 #include <fstream>
 #include <cmath>
 #include <cassert>
+#include <cstring>
+#include <vector>
 #include <algorithm>
+#include <sys/stat.h>
+
+#ifdef WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
 
 #include "../utils/utils.h"
 #include "hdre.h"
@@ -24,8 +36,15 @@ HDRE::HDRE(const char* filename)
 void HDRE::init()
 {
     data = nullptr;
+    mapped = nullptr;
+    mapped_size = 0;
+#ifdef WIN32
+    file_handle = nullptr;
+    mapping_handle = nullptr;
+#endif
     width = height = 0;
     levels = N_MAX_LEVELS;
+    stored_levels = 0;
 
     for (int j = 0; j < N_FACES; j++)
     {
@@ -35,7 +54,11 @@ void HDRE::init()
             pixels_f[i][j] = nullptr;
             pixels_b[i][j] = nullptr;
         }
+        for (int i = 0; i < N_LEVELS; i++)
+            faces[i][j] = nullptr;
     }
+    for (int i = 0; i < N_LEVELS; i++)
+        level_width[i] = 0;
 }
 
 HDRE::~HDRE()
@@ -70,92 +93,224 @@ HDRE::~HDRE()
 
 float* HDRE::getData()
 {
-	return this->data;
+	if (data || !mapped)
+		return data;
+
+	//float files are used as they are (the mapping is copy on write)
+	if (header.type == HDRE_TYPE_FLOAT)
+		return data = (float*)(mapped + header.headerSize);
+
+	size_t num_values = 0;
+	for (int i = 0; i < stored_levels; i++)
+		num_values += (size_t)level_width[i] * level_width[i] * header.numChannels * N_FACES;
+	data = new float[num_values];
+	const uint16* src = (const uint16*)(mapped + header.headerSize);
+	for (size_t i = 0; i < num_values; ++i)
+		data[i] = halfToFloat(src[i]);
+	return data;
+}
+
+void HDRE::convertFace(int level, int face, void* output, int type)
+{
+	int w = level_width[level];
+	size_t row_values = (size_t)w * header.numChannels;
+	int bytes_per_value = getBytesPerValue();
+	for (int y = 0; y < w; ++y)
+	{
+		//the levels after the first one are stored upside down
+		int src_y = level ? w - y - 1 : y;
+		const byte* src = faces[level][face] + src_y * row_values * bytes_per_value;
+		size_t start = y * row_values;
+		if (type == header.type)
+		{
+			memcpy((byte*)output + start * bytes_per_value, src, row_values * bytes_per_value);
+			continue;
+		}
+		for (size_t i = 0; i < row_values; ++i)
+		{
+			float v = header.type == HDRE_TYPE_HALF ? halfToFloat(((const uint16*)src)[i]) : ((const float*)src)[i];
+			if (type == HDRE_TYPE_FLOAT)
+				((float*)output)[start + i] = v;
+			else if (type == HDRE_TYPE_HALF)
+				((uint16*)output)[start + i] = floatToHalf(v);
+			else
+				((byte*)output)[start + i] = (byte)(clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f);
+		}
+	}
 }
 
 float** HDRE::getFacesf(int level)
 {
-    return this->pixels_f[level];
+	if (level >= stored_levels)
+		return nullptr;
+	for (int i = 0; i < N_FACES; ++i)
+		getFacef(level, i);
+	return this->pixels_f[level];
 }
 float* HDRE::getFacef(int level, int face)
 {
-    return this->pixels_f[level][face];
+	if (level >= stored_levels)
+		return nullptr;
+	float*& pixels = this->pixels_f[level][face];
+	if (!pixels && header.type == HDRE_TYPE_FLOAT && level == 0)
+		pixels = (float*)faces[level][face];
+	else if (!pixels)
+	{
+		pixels = new float[level_width[level] * level_width[level] * header.numChannels];
+		convertFace(level, face, pixels, HDRE_TYPE_FLOAT);
+	}
+	return pixels;
 }
 
-byte** HDRE::getFacesb(int level)
+unsigned char** HDRE::getFacesb(int level)
 {
+	if (level >= stored_levels)
+		return nullptr;
+	for (int i = 0; i < N_FACES; ++i)
+		getFaceb(level, i);
 	return this->pixels_b[level];
 }
-byte* HDRE::getFaceb(int level, int face)
+unsigned char* HDRE::getFaceb(int level, int face)
 {
-    return this->pixels_b[level][face];
+	if (level >= stored_levels)
+		return nullptr;
+	unsigned char*& pixels = this->pixels_b[level][face];
+	if (!pixels)
+	{
+		pixels = new unsigned char[level_width[level] * level_width[level] * header.numChannels];
+		convertFace(level, face, pixels, 0);
+	}
+	return pixels;
 }
 
 short** HDRE::getFacesh(int level)
 {
-    return this->pixels_h[level];
+	if (level >= stored_levels)
+		return nullptr;
+	for (int i = 0; i < N_FACES; ++i)
+		getFaceh(level, i);
+	return this->pixels_h[level];
 }
 short* HDRE::getFaceh(int level, int face)
 {
-    return this->pixels_h[level][face];
+	if (level >= stored_levels)
+		return nullptr;
+	short*& pixels = this->pixels_h[level][face];
+	if (!pixels && header.type == HDRE_TYPE_HALF && level == 0)
+		pixels = (short*)faces[level][face];
+	else if (!pixels)
+	{
+		pixels = new short[level_width[level] * level_width[level] * header.numChannels];
+		convertFace(level, face, pixels, HDRE_TYPE_HALF);
+	}
+	return pixels;
+}
+
+bool HDRE::map(const char* filename)
+{
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = GetFileSizeEx(file, &size) && size.QuadPart ? CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+	void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+	if (!view)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	file_handle = file;
+	mapping_handle = mapping;
+	mapped = (byte*)view;
+	mapped_size = (size_t)size.QuadPart;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void* view = (fstat(fd, &st) == 0 && st.st_size) ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd); //the mapping keeps the file
+	if (view == MAP_FAILED)
+		return false;
+	mapped = (byte*)view;
+	mapped_size = (size_t)st.st_size;
+#endif
+	return true;
 }
 
+void HDRE::unmap()
+{
+	if (!mapped)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(mapped);
+	CloseHandle(mapping_handle);
+	CloseHandle(file_handle);
+	file_handle = mapping_handle = nullptr;
+#else
+	munmap(mapped, mapped_size);
+#endif
+	mapped = nullptr;
+	mapped_size = 0;
+}
 
 bool HDRE::load(const char* filename)
 {
 	assert(filename);
+	clean();
+	init();
 
-	FILE *f = fopen(filename,"rb");
-	if (f == nullptr)
+	if (!map(filename))
 		return false;
 
-	sHDREHeader HDREHeader;
-
-	fread(&HDREHeader, sizeof(sHDREHeader), 1, f);
+	if (mapped_size < sizeof(sHDREHeader))
+	{
+		std::cout << "HDRE file too small: " << filename << std::endl;
+		unmap();
+		return false;
+	}
+	memcpy(&header, mapped, sizeof(sHDREHeader));
 
-	if (HDREHeader.type != 3) {
-        std::cout << "HDRE Header has wrong type: " << HDREHeader.type << std::endl;
-        throw ("ArrayType not supported. Please export in Float32Array.");
+	if (header.type != HDRE_TYPE_FLOAT && header.type != HDRE_TYPE_HALF) {
+        std::cout << "HDRE Header has wrong type: " << header.type << ", export it as Float32Array or Uint16Array" << std::endl;
+        unmap();
+        return false;
     }
 
-    this->header = HDREHeader;
-
-	int width = HDREHeader.width;
-	int height = HDREHeader.height;
+	this->width = header.width;
+	this->height = header.height;
 
-	this->width = width;
-	this->height = height;
-
-	int dataSize = 0;
+	// find the faces of every level inside the file
 	int w = width;
-
-	// Get number of floats inside the HDRE
-	// Per channel & Per face
+	size_t offset = header.headerSize;
 	for (int i = 0; i < N_LEVELS; i++)
 	{
 		int mip_level = i + 1;
-		dataSize += w * w * N_FACES * HDREHeader.numChannels;
-
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
+		size_t face_bytes = (size_t)w * w * header.numChannels * getBytesPerValue();
+		if (offset + face_bytes * N_FACES > mapped_size)
+			break; //truncated
+		level_width[i] = w;
+		for (int j = 0; j < N_FACES; j++)
+			faces[i][j] = mapped + offset + face_bytes * j;
+		offset += face_bytes * N_FACES;
+		stored_levels++;
 
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
+		// reassign width for next level
+		w = width >> mip_level;
+		if (this->header.version <= 2.0)
+			w = std::max(8, w);
+	}
+	if (!stored_levels)
+	{
+		std::cout << "HDRE file truncated: " << filename << std::endl;
+		unmap();
+		return false;
 	}
-
-	this->data = new float[dataSize];
-
-	fseek(f, HDREHeader.headerSize, SEEK_SET);
-
-	fread(this->data, sizeof(float) * dataSize, 1, f);
-	fclose(f);
-
-	// get separated levels
 
 	w = width;
-	int mapOffset = 0;
-    int mapPrevOffset = 0;
-
 	int nFullMips = 0;
 	while (w)
     {
@@ -164,93 +319,80 @@ bool HDRE::load(const char* filename)
     }
 	assert(nFullMips <= N_MAX_LEVELS);
 	levels = nFullMips;
-	w = width;
-    //printf("Load %d mips of HDRE texture\n", nFullMips);
 
-    int i;
-    for (i = 0; i < N_LEVELS; i++)
-	{
-		int mip_level = i + 1;
-		int faceSize = w * w * HDREHeader.numChannels;
-		int mapSize = faceSize * N_FACES;
+	std::cout << " + '" << filename << "' (v" << this->header.version << (isHalf() ? ", half" : "") << ") loaded successfully" << std::endl;
+	return true;
+}
 
-		int faceOffset = 0;
+bool HDRE::saveHalf(const char* filename)
+{
+	if (!mapped)
+		return false;
+	FILE* f = fopen(filename, "wb");
+	if (f == nullptr)
+		return false;
 
-		for (int j = 0; j < N_FACES; j++)
+	//same header with the new type, the rest of the header bytes are kept
+	sHDREHeader half_header = header;
+	half_header.type = HDRE_TYPE_HALF;
+	half_header.bitsPerChannel = 16;
+	std::vector<byte> head(mapped, mapped + header.headerSize);
+	memcpy(&head[0], &half_header, std::min(sizeof(sHDREHeader), head.size()));
+	bool ok = fwrite(&head[0], 1, head.size(), f) == head.size();
+
+	//levels in the same order (and orientation) as the source
+	std::vector<uint16> values;
+	for (int i = 0; i < stored_levels && ok; i++)
+		for (int j = 0; j < N_FACES && ok; j++)
 		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
-
-			//reverseY
-			if (i && 1)
-			{
-				for (int y = 0; y < w; ++y)
-				{
-					memcpy(this->pixels_f[i][j] + w * (w - y - 1) * HDREHeader.numChannels, &this->data[mapOffset + faceOffset + w * y * HDREHeader.numChannels], sizeof(float) * w * HDREHeader.numChannels);
-				}
-			}
-			else
-			{
-				// set data
-				memcpy(this->pixels_f[i][j], &this->data[mapOffset + faceOffset], faceSize * sizeof(float));
-			}
-
-			/* OLD
-			for (int k = 0; k < faceSize; k++) {
-
-				float value = this->data[mapOffset + faceOffset + k];
-				this->pixels_f[i][j][k] = value;
-			}
-			*/
-
-			// update face offset
-			faceOffset += faceSize;
+			values.resize((size_t)level_width[i] * level_width[i] * header.numChannels);
+			for (size_t k = 0; k < values.size(); ++k)
+				values[k] = header.type == HDRE_TYPE_HALF ? ((const uint16*)faces[i][j])[k] : floatToHalf(((const float*)faces[i][j])[k]);
+			ok = fwrite(&values[0], sizeof(uint16), values.size(), f) == values.size();
 		}
-
-		// update level offset
-		mapPrevOffset = mapOffset;
-		mapOffset += mapSize;
-		// reassign width for next level
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
-
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
-	}
-	std::cout << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
-	return true;
+	fclose(f);
+	if (!ok)
+		remove(filename);
+	return ok;
 }
 
-bool HDRE::clean()
+void HDRE::freeConverted()
 {
-	try
+	for (int j = 0; j < N_FACES; j++)
 	{
-		if (data)
-			delete data;
-
-        for (int j = 0; j < N_FACES; j++)
-        {
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-				delete pixels_h[i][j];
-				pixels_h[i][j] = nullptr;
-			}
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
+		for (int i = 0; i < N_MAX_LEVELS; i++)
+		{
+			if (!isMapped(pixels_h[i][j]))
+				delete[] pixels_h[i][j];
+			if (!isMapped(pixels_f[i][j]))
+				delete[] pixels_f[i][j];
+			delete[] pixels_b[i][j];
+			pixels_h[i][j] = nullptr;
+			pixels_f[i][j] = nullptr;
+			pixels_b[i][j] = nullptr;
 		}
-
-		return true;
-	}
-	catch (const std::exception&)
-	{
-		std::cout << std::endl << "Error cleaning" << std::endl;
-		return false;
 	}
+	if (!isMapped(data))
+		delete[] data;
+	data = nullptr;
+}
 
-	return false;
+bool HDRE::clean()
+{
+	freeConverted();
+	unmap();
+	return true;
+}
+
+std::string HDRE::getHalfCachePath(const std::string& filename)
+{
+	std::string cache = filename + ".half";
+	struct stat source_stat, cache_stat;
+	if (stat(cache.c_str(), &cache_stat) != 0)
+		return "";
+	if (stat(filename.c_str(), &source_stat) == 0 && source_stat.st_mtime > cache_stat.st_mtime)
+		return "";
+	return cache;
 }
 
 HDRE* HDRE::Get(const char* filename)
@@ -260,13 +402,22 @@ HDRE* HDRE::Get(const char* filename)
 		return it->second;
 
 	HDRE* hdre = new HDRE();
-	if (!hdre->load(filename))
+	//half version saved by a previous load
+	std::string cache = getHalfCachePath(filename);
+	if (cache.empty() || !hdre->load(cache.c_str()))
 	{
-		delete hdre;
-		return nullptr;
+		if (!hdre->load(filename))
+		{
+			delete hdre;
+			return nullptr;
+		}
+		//next time it maps half the bytes, the float file is used if it cannot be saved
+		cache = std::string(filename) + ".half";
+		if (!hdre->isHalf() && hdre->saveHalf(cache.c_str()) && !hdre->load(cache.c_str()))
+			hdre->load(filename);
 	}
 	hdre->filename = filename;
 
 	s_loaded_hdres[filename] = hdre;
 	return hdre;
-}
\ No newline at end of file
+}
@@ -9,6 +9,12 @@
 
 typedef unsigned char byte;
 
+//header.type, the typed array used by the exporter
+enum eHDREType {
+	HDRE_TYPE_HALF = 2, //16 bits floats (Uint16Array)
+	HDRE_TYPE_FLOAT = 3 //32 bits floats (Float32Array)
+};
+
 typedef struct {
 
 	char signature[4];
@@ -45,19 +51,40 @@ typedef struct {
 
 } sHDRELevel;
 
+//The file is memory mapped and the pixels are read from the mapping, nothing is expanded when loading.
+//The arrays of every format (float, half, byte) are converted on demand, the ones in the format of the
+//file point to the mapping (level 0, the rest are stored upside down and need a flipped copy).
+//Float files are saved as half next to the source (.half) the first time, so the next loads map half data.
 class HDRE {
 
 private:
 
     std::string filename;
-	float* data; // only f32 now
+
+	//memory mapped file
+	unsigned char* mapped;
+	size_t mapped_size;
+#ifdef WIN32
+	void* file_handle;
+	void* mapping_handle;
+#endif
+
+	const unsigned char* faces[N_LEVELS][N_FACES]; //inside the mapping, in the format of the file
+	int level_width[N_LEVELS];
+	int stored_levels; //levels in the file
+	float* data; //all the levels as floats, only if getData is called
 
     float* pixels_f[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
     short* pixels_h[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
-    byte* pixels_b[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
+    unsigned char* pixels_b[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
 
 	bool clean();
 	void init();
+	bool map(const char* filename);
+	void unmap();
+	bool isMapped(const void* pointer) { return pointer >= mapped && pointer < mapped + mapped_size; }
+	int getBytesPerValue() { return header.type == HDRE_TYPE_HALF ? 2 : 4; }
+	void convertFace(int level, int face, void* output, int type); //type: 0 byte, HDRE_TYPE_HALF or HDRE_TYPE_FLOAT
 
 public:
 	static std::map<std::string, HDRE*> s_loaded_hdres;
@@ -73,6 +100,7 @@ public:
 
 	bool load(const char* filename);
 	//bool load(void* data, int size);
+	bool saveHalf(const char* filename); //same levels with 16 bits floats
 
 	// useful methods
 	float getMaxLuminance() { return this->header.maxLuminance; };
@@ -82,19 +110,25 @@ public:
 			return this->header.coeffs;
 		return nullptr;
 	}
+	bool isHalf() { return header.type == HDRE_TYPE_HALF; }
+	int getNumStoredLevels() { return stored_levels; } //prefiltered levels in the file, the rest are missing
+	int getLevelWidth(int level) { return level < stored_levels ? level_width[level] : 0; }
 
 	float* getData(); // All pixel data
 
 	float* getFacef(int level, int face);	// Specific level and face
 	float** getFacesf(int level = 0);		// [[]]: Array per face with all level data
 
-    byte* getFaceb(int level, int face);	// Specific level and face
-    byte** getFacesb(int level = 0);		// [[]]: Array per face with all level data
+    unsigned char* getFaceb(int level, int face);	// Specific level and face, clamped to [0,1]
+    unsigned char** getFacesb(int level = 0);		// [[]]: Array per face with all level data
 
     short* getFaceh(int level, int face);	// Specific level and face
 	short** getFacesh(int level = 0);		// [[]]: Array per face with all level data
 
+	void freeConverted(); //frees the arrays converted on demand (after uploading them), the mapping stays
+
 	//sHDRELevel getLevel(int level = 0);
 
+	static std::string getHalfCachePath(const std::string& filename); //.half next to the source, empty if missing or outdated
 	static HDRE* Get(const char* filename);
 };
@@ -10,6 +10,7 @@ namespace GFX {
 
 	long gpu_frame_microseconds = 0;
 	long gpu_frame_microseconds_history[GPU_FRAME_HISTORY_SIZE];
+	int gpu_frame_history_pos = 0;
 
 	void startGPULabel(const char* text)
 	{
@@ -37,9 +38,15 @@ namespace GFX {
 			nCurAvailMemoryInKB = 0;
 		}
 
-		std::string str = "FPS: " + std::to_string(CORE::BaseApplication::instance->fps) + " Time: " + std::to_string(gpu_frame_microseconds) + "us DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+		double cpu_per_draw = Mesh::num_meshes_rendered ? Mesh::render_cpu_time / Mesh::num_meshes_rendered : 0.0;
+		std::string cpu_per_draw_str = Mesh::profile_render ? " CPU/DC: " + std::to_string(cpu_per_draw).substr(0, 4) + "us" : "";
+		std::string str = "FPS: " + std::to_string(CORE::BaseApplication::instance->fps) + " Time: " + std::to_string(gpu_frame_microseconds) + "us DCS: " + std::to_string(Mesh::num_meshes_rendered) + cpu_per_draw_str + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+		str += " State: " + std::to_string(gpu_state_calls) + " calls " + std::to_string(gpu_redundant_calls) + " redundant";
 		Mesh::num_meshes_rendered = 0;
 		Mesh::num_triangles_rendered = 0;
+		Mesh::render_cpu_time = 0;
+		gpu_state_calls = 0;
+		gpu_redundant_calls = 0;
 		return str;
 	}
 
@@ -76,9 +83,8 @@ namespace GFX {
 		}
 
 		glLineWidth(1);
-		glEnable(GL_BLEND);
-		glDepthMask(false);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		uint64 previous_state = getGPUState();
+		setGPUState((previous_state & ~(GFX_STATE_WRITE_Z | GFX_STATE_BLEND_MASK)) | GFX_STATE_BLEND_ALPHA);
 		Shader* grid_shader = Shader::getDefaultShader("grid");
 		grid_shader->enable();
 		Matrix44 m;
@@ -88,8 +94,7 @@ namespace GFX {
 		grid_shader->setUniform("u_camera_position", Camera::current->eye);
 		grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 		grid->render(GL_LINES); //background grid
-		glDisable(GL_BLEND);
-		glDepthMask(true);
+		setGPUState(previous_state);
 		grid_shader->disable();
 	}
 
@@ -123,8 +128,7 @@ namespace GFX {
 		Vector2f size = CORE::getWindowSize();
 		projection_matrix.ortho(0, size.x / scale, size.y / scale, 0, -1, 1);
 
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_CULL_FACE);
+		setGPUState(getGPUState() & ~(GFX_STATE_DEPTH_TEST_MASK | GFX_STATE_CULL_MASK));
 
 		Shader* shader = Shader::getDefaultShader("flat2D");
 		shader->enable();
@@ -142,7 +146,7 @@ namespace GFX {
 
 	void drawTexture2D(Texture* tex, vec4 pos)
 	{
-		glDisable(GL_DEPTH_TEST);
+		setGPUState(getGPUState() & ~GFX_STATE_DEPTH_TEST_MASK);
 		glPushAttrib(GL_VIEWPORT_BIT);
 		glViewport(pos.x, pos.y, pos.z, pos.w);
 
@@ -235,14 +239,201 @@ namespace GFX {
 		waiting = available == 0;
 		return available != 0;
 	}
-};
 
-/*
-uint64 gpu_current_state = GFX_STATE_DEFAULT;
+	//GL state cache ***********************************************
+
+	#define GPU_STATE_TEXTURE_UNITS 32
+	#define GPU_STATE_UNKNOWN 0xFFFFFFFF //binding not known, the next one always calls GL
+
+	long gpu_state_calls = 0;
+	long gpu_redundant_calls = 0;
+
+	//the initial state of a GL context: all writes, no depth test, blending or culling
+	static uint64 gpu_current_state = GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_WRITE_Z | GFX_STATE_FRONT_CCW | GFX_STATE_MSAA;
+	static bool gpu_state_valid = true;
+	static GLuint gpu_current_program = 0;
+	static int gpu_active_unit = 0; //-1 when not known
+	static GLuint gpu_texture_bindings[GPU_STATE_TEXTURE_UNITS][4] = {}; //2D, cubemap, 3D and 2D array of every unit
+
+	//indexed by the values in the state word, 0 means not set
+	static const GLenum gpu_depth_funcs[] = { 0, GL_LESS, GL_LEQUAL, GL_EQUAL, GL_GEQUAL, GL_GREATER, GL_NOTEQUAL, GL_NEVER, GL_ALWAYS };
+	static const GLenum gpu_blend_factors[] = { 0, GL_ZERO, GL_ONE, GL_SRC_COLOR, GL_ONE_MINUS_SRC_COLOR, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+		GL_DST_ALPHA, GL_ONE_MINUS_DST_ALPHA, GL_DST_COLOR, GL_ONE_MINUS_DST_COLOR, GL_SRC_ALPHA_SATURATE, GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR };
+	static const GLenum gpu_blend_equations[] = { GL_FUNC_ADD, GL_FUNC_SUBTRACT, GL_FUNC_REVERSE_SUBTRACT, GL_MIN, GL_MAX };
+
+	static void setCapability(GLenum capability, bool enabled)
+	{
+		if (enabled)
+			glEnable(capability);
+		else
+			glDisable(capability);
+		gpu_state_calls++;
+	}
 
-void setGPUState(uint64 state)
-{
-	//TODO
-}
-*/
+	void setGPUState(uint64 state)
+	{
+		bool known = gpu_state_valid;
+		uint64 previous = gpu_current_state;
+		uint64 changed = known ? (previous ^ state) : GFX_STATE_MASK;
+		gpu_current_state = state;
+		gpu_state_valid = true;
+
+		//write masks
+		if (changed & (GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A))
+		{
+			glColorMask((state & GFX_STATE_WRITE_R) != 0, (state & GFX_STATE_WRITE_G) != 0, (state & GFX_STATE_WRITE_B) != 0, (state & GFX_STATE_WRITE_A) != 0);
+			gpu_state_calls++;
+		}
+		else
+			gpu_redundant_calls++;
+		if (changed & GFX_STATE_WRITE_Z)
+		{
+			glDepthMask((state & GFX_STATE_WRITE_Z) != 0);
+			gpu_state_calls++;
+		}
+		else
+			gpu_redundant_calls++;
+
+		//depth test, disabled when there is no function
+		if (changed & GFX_STATE_DEPTH_TEST_MASK)
+		{
+			int func = int((state & GFX_STATE_DEPTH_TEST_MASK) >> GFX_STATE_DEPTH_TEST_SHIFT);
+			int previous_func = int((previous & GFX_STATE_DEPTH_TEST_MASK) >> GFX_STATE_DEPTH_TEST_SHIFT);
+			if (!known || !func != !previous_func)
+				setCapability(GL_DEPTH_TEST, func != 0);
+			if (func)
+			{
+				glDepthFunc(gpu_depth_funcs[func]);
+				gpu_state_calls++;
+			}
+		}
+		else
+			gpu_redundant_calls += 2;
+
+		//blending, disabled when there are no factors
+		if (changed & (GFX_STATE_BLEND_MASK | GFX_STATE_BLEND_EQUATION_MASK))
+		{
+			uint64 blend = (state & GFX_STATE_BLEND_MASK) >> GFX_STATE_BLEND_SHIFT;
+			uint64 previous_blend = (previous & GFX_STATE_BLEND_MASK) >> GFX_STATE_BLEND_SHIFT;
+			if (!known || !blend != !previous_blend)
+				setCapability(GL_BLEND, blend != 0);
+			if (blend)
+			{
+				glBlendFuncSeparate(gpu_blend_factors[blend & 0xf], gpu_blend_factors[(blend >> 4) & 0xf], gpu_blend_factors[(blend >> 8) & 0xf], gpu_blend_factors[(blend >> 12) & 0xf]);
+				uint64 equation = (state & GFX_STATE_BLEND_EQUATION_MASK) >> GFX_STATE_BLEND_EQUATION_SHIFT;
+				glBlendEquationSeparate(gpu_blend_equations[equation & 0x7], gpu_blend_equations[(equation >> 3) & 0x7]);
+				gpu_state_calls += 2;
+			}
+		}
+		else
+			gpu_redundant_calls += 2;
+
+		//culling, the state names the winding that is removed so it depends on which one is the front
+		if (changed & (GFX_STATE_CULL_MASK | GFX_STATE_FRONT_CCW))
+		{
+			uint64 cull = state & GFX_STATE_CULL_MASK;
+			bool front_ccw = (state & GFX_STATE_FRONT_CCW) != 0;
+			setCapability(GL_CULL_FACE, cull != 0);
+			glFrontFace(front_ccw ? GL_CCW : GL_CW);
+			gpu_state_calls++;
+			if (cull)
+			{
+				glCullFace((cull == GFX_STATE_CULL_CW) == front_ccw ? GL_BACK : GL_FRONT);
+				gpu_state_calls++;
+			}
+		}
+		else
+			gpu_redundant_calls += 2;
+
+		if (changed & GFX_STATE_MSAA)
+			setCapability(GL_MULTISAMPLE, (state & GFX_STATE_MSAA) != 0);
+		else
+			gpu_redundant_calls++;
+		if (changed & GFX_STATE_LINEAA)
+			setCapability(GL_LINE_SMOOTH, (state & GFX_STATE_LINEAA) != 0);
+		else
+			gpu_redundant_calls++;
+		if (changed & GFX_STATE_BLEND_ALPHA_TO_COVERAGE)
+			setCapability(GL_SAMPLE_ALPHA_TO_COVERAGE, (state & GFX_STATE_BLEND_ALPHA_TO_COVERAGE) != 0);
+		else
+			gpu_redundant_calls++;
+	}
+
+	uint64 getGPUState()
+	{
+		return gpu_current_state;
+	}
+
+	void resetGPUState()
+	{
+		gpu_state_valid = false;
+		gpu_current_program = GPU_STATE_UNKNOWN;
+		gpu_active_unit = -1;
+		memset(gpu_texture_bindings, 0xFF, sizeof(gpu_texture_bindings));
+	}
+
+	void useProgram(GLuint program)
+	{
+		if (program == gpu_current_program)
+		{
+			gpu_redundant_calls++;
+			return;
+		}
+		glUseProgram(program);
+		gpu_current_program = program;
+		gpu_state_calls++;
+	}
+
+	static int getTextureTargetIndex(GLenum target)
+	{
+		switch (target)
+		{
+			case GL_TEXTURE_2D: return 0;
+			case GL_TEXTURE_CUBE_MAP: return 1;
+			case GL_TEXTURE_3D: return 2;
+			case GL_TEXTURE_2D_ARRAY: return 3;
+		}
+		return -1;
+	}
+
+	void bindTexture(GLenum target, GLuint texture, int unit)
+	{
+		if (unit != -1 && unit != gpu_active_unit)
+		{
+			glActiveTexture(GL_TEXTURE0 + unit);
+			gpu_active_unit = unit;
+			gpu_state_calls++;
+		}
+		else if (unit != -1)
+			gpu_redundant_calls++;
+
+		//other targets and units (or an unknown active unit) are not cached
+		int index = getTextureTargetIndex(target);
+		if (index == -1 || gpu_active_unit < 0 || gpu_active_unit >= GPU_STATE_TEXTURE_UNITS)
+		{
+			glBindTexture(target, texture);
+			gpu_state_calls++;
+			return;
+		}
+
+		GLuint& bound = gpu_texture_bindings[gpu_active_unit][index];
+		if (bound == texture)
+		{
+			gpu_redundant_calls++;
+			return;
+		}
+		glBindTexture(target, texture);
+		bound = texture;
+		gpu_state_calls++;
+	}
+
+	void forgetTexture(GLuint texture)
+	{
+		//GL unbinds it from every unit
+		for (int i = 0; i < GPU_STATE_TEXTURE_UNITS; ++i)
+			for (int j = 0; j < 4; ++j)
+				if (gpu_texture_bindings[i][j] == texture)
+					gpu_texture_bindings[i][j] = 0;
+	}
+};
 
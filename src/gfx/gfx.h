@@ -13,6 +13,7 @@ namespace GFX {
 	#define GPU_FRAME_HISTORY_SIZE 256
 	extern long gpu_frame_microseconds;
 	extern long gpu_frame_microseconds_history[GPU_FRAME_HISTORY_SIZE];
+	extern int gpu_frame_history_pos; //next one to write, the last frame is the one before
 
 	//check opengl errors
 	bool checkGLErrors();
@@ -25,6 +26,18 @@ namespace GFX {
 	bool drawText(float x, float y, std::string text, Vector4f c, float scale);
 	bool drawText3D(Vector3f pos, std::string text, Vector4f c, float scale);
 
+	//GL state cache: setGPUState only calls GL for the fields of the GFX_STATE_* word (below) that change, and the
+	//bindings of programs and textures are skipped when they are already bound. After GL calls made outside of it
+	//call resetGPUState, the next call sets everything again
+	void setGPUState(uint64 state);
+	uint64 getGPUState();
+	void resetGPUState();
+	void useProgram(GLuint program);
+	void bindTexture(GLenum target, GLuint texture, int unit = -1); //-1 is the active unit
+	void forgetTexture(GLuint texture); //before glDeleteTextures, the name can be reused
+	extern long gpu_state_calls; //GL calls issued, reset every frame by getGPUStats
+	extern long gpu_redundant_calls; //GL calls skipped because the state was already set
+
 	void drawTexture2D(Texture* tex, vec4 pos);
 	void drawPoints(std::vector<Vector3f> points, Vector4f color, int size);
 
@@ -47,9 +60,10 @@ namespace GFX {
 };
 
 
-//GPU state representation from BGFX
+//GPU state representation from BGFX, applied with GFX::setGPUState.
+//Primitive type, alpha reference, point size, conservative raster and independent blend are not part of the GL state
+//set by it (the first ones are decided in the draw call or the shader)
 
-/*
 //Color RGB/alpha/depth write. When it's not specified write will be disabled.
 
 #define GFX_STATE_WRITE_R                        UINT64_C(0x0000000000000001) //!< Enable R write.
@@ -113,6 +127,17 @@ namespace GFX {
 #define GFX_STATE_BLEND_EQUATION_SHIFT           28                           //!< Blend equation bit shift
 #define GFX_STATE_BLEND_EQUATION_MASK            UINT64_C(0x00000003f0000000) //!< Blend equation bit mask
 
+#define GFX_STATE_BLEND_FUNC_SEPARATE(_srcRGB, _dstRGB, _srcA, _dstA) (UINT64_C(0) \
+	| ( ( (uint64_t)(_srcRGB)|( (uint64_t)(_dstRGB)<<4) ) ) \
+	| ( ( (uint64_t)(_srcA  )|( (uint64_t)(_dstA  )<<4) )<<8) \
+	)
+#define GFX_STATE_BLEND_EQUATION_SEPARATE(_equationRGB, _equationA) ( (uint64_t)(_equationRGB)|( (uint64_t)(_equationA)<<3) )
+#define GFX_STATE_BLEND_FUNC(_src, _dst) GFX_STATE_BLEND_FUNC_SEPARATE(_src, _dst, _src, _dst)
+#define GFX_STATE_BLEND_EQUATION(_equation) GFX_STATE_BLEND_EQUATION_SEPARATE(_equation, _equation)
+
+#define GFX_STATE_BLEND_ADD    GFX_STATE_BLEND_FUNC(GFX_STATE_BLEND_ONE, GFX_STATE_BLEND_ONE) //!< Additive, lights
+#define GFX_STATE_BLEND_ALPHA  GFX_STATE_BLEND_FUNC(GFX_STATE_BLEND_SRC_ALPHA, GFX_STATE_BLEND_INV_SRC_ALPHA) //!< Transparency
+
 //Cull state. When `GFX_STATE_CULL_*` is not specified culling will be disabled.
 #define GFX_STATE_CULL_CW                        UINT64_C(0x0000001000000000) //!< Cull clockwise triangles.
 #define GFX_STATE_CULL_CCW                       UINT64_C(0x0000002000000000) //!< Cull counter-clockwise triangles.
@@ -148,16 +173,15 @@ namespace GFX {
 #define GFX_STATE_BLEND_ALPHA_TO_COVERAGE        UINT64_C(0x0000000800000000) //!< Enable alpha to coverage.
        /// Default state is write to RGB, alpha, and depth with depth test less enabled, with clockwise
        /// culling and MSAA (when writing into MSAA frame buffer, otherwise this flag is ignored).
+       /// Our meshes are counter-clockwise like in GL, so it culls the back faces.
 #define GFX_STATE_DEFAULT (0 \
 	| GFX_STATE_WRITE_RGB \
 	| GFX_STATE_WRITE_A \
 	| GFX_STATE_WRITE_Z \
 	| GFX_STATE_DEPTH_TEST_LESS \
 	| GFX_STATE_CULL_CW \
+	| GFX_STATE_FRONT_CCW \
 	| GFX_STATE_MSAA \
 	)
 
 #define GFX_STATE_MASK                           UINT64_C(0xffffffffffffffff) //!< State bit mask
-
-void setGPUState(uint64 state);
-*/
@@ -0,0 +1,234 @@
+#include "megabuffer.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include "mesh.h"
+#include "gfx.h"
+#include "uploadmanager.h"
+
+namespace GFX
+{
+	MegaBuffer* global_mega_buffer = nullptr;
+
+	MegaBuffer::MegaBuffer()
+	{
+		vao_id = vertices_vbo_id = indices_vbo_id = draw_ids_vbo_id = models_ssbo_id = indirect_buffer_id = 0;
+		num_vertices = num_indices = max_vertices = max_indices = max_draw_ids = generation = 0;
+	}
+
+	MegaBuffer::~MegaBuffer()
+	{
+		if (vao_id)
+			glDeleteVertexArrays(1, &vao_id);
+		GLuint buffers[] = { vertices_vbo_id, indices_vbo_id, draw_ids_vbo_id, models_ssbo_id, indirect_buffer_id };
+		for (GLuint id : buffers)
+			if (id)
+				glDeleteBuffers(1, &id);
+	}
+
+	MegaBuffer* MegaBuffer::get()
+	{
+		if (!global_mega_buffer)
+			global_mega_buffer = new MegaBuffer();
+		return global_mega_buffer;
+	}
+
+	bool MegaBuffer::canStore(Mesh* mesh)
+	{
+		//only the streams of tInterleaved
+		return mesh->interleaved.size() && mesh->bones.empty() && mesh->weights.empty() && mesh->colors.empty() && mesh->m_uvs1.empty();
+	}
+
+	//grows the buffers keeping the content
+	static GLuint resizeBuffer(GLuint old_id, unsigned int old_bytes, unsigned int new_bytes)
+	{
+		GLuint id = 0;
+		glGenBuffers(1, &id);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+		glBufferData(GL_COPY_WRITE_BUFFER, new_bytes, NULL, GL_STATIC_DRAW);
+		if (old_id)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, old_id);
+			if (old_bytes)
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, old_bytes);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glDeleteBuffers(1, &old_id);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return id;
+	}
+
+	void MegaBuffer::reserve(unsigned int vertices, unsigned int indices)
+	{
+		bool changed = false;
+		if (vertices > max_vertices)
+		{
+			unsigned int size = std::max(vertices, std::max(max_vertices * 2, 1u << 16));
+			vertices_vbo_id = resizeBuffer(vertices_vbo_id, num_vertices * sizeof(Mesh::tInterleaved), size * sizeof(Mesh::tInterleaved));
+			max_vertices = size;
+			changed = true;
+		}
+		if (indices > max_indices)
+		{
+			unsigned int size = std::max(indices, std::max(max_indices * 2, 1u << 18));
+			indices_vbo_id = resizeBuffer(indices_vbo_id, num_indices * sizeof(unsigned int), size * sizeof(unsigned int));
+			max_indices = size;
+			changed = true;
+		}
+		if (changed)
+		{
+			createVAO();
+			generation++;
+		}
+	}
+
+	void MegaBuffer::createVAO()
+	{
+		if (!vao_id)
+			glGenVertexArrays(1, &vao_id);
+		glBindVertexArray(vao_id);
+
+		glBindBuffer(GL_ARRAY_BUFFER, vertices_vbo_id);
+		glEnableVertexAttribArray(VERTEX_ATTRIB);
+		glVertexAttribPointer(VERTEX_ATTRIB, 3, GL_FLOAT, GL_FALSE, sizeof(Mesh::tInterleaved), (void*)offsetof(Mesh::tInterleaved, vertex));
+		glEnableVertexAttribArray(NORMAL_ATTRIB);
+		glVertexAttribPointer(NORMAL_ATTRIB, 3, GL_FLOAT, GL_FALSE, sizeof(Mesh::tInterleaved), (void*)offsetof(Mesh::tInterleaved, normal));
+		glEnableVertexAttribArray(UV_ATTRIB);
+		glVertexAttribPointer(UV_ATTRIB, 2, GL_FLOAT, GL_FALSE, sizeof(Mesh::tInterleaved), (void*)offsetof(Mesh::tInterleaved, uv));
+
+		//one value per instance, the base_instance of every command selects the draw
+		if (draw_ids_vbo_id)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, draw_ids_vbo_id);
+			glEnableVertexAttribArray(DRAW_ID_ATTRIB);
+			glVertexAttribIPointer(DRAW_ID_ATTRIB, 1, GL_UNSIGNED_INT, 0, 0);
+			glVertexAttribDivisor(DRAW_ID_ATTRIB, 1);
+		}
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	//big ranges are streamed by the UploadManager, the mesh is not drawn until they arrive
+	static void uploadRange(Mesh* mesh, unsigned int target, GLuint* buffer_id, size_t offset, const void* data, size_t size)
+	{
+		if (UploadManager::enabled && size >= UploadManager::min_async_size)
+		{
+			UploadManager::get()->uploadBuffer(&mesh->pending_uploads, buffer_id, offset, data, size);
+			return;
+		}
+		glBindBuffer(target, *buffer_id);
+		glBufferSubData(target, offset, size, data);
+		glBindBuffer(target, 0);
+	}
+
+	bool MegaBuffer::add(Mesh* mesh)
+	{
+		if (!canStore(mesh))
+			return false;
+
+		unsigned int mesh_vertices = (unsigned int)mesh->interleaved.size();
+		//non indexed meshes get sequential indices so every draw can be an indexed one
+		std::vector<unsigned int> sequential;
+		const std::vector<unsigned int>* indices = &mesh->m_indices;
+		if (mesh->m_indices.empty())
+		{
+			sequential.resize(mesh_vertices);
+			for (unsigned int i = 0; i < mesh_vertices; ++i)
+				sequential[i] = i;
+			indices = &sequential;
+		}
+		unsigned int mesh_indices = (unsigned int)indices->size();
+
+		reserve(num_vertices + mesh_vertices, num_indices + mesh_indices);
+
+		uploadRange(mesh, GL_ARRAY_BUFFER, &vertices_vbo_id, num_vertices * sizeof(Mesh::tInterleaved), &mesh->interleaved[0], mesh_vertices * sizeof(Mesh::tInterleaved));
+		uploadRange(mesh, GL_ELEMENT_ARRAY_BUFFER, &indices_vbo_id, num_indices * sizeof(unsigned int), &(*indices)[0], mesh_indices * sizeof(unsigned int));
+
+		mesh->mega_base_vertex = (int)num_vertices;
+		mesh->mega_first_index = num_indices;
+		num_vertices += mesh_vertices;
+		num_indices += mesh_indices;
+		checkGLErrors();
+		return true;
+	}
+
+	void MegaBuffer::addDraw(Mesh* mesh, const Matrix44& model, const std::vector<uint8>* visible_meshlets)
+	{
+		assert(mesh->mega_base_vertex != -1 && "mesh is not in the MegaBuffer");
+		uint32 draw_id = (uint32)models.size();
+		models.push_back(model);
+
+		if (!visible_meshlets || visible_meshlets->empty())
+		{
+			unsigned int count = mesh->m_indices.size() ? (unsigned int)mesh->m_indices.size() : mesh->getNumVertices();
+			commands.push_back({ count, 1, mesh->mega_first_index, (uint32)mesh->mega_base_vertex, draw_id });
+			return;
+		}
+
+		//consecutive visible meshlets are merged in a single command
+		size_t first_command = commands.size();
+		for (size_t i = 0; i < mesh->meshlets.size(); ++i)
+		{
+			if (!(*visible_meshlets)[i])
+				continue;
+			const sMeshlet& meshlet = mesh->meshlets[i];
+			uint32 first_index = mesh->mega_first_index + meshlet.start;
+			if (commands.size() > first_command && commands.back().first_index + commands.back().count == first_index)
+				commands.back().count += meshlet.length;
+			else
+				commands.push_back({ meshlet.length, 1, first_index, (uint32)mesh->mega_base_vertex, draw_id });
+		}
+	}
+
+	void MegaBuffer::render(unsigned int primitive)
+	{
+		if (commands.empty())
+		{
+			models.clear();
+			return;
+		}
+
+		//draw ids 0..N, read as instanced attribute
+		if (models.size() > max_draw_ids)
+		{
+			max_draw_ids = std::max((unsigned int)models.size() * 2, 1024u);
+			std::vector<uint32> ids(max_draw_ids);
+			for (uint32 i = 0; i < max_draw_ids; ++i)
+				ids[i] = i;
+			if (!draw_ids_vbo_id)
+				glGenBuffers(1, &draw_ids_vbo_id);
+			glBindBuffer(GL_ARRAY_BUFFER, draw_ids_vbo_id);
+			glBufferData(GL_ARRAY_BUFFER, max_draw_ids * sizeof(uint32), &ids[0], GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			createVAO();
+		}
+
+		if (!models_ssbo_id)
+			glGenBuffers(1, &models_ssbo_id);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, models_ssbo_id);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, models.size() * sizeof(Matrix44), &models[0], GL_STREAM_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, models_ssbo_id);
+
+		if (!indirect_buffer_id)
+			glGenBuffers(1, &indirect_buffer_id);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_id);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(sDrawElementsIndirect), &commands[0], GL_STREAM_DRAW);
+
+		glBindVertexArray(vao_id);
+		glMultiDrawElementsIndirect(primitive, GL_UNSIGNED_INT, 0, (GLsizei)commands.size(), 0);
+		glBindVertexArray(0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+
+		for (const sDrawElementsIndirect& command : commands)
+			Mesh::num_triangles_rendered += command.count / 3;
+		Mesh::num_meshes_rendered += (long)models.size();
+
+		models.clear();
+		commands.clear();
+	}
+};
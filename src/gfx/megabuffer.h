@@ -0,0 +1,64 @@
+#ifndef MEGABUFFER_H
+#define MEGABUFFER_H
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <vector>
+
+namespace GFX {
+
+	class Mesh;
+
+	//same layouts as DrawElementsIndirectCommand and DrawArraysIndirectCommand
+	struct sDrawElementsIndirect { uint32 count, instance_count, first_index, base_vertex, base_instance; };
+	struct sDrawArraysIndirect { uint32 count, instance_count, first, base_instance; };
+
+	//Big vertex and index buffers where the static meshes are suballocated (tInterleaved layout),
+	//so draws sharing a shader and material can be submitted with a single glMultiDrawElementsIndirect.
+	//Shaders read the model of every draw from u_models[a_draw_id] (see multidraw.vs),
+	//a_draw_id comes from an instanced attribute offset by the base_instance of the command.
+	//Space of released meshes is not reclaimed, it is meant for static geometry.
+	class MegaBuffer {
+	public:
+		GLuint vao_id;
+		GLuint vertices_vbo_id;
+		GLuint indices_vbo_id;
+		GLuint draw_ids_vbo_id;
+		GLuint models_ssbo_id;
+		GLuint indirect_buffer_id;
+
+		unsigned int num_vertices; //used
+		unsigned int num_indices;
+		unsigned int max_vertices; //allocated
+		unsigned int max_indices;
+		unsigned int max_draw_ids;
+		unsigned int generation; //increased when the buffers are recreated, VAOs using them must be rebuilt
+
+		//draws added since the last render
+		std::vector<Matrix44> models;
+		std::vector<sDrawElementsIndirect> commands;
+
+		MegaBuffer();
+		~MegaBuffer();
+
+		static MegaBuffer* get(); //global one, created on first use
+		static bool canStore(Mesh* mesh);
+
+		//copies the geometry and sets mesh->mega_base_vertex and mesh->mega_first_index
+		bool add(Mesh* mesh);
+
+		//visible_meshlets (optional) draws only those meshlets of the mesh
+		void addDraw(Mesh* mesh, const Matrix44& model, const std::vector<uint8>* visible_meshlets = nullptr);
+		unsigned int getNumDraws() { return (unsigned int)models.size(); }
+
+		//submits every draw added with the current shader and clears the list
+		void render(unsigned int primitive);
+
+	private:
+		void reserve(unsigned int vertices, unsigned int indices);
+		void createVAO();
+	};
+
+};
+
+#endif
@@ -10,12 +10,18 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
 #include <sys/stat.h>
 
 #include "../pipeline/camera.h" //??
 #include "texture.h"
 //#include "animation.h"
 #include "../extra/coldet/coldet.h"
+#include "meshsimplify.h"
+#include "megabuffer.h"
+#include "uploadmanager.h"
 
 //#include "engine/application.h"
 
@@ -24,12 +30,20 @@ namespace GFX {
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
-bool Mesh::use_vao = false;	//places the geometry in an interleaved array
+bool Mesh::use_vao = true;	//one VAO per mesh, shaders share the attribute locations
+bool Mesh::use_packed_vertices = false;	//uploads loaded meshes quantized to half the size (shaders must use decodePosition)
+bool Mesh::use_mega_buffer = true;	//geometry of static meshes in a shared buffer, allows multi draw indirect
+bool Mesh::build_meshlets = true;	//dense meshes are split in clusters, stored also in the .mbin
+bool Mesh::generate_lods = true;	//creates simplified versions of loaded meshes, stored also in the .mbin
 
-std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+CORE::AssetRegistry<Mesh> Mesh::sMeshesLoaded(128 * 1024 * 1024);
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
-uint32 Mesh::s_last_index = 0;
+bool Mesh::profile_render = false;
+double Mesh::render_cpu_time = 0;
+
+const char* vertex_attrib_names[NUM_FIXED_ATTRIBS] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights", "a_draw_id" };
+std::atomic<uint32> Mesh::s_last_index(0);
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -40,8 +54,12 @@ Mesh::Mesh()
 {
 	index = s_last_index++;
 	radius = 0;
-	vao_id = vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	vao_id = vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = indirect_buffer_id = 0;
+	packed_vertices = false;
 	collision_model = NULL;
+	mega_base_vertex = -1;
+	vao_generation = 0;
+	pending_uploads = 0;
 
 	clear();
 }
@@ -49,11 +67,15 @@ Mesh::Mesh()
 Mesh::~Mesh()
 {
 	clear();
+	sMeshesLoaded.remove(this);
 }
 
 
 void Mesh::clear()
 {
+	if (pending_uploads)
+		UploadManager::get()->cancel(&pending_uploads);
+
 	//Free VBOs
 	#ifdef USE_OPENGL_EXT
 		if (vertices_vbo_id)
@@ -95,11 +117,17 @@ void Mesh::clear()
 		glDeleteBuffers(1, &weights_vbo_id);
 	if (uvs1_vbo_id)
 		glDeleteBuffers(1, &uvs1_vbo_id);
+	if (indirect_buffer_id)
+		glDeleteBuffers(1, &indirect_buffer_id);
     #endif
 
 
 	//GPU Buffers ids set to 0
-	vao_id = vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	vao_id = vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = indirect_buffer_id = 0;
+	packed_vertices = false;
+	mega_base_vertex = -1; //its space in the MegaBuffer is not reused
+	mega_first_index = 0;
+	uv_density = -1;
 
 	//buffers
 	vertices.clear();
@@ -111,9 +139,20 @@ void Mesh::clear()
 	bones.clear();
 	weights.clear();
 	m_uvs1.clear();
+	meshlets.clear();
 
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
+	collision_model = NULL;
+
+	clearLODs();
+}
+
+void Mesh::clearLODs()
+{
+	for (Mesh* lod : lods)
+		delete lod;
+	lods.clear();
 }
 
 #define glGenBuffersARB glGenBuffers
@@ -122,18 +161,73 @@ void Mesh::clear()
 #define GL_ARRAY_BUFFER_ARB GL_ARRAY_BUFFER
 #define GL_STATIC_DRAW_ARB GL_STATIC_DRAW
 
-void Mesh::uploadToVRAM()
+//10 bits signed normalized per component, matches GL_INT_2_10_10_10_REV
+uint32 packNormal1010102(Vector3f n)
+{
+	int x = (int)round(clamp(n.x, -1.0f, 1.0f) * 511.0f) & 0x3FF;
+	int y = (int)round(clamp(n.y, -1.0f, 1.0f) * 511.0f) & 0x3FF;
+	int z = (int)round(clamp(n.z, -1.0f, 1.0f) * 511.0f) & 0x3FF;
+	return (uint32)x | ((uint32)y << 10) | ((uint32)z << 20);
+}
+
+//positions are stored as 16 bits inside the AABB, the shader gets u_vertex_dequant_offset/scale to restore them
+void packVertices(Mesh* mesh, std::vector<Mesh::tPackedVertex>& packed)
+{
+	bool interleaved = mesh->interleaved.size() != 0;
+	size_t num = interleaved ? mesh->interleaved.size() : mesh->vertices.size();
+	packed.resize(num);
+
+	mesh->updateBoundingBox();
+	Vector3f size = mesh->aabb_max - mesh->aabb_min;
+	Vector3f inv_size(size.x ? 1.0f / size.x : 0.0f, size.y ? 1.0f / size.y : 0.0f, size.z ? 1.0f / size.z : 0.0f);
+
+	for (size_t i = 0; i < num; ++i)
+	{
+		Vector3f pos = interleaved ? mesh->interleaved[i].vertex : mesh->vertices[i];
+		Vector3f normal = interleaved ? mesh->interleaved[i].normal : (mesh->normals.size() ? mesh->normals[i] : Vector3f(0, 0, 1));
+		Vector2f uv = interleaved ? mesh->interleaved[i].uv : (mesh->uvs.size() ? mesh->uvs[i] : Vector2f(0, 0));
+
+		Mesh::tPackedVertex& v = packed[i];
+		Vector3f t = (pos - mesh->aabb_min) * inv_size;
+		v.position[0] = (uint16)round(clamp(t.x, 0.0f, 1.0f) * 65535.0f);
+		v.position[1] = (uint16)round(clamp(t.y, 0.0f, 1.0f) * 65535.0f);
+		v.position[2] = (uint16)round(clamp(t.z, 0.0f, 1.0f) * 65535.0f);
+		v.padding = 0;
+		v.normal = packNormal1010102(normal);
+		v.uv[0] = floatToHalf(uv.x);
+		v.uv[1] = floatToHalf(uv.y);
+	}
+}
+
+//allocates the buffer and fills it now or, if it is big, through the UploadManager
+static void uploadBufferData(Mesh* mesh, unsigned int target, unsigned int* buffer_id, const void* data, size_t size)
+{
+	if (*buffer_id == 0)
+		glGenBuffersARB(1, buffer_id);
+	glBindBufferARB(target, *buffer_id);
+	if (UploadManager::enabled && size >= UploadManager::min_async_size)
+	{
+		glBufferDataARB(target, size, NULL, GL_STATIC_DRAW_ARB);
+		UploadManager::get()->uploadBuffer(&mesh->pending_uploads, buffer_id, 0, data, size);
+	}
+	else
+		glBufferDataARB(target, size, data, GL_STATIC_DRAW_ARB);
+}
+
+void Mesh::uploadToVRAM(bool pack_vertices)
 {
 	assert(vertices.size() || interleaved.size());
 
-	/*
-	if (use_vao)
+	//data queued from a previous upload is outdated
+	if (pending_uploads)
+		UploadManager::get()->cancel(&pending_uploads);
+
+	//the layout may change, the VAO is rebuilt on the next render
+	if (vao_id)
 	{
-		if (vao_id == 0)
-			glGenVertexArrays(1, &vao_id);
-		glBindVertexArray(vao_id);
+		glDeleteVertexArrays(1, &vao_id);
+		vao_id = 0;
 	}
-	*/
 
 	if (glGenBuffersARB == nullptr)
 	{
@@ -141,93 +235,77 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
+	//static meshes share a single buffer so they can be drawn with multi draw indirect
+	if (use_mega_buffer && !pack_vertices && MegaBuffer::canStore(this))
+	{
+		packed_vertices = false;
+		if (mega_base_vertex == -1)
+			MegaBuffer::get()->add(this);
+		for (Mesh* lod : lods)
+			lod->uploadToVRAM(pack_vertices);
+		return;
+	}
+
+	packed_vertices = pack_vertices;
+	if (packed_vertices)
+	{
+		// Vertex,Normal,UV quantized in one stream
+		std::vector<tPackedVertex> packed;
+		packVertices(this, packed);
+		uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &interleaved_vbo_id, &packed[0], packed.size() * sizeof(tPackedVertex));
+	}
+	else if (interleaved.size())
 	{
 		// Vertex,Normal,UV
-		if (interleaved_vbo_id == 0)
-			glGenBuffersARB(1, &interleaved_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+		uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &interleaved_vbo_id, &interleaved[0], interleaved.size() * sizeof(tInterleaved));
 	}
 	else
 	{
 		// Vertices
-		if (vertices_vbo_id == 0)
-			glGenBuffersARB(1, &vertices_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(Vector3f), &vertices[0], GL_STATIC_DRAW_ARB);
+		uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &vertices_vbo_id, &vertices[0], vertices.size() * sizeof(Vector3f));
 
 		// UVs
 		if (uvs.size())
-		{
-			if (uvs_vbo_id == 0)
-				glGenBuffersARB(1, &uvs_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2f), &uvs[0], GL_STATIC_DRAW_ARB);
-		}
+			uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &uvs_vbo_id, &uvs[0], uvs.size() * sizeof(Vector2f));
 
 		// Normals
 		if (normals.size())
-		{
-			if (normals_vbo_id == 0)
-				glGenBuffersARB(1, &normals_vbo_id);
-			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3f), &normals[0], GL_STATIC_DRAW_ARB);
-		}
+			uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &normals_vbo_id, &normals[0], normals.size() * sizeof(Vector3f));
 	}
 
 	// UVs
 	if (m_uvs1.size())
-	{
-		if (uvs1_vbo_id == 0)
-			glGenBuffersARB(1, &uvs1_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, m_uvs1.size() * sizeof(Vector2f), &m_uvs1[0], GL_STATIC_DRAW_ARB);
-	}
+		uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &uvs1_vbo_id, &m_uvs1[0], m_uvs1.size() * sizeof(Vector2f));
 
 	// Colors
 	if (colors.size())
-	{
-		if (colors_vbo_id == 0)
-			glGenBuffersARB(1, &colors_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(Vector4f), &colors[0], GL_STATIC_DRAW_ARB);
-	}
+		uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &colors_vbo_id, &colors[0], colors.size() * sizeof(Vector4f));
 
 	if (bones.size())
-	{
-		if (bones_vbo_id == 0)
-			glGenBuffersARB(1, &bones_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(Vector4ub), &bones[0], GL_STATIC_DRAW_ARB);
-	}
+		uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &bones_vbo_id, &bones[0], bones.size() * sizeof(Vector4ub));
 	if (weights.size())
 	{
-		if (weights_vbo_id == 0)
-			glGenBuffersARB(1, &weights_vbo_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(Vector4f), &weights[0], GL_STATIC_DRAW_ARB);
+		if (packed_vertices)
+		{
+			std::vector<Vector4ub> packed_weights(weights.size());
+			for (size_t i = 0; i < weights.size(); ++i)
+				packed_weights[i].set((uint8)round(clamp(weights[i].x, 0.0f, 1.0f) * 255.0f), (uint8)round(clamp(weights[i].y, 0.0f, 1.0f) * 255.0f),
+					(uint8)round(clamp(weights[i].z, 0.0f, 1.0f) * 255.0f), (uint8)round(clamp(weights[i].w, 0.0f, 1.0f) * 255.0f));
+			uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &weights_vbo_id, &packed_weights[0], packed_weights.size() * sizeof(Vector4ub));
+		}
+		else
+			uploadBufferData(this, GL_ARRAY_BUFFER_ARB, &weights_vbo_id, &weights[0], weights.size() * sizeof(Vector4f));
 	}
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
 
 	// Indices
 	if (m_indices.size())
-	{
-		if (indices_vbo_id == 0)
-			glGenBuffersARB(1, &indices_vbo_id);
-		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
-	}
+		uploadBufferData(this, GL_ELEMENT_ARRAY_BUFFER, &indices_vbo_id, &m_indices[0], m_indices.size() * sizeof(unsigned int));
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-	/*
-	if (use_vao)
-	{
-		enableBuffers(nullptr);
-		glBindVertexArray(0);
-	}
-	*/
+	for (Mesh* lod : lods)
+		lod->uploadToVRAM(pack_vertices);
 
 	checkGLErrors();
 	//clear buffers to save memory
@@ -241,9 +319,16 @@ int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
 
+//shaders using decodePosition need the AABB to restore packed positions, identity otherwise
+void Mesh::setVertexDecodeUniforms(Shader* sh)
+{
+	sh->setUniform3("u_vertex_dequant_offset", packed_vertices ? aabb_min : Vector3f(0, 0, 0));
+	sh->setUniform3("u_vertex_dequant_scale", packed_vertices ? aabb_max - aabb_min : Vector3f(1, 1, 1));
+}
+
 void Mesh::enableBuffers(Shader* sh)
 {
-	vertex_location = !sh ? 0 : sh->getAttribLocation("a_vertex");
+	vertex_location = !sh ? VERTEX_ATTRIB : sh->getAttribLocation("a_vertex");
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
 	if (vertex_location == -1)
@@ -254,20 +339,52 @@ void Mesh::enableBuffers(Shader* sh)
 	int offset_normal = 0;
 	int offset_uv = 0;
 
-	if (interleaved.size())
+	//stream formats, the packed layout uses smaller ones
+	GLenum vertex_type = GL_FLOAT;
+	GLenum normal_type = GL_FLOAT;
+	GLenum uv_type = GL_FLOAT;
+	GLenum weights_type = GL_FLOAT;
+	int normal_components = 3;
+	GLboolean normalized = GL_FALSE;
+
+	if (packed_vertices)
+	{
+		spacing = sizeof(tPackedVertex);
+		offset_normal = offsetof(tPackedVertex, normal);
+		offset_uv = offsetof(tPackedVertex, uv);
+		vertex_type = GL_UNSIGNED_SHORT;
+		normal_type = GL_INT_2_10_10_10_REV;
+		normal_components = 4;
+		uv_type = GL_HALF_FLOAT;
+		weights_type = GL_UNSIGNED_BYTE;
+		normalized = GL_TRUE;
+	}
+	else if (interleaved.size())
 	{
 		spacing = sizeof(tInterleaved);
 		offset_normal = sizeof(Vector3f);
 		offset_uv = sizeof(Vector3f) + sizeof(Vector3f);
 	}
 
+	//meshes in the MegaBuffer point to their range inside it
+	unsigned int vbo = interleaved_vbo_id;
+	size_t base_offset = 0;
+	if (mega_base_vertex != -1)
+	{
+		vbo = MegaBuffer::get()->vertices_vbo_id;
+		base_offset = mega_base_vertex * sizeof(tInterleaved);
+	}
+
+	if (sh)
+		setVertexDecodeUniforms(sh);
+
 	if (vertex_location != -1)
 	{
 		glEnableVertexAttribArray(vertex_location);
-		if (vertices_vbo_id || interleaved_vbo_id)
+		if (vertices_vbo_id || vbo)
 		{
-			glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
-			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, 0);
+			glBindBuffer(GL_ARRAY_BUFFER, vbo ? vbo : vertices_vbo_id);
+			glVertexAttribPointer(vertex_location, 3, vertex_type, normalized, spacing, (void*)base_offset);
 		}
 		else
 			glVertexAttribPointer(vertex_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].vertex : &vertices[0]);
@@ -277,14 +394,14 @@ void Mesh::enableBuffers(Shader* sh)
 	normal_location = -1;
 	if (normals.size() || spacing)
 	{
-		normal_location = !sh ? 1 : sh->getAttribLocation("a_normal");
+		normal_location = !sh ? NORMAL_ATTRIB : sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
 		{
 			glEnableVertexAttribArray(normal_location);
-			if (normals_vbo_id || interleaved_vbo_id)
+			if (normals_vbo_id || vbo)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
-				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
+				glBindBuffer(GL_ARRAY_BUFFER, vbo ? vbo : normals_vbo_id);
+				glVertexAttribPointer(normal_location, normal_components, normal_type, normalized, spacing, (void*)(base_offset + offset_normal));
 			}
 			else
 				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].normal : &normals[0]);
@@ -295,14 +412,14 @@ void Mesh::enableBuffers(Shader* sh)
 	uv_location = -1;
 	if (uvs.size() || spacing)
 	{
-		uv_location = !sh ? 2 : sh->getAttribLocation("a_coord");
+		uv_location = !sh ? UV_ATTRIB : sh->getAttribLocation("a_coord");
 		if (uv_location != -1)
 		{
 			glEnableVertexAttribArray(uv_location);
-			if (uvs_vbo_id || interleaved_vbo_id)
+			if (uvs_vbo_id || vbo)
 			{
-				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
-				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+				glBindBuffer(GL_ARRAY_BUFFER, vbo ? vbo : uvs_vbo_id);
+				glVertexAttribPointer(uv_location, 2, uv_type, GL_FALSE, spacing, (void*)(base_offset + offset_uv));
 			}
 			else
 				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, interleaved.size() ? &interleaved[0].uv : &uvs[0]);
@@ -313,7 +430,7 @@ void Mesh::enableBuffers(Shader* sh)
 	uv1_location = -1;
 	if (m_uvs1.size())
 	{
-		uv1_location = !sh ? 3 : sh->getAttribLocation("a_coord1");
+		uv1_location = !sh ? UV1_ATTRIB : sh->getAttribLocation("a_coord1");
 		if (uv1_location != -1)
 		{
 			glEnableVertexAttribArray(uv1_location);
@@ -331,7 +448,7 @@ void Mesh::enableBuffers(Shader* sh)
 	color_location = -1;
 	if (colors.size())
 	{
-		color_location = !sh ? 4 : sh->getAttribLocation("a_color");
+		color_location = !sh ? COLOR_ATTRIB : sh->getAttribLocation("a_color");
 		if (color_location != -1)
 		{
 			glEnableVertexAttribArray(color_location);
@@ -349,7 +466,7 @@ void Mesh::enableBuffers(Shader* sh)
 	bones_location = -1;
 	if (bones.size())
 	{
-		bones_location = !sh ? 5 : sh->getAttribLocation("a_bones");
+		bones_location = !sh ? BONES_ATTRIB : sh->getAttribLocation("a_bones");
 		if (bones_location != -1)
 		{
 			glEnableVertexAttribArray(bones_location);
@@ -365,14 +482,14 @@ void Mesh::enableBuffers(Shader* sh)
 	weights_location = -1;
 	if (weights.size())
 	{
-		weights_location = !sh ? 6 : sh->getAttribLocation("a_weights");
+		weights_location = !sh ? WEIGHTS_ATTRIB : sh->getAttribLocation("a_weights");
 		if (weights_location != -1)
 		{
 			glEnableVertexAttribArray(weights_location);
 			if (weights_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
-				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+				glVertexAttribPointer(weights_location, 4, weights_type, normalized, 0, NULL);
 			}
 			else
 				glVertexAttribPointer(weights_location, 4, GL_FLOAT, GL_FALSE, 0, &weights[0]);
@@ -393,17 +510,107 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
-	//bind buffers to attribute locations
-	enableBuffers(shader);
-	checkGLErrors();
+	//geometry still streaming to the GPU
+	if (pending_uploads)
+		return;
 
-	//draw call
-	drawCall(primitive, submesh_id, num_instances);
-	checkGLErrors();
+	std::chrono::high_resolution_clock::time_point start_time;
+	if (profile_render)
+		start_time = std::chrono::high_resolution_clock::now();
+
+	//fast path: the attribute bindings are already in the VAO
+	bool in_vram = interleaved_vbo_id || vertices_vbo_id || mega_base_vertex != -1;
+	bool has_ibo = m_indices.empty() || indices_vbo_id || mega_base_vertex != -1;
+	if (use_vao && !num_instances && in_vram && has_ibo)
+	{
+		setVertexDecodeUniforms(shader);
+		drawUsingVAO(primitive, submesh_id);
+	}
+	else
+	{
+		//bind buffers to attribute locations
+		enableBuffers(shader);
+		checkGLErrors();
+
+		//draw call
+		drawCall(primitive, submesh_id, num_instances);
+		checkGLErrors();
+
+		//unbind them
+		disableBuffers(shader);
+		checkGLErrors();
+	}
+
+	if (profile_render)
+		render_cpu_time += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start_time).count();
+}
+
+void Mesh::renderMeshlets(unsigned int primitive, const std::vector<uint8>& visible)
+{
+	assert(visible.size() == meshlets.size());
+	if (pending_uploads)
+		return;
+	bool indexed = m_indices.size() != 0;
+	bool in_mega_buffer = mega_base_vertex != -1; //vertex offset is applied in enableBuffers
+	unsigned int ibo = in_mega_buffer ? MegaBuffer::get()->indices_vbo_id : indices_vbo_id;
+	unsigned int index_offset = in_mega_buffer && indexed ? mega_first_index : 0;
+	if (indexed && !ibo)
+	{
+		render(primitive);
+		return;
+	}
+
+	Shader* shader = Shader::current;
+	if (!shader || !shader->compiled)
+	{
+		assert(0 && "no shader or shader not compiled or enabled");
+		return;
+	}
+
+	//compacted, consecutive visible meshlets are merged in a single command
+	static std::vector<sDrawElementsIndirect> commands;
+	commands.clear();
+	unsigned int num_primitives = 0;
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		if (!visible[i])
+			continue;
+		const sMeshlet& meshlet = meshlets[i];
+		num_primitives += meshlet.length;
+		if (commands.size() && commands.back().first_index + commands.back().count == meshlet.start + index_offset)
+			commands.back().count += meshlet.length;
+		else
+			commands.push_back({ meshlet.length, 1, meshlet.start + index_offset, 0, 0 });
+	}
+	if (commands.empty())
+		return;
+
+	if (!indirect_buffer_id)
+		glGenBuffers(1, &indirect_buffer_id);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_id);
 
-	//unbind them
+	enableBuffers(shader);
+	if (indexed)
+	{
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(sDrawElementsIndirect), &commands[0], GL_STREAM_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glMultiDrawElementsIndirect(primitive, GL_UNSIGNED_INT, 0, (GLsizei)commands.size(), 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	else
+	{
+		//same fields without base_vertex
+		std::vector<sDrawArraysIndirect> array_commands(commands.size());
+		for (size_t i = 0; i < commands.size(); ++i)
+			array_commands[i] = { commands[i].count, 1, commands[i].first_index, 0 };
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, array_commands.size() * sizeof(sDrawArraysIndirect), &array_commands[0], GL_STREAM_DRAW);
+		glMultiDrawArraysIndirect(primitive, 0, (GLsizei)array_commands.size(), 0);
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 	disableBuffers(shader);
-	checkGLErrors();
+
+	num_triangles_rendered += num_primitives / 3;
+	num_meshes_rendered++;
 }
 
 void Mesh::getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned int& size)
@@ -420,7 +627,7 @@ void Mesh::getSubmeshStartAndSize(int submesh_id, unsigned int& start, unsigned
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
 	}
 }
 
@@ -430,15 +637,24 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	unsigned int size;
 	getSubmeshStartAndSize(submesh_id, start, size);
 
+	//meshes in the MegaBuffer use its indices, the vertex offset is applied in enableBuffers
+	unsigned int ibo = indices_vbo_id;
+	unsigned int index_offset = 0;
+	if (mega_base_vertex != -1)
+	{
+		ibo = MegaBuffer::get()->indices_vbo_id;
+		index_offset = mega_first_index;
+	}
+
 	//DRAW
 	if (m_indices.size())
 	{
 		if (num_instances > 0)
 		{
-			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			assert(ibo && "indices must be uploaded to the GPU");
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
+				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)((index_offset + start) * sizeof(unsigned int)), num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
             #endif
@@ -446,11 +662,11 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		}
 		else
 		{
-			if (indices_vbo_id)
+			if (ibo)
 			{
 				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
+					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) ((index_offset + start) * sizeof(unsigned int)));
 					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
@@ -496,27 +712,29 @@ void Mesh::drawUsingVAO(unsigned int primitive, int submesh_id)
 	unsigned int size;
 	getSubmeshStartAndSize( submesh_id, start, size );
 
-	if (vao_id == 0) //upload
+	//meshes in the MegaBuffer use its indices, the vertex offset is in the attribute pointers
+	MegaBuffer* mega_buffer = mega_base_vertex != -1 ? MegaBuffer::get() : nullptr;
+	unsigned int ibo = mega_buffer ? mega_buffer->indices_vbo_id : indices_vbo_id;
+	unsigned int index_offset = mega_buffer ? mega_first_index : 0;
+
+	//built once with the fixed locations, again if the MegaBuffer was reallocated
+	if (vao_id == 0 || (mega_buffer && vao_generation != mega_buffer->generation))
 	{
-		assert(vertices_vbo_id || interleaved_vbo_id); //geometry is not in the VRAM
-		glGenVertexArrays(1, &vao_id);
+		assert((vertices_vbo_id || interleaved_vbo_id || mega_buffer) && "geometry is not in the VRAM");
+		if (vao_id == 0)
+			glGenVertexArrays(1, &vao_id);
 		glBindVertexArray(vao_id);
 		enableBuffers(nullptr);
-		//enable also indices buffer
-		if (indices_vbo_id != 0)
-		{
-			glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(unsigned int), &m_indices[0], GL_STATIC_DRAW_ARB);
-		}
+		if (m_indices.size())
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo); //stored in the VAO
 		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		vao_generation = mega_buffer ? mega_buffer->generation : 0;
 	}
 
 	glBindVertexArray(vao_id);
-	if (indices_vbo_id)
-	{
-		glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)));
-		//glDrawElementsBaseVertex(primitive,size, GL_UNSIGNED_INT, (void*)(sizeof(unsigned int) * start), 0); //allows to specify offset for vertex buffers also, not only for indices
-	}
+	if (m_indices.size())
+		glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)((index_offset + start) * sizeof(unsigned int)));
 	else
 		glDrawArrays(primitive, start, size);
 	glBindVertexArray(0);
@@ -779,7 +997,9 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_lods; //meshes stored after this one
+	int num_meshlets;
+	char extra[24]; //unused
 } sMeshInfo;
 
 bool Mesh::readBin(const char* filename)
@@ -803,19 +1023,47 @@ bool Mesh::readBin(const char* filename)
 	if ( memcmp(data,"MBIN",4) != 0 )
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
 	char* pos = data + 4;
+	int num_lods = 0;
+	if (!readBinData(pos, num_lods))
+	{
+		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	//levels of detail are stored after the mesh, same format
+	clearLODs();
+	for (int i = 0; i < num_lods; ++i)
+	{
+		Mesh* lod = new Mesh();
+		int lod_lods = 0;
+		if (!lod->readBinData(pos, lod_lods))
+		{
+			delete lod;
+			break;
+		}
+		lod->name = name + "::lod" + std::to_string(i + 1);
+		lods.push_back(lod);
+	}
+
+	delete[] data;
+	createCollisionModel();
+	return true;
+}
+
+bool Mesh::readBinData(char*& pos, int& num_lods)
+{
 	sMeshInfo info;
 	memcpy(&info,pos,sizeof(sMeshInfo));
 	pos += sizeof(sMeshInfo);
 
 	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
-	{
-		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
 		return false;
-	}
 
 	if (info.streams[0] == 'I')
 	{
@@ -855,7 +1103,7 @@ bool Mesh::readBin(const char* filename)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -894,10 +1142,16 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	meshlets.resize(info.num_meshlets);
+	if (info.num_meshlets)
+		memcpy(&meshlets[0], pos, sizeof(sMeshlet) * info.num_meshlets);
+	pos += sizeof(sMeshlet) * info.num_meshlets;
+
+	num_lods = info.num_lods;
 	return true;
 }
 
@@ -917,6 +1171,16 @@ bool Mesh::writeBin(const char* filename)
 	//watermark
 	fwrite("MBIN",sizeof(char),4,f);
 
+	writeBinData(f, (int)lods.size());
+	for (Mesh* lod : lods)
+		lod->writeBinData(f, 0);
+
+	fclose(f);
+	return true;
+}
+
+void Mesh::writeBinData(FILE* f, int num_lods)
+{
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
@@ -931,6 +1195,8 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.num_lods = num_lods;
+	info.num_meshlets = meshlets.size();
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -944,7 +1210,7 @@ bool Mesh::writeBin(const char* filename)
 	//write info
 	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
 
-	//write streams
+	//write streams (same order as readBinData)
 	if (interleaved.size())
 		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
 	else
@@ -966,14 +1232,266 @@ bool Mesh::writeBin(const char* filename)
 		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
 	if (weights.size())
 		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4f), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
 	if (m_uvs1.size())
 		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2f), 1, f);
+	if (bones_info.size())
+		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (meshlets.size())
+		fwrite((void*)&meshlets[0], meshlets.size() * sizeof(sMeshlet), 1, f);
+}
+
+//every vertex of a non indexed mesh, used to weld duplicates before simplifying
+struct sWeldKey {
+	float values[14]; //position, normal, uv, color, uv1
+	bool operator==(const sWeldKey& k) const { return memcmp(values, k.values, sizeof(values)) == 0; }
+};
+struct sWeldKeyHash {
+	size_t operator()(const sWeldKey& k) const {
+		const uint32* v = (const uint32*)k.values;
+		size_t h = 0;
+		for (int i = 0; i < 14; ++i)
+			h = h * 31 + v[i];
+		return h;
+	}
+};
+
+bool Mesh::generateLODs(int num_levels, float ratio)
+{
+	const unsigned int min_triangles = 256; //not worth it below this
+
+	clearLODs();
+	if (getNumTriangles() < min_triangles || bones.size())
+		return false;
+
+	bool is_interleaved = interleaved.size() != 0;
+	unsigned int num_source = getNumVertices();
+
+	//source vertex of every unique vertex, and the triangles using unique vertices
+	std::vector<unsigned int> source_index;
+	std::vector<unsigned int> indices;
+	if (m_indices.size())
+	{
+		indices = m_indices;
+		source_index.resize(num_source);
+		for (unsigned int i = 0; i < num_source; ++i)
+			source_index[i] = i;
+	}
+	else
+	{
+		std::unordered_map<sWeldKey, unsigned int, sWeldKeyHash> unique;
+		indices.resize(num_source);
+		for (unsigned int i = 0; i < num_source; ++i)
+		{
+			sWeldKey key;
+			memset(&key, 0, sizeof(key));
+			Vector3f* p = (Vector3f*)&key.values[0];
+			Vector3f* n = (Vector3f*)&key.values[3];
+			Vector2f* uv = (Vector2f*)&key.values[6];
+			*p = is_interleaved ? interleaved[i].vertex : vertices[i];
+			if (is_interleaved || normals.size())
+				*n = is_interleaved ? interleaved[i].normal : normals[i];
+			if (is_interleaved || uvs.size())
+				*uv = is_interleaved ? interleaved[i].uv : uvs[i];
+			if (colors.size())
+				memcpy(&key.values[8], &colors[i], sizeof(Vector4f));
+			if (m_uvs1.size())
+				memcpy(&key.values[12], &m_uvs1[i], sizeof(Vector2f));
+
+			auto it = unique.find(key);
+			if (it == unique.end())
+			{
+				indices[i] = (unsigned int)source_index.size();
+				unique[key] = indices[i];
+				source_index.push_back(i);
+			}
+			else
+				indices[i] = it->second;
+		}
+	}
+
+	std::vector<Vector3f> positions(source_index.size());
+	std::vector<Vector3f> unique_normals;
+	std::vector<Vector2f> unique_uvs;
+	bool has_normals = is_interleaved || normals.size();
+	bool has_uvs = is_interleaved || uvs.size();
+	if (has_normals)
+		unique_normals.resize(source_index.size());
+	if (has_uvs)
+		unique_uvs.resize(source_index.size());
+	for (size_t i = 0; i < source_index.size(); ++i)
+	{
+		unsigned int src = source_index[i];
+		positions[i] = is_interleaved ? interleaved[src].vertex : vertices[src];
+		if (has_normals)
+			unique_normals[i] = is_interleaved ? interleaved[src].normal : normals[src];
+		if (has_uvs)
+			unique_uvs[i] = is_interleaved ? interleaved[src].uv : uvs[src];
+	}
+
+	sSimplifyInput input;
+	input.positions = &positions[0];
+	input.normals = has_normals ? &unique_normals[0] : nullptr;
+	input.uvs = has_uvs ? &unique_uvs[0] : nullptr;
+	input.num_vertices = (unsigned int)positions.size();
+
+	//every level is simplified from the previous one, error allowed grows with the level
+	std::vector<unsigned int> level_indices = indices;
+	std::vector<unsigned int> level_source; //original triangle of every triangle
+	for (int level = 1; level <= num_levels; ++level)
+	{
+		std::vector<unsigned int> result;
+		std::vector<unsigned int> triangle_source;
+		unsigned int target = (unsigned int)(level_indices.size() * ratio) / 3 * 3;
+		float max_error = 0.01f * (float)(1 << (level - 1));
+		simplifyTriangles(input, level_indices, target, max_error, result, &triangle_source);
+
+		//stop when it doesnt simplify enough
+		if (result.size() == 0 || result.size() > level_indices.size() * 0.9f)
+			break;
+
+		for (unsigned int& t : triangle_source)
+			t = level_source.size() ? level_source[t] : t;
+		level_indices = result;
+		level_source = triangle_source;
+
+		//build the mesh with only the vertices used
+		Mesh* lod = new Mesh();
+		lod->name = name + "::lod" + std::to_string(level);
+		std::vector<int> new_index(source_index.size(), -1);
+		lod->m_indices.resize(result.size());
+		for (size_t i = 0; i < result.size(); ++i)
+		{
+			unsigned int u = result[i];
+			if (new_index[u] == -1)
+			{
+				new_index[u] = (int)lod->getNumVertices();
+				unsigned int src = source_index[u];
+				if (is_interleaved)
+					lod->interleaved.push_back(interleaved[src]);
+				else
+				{
+					lod->vertices.push_back(vertices[src]);
+					if (normals.size())
+						lod->normals.push_back(normals[src]);
+					if (uvs.size())
+						lod->uvs.push_back(uvs[src]);
+				}
+				if (colors.size())
+					lod->colors.push_back(colors[src]);
+				if (m_uvs1.size())
+					lod->m_uvs1.push_back(m_uvs1[src]);
+			}
+			lod->m_indices[i] = new_index[u];
+		}
+
+		//submeshes keep their triangles in order, so just count the ones left in every range
+		for (const sSubmeshInfo& submesh : submeshes)
+		{
+			sSubmeshInfo lod_submesh = submesh;
+			unsigned int first = (unsigned int)(std::lower_bound(triangle_source.begin(), triangle_source.end(), (unsigned int)submesh.start / 3) - triangle_source.begin());
+			unsigned int last = (unsigned int)(std::lower_bound(triangle_source.begin(), triangle_source.end(), (unsigned int)(submesh.start + submesh.length) / 3) - triangle_source.begin());
+			lod_submesh.start = first * 3;
+			lod_submesh.length = (last - first) * 3;
+			lod->submeshes.push_back(lod_submesh);
+		}
+
+		lod->aabb_min = aabb_min;
+		lod->aabb_max = aabb_max;
+		lod->box = box;
+		lod->radius = radius;
+		lods.push_back(lod);
+	}
+
+	return lods.size() != 0;
+}
+
+bool Mesh::buildMeshlets()
+{
+	const unsigned int min_triangles = 4096; //only dense meshes benefit from it
+
+	meshlets.clear();
+	unsigned int num_triangles = getNumTriangles();
+	if (num_triangles < min_triangles)
+		return false;
+
+	bool is_interleaved = interleaved.size() != 0;
+	unsigned int num_vertices = getNumVertices();
+
+	//vertex id of every corner, non indexed meshes are welded by position
+	std::vector<Vector3f> positions;
+	std::vector<unsigned int> welded;
+	const unsigned int* corner_ids = NULL;
+	if (m_indices.size())
+	{
+		positions.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+			positions[i] = is_interleaved ? interleaved[i].vertex : vertices[i];
+		corner_ids = &m_indices[0];
+	}
+	else
+	{
+		std::unordered_map<sWeldKey, unsigned int, sWeldKeyHash> unique;
+		welded.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+		{
+			sWeldKey key;
+			memset(&key, 0, sizeof(key));
+			*(Vector3f*)&key.values[0] = is_interleaved ? interleaved[i].vertex : vertices[i];
+			auto it = unique.find(key);
+			if (it == unique.end())
+			{
+				welded[i] = (unsigned int)positions.size();
+				unique[key] = welded[i];
+				positions.push_back(*(Vector3f*)&key.values[0]);
+			}
+			else
+				welded[i] = it->second;
+		}
+		corner_ids = &welded[0];
+	}
+
+	//meshlets never cross a submesh boundary, so the submesh ranges stay valid
+	std::vector<unsigned int> bounds = { 0, num_triangles };
+	for (const sSubmeshInfo& submesh : submeshes)
+	{
+		bounds.push_back(std::min((unsigned int)submesh.start / 3, num_triangles));
+		bounds.push_back(std::min((unsigned int)(submesh.start + submesh.length) / 3, num_triangles));
+	}
+	std::sort(bounds.begin(), bounds.end());
+	bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+	std::vector<unsigned int> order;
+	order.reserve(num_triangles);
+	for (size_t i = 0; i + 1 < bounds.size(); ++i)
+		::buildMeshlets(&positions[0], corner_ids, (unsigned int)positions.size(), bounds[i], bounds[i + 1], meshlets, order);
+
+	//sort the triangles
+	auto reorder = [&](auto& stream) {
+		if (stream.empty())
+			return;
+		auto sorted = stream;
+		for (unsigned int i = 0; i < num_triangles; ++i)
+			for (int k = 0; k < 3; ++k)
+				sorted[i * 3 + k] = stream[order[i] * 3 + k];
+		stream.swap(sorted);
+	};
+	if (m_indices.size())
+		reorder(m_indices);
+	else
+	{
+		reorder(interleaved);
+		reorder(vertices);
+		reorder(normals);
+		reorder(uvs);
+		reorder(m_uvs1);
+		reorder(colors);
+		reorder(bones);
+		reorder(weights);
+	}
 
-	fclose(f);
 	return true;
 }
 
@@ -1622,6 +2140,36 @@ void Mesh::updateBoundingBox()
 	box.halfsize = aabb_max - box.center;
 }
 
+float Mesh::getUVDensity()
+{
+	if (uv_density >= 0)
+		return uv_density;
+
+	double surface_area = 0.0, uv_area = 0.0;
+	bool use_interleaved = interleaved.size() > 0;
+	unsigned int num_vertices = getNumVertices();
+	if (use_interleaved || uvs.size() == vertices.size())
+	{
+		unsigned int num_indices = m_indices.size() ? (unsigned int)m_indices.size() : num_vertices;
+		for (unsigned int i = 0; i + 2 < num_indices; i += 3)
+		{
+			unsigned int t[3];
+			for (int j = 0; j < 3; ++j)
+				t[j] = m_indices.size() ? m_indices[i + j] : i + j;
+			const Vector3f& a = use_interleaved ? interleaved[t[0]].vertex : vertices[t[0]];
+			const Vector3f& b = use_interleaved ? interleaved[t[1]].vertex : vertices[t[1]];
+			const Vector3f& c = use_interleaved ? interleaved[t[2]].vertex : vertices[t[2]];
+			const Vector2f& ta = use_interleaved ? interleaved[t[0]].uv : uvs[t[0]];
+			const Vector2f& tb = use_interleaved ? interleaved[t[1]].uv : uvs[t[1]];
+			const Vector2f& tc = use_interleaved ? interleaved[t[2]].uv : uvs[t[2]];
+			surface_area += (b - a).cross(c - a).length() * 0.5;
+			uv_area += fabs((tb.x - ta.x) * (tc.y - ta.y) - (tc.x - ta.x) * (tb.y - ta.y)) * 0.5;
+		}
+	}
+	uv_density = surface_area > 0.0 ? (float)sqrt(uv_area / surface_area) : 0.0f;
+	return uv_density;
+}
+
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -1676,9 +2224,9 @@ Mesh* Mesh::getQuad()
 Mesh* Mesh::Get(const char* filename, bool skip_load)
 {
 	assert(filename);
-	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
-	if (it != sMeshesLoaded.end())
-		return it->second;
+	Mesh* mesh = sMeshesLoaded.find(filename);
+	if (mesh)
+		return mesh;
 
 	if (skip_load)
 		return NULL;
@@ -1718,16 +2266,24 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		{
 			std::cout << "[INTERL] ";
 			m->interleaveBuffers();
+			for (Mesh* lod : m->lods)
+				lod->interleaveBuffers();
 		}
 
+		//old binaries were saved without levels of detail
+		if (generate_lods && m->lods.empty() && m->generateLODs())
+			std::cout << "[LODS " << m->lods.size() << "] ";
+		if (build_meshlets && m->meshlets.empty() && m->buildMeshlets())
+			std::cout << "[MESHLETS " << m->meshlets.size() << "] ";
+
 		if (auto_upload_to_vram)
 		{
 			std::cout << "[VRAM] ";
-			m->uploadToVRAM();
+			m->uploadToVRAM(use_packed_vertices);
 		}
 
 		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
+		m->registerMesh(filename);
 		return m;
 	}
 
@@ -1754,11 +2310,19 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	//simplified versions for far away instances, stored in the .mbin too
+	if (generate_lods && m->generateLODs())
+		std::cout << "[LODS " << m->lods.size() << "] ";
+
+	//clusters for fine culling, after the LODs as it reorders the triangles
+	if (build_meshlets && m->buildMeshlets())
+		std::cout << "[MESHLETS " << m->meshlets.size() << "] ";
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
 		std::cout << "[VRAM] ";
-		m->uploadToVRAM();
+		m->uploadToVRAM(use_packed_vertices);
 	}
 
 	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
@@ -1776,15 +2340,28 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 void Mesh::registerMesh( std::string name )
 {
 	this->name = name;
-	sMeshesLoaded[name] = this;
+	sMeshesLoaded.add(name, this);
+	sMeshesLoaded.setBytes(this, getMemoryBytes());
+}
+
+size_t Mesh::getMemoryBytes()
+{
+	size_t bytes = vertices.size() * sizeof(Vector3f) + normals.size() * sizeof(Vector3f) + uvs.size() * sizeof(Vector2f) + m_uvs1.size() * sizeof(Vector2f) +
+		colors.size() * sizeof(Vector4f) + interleaved.size() * sizeof(tInterleaved) + m_indices.size() * sizeof(unsigned int) +
+		bones.size() * sizeof(Vector4ub) + weights.size() * sizeof(Vector4f) + meshlets.size() * sizeof(sMeshlet);
+	for (Mesh* lod : lods)
+		bytes += lod->getMemoryBytes();
+	return bytes;
 }
 
 void Mesh::Release()
 {
-	for (auto m : sMeshesLoaded)
+	std::vector<Mesh*> meshes;
+	sMeshesLoaded.getAll(meshes);
+	for (Mesh* m : meshes)
 	{
-        stdlog("Destroy mesh: " + m.first );
-		delete m.second;
+        stdlog("Destroy mesh: " + m->name );
+		delete m;
 	}
 	sMeshesLoaded.clear();
 }
@@ -3,9 +3,13 @@
 
 #include <vector>
 #include "../core/math.h"
+#include "../core/assets.h"
+#include "meshlets.h"
 
 #include <map>
 #include <string>
+#include <atomic>
+#include <cstdio>
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -17,8 +21,22 @@ namespace GFX {
 	class Shader; //for binding
 	class Skeleton; //for skinned meshes
 
-	//version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+	//version 12 stores the levels of detail after the mesh, 13 the meshlets after the submeshes
+#define MESH_BIN_VERSION 13 //this is used to regenerate bins if the format changes
+
+	//locations bound to every shader before linking, so a VAO works with any of them
+	enum eVertexAttribLocation {
+		VERTEX_ATTRIB = 0,
+		NORMAL_ATTRIB = 1,
+		UV_ATTRIB = 2,
+		UV1_ATTRIB = 3,
+		COLOR_ATTRIB = 4,
+		BONES_ATTRIB = 5,
+		WEIGHTS_ATTRIB = 6,
+		DRAW_ID_ATTRIB = 7, //MegaBuffer multi draws
+		NUM_FIXED_ATTRIBS
+	};
+	extern const char* vertex_attrib_names[NUM_FIXED_ATTRIBS];
 
 	struct sSubmeshInfo
 	{
@@ -31,14 +49,20 @@ namespace GFX {
 	class Mesh
 	{
 	public:
-		static std::map<std::string, Mesh*> sMeshesLoaded;
+		static CORE::AssetRegistry<Mesh> sMeshesLoaded; //nodes hold references to their meshes
 		static bool use_binary; //always load the binary version of a mesh when possible
 		static bool interleave_meshes; //loaded meshes will me automatically interleaved
-		static bool use_vao; //use vertex array object
+		static bool use_vao; //render binds a VAO built with the fixed attribute locations instead of enabling every stream
 		static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+		static bool use_packed_vertices; //loaded meshes will be uploaded using the tPackedVertex layout
+		static bool use_mega_buffer; //static meshes are uploaded to the shared MegaBuffer instead of their own VBOs
+		static bool generate_lods; //loaded meshes will generate simplified versions (see generateLODs)
+		static bool build_meshlets; //dense loaded meshes will be split in clusters (see buildMeshlets)
 		static long num_meshes_rendered;
 		static long num_triangles_rendered;
-		static uint32 s_last_index;
+		static bool profile_render; //render measures its CPU time, shown per draw call in the stats
+		static double render_cpu_time; //microseconds spent in render since the stats were reset
+		static std::atomic<uint32> s_last_index; //meshes can be created from worker threads
 
 		std::string name;
 		uint32 index; //used internally
@@ -59,6 +83,19 @@ namespace GFX {
 
 		std::vector< tInterleaved > interleaved; //to render interleaved
 
+		//compressed layout, only in VRAM (16 bytes instead of 32)
+		//position is 16bits unorm inside the AABB (shaders must call decodePosition), normal is 10:10:10:2 snorm, uv is half float
+		struct tPackedVertex {
+			uint16 position[3];
+			uint16 padding;
+			uint32 normal;
+			uint16 uv[2];
+		};
+		bool packed_vertices; //VBO contains tPackedVertex and unorm8 weights
+
+		std::vector<Mesh*> lods; //simplified versions of this mesh, lods[0] is level 1
+		std::vector<sMeshlet> meshlets; //triangles are sorted so every meshlet is a contiguous range
+
 		std::vector<unsigned int> m_indices; //for indexed meshes
 
 		//for animated meshes
@@ -72,8 +109,10 @@ namespace GFX {
 		BoundingBox box;
 
 		float radius;
+		float uv_density; //uv units per local unit (sqrt of the uv/surface area ratio), -1 until getUVDensity is called
 
 		unsigned int vao_id; //Vertex Array Object
+		unsigned int vao_generation; //MegaBuffer generation the VAO was built for
 
 		unsigned int vertices_vbo_id;
 		unsigned int uvs_vbo_id;
@@ -85,6 +124,11 @@ namespace GFX {
 		unsigned int bones_vbo_id;
 		unsigned int weights_vbo_id;
 		unsigned int uvs1_vbo_id;
+		unsigned int indirect_buffer_id; //draw commands of renderMeshlets
+
+		int mega_base_vertex; //-1 if the geometry is not in the MegaBuffer
+		unsigned int mega_first_index;
+		int pending_uploads; //buffers still being streamed by the UploadManager, the mesh is not rendered meanwhile
 
 		Mesh();
 		~Mesh();
@@ -95,9 +139,11 @@ namespace GFX {
 		void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
 		void renderBounding(const Matrix44& model, bool world_bounding = true);
 		void renderFixedPipeline(int primitive); //sloooooooow
+		void renderMeshlets(unsigned int primitive, const std::vector<uint8>& visible); //one flag per meshlet, draws them with a single multi draw indirect
 		//void renderAnimated(unsigned int primitive, Skeleton *sk);
 
-		void enableBuffers(Shader* shader); //if shader is null the attrib locations must be POS=0, NORM=1, COORD=2, COORD1=3, COLOR=4, BONES=5, WEIGHTS=6
+		void setVertexDecodeUniforms(Shader* shader);
+		void enableBuffers(Shader* shader); //if shader is null the fixed attrib locations are used (see eVertexAttribLocation)
 		void drawCall(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
 		void disableBuffers(Shader* shader);
 
@@ -108,6 +154,16 @@ namespace GFX {
 
 		unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
 		unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+		unsigned int getNumTriangles() { return (m_indices.size() ? (unsigned int)m_indices.size() : getNumVertices()) / 3; }
+		size_t getMemoryBytes(); //geometry arrays, levels of detail included
+
+		//levels of detail, level 0 is the mesh itself
+		bool generateLODs(int num_levels = 3, float ratio = 0.5f); //quadric simplification, every level keeps ~ratio of the triangles of the previous one
+		void clearLODs();
+		Mesh* getLOD(int level) { if (level <= 0 || lods.empty()) return this; return lods[(level > (int)lods.size() ? (int)lods.size() : level) - 1]; }
+
+		//clusters for fine culling, reorders the triangles inside every submesh
+		bool buildMeshlets();
 
 		//collision testing
 		void* collision_model;
@@ -133,13 +189,16 @@ namespace GFX {
 		static Mesh* getQuad(); //get global quad
 
 		void updateBoundingBox();
+		float getUVDensity(); //used to choose the mip level a draw needs
 
 		//optimize meshes
-		void uploadToVRAM();
+		void uploadToVRAM(bool pack_vertices = false);
 		void drawUsingVAO(unsigned int primitive, int submesh_id = -1);
 		bool interleaveBuffers();
 
 	private:
+		bool readBinData(char*& pos, int& num_lods);
+		void writeBinData(FILE* f, int num_lods);
 		bool loadASE(const char* filename);
 		bool loadOBJ(const char* filename);
 		bool loadMESH(const char* filename); //personal format used for animations
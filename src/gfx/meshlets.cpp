@@ -0,0 +1,177 @@
+#include "meshlets.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+static void computeMeshletBounds(const Vector3f* positions, const unsigned int* corner_ids, const unsigned int* triangles, unsigned int num_triangles, sMeshlet& meshlet)
+{
+	Vector3f min_pos = positions[corner_ids[triangles[0] * 3]];
+	Vector3f max_pos = min_pos;
+	for (unsigned int i = 0; i < num_triangles; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			const Vector3f& p = positions[corner_ids[triangles[i] * 3 + k]];
+			min_pos.setMin(p);
+			max_pos.setMax(p);
+		}
+
+	meshlet.center = (min_pos + max_pos) * 0.5f;
+	float radius2 = 0.0f;
+	for (unsigned int i = 0; i < num_triangles; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			Vector3f d = positions[corner_ids[triangles[i] * 3 + k]] - meshlet.center;
+			radius2 = std::max(radius2, d.dot(d));
+		}
+	meshlet.radius = sqrtf(radius2);
+
+	//normal cone
+	std::vector<Vector3f> normals(num_triangles);
+	Vector3f axis(0, 0, 0);
+	for (unsigned int i = 0; i < num_triangles; ++i)
+	{
+		const unsigned int* tri = &corner_ids[triangles[i] * 3];
+		const Vector3f& a = positions[tri[0]];
+		Vector3f n = (positions[tri[1]] - a).cross(positions[tri[2]] - a);
+		float len = (float)n.length();
+		normals[i] = len > 0.0f ? n * (1.0f / len) : Vector3f(0, 0, 0);
+		axis = axis + normals[i];
+	}
+
+	meshlet.cone_axis = Vector3f(0, 0, 0);
+	meshlet.cone_cutoff = 1.0f;
+	float axis_len = (float)axis.length();
+	if (axis_len == 0.0f)
+		return;
+	axis = axis * (1.0f / axis_len);
+
+	float min_dot = 1.0f;
+	for (const Vector3f& n : normals)
+		if (n.x || n.y || n.z)
+			min_dot = std::min(min_dot, n.dot(axis));
+
+	//wider than 90 degrees: some triangle always faces the camera
+	meshlet.cone_axis = axis;
+	if (min_dot > 0.0f)
+		meshlet.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+}
+
+void buildMeshlets(const Vector3f* positions, const unsigned int* corner_ids, unsigned int num_ids,
+	unsigned int first_triangle, unsigned int last_triangle,
+	std::vector<sMeshlet>& meshlets, std::vector<unsigned int>& triangle_order)
+{
+	assert(first_triangle <= last_triangle);
+	unsigned int num_triangles = last_triangle - first_triangle;
+	if (!num_triangles)
+		return;
+
+	//triangles around every vertex (local triangle index)
+	std::vector<unsigned int> adjacency_offset(num_ids + 1, 0);
+	for (unsigned int i = first_triangle * 3; i < last_triangle * 3; ++i)
+		adjacency_offset[corner_ids[i] + 1]++;
+	for (unsigned int i = 0; i < num_ids; ++i)
+		adjacency_offset[i + 1] += adjacency_offset[i];
+	std::vector<unsigned int> adjacency(num_triangles * 3);
+	{
+		std::vector<unsigned int> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+		for (unsigned int i = first_triangle * 3; i < last_triangle * 3; ++i)
+			adjacency[fill[corner_ids[i]]++] = i / 3 - first_triangle;
+	}
+
+	std::vector<bool> used(num_triangles, false);
+	std::vector<bool> in_meshlet(num_ids, false); //vertex already in the current meshlet
+	std::vector<unsigned int> vertices; //of the current meshlet
+	std::vector<unsigned int> triangles; //of the current meshlet, global index
+	std::vector<unsigned int> candidates; //triangles sharing vertices with the current meshlet
+	std::vector<bool> is_candidate(num_triangles, false);
+	unsigned int next_seed = 0;
+
+	auto newVertices = [&](unsigned int t) {
+		const unsigned int* tri = &corner_ids[(t + first_triangle) * 3];
+		return (in_meshlet[tri[0]] ? 0 : 1) + (in_meshlet[tri[1]] ? 0 : 1) + (in_meshlet[tri[2]] ? 0 : 1);
+	};
+
+	auto flush = [&]() {
+		if (triangles.empty())
+			return;
+		sMeshlet meshlet;
+		computeMeshletBounds(positions, corner_ids, &triangles[0], (unsigned int)triangles.size(), meshlet);
+		meshlet.start = (unsigned int)triangle_order.size() * 3;
+		meshlet.length = (unsigned int)triangles.size() * 3;
+		meshlets.push_back(meshlet);
+		triangle_order.insert(triangle_order.end(), triangles.begin(), triangles.end());
+		for (unsigned int v : vertices)
+			in_meshlet[v] = false;
+		for (unsigned int t : candidates)
+			is_candidate[t] = false;
+		vertices.clear();
+		triangles.clear();
+		candidates.clear();
+	};
+
+	while (true)
+	{
+		//the candidate adding less vertices, so the meshlet grows as a compact patch
+		int best = -1;
+		int best_new = 4;
+		size_t write = 0;
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			unsigned int t = candidates[i];
+			if (used[t])
+			{
+				is_candidate[t] = false;
+				continue;
+			}
+			candidates[write++] = t;
+			int n = newVertices(t);
+			if (n < best_new)
+			{
+				best_new = n;
+				best = (int)t;
+			}
+		}
+		candidates.resize(write);
+
+		//no neighbours left: start a new patch from the next unused triangle
+		if (best == -1)
+		{
+			flush();
+			while (next_seed < num_triangles && used[next_seed])
+				next_seed++;
+			if (next_seed == num_triangles)
+				break;
+			best = (int)next_seed;
+			best_new = newVertices(best);
+		}
+
+		if (vertices.size() + best_new > MESHLET_MAX_VERTICES || triangles.size() == MESHLET_MAX_TRIANGLES)
+		{
+			flush();
+			best_new = 3;
+		}
+
+		used[best] = true;
+		triangles.push_back(best + first_triangle);
+		const unsigned int* tri = &corner_ids[(best + first_triangle) * 3];
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int v = tri[k];
+			if (!in_meshlet[v])
+			{
+				in_meshlet[v] = true;
+				vertices.push_back(v);
+			}
+			for (unsigned int j = adjacency_offset[v]; j < adjacency_offset[v + 1]; ++j)
+			{
+				unsigned int t = adjacency[j];
+				if (!used[t] && !is_candidate[t])
+				{
+					is_candidate[t] = true;
+					candidates.push_back(t);
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "../core/math.h"
+#include <vector>
+
+//Small clusters of triangles (max 64 vertices / 124 triangles) with their own bounds,
+//so dense meshes can be culled by parts instead of as a whole.
+
+struct sMeshlet {
+	Vector3f center; //bounding sphere in mesh space
+	float radius;
+	Vector3f cone_axis; //average normal of the triangles
+	float cone_cutoff; //1 when the cone is too wide to cull
+	unsigned int start; //in primitives, like sSubmeshInfo
+	unsigned int length;
+};
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+//corner_ids: vertex id of every triangle corner (same id = same vertex), positions are indexed by id
+//builds the meshlets of the triangles in [first_triangle, last_triangle) and appends them to meshlets,
+//appends to triangle_order the triangles in meshlet order, meshlet.start refers to that order
+void buildMeshlets(const Vector3f* positions, const unsigned int* corner_ids, unsigned int num_ids,
+	unsigned int first_triangle, unsigned int last_triangle,
+	std::vector<sMeshlet>& meshlets, std::vector<unsigned int>& triangle_order);
+
+//backface test of the whole cluster, center and axis in the same space as the eye
+inline bool isMeshletBackfacing(const Vector3f& center, float radius, const Vector3f& cone_axis, float cone_cutoff, const Vector3f& eye)
+{
+	Vector3f d = center - eye;
+	return d.dot(cone_axis) >= cone_cutoff * d.length() + radius;
+}
@@ -0,0 +1,272 @@
+#include "meshsimplify.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+
+//symmetric 4x4 matrix storing the sum of squared distances to a set of planes
+struct sQuadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+	double weight;
+
+	void clear() { memset(this, 0, sizeof(sQuadric)); }
+
+	void addPlane(double a, double b, double c, double d, double w)
+	{
+		a2 += a * a * w; ab += a * b * w; ac += a * c * w; ad += a * d * w;
+		b2 += b * b * w; bc += b * c * w; bd += b * d * w;
+		c2 += c * c * w; cd += c * d * w;
+		d2 += d * d * w;
+		weight += w;
+	}
+
+	void add(const sQuadric& q)
+	{
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+		weight += q.weight;
+	}
+
+	//weighted squared distance of the point to the planes
+	double eval(const Vector3f& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+			+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+			+ c2 * z * z + 2 * cd * z
+			+ d2;
+	}
+};
+
+struct sCollapse {
+	unsigned int from;
+	unsigned int to;
+	float cost;
+};
+
+struct sPositionHash {
+	size_t operator()(const Vector3f& v) const {
+		uint32 h[3];
+		memcpy(h, &v, sizeof(h));
+		return (h[0] * 73856093u) ^ (h[1] * 19349663u) ^ (h[2] * 83492791u);
+	}
+};
+struct sPositionEqual {
+	bool operator()(const Vector3f& a, const Vector3f& b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+};
+
+static Vector3f triangleNormal(const Vector3f& a, const Vector3f& b, const Vector3f& c)
+{
+	return (b - a).cross(c - a);
+}
+
+float simplifyTriangles(const sSimplifyInput& input, const std::vector<unsigned int>& indices, unsigned int target_index_count, float max_error,
+	std::vector<unsigned int>& result, std::vector<unsigned int>* triangle_source)
+{
+	const float attribute_weight = 0.01f; //how much a normal/uv difference counts compared to geometric error
+	unsigned int num_vertices = input.num_vertices;
+	const Vector3f* pos = input.positions;
+	assert(pos && indices.size() % 3 == 0);
+
+	result = indices;
+	std::vector<unsigned int> source(indices.size() / 3);
+	for (size_t i = 0; i < source.size(); ++i)
+		source[i] = (unsigned int)i;
+
+	//mesh size, errors are relative to it
+	Vector3f min_pos = pos[0], max_pos = pos[0];
+	for (unsigned int i = 1; i < num_vertices; ++i)
+	{
+		min_pos.setMin(pos[i]);
+		max_pos.setMax(pos[i]);
+	}
+	double extent = (max_pos - min_pos).length();
+	double inv_extent2 = extent > 0.0 ? 1.0 / (extent * extent) : 1.0;
+	double max_cost = (double)max_error * max_error;
+
+	//group vertices sharing the position (seams), every group gets a single id
+	std::vector<unsigned int> position_id(num_vertices);
+	std::vector<bool> locked(num_vertices, false);
+	{
+		std::unordered_map<Vector3f, unsigned int, sPositionHash, sPositionEqual> ids;
+		std::vector<unsigned int> first(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+		{
+			auto it = ids.find(pos[i]);
+			if (it == ids.end())
+			{
+				position_id[i] = (unsigned int)ids.size();
+				first[position_id[i]] = i;
+				ids[pos[i]] = position_id[i];
+			}
+			else
+			{
+				position_id[i] = it->second;
+				locked[i] = locked[first[it->second]] = true;
+			}
+		}
+	}
+
+	//open borders: edges used by a single triangle
+	{
+		std::unordered_map<uint64, int> edge_count;
+		for (size_t i = 0; i < result.size(); i += 3)
+			for (int e = 0; e < 3; ++e)
+			{
+				uint64 a = position_id[result[i + e]], b = position_id[result[i + (e + 1) % 3]];
+				edge_count[a < b ? (a << 32) | b : (b << 32) | a]++;
+			}
+		for (size_t i = 0; i < result.size(); i += 3)
+			for (int e = 0; e < 3; ++e)
+			{
+				unsigned int va = result[i + e], vb = result[i + (e + 1) % 3];
+				uint64 a = position_id[va], b = position_id[vb];
+				if (edge_count[a < b ? (a << 32) | b : (b << 32) | a] == 1)
+					locked[va] = locked[vb] = true;
+			}
+	}
+
+	//plane quadrics, weighted by area
+	std::vector<sQuadric> quadrics(num_vertices);
+	for (sQuadric& q : quadrics)
+		q.clear();
+	for (size_t i = 0; i < result.size(); i += 3)
+	{
+		const Vector3f& a = pos[result[i]];
+		Vector3f n = triangleNormal(a, pos[result[i + 1]], pos[result[i + 2]]);
+		double area = n.length();
+		if (area == 0.0)
+			continue;
+		n = n * (float)(1.0 / area);
+		double d = -(n.x * a.x + n.y * a.y + n.z * a.z);
+		for (int k = 0; k < 3; ++k)
+			quadrics[result[i + k]].addPlane(n.x, n.y, n.z, d, area * 0.5);
+	}
+
+	std::vector<unsigned int> remap(num_vertices);
+	std::vector<bool> touched(num_vertices);
+	std::vector<unsigned int> adjacency_offset(num_vertices + 1);
+	std::vector<unsigned int> adjacency;
+	std::vector<sCollapse> collapses;
+	float reached_error = 0.0f;
+
+	while (result.size() > target_index_count)
+	{
+		//triangles around every vertex
+		std::fill(adjacency_offset.begin(), adjacency_offset.end(), 0);
+		for (unsigned int v : result)
+			adjacency_offset[v + 1]++;
+		for (unsigned int i = 0; i < num_vertices; ++i)
+			adjacency_offset[i + 1] += adjacency_offset[i];
+		adjacency.resize(result.size());
+		{
+			std::vector<unsigned int> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+			for (size_t i = 0; i < result.size(); ++i)
+				adjacency[fill[result[i]]++] = (unsigned int)(i / 3);
+		}
+
+		//every edge can collapse in both directions
+		collapses.clear();
+		for (size_t i = 0; i < result.size(); i += 3)
+			for (int e = 0; e < 3; ++e)
+			{
+				unsigned int a = result[i + e], b = result[i + (e + 1) % 3];
+				for (int dir = 0; dir < 2; ++dir)
+				{
+					unsigned int from = dir ? b : a, to = dir ? a : b;
+					if (locked[from])
+						continue;
+					sQuadric q = quadrics[from];
+					q.add(quadrics[to]);
+					double cost = q.weight > 0.0 ? q.eval(pos[to]) / q.weight * inv_extent2 : 0.0;
+					if (input.normals)
+						cost += attribute_weight * 0.25 * (input.normals[from] - input.normals[to]).length() * (input.normals[from] - input.normals[to]).length();
+					if (input.uvs)
+					{
+						Vector2f duv = input.uvs[from] - input.uvs[to];
+						cost += attribute_weight * (duv.x * duv.x + duv.y * duv.y);
+					}
+					collapses.push_back({ from, to, (float)cost });
+				}
+			}
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.cost < b.cost; });
+
+		for (unsigned int i = 0; i < num_vertices; ++i)
+			remap[i] = i;
+		std::fill(touched.begin(), touched.end(), false);
+
+		size_t triangles_to_remove = (result.size() - target_index_count) / 3;
+		size_t triangles_removed = 0;
+		size_t num_collapses = 0;
+
+		for (const sCollapse& c : collapses)
+		{
+			if (c.cost > max_cost || triangles_removed >= triangles_to_remove)
+				break;
+			if (touched[c.from] || touched[c.to])
+				continue;
+
+			//moving "from" to "to" must not flip any triangle
+			bool valid = true;
+			size_t degenerated = 0;
+			for (unsigned int k = adjacency_offset[c.from]; k < adjacency_offset[c.from + 1] && valid; ++k)
+			{
+				const unsigned int* tri = &result[adjacency[k] * 3];
+				if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to)
+				{
+					degenerated++;
+					continue;
+				}
+				Vector3f p[3], q[3];
+				for (int j = 0; j < 3; ++j)
+				{
+					p[j] = pos[tri[j]];
+					q[j] = tri[j] == c.from ? pos[c.to] : p[j];
+				}
+				Vector3f n0 = triangleNormal(p[0], p[1], p[2]);
+				Vector3f n1 = triangleNormal(q[0], q[1], q[2]);
+				if (n0.dot(n1) <= 0.0f)
+					valid = false;
+			}
+			if (!valid)
+				continue;
+
+			remap[c.from] = c.to;
+			quadrics[c.to].add(quadrics[c.from]);
+			//lock the neighbourhood for this pass so the flip tests stay valid
+			for (unsigned int k = adjacency_offset[c.from]; k < adjacency_offset[c.from + 1]; ++k)
+				for (int j = 0; j < 3; ++j)
+					touched[result[adjacency[k] * 3 + j]] = true;
+			triangles_removed += degenerated;
+			reached_error = std::max(reached_error, (float)sqrt(c.cost));
+			num_collapses++;
+		}
+
+		if (!num_collapses)
+			break;
+
+		//apply and remove degenerated triangles keeping the order
+		size_t write = 0;
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			unsigned int a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			result[write] = a;
+			result[write + 1] = b;
+			result[write + 2] = c;
+			source[write / 3] = source[i / 3];
+			write += 3;
+		}
+		result.resize(write);
+		source.resize(write / 3);
+	}
+
+	if (triangle_source)
+		*triangle_source = source;
+	return reached_error;
+}
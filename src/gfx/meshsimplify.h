@@ -0,0 +1,23 @@
+#pragma once
+
+#include "../core/math.h"
+#include <vector>
+
+//Quadric error simplification (Garland & Heckbert) using half edge collapses:
+//vertices never move, they are merged into a neighbour, so every attribute stays valid.
+//Vertices on open borders or on uv/normal seams (same position, different vertex) are locked.
+//The cost of a collapse is the quadric error relative to the mesh size plus the normal/uv difference.
+
+struct sSimplifyInput {
+	const Vector3f* positions = nullptr;
+	const Vector3f* normals = nullptr; //optional
+	const Vector2f* uvs = nullptr; //optional
+	unsigned int num_vertices = 0;
+};
+
+//indices: triangle list referencing the input vertices
+//result: triangles left, same order as the input, referencing the same vertices
+//triangle_source: (optional) for every resulting triangle, the index of the triangle in the input list
+//max_error is relative to the mesh size, returns the error reached
+float simplifyTriangles(const sSimplifyInput& input, const std::vector<unsigned int>& indices, unsigned int target_index_count, float max_error,
+	std::vector<unsigned int>& result, std::vector<unsigned int>* triangle_source = nullptr);
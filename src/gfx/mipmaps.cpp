@@ -0,0 +1,341 @@
+#include "mipmaps.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include "texture.h"
+#include "../core/task.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MIPMAPS_USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+#define LINEAR_TO_SRGB_SIZE 4096
+#define KAISER_TAPS 8
+#define ROWS_PER_BAND 16
+
+int getMipFlags(eTextureUsage usage)
+{
+	switch (usage)
+	{
+	case TEXTURE_USAGE_NORMAL: return MIP_NORMAL_MAP;
+	case TEXTURE_USAGE_COLOR: return MIP_SRGB;
+	default: return MIP_LINEAR; //data, also the textures loaded without usage, as they may not be colours
+	}
+}
+
+//conversion tables, built the first time they are used
+struct sMipTables {
+	float srgb_to_linear[256];
+	float unorm_to_float[256];
+	uint8 linear_to_srgb[LINEAR_TO_SRGB_SIZE];
+	float kaiser[KAISER_TAPS];
+
+	static double besselI0(double x)
+	{
+		double sum = 1.0, term = 1.0;
+		for (int k = 1; k < 20; ++k)
+		{
+			term *= (x / (2.0 * k)) * (x / (2.0 * k));
+			sum += term;
+		}
+		return sum;
+	}
+
+	sMipTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			double c = i / 255.0;
+			srgb_to_linear[i] = (float)(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+			unorm_to_float[i] = (float)c;
+		}
+		for (int i = 0; i < LINEAR_TO_SRGB_SIZE; ++i)
+		{
+			double v = i / (double)(LINEAR_TO_SRGB_SIZE - 1);
+			double c = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+			linear_to_srgb[i] = (uint8)std::min(255.0, c * 255.0 + 0.5);
+		}
+
+		//sinc with the cutoff at half the source frequency, Kaiser window of radius 4 source pixels
+		const double alpha = 4.0, radius = 4.0;
+		double total = 0.0;
+		double weights[KAISER_TAPS];
+		for (int i = 0; i < KAISER_TAPS; ++i)
+		{
+			double d = i - (KAISER_TAPS - 1) * 0.5; //-3.5 .. 3.5 from the center of the destination pixel
+			double t = d / radius;
+			double window = besselI0(alpha * sqrt(std::max(0.0, 1.0 - t * t))) / besselI0(alpha);
+			double x = PI * d * 0.5;
+			weights[i] = (x == 0.0 ? 1.0 : sin(x) / x) * window;
+			total += weights[i];
+		}
+		for (int i = 0; i < KAISER_TAPS; ++i)
+			kaiser[i] = (float)(weights[i] / total);
+	}
+};
+
+static const sMipTables& getMipTables()
+{
+	static sMipTables tables;
+	return tables;
+}
+
+static inline int clampIndex(int i, int size)
+{
+	return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+//a level read by the filter, the base one comes as bytes and the next ones as linear floats
+struct sMipLevel {
+	int width;
+	int height;
+	int num_channels;
+	const uint8* bytes;
+	const float* floats;
+};
+
+//channels affected by the sRGB curve (grey or rgb), alpha is always linear
+static inline int colorChannels(int num_channels)
+{
+	return num_channels >= 3 ? 3 : 1;
+}
+
+static void fetchRow(const sMipLevel& src, int y, int flags, float* out)
+{
+	int row_size = src.width * src.num_channels;
+	if (src.floats)
+	{
+		memcpy(out, src.floats + (size_t)y * row_size, row_size * sizeof(float));
+		return;
+	}
+
+	const sMipTables& tables = getMipTables();
+	const uint8* row = src.bytes + (size_t)y * row_size;
+	const float* color_table = (flags & MIP_SRGB) ? tables.srgb_to_linear : tables.unorm_to_float;
+	int color_channels = colorChannels(src.num_channels);
+	for (int x = 0; x < src.width; ++x)
+		for (int k = 0; k < src.num_channels; ++k, ++row, ++out)
+			*out = k < color_channels ? color_table[*row] : tables.unorm_to_float[*row];
+}
+
+//acc += row * weight
+static void addScaledRow(float* acc, const float* row, float weight, int size)
+{
+	int i = 0;
+#ifdef MIPMAPS_USE_SSE
+	__m128 w = _mm_set1_ps(weight);
+	for (; i + 4 <= size; i += 4)
+		_mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(row + i), w)));
+#endif
+	for (; i < size; ++i)
+		acc[i] += row[i] * weight;
+}
+
+//box: average of the two columns
+static void boxRow(const float* src, int src_width, int num_channels, int dst_width, float* dst)
+{
+	for (int x = 0; x < dst_width; ++x)
+	{
+		const float* a = src + std::min(x * 2, src_width - 1) * num_channels;
+		const float* b = src + std::min(x * 2 + 1, src_width - 1) * num_channels;
+		float* o = dst + x * num_channels;
+#ifdef MIPMAPS_USE_SSE
+		if (num_channels == 4)
+		{
+			_mm_storeu_ps(o, _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)), _mm_set1_ps(0.25f)));
+			continue;
+		}
+#endif
+		for (int k = 0; k < num_channels; ++k)
+			o[k] = (a[k] + b[k]) * 0.25f; //the two rows were already added
+	}
+}
+
+static void kaiserRow(const float* src, int src_width, int num_channels, int dst_width, float* dst)
+{
+	const float* weights = getMipTables().kaiser;
+	for (int x = 0; x < dst_width; ++x)
+	{
+		float* o = dst + x * num_channels;
+		int first = x * 2 - KAISER_TAPS / 2 + 1;
+#ifdef MIPMAPS_USE_SSE
+		if (num_channels == 4)
+		{
+			__m128 sum = _mm_setzero_ps();
+			for (int i = 0; i < KAISER_TAPS; ++i)
+			{
+				int sx = clampIndex(first + i, src_width);
+				sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(src + sx * 4), _mm_set1_ps(weights[i])));
+			}
+			_mm_storeu_ps(o, sum);
+			continue;
+		}
+#endif
+		for (int k = 0; k < num_channels; ++k)
+			o[k] = 0.0f;
+		for (int i = 0; i < KAISER_TAPS; ++i)
+		{
+			const float* p = src + clampIndex(first + i, src_width) * num_channels;
+			for (int k = 0; k < num_channels; ++k)
+				o[k] += p[k] * weights[i];
+		}
+	}
+}
+
+//negative lobes of the kaiser filter and normals shortened by the average
+static void fixPixels(float* pixels, int count, int num_channels, int flags, eMipFilter filter)
+{
+	if (filter == MIP_FILTER_KAISER)
+		for (int i = 0; i < count * num_channels; ++i)
+			pixels[i] = std::max(0.0f, pixels[i]);
+
+	if (!(flags & MIP_NORMAL_MAP) || num_channels < 3)
+		return;
+	for (int i = 0; i < count; ++i)
+	{
+		float* p = pixels + i * num_channels;
+		float x = p[0] * 2.0f - 1.0f, y = p[1] * 2.0f - 1.0f, z = p[2] * 2.0f - 1.0f;
+		float len = sqrtf(x * x + y * y + z * z);
+		if (len < 0.00001f)
+		{
+			x = y = 0.0f;
+			z = len = 1.0f;
+		}
+		p[0] = x / len * 0.5f + 0.5f;
+		p[1] = y / len * 0.5f + 0.5f;
+		p[2] = z / len * 0.5f + 0.5f;
+	}
+}
+
+static void encodePixels(const float* pixels, int count, int num_channels, int flags, uint8* out)
+{
+	const uint8* to_srgb = getMipTables().linear_to_srgb;
+	int color_channels = (flags & MIP_SRGB) ? colorChannels(num_channels) : 0;
+	for (int i = 0; i < count; ++i)
+		for (int k = 0; k < num_channels; ++k, ++pixels, ++out)
+		{
+			float v = clamp(*pixels, 0.0f, 1.0f);
+			*out = k < color_channels ? to_srgb[(int)(v * (LINEAR_TO_SRGB_SIZE - 1) + 0.5f)] : (uint8)(v * 255.0f + 0.5f);
+		}
+}
+
+//one band of rows of the destination
+static void filterRows(const sMipLevel& src, int flags, eMipFilter filter, int dst_width, int y_start, int y_end, float* dst, uint8* dst_bytes)
+{
+	int num_channels = src.num_channels;
+	int row_size = src.width * num_channels;
+	int dst_row_size = dst_width * num_channels;
+	std::vector<float> row(row_size), acc(row_size);
+	const float* weights = getMipTables().kaiser;
+
+	for (int y = y_start; y < y_end; ++y)
+	{
+		//vertical pass
+		if (filter == MIP_FILTER_BOX)
+		{
+			fetchRow(src, std::min(y * 2, src.height - 1), flags, &acc[0]);
+			fetchRow(src, std::min(y * 2 + 1, src.height - 1), flags, &row[0]);
+			addScaledRow(&acc[0], &row[0], 1.0f, row_size);
+		}
+		else
+		{
+			std::fill(acc.begin(), acc.end(), 0.0f);
+			int first = y * 2 - KAISER_TAPS / 2 + 1;
+			for (int i = 0; i < KAISER_TAPS; ++i)
+			{
+				fetchRow(src, clampIndex(first + i, src.height), flags, &row[0]);
+				addScaledRow(&acc[0], &row[0], weights[i], row_size);
+			}
+		}
+
+		//horizontal pass
+		float* out = dst + (size_t)y * dst_row_size;
+		if (filter == MIP_FILTER_BOX)
+			boxRow(&acc[0], src.width, num_channels, dst_width, out);
+		else
+			kaiserRow(&acc[0], src.width, num_channels, dst_width, out);
+
+		fixPixels(out, dst_width, num_channels, flags, filter);
+		if (dst_bytes)
+			encodePixels(out, dst_width, num_channels, flags, dst_bytes + (size_t)y * dst_row_size);
+	}
+}
+
+static void filterLevel(const sMipLevel& src, int flags, eMipFilter filter, int dst_width, int dst_height, float* dst, uint8* dst_bytes, int num_threads)
+{
+	//not worth to wake up threads for the small levels
+	if ((size_t)dst_width * dst_height < 128 * 128)
+		num_threads = 1;
+	int num_bands = (dst_height + ROWS_PER_BAND - 1) / ROWS_PER_BAND;
+	parallelFor(num_bands, [&](int band) {
+		filterRows(src, flags, filter, dst_width, band * ROWS_PER_BAND, std::min(dst_height, (band + 1) * ROWS_PER_BAND), dst, dst_bytes);
+	}, num_threads);
+}
+
+void generateMipChain(const uint8* pixels, int width, int height, int num_channels, int flags, eMipFilter filter, std::vector<Image*>& levels, int num_threads)
+{
+	assert(pixels && width > 0 && height > 0);
+	sMipLevel src = { width, height, num_channels, pixels, NULL };
+	std::vector<float> current, next; //previous level in float, so the error doesn't accumulate
+	while (src.width > 1 || src.height > 1)
+	{
+		int w = std::max(1, src.width / 2), h = std::max(1, src.height / 2);
+		next.resize((size_t)w * h * num_channels);
+		Image* level = new Image();
+		level->resize(w, h, num_channels);
+		filterLevel(src, flags, filter, w, h, &next[0], level->data, num_threads);
+		levels.push_back(level);
+
+		current.swap(next);
+		src = { w, h, num_channels, NULL, &current[0] };
+	}
+}
+
+void generateMipChain(const Image* image, std::vector<Image*>& levels, int flags, eMipFilter filter, int num_threads)
+{
+	size_t first = levels.size();
+	generateMipChain(image->data, image->width, image->height, image->num_channels, flags, filter, levels, num_threads);
+	for (size_t i = first; i < levels.size(); ++i)
+		levels[i]->origin_topleft = image->origin_topleft;
+}
+
+void generateMipChain(const FloatImage* image, std::vector<FloatImage*>& levels, int flags, eMipFilter filter, int num_threads)
+{
+	assert(image->data && image->width && image->height);
+	flags &= ~MIP_SRGB; //float images are linear
+	sMipLevel src = { (int)image->width, (int)image->height, (int)image->num_channels, NULL, image->data };
+	while (src.width > 1 || src.height > 1)
+	{
+		int w = std::max(1, src.width / 2), h = std::max(1, src.height / 2);
+		FloatImage* level = new FloatImage();
+		level->resize(w, h, src.num_channels);
+		level->origin_topleft = image->origin_topleft;
+		filterLevel(src, flags, filter, w, h, level->data, NULL, num_threads);
+		levels.push_back(level);
+		src = { w, h, src.num_channels, NULL, level->data };
+	}
+}
+
+void downsampleImage(const Image* src, Image* dst, int flags, eMipFilter filter, int num_threads)
+{
+	assert(src != dst && src->data);
+	int w = std::max(1u, src->width / 2), h = std::max(1u, src->height / 2);
+	dst->resize(w, h, src->num_channels);
+	dst->origin_topleft = src->origin_topleft;
+	std::vector<float> tmp((size_t)w * h * src->num_channels);
+	sMipLevel level = { (int)src->width, (int)src->height, (int)src->num_channels, src->data, NULL };
+	filterLevel(level, flags, filter, w, h, &tmp[0], dst->data, num_threads);
+}
+
+void downsampleImage(const FloatImage* src, FloatImage* dst, int flags, eMipFilter filter, int num_threads)
+{
+	assert(src != dst && src->data);
+	int w = std::max(1u, src->width / 2), h = std::max(1u, src->height / 2);
+	dst->resize(w, h, src->num_channels);
+	dst->origin_topleft = src->origin_topleft;
+	sMipLevel level = { (int)src->width, (int)src->height, (int)src->num_channels, NULL, src->data };
+	filterLevel(level, flags & ~MIP_SRGB, filter, w, h, dst->data, NULL, num_threads);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../core/math.h"
+#include "texturecompress.h"
+#include <vector>
+
+class Image;
+class FloatImage;
+
+//CPU mipmap generation, used instead of glGenerateMipmap (the driver filters sRGB colours in gamma space)
+//every level is filtered from the previous one kept in float, rows are split between threads
+
+enum eMipFlags {
+	MIP_LINEAR = 0, //data is already linear (roughness, occlusion, float images)
+	MIP_SRGB = 1, //rgb is converted to linear before filtering and back after it, alpha is always linear
+	MIP_NORMAL_MAP = 2 //rgb is a unit vector encoded in [0,1], renormalised in every level
+};
+
+enum eMipFilter {
+	MIP_FILTER_BOX, //2x2 average, fast
+	MIP_FILTER_KAISER //8 taps Kaiser windowed sinc, sharper, used when the result is cached
+};
+
+int getMipFlags(eTextureUsage usage);
+
+//levels receives every level after the base one down to 1x1, the caller must delete them
+//num_threads 0 uses all the cores, use 1 when already running in a worker thread
+void generateMipChain(const uint8* pixels, int width, int height, int num_channels, int flags, eMipFilter filter, std::vector<Image*>& levels, int num_threads = 0);
+void generateMipChain(const Image* image, std::vector<Image*>& levels, int flags, eMipFilter filter = MIP_FILTER_BOX, int num_threads = 0);
+void generateMipChain(const FloatImage* image, std::vector<FloatImage*>& levels, int flags, eMipFilter filter = MIP_FILTER_BOX, int num_threads = 0);
+
+//single level, dst gets half the size (at least 1 pixel)
+void downsampleImage(const Image* src, Image* dst, int flags, eMipFilter filter = MIP_FILTER_BOX, int num_threads = 0);
+void downsampleImage(const FloatImage* src, FloatImage* dst, int flags, eMipFilter filter = MIP_FILTER_BOX, int num_threads = 0);
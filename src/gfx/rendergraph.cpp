@@ -0,0 +1,324 @@
+#include "rendergraph.h"
+
+#include <set>
+#include <algorithm>
+#include <iostream>
+
+#include "fbo.h"
+#include "texture.h"
+#include "gfx.h"
+#include "../utils/utils.h"
+
+namespace GFX
+{
+
+	static size_t getFBOBytes(FBO* fbo)
+	{
+		size_t bytes = 0;
+		for (int i = 0; i < 4; ++i)
+			if (fbo->color_textures[i])
+				bytes += fbo->color_textures[i]->getVRAMBytes();
+		if (fbo->depth_texture)
+			bytes += fbo->depth_texture->getVRAMBytes();
+		return bytes;
+	}
+
+	RenderGraph::RenderGraph()
+	{
+		free_after_frames = 120;
+		width = height = 0;
+	}
+
+	RenderGraph::~RenderGraph()
+	{
+		clear();
+		for (sAllocation* allocation : allocations)
+		{
+			for (auto& it : allocation->shared_depth_fbos)
+				delete it.second;
+			delete allocation->fbo;
+			delete allocation;
+		}
+		allocations.clear();
+	}
+
+	void RenderGraph::clear()
+	{
+		passes.clear();
+		targets.clear();
+		outputs.clear();
+	}
+
+	void RenderGraph::setSize(int width, int height)
+	{
+		if (this->width == width && this->height == height)
+			return;
+		this->width = width;
+		this->height = height;
+
+		//the depth of an imported target could be recreated with the new size
+		for (sAllocation* allocation : allocations)
+		{
+			for (auto& it : allocation->shared_depth_fbos)
+				delete it.second;
+			allocation->shared_depth_fbos.clear();
+			allocation->unused_frames = free_after_frames; //freed unless still used
+		}
+	}
+
+	void RenderGraph::importTarget(const char* name, FBO* fbo)
+	{
+		sTarget& target = targets[name];
+		target = sTarget();
+		target.imported = fbo;
+		target.is_imported = true;
+	}
+
+	void RenderGraph::createTarget(const char* name, const sTargetDesc& desc)
+	{
+		sTarget& target = targets[name];
+		target = sTarget();
+		target.desc = desc;
+		if (!desc.width || !desc.height)
+		{
+			assert(width && height && "setSize before creating relative targets");
+			target.desc.width = std::max(1, (int)(width * desc.scale));
+			target.desc.height = std::max(1, (int)(height * desc.scale));
+		}
+	}
+
+	RenderGraph::sPass& RenderGraph::addPass(const char* name, const char* target, std::vector<std::string> reads, std::function<void()> execute)
+	{
+		sPass pass;
+		pass.name = name;
+		pass.target = target;
+		pass.reads = reads;
+		pass.execute = execute;
+		passes.push_back(pass);
+		return passes.back();
+	}
+
+	bool RenderGraph::compile()
+	{
+		stats = sStats();
+		stats.num_passes = (int)passes.size();
+
+		for (sPass& pass : passes)
+		{
+			bool valid = targets.count(pass.target) && (pass.depth_from.empty() || targets.count(pass.depth_from));
+			for (std::string& name : pass.reads)
+				valid = valid && targets.count(name);
+			if (!valid)
+			{
+				std::cout << TermColor::RED << "[ERROR] Render graph pass uses a target not in the graph: " << pass.name << TermColor::DEFAULT << std::endl;
+				return false;
+			}
+		}
+
+		//backwards from the outputs, a pass is needed when a later one reads what it writes
+		std::set<std::string> needed(outputs.begin(), outputs.end());
+		for (int i = (int)passes.size() - 1; i >= 0; --i)
+		{
+			sPass& pass = passes[i];
+			pass.culled = !needed.count(pass.target);
+			if (pass.culled)
+			{
+				stats.culled_passes++;
+				continue;
+			}
+			if (!pass.load) //the previous content is not used
+				needed.erase(pass.target);
+			for (std::string& name : pass.reads)
+				needed.insert(name);
+			if (pass.depth_from.size())
+				needed.insert(pass.depth_from);
+		}
+
+		//lifetimes of the targets, in passes that run
+		for (auto& it : targets)
+		{
+			it.second.first_pass = it.second.last_pass = -1;
+			it.second.allocation = nullptr;
+		}
+		auto use = [&](const std::string& name, int index) {
+			sTarget& target = targets[name];
+			if (target.first_pass == -1)
+				target.first_pass = index;
+			target.last_pass = index;
+		};
+		for (int i = 0; i < (int)passes.size(); ++i)
+		{
+			sPass& pass = passes[i];
+			if (pass.culled)
+				continue;
+			use(pass.target, i);
+			for (std::string& name : pass.reads)
+				use(name, i);
+			if (pass.depth_from.size())
+				use(pass.depth_from, i);
+		}
+
+		//in order of first use, every transient target takes an allocation with the same description that is free by then
+		std::vector<sTarget*> transients;
+		for (auto& it : targets)
+			if (!it.second.is_imported && it.second.first_pass != -1)
+				transients.push_back(&it.second);
+		std::sort(transients.begin(), transients.end(), [](const sTarget* a, const sTarget* b) { return a->first_pass < b->first_pass; });
+
+		for (sAllocation* allocation : allocations)
+			allocation->busy_until = -1;
+		for (sTarget* target : transients)
+		{
+			sAllocation* found = nullptr;
+			for (sAllocation* allocation : allocations)
+				if (allocation->desc == target->desc && allocation->busy_until < target->first_pass)
+				{
+					found = allocation;
+					break;
+				}
+			if (!found)
+			{
+				const sTargetDesc& desc = target->desc;
+				found = new sAllocation();
+				found->desc = desc;
+				found->fbo = new FBO();
+				found->fbo->create(desc.width, desc.height, desc.num_textures, desc.format, desc.type, desc.depth);
+				if (desc.linear)
+					for (int i = 0; i < desc.num_textures; ++i)
+					{
+						found->fbo->color_textures[i]->bind();
+						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+						glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+					}
+				found->unused_frames = 0;
+				allocations.push_back(found);
+			}
+			found->busy_until = target->last_pass;
+			target->allocation = found;
+		}
+
+		//what it would take with a target per transient and a depth copy for every pass that shares one
+		size_t separate_bytes = 0;
+		for (sTarget* target : transients)
+			separate_bytes += getFBOBytes(target->allocation->fbo);
+		for (sPass& pass : passes)
+		{
+			Texture* depth = pass.culled || pass.depth_from.empty() ? nullptr : getDepthTexture(pass.depth_from.c_str());
+			if (!depth)
+				continue;
+			separate_bytes += depth->getVRAMBytes();
+			stats.blits_removed++;
+		}
+
+		for (sAllocation* allocation : allocations)
+		{
+			if (allocation->busy_until == -1)
+			{
+				allocation->unused_frames++;
+				continue;
+			}
+			allocation->unused_frames = 0;
+			stats.num_allocations++;
+			stats.allocated_bytes += getFBOBytes(allocation->fbo);
+		}
+		stats.num_targets = (int)transients.size();
+		stats.saved_bytes = separate_bytes > stats.allocated_bytes ? separate_bytes - stats.allocated_bytes : 0;
+
+		releaseUnused();
+		return true;
+	}
+
+	void RenderGraph::execute()
+	{
+		for (sPass& pass : passes)
+		{
+			if (pass.culled)
+				continue;
+			FBO* fbo = getPassFBO(pass);
+			startGPULabel(pass.name.c_str());
+			if (fbo)
+				fbo->bind();
+			else
+				glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			pass.execute();
+			if (fbo)
+				fbo->unbind();
+			endGPULabel();
+		}
+	}
+
+	FBO* RenderGraph::getPassFBO(sPass& pass)
+	{
+		sTarget& target = targets[pass.target];
+		if (target.is_imported)
+			return target.imported;
+
+		sAllocation* allocation = target.allocation;
+		Texture* depth = pass.depth_from.size() ? getDepthTexture(pass.depth_from.c_str()) : nullptr;
+		if (!depth)
+			return allocation->fbo;
+		if (depth->width != allocation->desc.width || depth->height != allocation->desc.height)
+		{
+			std::cout << TermColor::RED << "[ERROR] Render graph pass " << pass.name << " shares a depth of a different size" << TermColor::DEFAULT << std::endl;
+			return allocation->fbo;
+		}
+
+		//the color textures of the allocation with the depth texture of the other target
+		FBO*& fbo = allocation->shared_depth_fbos[depth];
+		if (!fbo)
+		{
+			std::vector<Texture*> textures(allocation->fbo->color_textures, allocation->fbo->color_textures + allocation->fbo->num_color_textures);
+			fbo = new FBO();
+			fbo->setTextures(textures, depth);
+		}
+		return fbo;
+	}
+
+	Texture* RenderGraph::getTexture(const char* name, int index)
+	{
+		auto it = targets.find(name);
+		if (it == targets.end())
+			return nullptr;
+		FBO* fbo = it->second.is_imported ? it->second.imported : (it->second.allocation ? it->second.allocation->fbo : nullptr);
+		return fbo ? fbo->color_textures[index] : nullptr;
+	}
+
+	Texture* RenderGraph::getDepthTexture(const char* name)
+	{
+		auto it = targets.find(name);
+		if (it == targets.end())
+			return nullptr;
+		FBO* fbo = it->second.is_imported ? it->second.imported : (it->second.allocation ? it->second.allocation->fbo : nullptr);
+		return fbo ? fbo->depth_texture : nullptr;
+	}
+
+	void RenderGraph::releaseUnused()
+	{
+		for (size_t i = 0; i < allocations.size(); )
+		{
+			sAllocation* allocation = allocations[i];
+			if (allocation->unused_frames <= free_after_frames)
+			{
+				++i;
+				continue;
+			}
+			for (auto& it : allocation->shared_depth_fbos)
+				delete it.second;
+			//the other allocations may have attached its depth, the address could be reused by a new texture
+			Texture* depth = allocation->fbo->depth_texture;
+			if (depth)
+				for (sAllocation* other : allocations)
+				{
+					auto it = other->shared_depth_fbos.find(depth);
+					if (it == other->shared_depth_fbos.end())
+						continue;
+					delete it->second;
+					other->shared_depth_fbos.erase(it);
+				}
+			delete allocation->fbo;
+			delete allocation;
+			allocations.erase(allocations.begin() + i);
+		}
+	}
+
+};
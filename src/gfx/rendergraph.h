@@ -0,0 +1,112 @@
+#ifndef RENDERGRAPH_H
+#define RENDERGRAPH_H
+
+#include "../core/includes.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <functional>
+
+namespace GFX {
+
+	class FBO;
+	class Texture;
+
+	//The passes of a frame declare the targets they read and the one they write, compile() culls the passes whose
+	//result is never read (or overwritten before), gives the same textures to transient targets with the same
+	//description whose lifetimes do not overlap, and the passes that only test against the depth of another target
+	//get an FBO with that depth texture attached instead of a copy of it. execute() binds the target of every pass left.
+	//Transient targets are only valid while the passes run, the textures are kept between frames for the next one.
+	//Their size can be a scale of the size of the graph, so they follow the window and effects can run at a lower resolution.
+	class RenderGraph {
+	public:
+		struct sTargetDesc {
+			int width = 0; //0 to use the size of the graph multiplied by scale
+			int height = 0;
+			float scale = 1.0f;
+			bool linear = false; //filtered when read, for the ones upscaled later
+			int num_textures = 1;
+			int format = GL_RGBA;
+			int type = GL_UNSIGNED_BYTE;
+			bool depth = false; //with a depth texture, otherwise a renderbuffer (not readable)
+
+			bool operator==(const sTargetDesc& o) const { return width == o.width && height == o.height && linear == o.linear && num_textures == o.num_textures && format == o.format && type == o.type && depth == o.depth; }
+		};
+
+		struct sPass {
+			std::string name;
+			std::string target; //written, the content it had is lost unless load is set
+			std::vector<std::string> reads;
+			std::string depth_from; //tests against the depth of this target, without writing it
+			bool load = false; //draws over the previous content of the target
+			std::function<void()> execute;
+			bool culled = false;
+		};
+
+		//of the last compile
+		struct sStats {
+			int num_passes = 0;
+			int culled_passes = 0;
+			int num_targets = 0; //transient ones
+			int num_allocations = 0;
+			size_t allocated_bytes = 0;
+			size_t saved_bytes = 0; //against a target per transient and a depth for every pass sharing one
+			int blits_removed = 0; //depth copies replaced by sharing the texture
+		};
+
+		sStats stats;
+		int free_after_frames; //allocations not used for these frames are deleted
+		int width; //size of the targets with scale, see setSize
+		int height;
+
+		RenderGraph();
+		~RenderGraph();
+
+		//removes the passes and targets of the previous frame (not the allocations)
+		void clear();
+		//the allocations of another size are freed in the next compile, the new ones are created as the passes need them
+		void setSize(int width, int height);
+		//created outside (or NULL for the backbuffer), never aliased
+		void importTarget(const char* name, FBO* fbo);
+		void createTarget(const char* name, const sTargetDesc& desc);
+		//targets whose last content is the result of the frame, the passes that do not contribute to them are culled
+		void setOutput(const char* name) { outputs.push_back(name); }
+		sPass& addPass(const char* name, const char* target, std::vector<std::string> reads, std::function<void()> execute);
+
+		bool compile();
+		void execute();
+
+		//valid while executing, NULL if the target is not in the graph or its pass was culled
+		Texture* getTexture(const char* name, int index = 0);
+		Texture* getDepthTexture(const char* name);
+
+	private:
+		struct sAllocation {
+			sTargetDesc desc;
+			FBO* fbo; //owns the textures
+			std::map<Texture*, FBO*> shared_depth_fbos; //same color textures with the depth of another target
+			int busy_until; //index of the last pass using it this frame
+			int unused_frames;
+		};
+
+		struct sTarget {
+			sTargetDesc desc;
+			FBO* imported = nullptr;
+			bool is_imported = false;
+			sAllocation* allocation = nullptr;
+			int first_pass = -1;
+			int last_pass = -1;
+		};
+
+		std::map<std::string, sTarget> targets;
+		std::vector<sPass> passes;
+		std::vector<std::string> outputs;
+		std::vector<sAllocation*> allocations;
+
+		FBO* getPassFBO(sPass& pass);
+		void releaseUnused();
+	};
+
+};
+
+#endif
@@ -5,15 +5,27 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <set>
 
 #include "../utils/utils.h"
+#include "../utils/filewatcher.h"
 
+#include "gfx.h"
 #include "texture.h"
+#include "mesh.h" //vertex_attrib_names
 
 #ifndef MAX
 	#define MAX(A,B) ((A)>(B)?(A):(B))
 #endif
 
+#ifndef GL_COMPLETION_STATUS_KHR
+	#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+//KHR_parallel_shader_compile / ARB_parallel_shader_compile, detected at runtime in Shader::init
+typedef void (APIENTRY* MaxShaderCompilerThreadsFunc)(GLuint count);
+static bool s_parallel_compile = false;
+
 //typedef unsigned int GLhandle;
 
 #ifdef LOAD_EXTENSIONS_MANUALLY
@@ -57,8 +69,18 @@
 namespace GFX {
 
 std::string Shader::s_shader_atlas_filename;
+std::string Shader::s_shader_atlas_base_path;
+std::vector<Shader*> Shader::s_pending_shaders;
+bool Shader::use_hot_reload = true;
+static std::set<std::string> s_atlas_include_files; //external files included by the atlas
+static FileWatcher* s_atlas_watcher = nullptr;
+static long s_reload_start_time = 0;
+static int s_reload_count = 0;
 std::map<std::string, std::string> Shader::s_shader_files;
 std::map<std::string, Shader::UberShader*> Shader::s_ubershaders;
+std::vector<std::string> Shader::s_feature_macros;
+std::string Shader::s_permutations_filename;
+bool Shader::s_permutations_changed = false;
 
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
@@ -71,12 +93,20 @@ Shader::Shader()
 		Shader::init();
 	program = vs = fs = cs = 0;
 	compiled = false;
+	pending = false;
 	from_atlas = false;
-
+	binary_key = 0;
+	program_key = 0;
+	source_hash = 0;
+	reloading = nullptr;
 }
 
 Shader::~Shader()
 {
+	auto it = std::find(s_pending_shaders.begin(), s_pending_shaders.end(), this);
+	if (it != s_pending_shaders.end())
+		s_pending_shaders.erase(it);
+	delete reloading;
 	release();
 }
 
@@ -159,7 +189,12 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 		name = vsf;
 	std::map<std::string,Shader*>::iterator it = s_Shaders.find(name);
 	if (it != s_Shaders.end())
-		return it->second;
+	{
+		Shader* shader = it->second;
+		if (shader->pending)
+			shader->finishCompile();
+		return shader->compiled ? shader : NULL;
+	}
 
 	if (!psf)
 		return NULL;
@@ -176,10 +211,73 @@ void Shader::ReloadAll()
 	for( std::map<std::string,Shader*>::iterator it = s_Shaders.begin(); it!=s_Shaders.end();it++)
 		it->second->recompile();
 	if(!s_shader_atlas_filename.empty())
-		LoadAtlas(s_shader_atlas_filename.c_str());
+		LoadAtlas(s_shader_atlas_filename.c_str(), s_shader_atlas_base_path.c_str());
 	std::cout << "Shaders recompiled" << std::endl;
 }
 
+bool Shader::FinishPending(bool wait)
+{
+	bool ok = true;
+	for (size_t i = 0; i < s_pending_shaders.size(); )
+	{
+		Shader* shader = s_pending_shaders[i];
+		if (!wait && !shader->isReady())
+		{
+			++i;
+			continue;
+		}
+		s_pending_shaders.erase(s_pending_shaders.begin() + i);
+		if (!shader->pending && !shader->reloading)
+			continue; //finished when it was used
+		if (!shader->finishCompile())
+		{
+			std::cout << " * Compilation error in shader: " << shader->name << std::endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void Shader::UpdateHotReload()
+{
+	if (!use_hot_reload || s_shader_atlas_filename.empty())
+		return;
+
+	bool watch = !s_atlas_watcher;
+	if (watch)
+		s_atlas_watcher = new FileWatcher();
+
+	std::vector<std::string> changed;
+	if (s_atlas_watcher->poll(changed))
+	{
+		for (std::string& filename : changed)
+			std::cout << " * Shader file changed: " << TermColor::CYAN << filename << TermColor::DEFAULT << std::endl;
+		//the poll can be a while after the save (twice per second without inotify), so it counts from the write
+		s_reload_start_time = getTime() - s_atlas_watcher->getLatency();
+		size_t num_pending = s_pending_shaders.size();
+		LoadAtlas(s_shader_atlas_filename.c_str(), s_shader_atlas_base_path.c_str(), false);
+		s_reload_count += (int)(s_pending_shaders.size() - num_pending);
+		watch = true; //the includes could be others
+	}
+
+	if (watch)
+	{
+		s_atlas_watcher->clear();
+		s_atlas_watcher->add(s_shader_atlas_filename);
+		for (const std::string& filename : s_atlas_include_files)
+			s_atlas_watcher->add(filename);
+	}
+
+	FinishPending(false);
+	if (s_reload_start_time && s_pending_shaders.empty())
+	{
+		//this frame already renders with the new programs
+		std::cout << " * Shaders hot reloaded: " << s_reload_count << " programs, " << getTime() - s_reload_start_time << "ms from the edit to the pixels" << std::endl;
+		s_reload_start_time = 0;
+		s_reload_count = 0;
+	}
+}
+
 //functions to trim strings
 static inline std::string trim(std::string str) {
 	size_t startpos = str.find_first_not_of(" \t\r\n");
@@ -226,6 +324,16 @@ bool Shader::hasInfoLog() const
 // ******************************************
 
 bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::string& psm)
+{
+	return submitRasterShader(vsm, psm) && finishCompile();
+}
+
+bool Shader::compileComputeShaderFromMemory(const std::string& csm)
+{
+	return submitComputeShader(csm) && finishCompile();
+}
+
+bool Shader::submitRasterShader(const std::string& vsm, const std::string& psm)
 {
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -235,38 +343,106 @@ bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::st
 		exit(0);
 	}
 
-	if (program != 0)
-		glDeleteProgram(program);
+	release();
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
+	s_type = RASTER_SHADER;
+	pending = true;
 
-	if (!createVertexShaderObject(vsm))
+	binary_key = use_binary_cache ? GetBinaryKey(vsm + '\0' + psm) : 0;
+	if (binary_key && loadProgramBinary(binary_key))
 	{
-		printf("Vertex shader compilation failed\n");
-		return false;
+		binary_key = 0;
+		return true;
+	}
+
+	createVertexShaderObject(vsm);
+	createFragmentShaderObject(psm);
+
+	//same locations in every shader so meshes can keep their bindings in a VAO
+	for (int i = 0; i < NUM_FIXED_ATTRIBS; ++i)
+		glBindAttribLocation(program, i, vertex_attrib_names[i]);
+
+	if (binary_key)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+	assert (glGetError() == GL_NO_ERROR);
+
+	return true;
+}
+
+bool Shader::submitComputeShader(const std::string& csm)
+{
+	assert(glGetError() == GL_NO_ERROR);
+
+	if (glCreateProgram == 0)
+	{
+		std::cout << "Error: your graphics cards dont support shaders. Sorry." << std::endl;
+		exit(0);
 	}
 
-	if (!createFragmentShaderObject(psm))
+	release();
+	program = glCreateProgram();
+	assert(glGetError() == GL_NO_ERROR);
+	s_type = COMPUTE_SHADER;
+	pending = true;
+
+	binary_key = use_binary_cache ? GetBinaryKey(csm) : 0;
+	if (binary_key && loadProgramBinary(binary_key))
 	{
-		printf("Fragment shader compilation failed\n");
-		return false;
+		binary_key = 0;
+		return true;
 	}
 
+	createComputeShaderObject(csm);
+
+	if (binary_key)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(program);
-	assert (glGetError() == GL_NO_ERROR);
+	assert(glGetError() == GL_NO_ERROR);
 
-	GLint linked=0;
-    
-	glGetProgramiv(program,GL_LINK_STATUS,&linked);
+	return true;
+}
+
+bool Shader::isReady()
+{
+	if (reloading)
+		return reloading->isReady();
+	if (!pending)
+		return true;
+	if (s_parallel_compile)
+	{
+		GLint done = 0;
+		glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &done);
+		return done != 0;
+	}
+	return true;
+}
+
+bool Shader::finishCompile()
+{
+	if (reloading)
+		return finishReload();
+	if (!pending)
+		return compiled;
+	pending = false;
+
+	//the first status query waits for the driver
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
 	assert(glGetError() == GL_NO_ERROR);
 
 	if (!linked)
 	{
-		saveProgramInfoLog(program);
+		if (checkShaderObject(vs, "Vertex") && checkShaderObject(fs, "Fragment") && checkShaderObject(cs, "Compute"))
+			saveProgramInfoLog(program);
 		release();
 		return false;
 	}
 
+	if (binary_key)
+		storeProgramBinary(binary_key);
+
 #ifdef _DEBUG
 	validate();
 #endif
@@ -274,57 +450,229 @@ bool Shader::compileRasterShaderFromMemory(const std::string& vsm, const std::st
 	compiled = true;
 	locations.clear(); //regenerate table
 
-	s_type = RASTER_SHADER;
+	return true;
+}
+
+bool Shader::finishReload()
+{
+	Shader* shader = reloading;
+	reloading = nullptr;
+	if (!shader->finishCompile())
+	{
+		delete shader;
+		return false;
+	}
 
+	release();
+	if (current == this)
+		current = nullptr; //enable must bind the new program
+	program = shader->program, vs = shader->vs, fs = shader->fs, cs = shader->cs;
+	shader->program = shader->vs = shader->fs = shader->cs = 0;
+	program_key = shader->program_key;
+	shader->program_key = 0;
+	s_type = shader->s_type;
+	source_hash = shader->source_hash;
+	compiled = true;
+	delete shader;
 	return true;
 }
 
+// Program binary cache ******************************
 
-bool Shader::compileComputeShaderFromMemory(const std::string& csm) {
-	assert(glGetError() == GL_NO_ERROR);
+//the file has a header (signature and hash of the driver) and then the programs: key, format, size and binary
+struct sProgramBinary {
+	GLenum format;
+	std::vector<uint8> data;
+	int users; //shaders using the program now, the ones without are dropped by SaveBinaryCache
+};
 
-	if (glCreateProgram == 0)
+bool Shader::use_binary_cache = true;
+int Shader::s_binary_cache_hits = 0;
+int Shader::s_binary_cache_misses = 0;
+static std::string s_binary_cache_filename;
+static std::map<uint64, sProgramBinary> s_program_binaries;
+static bool s_binary_cache_appendable = false; //the file is valid for this driver, new programs go at the end
+static int s_binary_cache_records = 0; //programs in the file, stale ones and repeated keys included
+
+static void writeProgramBinary(FILE* file, uint64 key, const sProgramBinary& binary)
+{
+	uint32 info[2] = { binary.format, (uint32)binary.data.size() };
+	fwrite(&key, sizeof(key), 1, file);
+	fwrite(info, sizeof(info), 1, file);
+	fwrite(binary.data.data(), 1, binary.data.size(), file);
+}
+
+static uint64 getDriverHash()
+{
+	static uint64 driver_hash = 0;
+	if (!driver_hash)
 	{
-		std::cout << "Error: your graphics cards dont support shaders. Sorry." << std::endl;
-		exit(0);
+		std::string driver;
+		GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+		for (GLenum name : names)
+		{
+			const char* str = (const char*)glGetString(name);
+			driver += std::string(str ? str : "") + "\n";
+		}
+		driver_hash = hashData(driver.c_str(), driver.size());
 	}
+	return driver_hash;
+}
 
-	if (program != 0)
-		glDeleteProgram(program);
-	program = glCreateProgram();
-	assert(glGetError() == GL_NO_ERROR);
+//rewrites the whole file, only_used skips the programs no shader uses now
+static void writeBinaryCache(bool only_used)
+{
+	FILE* file = fopen(s_binary_cache_filename.c_str(), "wb");
+	if (!file)
+		return;
+	uint64 driver = getDriverHash();
+	fwrite("SHBC", 4, 1, file);
+	fwrite(&driver, sizeof(driver), 1, file);
+	s_binary_cache_records = 0;
+	for (auto& it : s_program_binaries)
+		if (it.second.users || !only_used)
+		{
+			writeProgramBinary(file, it.first, it.second);
+			s_binary_cache_records++;
+		}
+	s_binary_cache_appendable = true;
+	fclose(file);
+}
 
-	if (!createComputeShaderObject(csm))
+void Shader::LoadBinaryCache(const char* filename)
+{
+	s_binary_cache_filename = filename;
+	s_program_binaries.clear();
+	s_binary_cache_appendable = false;
+	s_binary_cache_records = 0;
+
+	GLint num_formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+	if (num_formats == 0)
 	{
-		printf("Compute shader compilation failed\n");
-		return false;
+		std::cout << " - Program binaries not supported by the driver, shaders will always be compiled" << std::endl;
+		use_binary_cache = false;
+		return;
 	}
 
-	glLinkProgram(program);
-	assert(glGetError() == GL_NO_ERROR);
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+		return;
 
-	GLint linked = 0;
+	char signature[4];
+	uint64 driver = 0;
+	if (fread(signature, 4, 1, file) == 1 && memcmp(signature, "SHBC", 4) == 0 &&
+		fread(&driver, sizeof(driver), 1, file) == 1 && driver == getDriverHash())
+	{
+		s_binary_cache_appendable = true;
+		uint64 key;
+		uint32 info[2]; //format, size
+		while (fread(&key, sizeof(key), 1, file) == 1)
+		{
+			sProgramBinary& binary = s_program_binaries[key];
+			if (fread(info, sizeof(info), 1, file) != 1 ||
+				(binary.data.resize(info[1]), fread(binary.data.data(), 1, info[1], file) != info[1]))
+			{
+				s_program_binaries.erase(key); //truncated, it will be rewritten
+				s_binary_cache_appendable = false;
+				break;
+			}
+			binary.format = info[0];
+			binary.users = 0;
+			s_binary_cache_records++;
+		}
+	}
+	fclose(file);
+	std::cout << " + Program binary cache: " << filename << " (" << s_program_binaries.size() << " programs)" << std::endl;
+}
+
+uint64 Shader::GetBinaryKey(const std::string& code)
+{
+	uint64 hashes[2] = { hashData(code.c_str(), code.size()), getDriverHash() };
+	return hashData(hashes, sizeof(hashes));
+}
 
+bool Shader::loadProgramBinary(uint64 key)
+{
+	auto it = s_program_binaries.find(key);
+	if (it == s_program_binaries.end())
+	{
+		s_binary_cache_misses++;
+		return false;
+	}
+
+	sProgramBinary& binary = it->second;
+	glProgramBinary(program, binary.format, binary.data.data(), (GLsizei)binary.data.size());
+	GLint linked = 0;
 	glGetProgramiv(program, GL_LINK_STATUS, &linked);
-	assert(glGetError() == GL_NO_ERROR);
+	glGetError(); //an unknown format is an error, not only a failed link
 
 	if (!linked)
 	{
-		saveProgramInfoLog(program);
-		release();
+		//the driver can reject its own binaries (after an update, for instance), compile it from a clean program
+		s_program_binaries.erase(it);
+		s_binary_cache_misses++;
+		glDeleteProgram(program);
+		program = glCreateProgram();
 		return false;
 	}
 
-#ifdef _DEBUG
-	validate();
-#endif
+	binary.users++;
+	program_key = key;
+	s_binary_cache_hits++;
+	return true;
+}
 
-	compiled = true;
-	locations.clear(); //regenerate table
+void Shader::storeProgramBinary(uint64 key)
+{
+	if (s_binary_cache_filename.empty())
+		return;
 
-	s_type = COMPUTE_SHADER;
+	GLint size = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return;
+	sProgramBinary& binary = s_program_binaries[key];
+	binary.data.resize(size);
+	glGetProgramBinary(program, size, &size, &binary.format, binary.data.data());
+	binary.data.resize(size);
+	binary.users++;
+	program_key = key;
+	assert(glGetError() == GL_NO_ERROR);
 
-	return true;
+	//append the new program, or write all of them if the file is missing or was made by another driver
+	if (!s_binary_cache_appendable)
+	{
+		writeBinaryCache(false);
+		return;
+	}
+	FILE* file = fopen(s_binary_cache_filename.c_str(), "ab");
+	if (!file)
+		return;
+	writeProgramBinary(file, key, binary);
+	s_binary_cache_records++;
+	fclose(file);
+}
+
+void Shader::releaseProgramBinary()
+{
+	auto it = s_program_binaries.find(program_key);
+	if (it != s_program_binaries.end() && it->second.users > 0)
+		it->second.users--;
+	program_key = 0;
+}
+
+void Shader::SaveBinaryCache()
+{
+	//the programs of the previous versions of edited shaders or not used in this run
+	int num_used = 0;
+	for (auto& it : s_program_binaries)
+		num_used += it.second.users > 0;
+	if (s_binary_cache_filename.empty() || num_used == s_binary_cache_records)
+		return;
+	int num_records = s_binary_cache_records;
+	writeBinaryCache(true);
+	std::cout << " + Program binary cache: " << s_binary_cache_filename << " compacted from " << num_records << " to " << num_used << " programs" << std::endl;
 }
 
 bool Shader::validate()
@@ -380,33 +728,45 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	glCompileShader(handle);
 	assert( glGetError() == GL_NO_ERROR );
 
-	GLint compile=0;
-	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
+	//the status is checked in finishCompile, asking now would wait for the driver
+	glAttachShader(program,handle);
 	assert( glGetError() == GL_NO_ERROR );
 
-	//we want to see the compile log if we are in debug (to check warnings)
-	if (!compile)
-	{
-		//prints errors
-		saveShaderInfoLog(handle);
-        std::cout << "Shader code:\n " << std::endl;
-		std::vector<std::string> lines = split( fullcode, '\n' );
-		std::vector<char> lines_errors_mask(lines.size());
-		memset(&lines_errors_mask[0], 0, sizeof(char) * lines_errors_mask.size());
-		for (size_t i = 0; i < lines_with_error.size(); ++i)
-			if(lines_with_error[i] < lines_errors_mask.size())
-				lines_errors_mask[lines_with_error[i]] = 1;
-
-		for( size_t i = 0; i < lines.size(); ++i)
-			std::cout << (i+1) << "  " << (lines_errors_mask[i] ? TermColor::RED : TermColor::WHITE) << lines[i] << TermColor::DEFAULT << std::endl;
+	return true;
+}
 
-		return false;
-	}
+bool Shader::checkShaderObject(GLuint handle, const char* stage)
+{
+	if (handle == 0)
+		return true;
 
-	glAttachShader(program,handle);
+	GLint compile=0;
+	glGetShaderiv(handle,GL_COMPILE_STATUS,&compile);
 	assert( glGetError() == GL_NO_ERROR );
+	if (compile)
+		return true;
 
-	return true;
+	//prints errors
+	saveShaderInfoLog(handle);
+	GLint length = 0;
+	glGetShaderiv(handle, GL_SHADER_SOURCE_LENGTH, &length);
+	std::string fullcode(length, '\0');
+	if (length)
+		glGetShaderSource(handle, length, NULL, &fullcode[0]);
+
+    std::cout << "Shader code:\n " << std::endl;
+	std::vector<std::string> lines = split( fullcode, '\n' );
+	std::vector<char> lines_errors_mask(lines.size());
+	memset(&lines_errors_mask[0], 0, sizeof(char) * lines_errors_mask.size());
+	for (size_t i = 0; i < lines_with_error.size(); ++i)
+		if(lines_with_error[i] < lines_errors_mask.size())
+			lines_errors_mask[lines_with_error[i]] = 1;
+
+	for( size_t i = 0; i < lines.size(); ++i)
+		std::cout << (i+1) << "  " << (lines_errors_mask[i] ? TermColor::RED : TermColor::WHITE) << lines[i] << TermColor::DEFAULT << std::endl;
+
+	printf("%s shader compilation failed\n", stage);
+	return false;
 }
 
 
@@ -439,10 +799,13 @@ void Shader::release()
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
 	}
+	if (program_key)
+		releaseProgramBinary();
 
 	locations.clear();
 
 	compiled = false;
+	pending = false;
 }
 
 
@@ -452,8 +815,10 @@ void Shader::enable()
 		return;
 
 	current = this;
+	if (pending)
+		finishCompile();
 
-	glUseProgram(program);
+	useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -465,14 +830,14 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -615,10 +980,12 @@ int Shader::getUniformBlockLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	if (tex->loading) //on screen, decode it before the others
+		tex->markNeeded();
+	if (tex->pending_uploads) //still streaming
+		tex = Texture::getGreyTexture();
+	bindTexture(tex->texture_type, tex->texture_id, slot);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 void Shader::setImage(const char* varname, Texture* texture, int biding, GLenum access) {
@@ -837,6 +1204,17 @@ void Shader::init()
 		IMPORT_GLEXT( glUniform4fv );
 		IMPORT_GLEXT( glUniformMatrix4fv );
 	#endif
+
+		//without the extension the link blocks, so isReady always reports true
+		s_parallel_compile = SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile") || SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile");
+		if (s_parallel_compile)
+		{
+			MaxShaderCompilerThreadsFunc max_threads = (MaxShaderCompilerThreadsFunc)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+			if (!max_threads)
+				max_threads = (MaxShaderCompilerThreadsFunc)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+			if (max_threads)
+				max_threads(0xFFFFFFFF); //let the driver use all the threads it wants
+		}
 	}
 	
 	firsttime = false;
@@ -1022,6 +1400,7 @@ Shader* Shader::getDefaultShader(std::string name)
 bool Shader::_ProcessShaderAtlas(const char* filename, const char* base_path_cstr, std::vector<std::string> &shader_lines) {
 	std::string content;
 	std::string base_path = base_path_cstr ? base_path_cstr : "";
+	s_atlas_include_files.clear();
 
 	if (!readFile(filename, content))
 	{
@@ -1064,12 +1443,21 @@ bool Shader::_ProcessShaderAtlas(const char* filename, const char* base_path_cst
 	std::string shaders = s_shader_files[""];
 
 	shader_lines = tokenize(shaders, "\n");
+	return true;
 }
 
-bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
+bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr, bool wait)
 {
 	std::vector<std::string> lines;
 	s_shader_atlas_filename = filename;
+	s_shader_atlas_base_path = base_path_cstr ? base_path_cstr : "";
+
+	//the time to compare runs with and without the binary cache
+	long start_time = getTime();
+	int cache_hits = s_binary_cache_hits;
+	int cache_misses = s_binary_cache_misses;
+	if (use_binary_cache && s_binary_cache_filename.empty())
+		LoadBinaryCache((std::string(filename) + ".bin").c_str());
 
 	// Load all the different files from the atlas
 	if (!_ProcessShaderAtlas(filename, base_path_cstr, lines)) {
@@ -1102,7 +1490,11 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 			std::vector<std::string> macros_tokens;
 			if (macros.size())
 				macros_tokens = tokenize(macros, ",");
-			s_ubershaders[name] = new UberShader(name, vs_filename, fs_filename, macros_tokens);
+			auto it = s_ubershaders.find(name);
+			if (it == s_ubershaders.end())
+				s_ubershaders[name] = new UberShader(name, vs_filename, fs_filename, macros_tokens);
+			else
+				it->second->reload(vs_filename, fs_filename, macros_tokens);
 		}
 		else if (pos2 == std::string::npos && vs_filename.substr(shader_filename_len - 2, shader_filename_len) == "cs")
 		{
@@ -1114,15 +1506,11 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 				return false;
 			}
 
-			Shader* shader = CompileShader(COMPUTE_SHADER, name.c_str(), cs_code.c_str(), nullptr, macros.c_str());
-			if (!shader)
-			{
-				std::cout << TermColor::RED << "[ERROR]" << TermColor::DEFAULT << " Problem compiling shaders in atlas, canceling compilation." << std::endl;
-				return false;
-			}
+			Shader* shader = CompileShader(COMPUTE_SHADER, name.c_str(), cs_code.c_str(), nullptr, macros.c_str(), false);
 			shader->cs_filename = vs_filename;
 			shader->from_atlas = true;
-			std::cout << " + Compute shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
+			if (shader->pending || shader->reloading)
+				std::cout << " + Compute shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
 		}
 		else //regular shader
 		{
@@ -1136,19 +1524,26 @@ bool Shader::LoadAtlas(const char* filename, const char* base_path_cstr)
 				return false;
 			}
 
-			Shader* shader = CompileShader(RASTER_SHADER, name.c_str(), vs_code.c_str(), fs_code.c_str(), macros.c_str());
-			if (!shader)
-			{
-				std::cout << TermColor::RED << "[ERROR]" << TermColor::DEFAULT << " Problem compiling shaders in atlas, canceling compilation." << std::endl;
-				return false;
-			}
+			Shader* shader = CompileShader(RASTER_SHADER, name.c_str(), vs_code.c_str(), fs_code.c_str(), macros.c_str(), false);
 			shader->vs_filename = vs_filename;
 			shader->fs_filename = fs_filename;
 			shader->from_atlas = true;
-			std::cout << " + Raster shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
+			if (shader->pending || shader->reloading)
+				std::cout << " + Raster shader from atlas: " << TermColor::CYAN << name << TermColor::DEFAULT << std::endl;
 		}
 	}
 
+	if (!wait)
+		return true;
+
+	//all the programs are in the driver queue, waiting for the first one lets the rest compile meanwhile
+	if (!FinishPending(true))
+	{
+		std::cout << TermColor::RED << "[ERROR]" << TermColor::DEFAULT << " Problem compiling shaders in atlas." << std::endl;
+		return false;
+	}
+
+	std::cout << " * Shader atlas ready in " << getTime() - start_time << "ms (" << s_binary_cache_hits - cache_hits << " from the binary cache, " << s_binary_cache_misses - cache_misses << " compiled)" << std::endl;
 	return true;
 }
 
@@ -1183,6 +1578,7 @@ std::string Shader::ExpandIncludes(std::string name, std::string content, std::m
 					else if (param.size() > 2 && param[0] == '.' && param[1] == '/') //external file
 					{
 						std::string file_content;
+						s_atlas_include_files.insert(base_path + param.substr(1));
 						if (readFile(base_path + param.substr(1), file_content))
 						{
 							subfiles[param] = file_content + "\n";
@@ -1230,7 +1626,7 @@ void _compileShaderProcessMacros(const char* macros, std::string &shader_code) {
 	shader_code = version_shader + "\n" + macros_str + "\n" + shader_code;
 }
 
-Shader* Shader::CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros = nullptr)
+Shader* Shader::CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros, bool wait)
 {
 	//expand macros
 	std::string vs(vs_code);
@@ -1243,27 +1639,50 @@ Shader* Shader::CompileShader(const eShaderType type, const char* name, const ch
 		_compileShaderProcessMacros(macros, fs);
 	}
 
+	std::string code = vs + '\0' + fs;
+	uint64 source_hash = hashData(code.c_str(), code.size());
+
 	Shader* shader = NULL;
 	bool is_new = false;
 	auto it2 = s_Shaders.find(name);
 	if (it2 == s_Shaders.end())
 	{
 		shader = new Shader();
+		shader->name = name;
 		is_new = true;
 	}
 	else
 		shader = it2->second;
 
-	bool compile_shader_result;
-	if (type == COMPUTE_SHADER) {
-		compile_shader_result = shader->compileComputeShaderFromMemory(vs.c_str());
-	} else {
-		compile_shader_result = shader->compileRasterShaderFromMemory(vs.c_str(), fs.c_str());
+	//if the code changed a compiled shader keeps its program until the new one links, so errors dont break it
+	Shader* target = shader;
+	if (!is_new)
+	{
+		Shader* latest = shader->reloading ? shader->reloading : shader;
+		if (latest->source_hash == source_hash && (latest->compiled || latest->pending))
+			return shader;
+		if (shader->compiled)
+		{
+			delete shader->reloading;
+			target = shader->reloading = new Shader();
+		}
 	}
+	target->source_hash = source_hash;
 
-	if (!compile_shader_result)
+	if (type == COMPUTE_SHADER)
+		target->submitComputeShader(vs.c_str());
+	else
+		target->submitRasterShader(vs.c_str(), fs.c_str());
+
+	if (!wait)
 	{
-		delete shader;
+		if (std::find(s_pending_shaders.begin(), s_pending_shaders.end(), shader) == s_pending_shaders.end())
+			s_pending_shaders.push_back(shader);
+	}
+	else if (!shader->finishCompile())
+	{
+		if (is_new)
+			delete shader;
 		std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
 		return nullptr; //stop here
 	}
@@ -1293,6 +1712,32 @@ bool Shader::GetShaderFile(const char* filename, std::string& content)
 }
 
 Shader* Shader::UberShader::get(uint64 macros)
+{
+	markRequested(macros);
+	Shader* shader = submit(macros);
+	if (!shader)
+		return nullptr;
+
+	if (shader->pending ? !shader->finishCompile() : !shader->compiled)
+	{
+		std::cout << " * Compilation error in Ubershader: " << name << "[" << macros << "]" << std::endl;
+		compiled_shaders[macros] = nullptr;
+		has_error = true;
+		return nullptr;
+	}
+	return shader;
+}
+
+Shader* Shader::UberShader::getReady(uint64 macros)
+{
+	markRequested(macros); //even while the fallback is used
+	Shader* shader = submit(macros);
+	if (shader && (!shader->pending || shader->isReady()))
+		return get(macros);
+	return macros ? get(0) : nullptr;
+}
+
+Shader* Shader::UberShader::submit(uint64 macros)
 {
 	auto it = compiled_shaders.find(macros);
 	if (it != compiled_shaders.end())
@@ -1301,6 +1746,18 @@ Shader* Shader::UberShader::get(uint64 macros)
 	if (has_error)
 		return nullptr;
 
+	long start_time = getTime();
+	int cache_hits = s_binary_cache_hits;
+	Shader* shader = compilePermutation(macros);
+	if (!shader)
+		return nullptr;
+	compiled_shaders[macros] = shader;
+	std::cout << " + Shader from Ubershader: " << TermColor::CYAN << shader->name << TermColor::DEFAULT << " " << getTime() - start_time << "ms" << (s_binary_cache_hits > cache_hits ? " (binary cache)" : "") << std::endl;
+	return shader;
+}
+
+Shader* Shader::UberShader::compilePermutation(uint64 macros)
+{
 	std::string fullname = name + "[" + std::to_string(macros) + "]";
 
 	std::string vs_code;
@@ -1313,7 +1770,7 @@ Shader* Shader::UberShader::get(uint64 macros)
 	std::string macros_str;
 	if (macros)
 	{
-		int bit = 1;
+		uint64 bit = 1;
 		int max_macros = this->macros.size() < 64 ? this->macros.size() : 64;
 		for (int i = 0; i < max_macros; ++i)
 		{
@@ -1323,20 +1780,55 @@ Shader* Shader::UberShader::get(uint64 macros)
 		macros_str = macros_str.substr(0, macros_str.size() - 1); //remove last comma
 	}
 
-	Shader* shader = Shader::CompileShader(RASTER_SHADER, fullname.c_str(), vs_code.c_str(), fs_code.c_str(), macros_str.c_str());
-	if (!shader)
-	{
-		has_error = true;
-		return nullptr;
-	}
-	compiled_shaders[macros] = shader;
+	Shader* shader = Shader::CompileShader(RASTER_SHADER, fullname.c_str(), vs_code.c_str(), fs_code.c_str(), macros_str.c_str(), false);
 	shader->vs_filename = this->vs_name;
 	shader->fs_filename = this->fs_name;
 	shader->from_atlas = true;
-	std::cout << " + Shader from Ubershader: " << TermColor::CYAN << fullname << TermColor::DEFAULT << std::endl;
 	return shader;
 }
 
+void Shader::UberShader::reload(std::string vs_name, std::string fs_name, std::vector<std::string> macros)
+{
+	this->vs_name = vs_name, this->fs_name = fs_name, this->macros = macros;
+	macros_index.clear();
+	for (size_t i = 0; i < macros.size(); ++i)
+		macros_index[macros[i]] = i;
+	updateFeatureBits();
+	has_error = false;
+
+	//the permutations in use compile again if their code changed, the ones that failed wait until they are used
+	for (auto it = compiled_shaders.begin(); it != compiled_shaders.end(); )
+	{
+		if (it->second && compilePermutation(it->first))
+			++it;
+		else
+			it = compiled_shaders.erase(it);
+	}
+}
+
+void Shader::UberShader::markRequested(uint64 macros)
+{
+	if (requested.insert(macros).second)
+		s_permutations_changed = true;
+}
+
+void Shader::UberShader::prewarm(const std::vector<uint64>& permutations)
+{
+	//the driver compiles them in its threads, getReady uses each one as soon as it is linked
+	for (uint64 macros : permutations)
+		submit(macros);
+}
+
+void Shader::UberShader::updateFeatureBits()
+{
+	feature_bits.resize(s_feature_macros.size());
+	for (size_t i = 0; i < s_feature_macros.size(); ++i)
+	{
+		int index = getMacroIndex(s_feature_macros[i].c_str());
+		feature_bits[i] = index == -1 ? 0 : (uint64)1 << index;
+	}
+}
+
 void Shader::UberShader::clear()
 {
 	compiled_shaders.clear();
@@ -1351,6 +1843,74 @@ Shader::UberShader* Shader::GetUberShader(const char* name)
 	return it->second;
 }
 
+void Shader::SetFeatureMacros(const char* const* names, int num)
+{
+	s_feature_macros.assign(names, names + num);
+	for (auto& it : s_ubershaders)
+		it.second->updateFeatureBits();
+}
+
+//one line per ubershader: its name and the keys of the permutations
+bool Shader::LoadPermutationManifest(const char* filename)
+{
+	s_permutations_filename = filename;
+	std::string content;
+	if (!readFile(filename, content))
+		return false;
+
+	int num = 0;
+	std::vector<std::string> lines = tokenize(content, "\n");
+	for (std::string& line : lines)
+	{
+		std::vector<std::string> tokens = tokenize(trim(line), " ");
+		UberShader* ubershader = tokens.size() ? GetUberShader(tokens[0].c_str()) : nullptr;
+		if (!ubershader)
+			continue;
+		//a corrupt key is skipped, it would be a permutation of macros the ubershader does not have
+		std::vector<uint64> permutations;
+		for (size_t i = 1; i < tokens.size(); ++i)
+		{
+			char* end = nullptr;
+			uint64 macros = strtoull(tokens[i].c_str(), &end, 10);
+			if (end == tokens[i].c_str() || *end || (ubershader->macros.size() < 64 && macros >> ubershader->macros.size()))
+			{
+				std::cout << "[WARN] Permutation manifest " << filename << ": invalid permutation " << tokens[i] << " of " << tokens[0] << std::endl;
+				continue;
+			}
+			permutations.push_back(macros);
+		}
+		ubershader->prewarm(permutations);
+		num += (int)permutations.size();
+	}
+	s_permutations_changed = false;
+	std::cout << " + Permutation manifest: " << filename << " (" << num << " permutations)" << std::endl;
+	return true;
+}
+
+void Shader::SavePermutationManifest()
+{
+	if (!s_permutations_changed || s_permutations_filename.empty())
+		return;
+	s_permutations_changed = false;
+
+	std::string content;
+	for (auto& it : s_ubershaders)
+	{
+		std::string line;
+		UberShader* ubershader = it.second;
+		for (uint64 macros : ubershader->requested)
+		{
+			auto compiled = ubershader->compiled_shaders.find(macros);
+			if (compiled != ubershader->compiled_shaders.end() && !compiled->second)
+				continue; //failed ones are not worth precompiling
+			line += " " + std::to_string(macros);
+		}
+		if (line.size())
+			content += it.first + line + "\n";
+	}
+	writeFile(s_permutations_filename, content);
+}
+
 // **************************************
 
 BufferObject::BufferObject()
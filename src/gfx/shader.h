@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <cassert>
 
 #include "../core/includes.h"
@@ -55,6 +56,14 @@ namespace GFX {
 		//internal functions
 		bool compileRasterShaderFromMemory(const std::string& vsm, const std::string& psm);
 		bool compileComputeShaderFromMemory(const std::string& csm);
+
+		//non blocking compilation: submit sends the code to the driver without asking for the result, so it can
+		//compile several programs in parallel (KHR_parallel_shader_compile), finishCompile waits and checks errors
+		bool submitRasterShader(const std::string& vsm, const std::string& psm);
+		bool submitComputeShader(const std::string& csm);
+		bool isReady(); //finishCompile will not block (always true without the extension)
+		bool finishCompile();
+		bool finishReload(); //takes the program of reloading if it linked, keeps the current one otherwise
 		void release();
 		void enable();
 		void disable();
@@ -128,12 +137,26 @@ namespace GFX {
 		static void ReloadAll();
 		static std::map<std::string, Shader*> s_Shaders;
 
+		//shaders submitted without waiting, FinishPending checks the ones the driver completed (all if wait)
+		static std::vector<Shader*> s_pending_shaders;
+		static bool FinishPending(bool wait);
+
+		//watches the atlas and its external includes, the programs whose code changed compile in the background
+		static bool use_hot_reload;
+		static void UpdateHotReload(); //call it every frame
+
 		std::string vs_filename;
 		std::string fs_filename;
 		std::string cs_filename;
 		std::string macros;
+		std::string name; //in s_Shaders
 		bool compiled;
+		bool pending; //submitted, finishCompile not called yet
 		bool from_atlas;
+		uint64 binary_key; //to store the program once linked, 0 if loaded from the binary cache
+		uint64 program_key; //of the program in the binary cache, 0 if it is not there
+		uint64 source_hash; //of the final code, to recompile only what changed
+		Shader* reloading; //new version of the code being compiled, this one is used until it links
 
 		GLuint vs;
 		GLuint fs;
@@ -148,6 +171,7 @@ namespace GFX {
 		bool createFragmentShaderObject(const std::string& shader);
 		bool createComputeShaderObject(const std::string& shader); //not used yet
 		bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
+		bool checkShaderObject(GLuint handle, const char* stage); //prints the log and the code if it didnt compile
 		void saveShaderInfoLog(GLuint obj);
 		void saveProgramInfoLog(GLuint obj);
 
@@ -167,15 +191,30 @@ namespace GFX {
 		//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
 		//this is a way to load a single file that contains all the shaders 
 		static std::string s_shader_atlas_filename;
+		static std::string s_shader_atlas_base_path;
 		static std::map<std::string, std::string> s_shader_files; //stores strings with shadercode
 
 		//compiles and stores shader, if exist it will recompile it!
-		static Shader* CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros);
+		//with wait false the shader is returned pending, Get finishes it
+		static Shader* CompileShader(const eShaderType type, const char* name, const char* vs_code, const char* fs_code, const char* macros, bool wait = true);
 		static std::string ExpandIncludes(std::string name, std::string content, std::map<std::string, std::string>& subfiles, const std::string& base_path);
-		static bool LoadAtlas(const char* filename, const char* base_path = nullptr);
+		static bool LoadAtlas(const char* filename, const char* base_path = nullptr, bool wait = true); //without wait UpdateHotReload finishes it
 		static bool _ProcessShaderAtlas(const char* filename, const char* base_path_cstr, std::vector<std::string>& shader_lines);
 		static bool GetShaderFile(const char* filename, std::string& content);
 
+		//Program binary cache ************************
+		//linked programs are saved in a file (by default next to the atlas) and loaded with glProgramBinary in the next runs,
+		//the key hashes the final code (macros included) and the driver, so any change compiles the program again
+		static bool use_binary_cache;
+		static int s_binary_cache_hits;
+		static int s_binary_cache_misses;
+		static void LoadBinaryCache(const char* filename);
+		static void SaveBinaryCache(); //rewrites the file with the programs the shaders use now, call it on exit
+		static uint64 GetBinaryKey(const std::string& code);
+		bool loadProgramBinary(uint64 key); //false if not cached or the driver rejects it
+		void storeProgramBinary(uint64 key);
+		void releaseProgramBinary(); //the program is no longer used by this shader
+
 		//UberShaders allow permutations, use @ as the first char in the name to specify it
 		class UberShader {
 		public:
@@ -186,19 +225,47 @@ namespace GFX {
 			std::vector<std::string> macros;
 			std::map<std::string,int> macros_index;
 			std::map<uint64,Shader*> compiled_shaders;
+			std::set<uint64> requested; //permutations used in this run (not only prewarmed), the ones saved in the manifest
+			std::vector<uint64> feature_bits; //bit of the permutation for every feature in s_feature_macros, 0 if not used
 			UberShader(std::string name, std::string vs_name, std::string fs_name, std::vector<std::string> macros) {
 				has_error = false;
 				this->name = name, this->vs_name = vs_name, this->fs_name = fs_name, this->macros = macros;
 				for (size_t i = 0; i < macros.size(); ++i) 
 					macros_index[ macros[i] ] = i;
+				updateFeatureBits();
 			}
-			Shader* get(uint64 macros);
+			Shader* get(uint64 macros); //waits if the permutation is still compiling
+			Shader* getReady(uint64 macros); //the permutation without macros until this one is compiled
+			Shader* submit(uint64 macros); //starts compiling it, pending until get
+			Shader* compilePermutation(uint64 macros);
+			void markRequested(uint64 macros);
+			void prewarm(const std::vector<uint64>& permutations);
+			void reload(std::string vs_name, std::string fs_name, std::vector<std::string> macros); //atlas changed
 			void clear();
 			int getMacroIndex(const char* name) { auto it = macros_index.find(name); return it == macros_index.end() ? -1 : it->second; }
+			void updateFeatureBits();
+			uint64 getFeatureKey(uint32 features) { //features is a mask of indices of s_feature_macros
+				uint64 key = 0;
+				for (size_t i = 0; features && i < feature_bits.size(); ++i, features >>= 1)
+					if (features & 1)
+						key |= feature_bits[i];
+				return key;
+			}
 		};
 		static std::map<std::string, UberShader*> s_ubershaders;
 		static UberShader* GetUberShader(const char* name);
 
+		//features known by the engine (like the flags of a material), every ubershader maps them to its own macros
+		//once, so the key of a permutation is built from the flags without looking for strings
+		static std::vector<std::string> s_feature_macros;
+		static void SetFeatureMacros(const char* const* names, int num);
+
+		//permutations compiled in previous runs, precompiled in the background at startup
+		static std::string s_permutations_filename;
+		static bool s_permutations_changed;
+		static bool LoadPermutationManifest(const char* filename);
+		static void SavePermutationManifest();
+
 		static Shader* getDefaultShader(std::string name);
 	};
 
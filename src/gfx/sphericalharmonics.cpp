@@ -1,5 +1,14 @@
 #include "sphericalharmonics.h"
 
+#include <mutex>
+#include <memory>
+#include <map>
+#include <iostream>
+#include <chrono>
+
+#include "../core/task.h"
+#include "../utils/utils.h"
+
 //system axis
 Vector3f cubemapFaceNormals[6][3] = {
     {{0, 0, -1} ,{0, -1, 0},{1, 0, 0} },  // posx
@@ -13,8 +22,8 @@ Vector3f cubemapFaceNormals[6][3] = {
 };
 
 const int sh_length = 9;
-std::vector< std::vector<Vector3f> > cubeMapVecs;
-int cubeMapVecs_size = 0;
+const int sh_lanes = 8; //texels accumulated side by side, rows are padded to a multiple
+const int sh_moments = 10; //1, a, b, c, aa, bb, cc, ab, bc, ac
 
 float areaElement(float x, float y) {
     return atan2(x * y, sqrtf(x * x + y * y + 1.0f));
@@ -40,86 +49,211 @@ float texelSolidAngle(float aU, float aV, float width, float height) {
     return angle;
 }
 
+//Direction and solid angle of every texel of a face of one size. The direction in face space is (a,b,c),
+//every face only permutes and flips it (cubemapFaceNormals), so one table works for the six faces.
+struct sSHTable {
+    int size;
+    int stride; //size padded to sh_lanes, the padding has weight 0
+    std::vector<float> a, b, c, weight;
+    double total_weight;
+};
+
+static std::shared_ptr<const sSHTable> getSHTable(int size)
+{
+    //tables are never modified once built, so computeSH can run in several threads
+    static std::mutex mutex;
+    static std::map<int, std::shared_ptr<const sSHTable>> tables;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = tables.find(size);
+    if (it != tables.end())
+        return it->second;
+
+    std::shared_ptr<sSHTable> table = std::make_shared<sSHTable>();
+    table->size = size;
+    table->stride = (size + sh_lanes - 1) / sh_lanes * sh_lanes;
+    table->total_weight = 0;
+    size_t num = (size_t)table->stride * size;
+    table->a.resize(num, 0.0f);
+    table->b.resize(num, 0.0f);
+    table->c.resize(num, 0.0f);
+    table->weight.resize(num, 0.0f);
+    float den = size > 1 ? size - 1.0f : 1.0f;
+    for (int v = 0; v < size; v++) {
+        for (int u = 0; u < size; u++)
+        {
+            float fU = (2.0f * u / den) - 1.0f;
+            float fV = (2.0f * v / den) - 1.0f;
+            float inv_length = 1.0f / sqrtf(fU * fU + fV * fV + 1.0f);
+            size_t i = (size_t)v * table->stride + u;
+            table->a[i] = fU * inv_length;
+            table->b[i] = fV * inv_length;
+            table->c[i] = inv_length;
+            table->weight[i] = texelSolidAngle(u, v, size, size);
+            table->total_weight += table->weight[i];
+        }
+    }
+    tables[size] = table;
+    return table;
+}
+
+//sum of colour * weight * moment over some rows of a face, [moment * 3 + channel]
+static void accumulateMoments(const sSHTable& table, const FloatImage& face, int start_row, int end_row, bool degamma, double* sums)
+{
+    int size = table.size;
+    int channels = face.num_channels;
+    std::vector<float> rgb(table.stride * 3, 0.0f); //a row as planar r, g, b (padding stays 0)
+    float* r = &rgb[0];
+    float* g = r + table.stride;
+    float* b = g + table.stride;
+
+    for (int y = start_row; y < end_row; ++y)
+    {
+        const float* pixel = face.data + (size_t)y * size * channels;
+        for (int x = 0; x < size; ++x, pixel += channels)
+        {
+            r[x] = pixel[0];
+            g[x] = pixel[1];
+            b[x] = pixel[2];
+        }
+        if (degamma)
+            for (int x = 0; x < size; ++x)
+            {
+                r[x] = powf(r[x], 2.2f);
+                g[x] = powf(g[x], 2.2f);
+                b[x] = powf(b[x], 2.2f);
+            }
+
+        //every lane has its own sums so the compiler can use vector registers without reordering the additions
+        float acc[sh_moments * 3][sh_lanes] = {};
+        size_t row = (size_t)y * table.stride;
+        const float* ta = &table.a[row];
+        const float* tb = &table.b[row];
+        const float* tc = &table.c[row];
+        const float* tw = &table.weight[row];
+        for (int x = 0; x < table.stride; x += sh_lanes)
+        {
+            for (int l = 0; l < sh_lanes; ++l)
+            {
+                int i = x + l;
+                float w = tw[i];
+                float wa = w * ta[i], wb = w * tb[i], wc = w * tc[i];
+                float m[sh_moments] = { w, wa, wb, wc, wa * ta[i], wb * tb[i], wc * tc[i], wa * tb[i], wb * tc[i], wa * tc[i] };
+                for (int k = 0; k < sh_moments; ++k)
+                {
+                    acc[k * 3][l] += r[i] * m[k];
+                    acc[k * 3 + 1][l] += g[i] * m[k];
+                    acc[k * 3 + 2][l] += b[i] * m[k];
+                }
+            }
+        }
+        for (int k = 0; k < sh_moments * 3; ++k)
+            for (int l = 0; l < sh_lanes; ++l)
+                sums[k] += acc[k][l];
+    }
+}
+
 // give me a cubemap, its size and number of channels
 // and i'll give you spherical harmonics
-SphericalHarmonics computeSH( FloatImage images[], bool degamma ) {
+SphericalHarmonics computeSH( FloatImage images[], bool degamma, int num_threads ) {
 	assert(images[0].width == images[0].height && images[0].width != 0 && "Image is not square");
     int size = images[0].width;
-    int channels = 3;
-    SphericalHarmonics sh;
+    std::shared_ptr<const sSHTable> table = getSHTable(size);
+
+    //the faces are split in bands of rows so all the threads have work, every band sums on its own
+    int bands = std::max(1, size / 64);
+    int num_jobs = 6 * bands;
+    std::vector<double> job_sums(num_jobs * sh_moments * 3, 0.0);
+    parallelFor(num_jobs, [&](int job) {
+        int index = job / bands;
+        int band = job % bands;
+        assert(images[index].width == size && images[index].height == size && images[index].num_channels >= 3);
+        accumulateMoments(*table, images[index], size * band / bands, size * (band + 1) / bands, degamma, &job_sums[job * sh_moments * 3]);
+    }, num_threads);
 
-    // generate cube map vectors
-    if (cubeMapVecs_size != size)
+    // generate spherical harmonics
+    SphericalHarmonics sh;
+    for (int index = 0; index < 6; ++index)
     {
-        cubeMapVecs_size = size;
-        cubeMapVecs.clear();
-        for (int index = 0; index < 6; ++index)
+        double moments[sh_moments][3] = {};
+        for (int band = 0; band < bands; ++band)
         {
-            std::vector<Vector3f> faceVecs;
-            for (int v = 0; v < size; v++) {
-                for (int u = 0; u < size; u++)
-                {
-                    float fU = (2.0f * u / (size - 1.0f)) - 1.0f;
-                    float fV = (2.0f * v / (size - 1.0f)) - 1.0f;
-
-                    Vector3f vecX = cubemapFaceNormals[index][0] * fU;
-                    Vector3f vecY = cubemapFaceNormals[index][1] * fV;
-                    Vector3f vecZ = cubemapFaceNormals[index][2];
+            const double* sums = &job_sums[(index * bands + band) * sh_moments * 3];
+            for (int k = 0; k < sh_moments * 3; ++k)
+                moments[k / 3][k % 3] += sums[k];
+        }
 
-                    Vector3f res = normalize(vecX + vecY + vecZ);
-                    faceVecs.push_back(res);
+        //direction = a * n0 + b * n1 + c * n2, so the sums over the direction come from the sums over a, b and c
+        Vector3f* n = cubemapFaceNormals[index];
+        for (int ch = 0; ch < 3; ++ch)
+        {
+            double s1 = moments[0][ch];
+            double s[3] = { moments[1][ch], moments[2][ch], moments[3][ch] };
+            double ss[3][3] = {
+                { moments[4][ch], moments[7][ch], moments[9][ch] },
+                { moments[7][ch], moments[5][ch], moments[8][ch] },
+                { moments[9][ch], moments[8][ch], moments[6][ch] } };
+            double d[3] = {}, dd[3][3] = {}; //sums of colour * weight * direction and direction products
+            for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 3; ++j)
+                {
+                    d[i] += n[j][i] * s[j];
+                    for (int k = 0; k < 3; ++k)
+                        for (int l = 0; l < 3; ++l)
+                            dd[i][k] += n[j][i] * n[l][k] * ss[j][l];
                 }
-            }
-            cubeMapVecs.push_back(faceVecs);
+
+            // forsyths weights
+            double coeffs[sh_length] = {
+                s1 * 4 / 17,
+                d[1] * 8 / 17,
+                d[2] * 8 / 17,
+                d[0] * 8 / 17,
+                dd[0][1] * 15 / 17,
+                dd[1][2] * 15 / 17,
+                (3.0 * dd[2][2] - s1) * 5 / 68,
+                dd[0][2] * 15 / 17,
+                (dd[0][0] - dd[1][1]) * 15 / 68 };
+            for (int i = 0; i < sh_length; i++)
+                sh.coeffs[i][ch] += (float)coeffs[i];
         }
     }
 
-    // generate spherical harmonics
-    float weightAccum = 0;
+    double weightAccum = table->total_weight * 6 * 3;
+    for (int i = 0; i < sh_length; i++)
+        sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / weightAccum);
+    return sh;
+}
 
-    for (int index = 0; index < 6; ++index)
+void benchmarkSH(int iterations, int num_threads)
+{
+    int sizes[] = { 128, 256, 512 };
+    for (int size : sizes)
     {
-        FloatImage& face = images[index];
-        float* pixels = face.data;
-        bool gammaCorrect = degamma;
-        for (int y = 0; y < size; y++) {
-            for (int x = 0; x < size; x++) {
-                Vector3f texelVect = cubeMapVecs[index][y * size + x];
-                float weight = texelSolidAngle(x, y, size, size);
-                    // forsyths weights
-                float weight1 = weight * 4 / 17;
-                float weight2 = weight * 8 / 17;
-                float weight3 = weight * 15 / 17;
-                float weight4 = weight * 5 / 68;
-                float weight5 = weight * 15 / 68;
-
-                float dx = texelVect[0];
-                float dy = texelVect[1];
-                float dz = texelVect[2];
-
-                Vector3f value = face.getPixel(x,y).xyz();
-                if (gammaCorrect)
-                    value = Vector3f(pow(value.x, 2.2), pow(value.y, 2.2), pow(value.z, 2.2));
-                    
-                sh.coeffs[0] += value * weight1;
-                sh.coeffs[1] += value * weight2 * dy;
-                sh.coeffs[2] += value * weight2 * dz;
-                sh.coeffs[3] += value * weight2 * dx;
-
-                sh.coeffs[4] += value * weight3 * dx * dy;
-                sh.coeffs[5] += value * weight3 * dy * dz;
-                sh.coeffs[6] += value * weight4 * (3.0f * dz * dz - 1.0f);
-
-                sh.coeffs[7] += value * weight3 * dx * dz;
-                sh.coeffs[8] += value * weight5 * (dx * dx - dy * dy);
-
-                weightAccum += weight * 3.0f;
-            }
+        FloatImage faces[6];
+        for (int i = 0; i < 6; ++i)
+        {
+            faces[i].resize(size, size, 3);
+            for (unsigned int j = 0; j < faces[i].width * faces[i].height * 3; ++j)
+                faces[i].data[j] = random(4.0f);
         }
-    };
 
-    SphericalHarmonics linear_sh;
-    for (int i = 0; i < sh_length; i++)
-        linear_sh.coeffs[i] = sh.coeffs[i] * (float)(4 * PI / weightAccum);
-    return linear_sh;
+        //in ms
+        typedef std::chrono::high_resolution_clock Clock;
+        auto elapsed = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+
+        Clock::time_point start = Clock::now();
+        computeSH(faces, false, num_threads); //builds the table of this size
+        double first = elapsed(start);
+        double best = 1e10;
+        for (int i = 0; i < iterations; ++i)
+        {
+            start = Clock::now();
+            computeSH(faces, false, num_threads);
+            best = std::min(best, elapsed(start));
+        }
+        start = Clock::now();
+        computeSH(faces, true, num_threads);
+        double degamma = elapsed(start);
+        std::cout << " * SH " << (num_threads ? std::to_string(num_threads) : std::string("all")) << " threads " << size << "x" << size << "x6: " << best << "ms (" << 1000.0 / best << " probes/s), degamma " << degamma << "ms, first call " << first << "ms" << std::endl;
+    }
 }
@@ -9,4 +9,6 @@ struct SphericalHarmonics {
 	Vector3f coeffs[9];
 };
 
-SphericalHarmonics computeSH( FloatImage images[], bool degamma = false);
+//reentrant, the faces are processed with num_threads threads (0 uses all the cores)
+SphericalHarmonics computeSH( FloatImage images[], bool degamma = false, int num_threads = 0);
+void benchmarkSH(int iterations = 10, int num_threads = 0); //prints the time of computeSH with 128, 256 and 512 faces
@@ -3,17 +3,41 @@
 #include <iostream> //to output
 #include <cmath>
 #include <cassert>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sys/stat.h>
 
 #include "texture.h"
 #include "fbo.h"
 #include "mesh.h"
 #include "shader.h"
+#include "gfx.h"
+#include "uploadmanager.h"
+#include "mipmaps.h"
+#include "texturestreamer.h"
 
 #include "../utils/utils.h"
 #include "../extra/picopng.h"
 #include "../extra/jpgd.h"
 #define DDSKTX_IMPLEMENT
 #include "../extra/dds-ktx.h"
+//stb_image allocates its result with new[] taken from the pixels pool, so the decoded buffer becomes Image::data without a copy
+static void* stbiMalloc(size_t size) { return Image::allocPixels(size); }
+static void stbiFree(void* p) { delete[] (uint8*)p; }
+static void* stbiRealloc(void* p, size_t old_size, size_t new_size)
+{
+	uint8* data = Image::allocPixels(new_size);
+	if (p)
+	{
+		memcpy(data, p, std::min(old_size, new_size));
+		stbiFree(p);
+	}
+	return data;
+}
+#define STBI_MALLOC(size) stbiMalloc(size)
+#define STBI_FREE(p) stbiFree(p)
+#define STBI_REALLOC_SIZED(p, old_size, new_size) stbiRealloc(p, old_size, new_size)
 #define STB_IMAGE_IMPLEMENTATION
 #include "../extra/stb_image.h"
 
@@ -51,13 +75,15 @@ Vector4f Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 namespace GFX
 {
 
-	std::map<std::string, Texture*> Texture::sTexturesLoaded;
+	CORE::AssetRegistry<Texture> Texture::sTexturesLoaded(256 * 1024 * 1024);
 	std::map<unsigned int, Texture*> Texture::sTextures;
 	unsigned int Texture::s_last_index = 0;
 
 	int Texture::default_mag_filter = GL_LINEAR;
 	int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
 	FBO* Texture::global_fbo = NULL;
+	bool Texture::use_compression = true;
+	bool Texture::cpu_mipmaps = true;
 
 	Texture::Texture()
 	{
@@ -66,10 +92,14 @@ namespace GFX
 		depth = 0;
 		texture_id = 0;
 		mipmaps = false;
+		num_mips = 1;
+		base_mip = 0;
 		format = 0;
+		internal_format = 0;
 		type = 0;
 		texture_type = GL_TEXTURE_2D;
 		loading = false;
+		pending_uploads = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
 		near_far.set(0.1f, 1000.0f);
@@ -78,7 +108,10 @@ namespace GFX
 	Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		loading = false;
+		pending_uploads = 0;
 		texture_id = 0;
+		num_mips = 1;
+		base_mip = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index, this));
 		near_far.set(0.1f, 1000.0f);
@@ -88,7 +121,10 @@ namespace GFX
 	Texture::Texture(::Image* img)
 	{
 		loading = false;
+		pending_uploads = 0;
 		texture_id = 0;
+		num_mips = 1;
+		base_mip = 0;
 		index = s_last_index++;
 		sTextures.insert(std::pair<unsigned int, Texture*>(index,this));
 		near_far.set(0.1f, 1000.0f);
@@ -98,6 +134,7 @@ namespace GFX
 	Texture::~Texture()
 	{
 		clear();
+		sTexturesLoaded.remove(this);
 		auto it = sTextures.find(index);
 		if (it != sTextures.end())
 			sTextures.erase(it);
@@ -105,36 +142,33 @@ namespace GFX
 
 	void Texture::clear()
 	{
+		if (pending_uploads)
+			UploadManager::get()->cancel(&pending_uploads);
+		TextureStreamer::release(this);
+		num_mips = 1;
+		base_mip = 0;
+
 		if (texture_id)
 		{
-			glBindTexture(this->texture_type, 0);
+			bindTexture(this->texture_type, 0);
 
 			//external textures are handled by an outside system (like Android OS)
 			if (texture_type != GL_TEXTURE_EXTERNAL_OES)
+			{
+				forgetTexture(texture_id);
 				glDeleteTextures(1, &texture_id);
+			}
 
 			if (!loading) //when loading the texture of 1x1 is replaced with the new one
 				stdlog("Destroy texture: " + filename);
 			texture_id = 0;
 		}
-
-		if (filename.size())
-		{
-			auto it = sTexturesLoaded.find(filename);
-			if (it != sTexturesLoaded.end())
-				sTexturesLoaded.erase(it);
-		}
 	}
 
 	void Texture::Release()
 	{
 		std::vector<Texture*> texs;
-
-		for (auto mp : sTexturesLoaded)
-		{
-			Texture* m = mp.second;
-			texs.push_back(m);
-		}
+		sTexturesLoaded.getAll(texs);
 
 		for (Texture* m : texs)
 		{
@@ -178,7 +212,6 @@ namespace GFX
 		upload(format, type, mipmaps, data, internal_format);
 	}
 
-	/*
 	void Texture::create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 	{
 		assert(width && height && depth && "texture must have a size");
@@ -204,7 +237,6 @@ namespace GFX
 
 		upload3D(format, type, mipmaps, data, internal_format);
 	}
-	*/
 
 	void Texture::createCubemap(unsigned int width, unsigned int height, Uint8** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 	{
@@ -225,20 +257,17 @@ namespace GFX
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		uploadCubemap(format, type, mipmaps, data, internal_format);
 	}
 
 	Texture* Texture::Find(const char* filename)
 	{
 		assert(filename);
-		auto it = sTexturesLoaded.find(filename);
-		if (it != sTexturesLoaded.end())
-			return it->second;
-		return NULL;
+		return sTexturesLoaded.find(filename);
 	}
 
-	Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
+	Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap, eTextureUsage usage)
 	{
 		//load it
 		Texture* texture = Find(filename);
@@ -246,7 +275,7 @@ namespace GFX
 			return texture;
 
 		texture = new Texture();
-		if (!texture->load(filename, mipmaps, wrap))
+		if (!texture->load(filename, mipmaps, wrap, GL_UNSIGNED_BYTE, usage))
 		{
 			std::cout << "" << std::endl;
 			delete texture;
@@ -256,7 +285,7 @@ namespace GFX
 		return texture;
 	}
 
-	Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
+	Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap, eTextureUsage usage)
 	{
 		//disable loading textures in thread
 		//return Get(filename, mipmaps, wrap);
@@ -275,14 +304,14 @@ namespace GFX
 		temp->setName(filename);
 		temp->loading = true;
 
-		//add action to BG Thread 
-		LoadTextureTask* task = new LoadTextureTask(filename);
-		TaskManager::background.addTask(task);
+		//add action to the decoding threads
+		LoadTextureTask* task = new LoadTextureTask(filename, usage);
+		TaskManager::decoding.addTask(task);
 
 		return temp;
 	}
 
-	Texture* Texture::DecodeAsync(const char* filename, std::vector<uint8>& buffer, bool mipmaps, bool wrap)
+	Texture* Texture::DecodeAsync(const char* filename, std::vector<uint8>& buffer, bool mipmaps, bool wrap, eTextureUsage usage)
 	{
 		//check if exists
 		Texture* texture = Find(filename);
@@ -298,15 +327,53 @@ namespace GFX
 		temp->setName(filename);
 		temp->loading = true;
 
-		//add action to BG Thread 
-		LoadTextureTask* task = new LoadTextureTask(filename,buffer);
-		TaskManager::background.addTask(task);
+		//add action to the decoding threads
+		LoadTextureTask* task = new LoadTextureTask(filename, buffer, usage);
+		TaskManager::decoding.addTask(task);
 
 		return temp;
 	}
 
-	bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type)
+	//files of loading textures that have been bound, read from the decoding threads
+	std::mutex needed_mutex;
+	std::set<std::string> needed_textures;
+
+	void Texture::markNeeded()
 	{
+		const std::lock_guard<std::mutex> lock(needed_mutex);
+		needed_textures.insert(filename);
+	}
+
+	bool Texture::IsNeeded(const std::string& filename)
+	{
+		const std::lock_guard<std::mutex> lock(needed_mutex);
+		return needed_textures.count(filename) != 0;
+	}
+
+	std::string Texture::getCompressedCachePath(const std::string& filename, eTextureUsage usage)
+	{
+		if (usage == TEXTURE_USAGE_NONE)
+			return "";
+		std::string cache = getKTXCacheName(filename, usage);
+		struct stat source_stat, cache_stat;
+		if (stat(cache.c_str(), &cache_stat) != 0)
+			return "";
+		if (stat(filename.c_str(), &source_stat) == 0 && source_stat.st_mtime > cache_stat.st_mtime)
+			return "";
+		return cache;
+	}
+
+	bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type, eTextureUsage usage)
+	{
+		//compressed version from a previous import
+		std::string cache = use_compression ? getCompressedCachePath(filename, usage) : "";
+		std::vector<uint8> ktx;
+		if (cache.size() && readFileBin(cache, ktx) && isKTXForUsage(ktx, usage) && TextureStreamer::get()->load(this, ktx, cache))
+		{
+			setName(filename);
+			return true;
+		}
+
 		//non-image based formats
 		std::string str = filename;
 		std::string ext = toLowerCase( getExtension(str) );
@@ -326,31 +393,69 @@ namespace GFX
 			return false;
 		}
 
-		loadFromImage(image, mipmaps, wrap, type);
+		loadFromImage(image, mipmaps, wrap, type, NULL, usage);
 		setName(filename);
 
 		this->image.clear(); //remove from RAM after loading. ???
 		return true;
 	}
 
-	void Texture::loadFromImage(::Image* image, bool mipmaps, bool wrap, unsigned int type)
+	void Texture::loadFromImage(::Image* image, bool mipmaps, bool wrap, unsigned int type, const std::vector<::Image*>* levels, eTextureUsage usage)
 	{
-		unsigned int internal_format = 0;
-		if (type == GL_FLOAT)
-			internal_format = (image->num_channels == 3 ? GL_RGB32F : GL_RGBA32F);
+		unsigned int format = image->num_channels == 3 ? GL_RGB : GL_RGBA;
+
+		//mipmaps filtered in linear space on the CPU (unless they come already filtered from the decoding threads)
+		std::vector<::Image*> own_levels;
+		bool cpu_mips = cpu_mipmaps && mipmaps && type == GL_UNSIGNED_BYTE;
+		if (cpu_mips && (!isPowerOfTwo(image->width) || !isPowerOfTwo(image->height)))
+		{
+			std::cout << "[WARN] CPU mipmaps need a power of two size, using glGenerateMipmap: " << image->width << "x" << image->height << std::endl;
+			cpu_mips = false;
+		}
+		if (!cpu_mips)
+			levels = NULL;
+		else if (!levels)
+		{
+			generateMipChain(image, own_levels, getMipFlags(usage));
+			levels = &own_levels;
+		}
+
+		//upload to VRAM, big images are streamed by the UploadManager (it keeps a copy as Image is not ref-counted)
+		size_t size = (size_t)image->width * image->height * image->num_channels;
+		bool async = UploadManager::enabled && type == GL_UNSIGNED_BYTE && size >= UploadManager::min_async_size;
+		if (async || levels)
+		{
+			create(image->width, image->height, format, type, mipmaps, NULL, 0);
+			if (async)
+				UploadManager::get()->uploadTexture(this, image->data, 0, levels == NULL);
+			else
+				uploadLevel(0, image->width, image->height, image->data);
+		}
+		else
+			create(image->width, image->height, format, type, mipmaps, image->data, 0);
 
-		//upload to VRAM
-		// We have to synchronously upload for now because Image class is not ref-counted
-		create(image->width, image->height, (image->num_channels == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
+		if (levels)
+		{
+			for (size_t i = 0; i < levels->size(); ++i)
+			{
+				::Image* level = (*levels)[i];
+				bool level_async = async && (size_t)level->width * level->height * level->num_channels >= UploadManager::min_async_size;
+				uploadLevel((int)i + 1, level->width, level->height, level_async ? NULL : level->data);
+				if (level_async)
+					UploadManager::get()->uploadTexture(this, level->data, (int)i + 1, false);
+			}
+			for (::Image* level : own_levels)
+				delete level;
+		}
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 		glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 		//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		//glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		//if (mipmaps)
 		//	generateMipmaps();
-		glBindTexture(GL_TEXTURE_2D, 0);
+		bindTexture(GL_TEXTURE_2D, 0);
 	}
 
 	void Texture::upload(::Image* img)
@@ -361,7 +466,44 @@ namespace GFX
 	void Texture::upload(FloatImage* img)
 	{
 		create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT, true);
-		upload(this->format, this->type, false, (Uint8*)img->data);
+		if (!cpu_mipmaps || !this->mipmaps)
+		{
+			upload(this->format, this->type, false, (Uint8*)img->data);
+			return;
+		}
+
+		std::vector<FloatImage*> levels;
+		generateMipChain(img, levels, MIP_LINEAR);
+		uploadLevel(0, img->width, img->height, img->data);
+		for (size_t i = 0; i < levels.size(); ++i)
+		{
+			uploadLevel((int)i + 1, levels[i]->width, levels[i]->height, levels[i]->data);
+			delete levels[i];
+		}
+	}
+
+	void Texture::uploadLevel(int level, unsigned int width, unsigned int height, const void* data)
+	{
+		assert(texture_id && texture_type == GL_TEXTURE_2D);
+		unsigned int internal = internal_format;
+		if (internal == 0)
+		{
+			if (type == GL_FLOAT)
+				internal = format == GL_RGB ? GL_RGB32F : GL_RGBA32F;
+			else if (type == GL_HALF_FLOAT)
+				internal = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+			else
+				internal = format;
+		}
+
+		bindTexture(GL_TEXTURE_2D, texture_id);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1); //small levels of RGB images have rows not multiple of 4
+		glTexImage2D(GL_TEXTURE_2D, level, internal, width, height, 0, format, type, data);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		if (level)
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+		bindTexture(GL_TEXTURE_2D, 0);
+		assert(checkGLErrors() && "Error uploading texture level");
 	}
 
 
@@ -371,7 +513,7 @@ namespace GFX
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_2D && "Texture type does not match.");
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
 		if (internal_format == 0)
 		{
@@ -392,18 +534,17 @@ namespace GFX
 		if (data && this->mipmaps)
 			generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D); 
 
-		glBindTexture(this->texture_type, 0);
+		bindTexture(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
 
-	/*
 	void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 		assert(texture_id && "Must create texture before uploading data.");
 		assert(texture_type == GL_TEXTURE_3D && "Texture type does not match.");
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
-		glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
+		glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, (int)width, (int)height, (int)depth, 0, format, type, data);
 
 		glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
@@ -414,10 +555,9 @@ namespace GFX
 		if (data && this->mipmaps)
 			generateMipmaps(); //glGenerateMipmapEXT(GL_TEXTURE_2D);
 
-		glBindTexture(this->texture_type, 0);
+		bindTexture(this->texture_type, 0);
 		assert(checkGLErrors() && "Error uploading texture");
 	}
-	*/
 
 	void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint8** data, unsigned int intFormat, int level) {
 
@@ -425,7 +565,7 @@ namespace GFX
 		assert(texture_type == GL_TEXTURE_CUBE_MAP && "Texture type does not match.");
 		//assert(glGetError() == GL_NO_ERROR);
 
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
 		int w = ((int)this->width) >> level;
@@ -466,7 +606,7 @@ namespace GFX
 			//	generateMipmaps();
 		}
 
-		glBindTexture(this->texture_type, 0);
+		bindTexture(this->texture_type, 0);
 		assert(glGetError() == GL_NO_ERROR && "Error creating texture");
 	}
 
@@ -526,7 +666,7 @@ namespace GFX
 		assert(glGetError() == GL_NO_ERROR);
 		if (texture_id == 0)
 			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		bindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexImage3D(this->texture_type, 0, format, width, height, num_textures, 0, dataFormat, type, data);
 		assert(glGetError() == GL_NO_ERROR);
 
@@ -554,51 +694,97 @@ namespace GFX
 		return loadKTX(buffer);
 	}
 
-	bool Texture::loadKTX(std::vector<unsigned char>& buffer)
+	bool Texture::loadKTX(std::vector<unsigned char>& buffer, int first_mip)
 	{
-		std::vector<unsigned char> out_image;
-
 		ddsktx_texture_info tc = { 0 };
-		if (!ddsktx_parse(&tc, &buffer[0], buffer.size(), NULL))
+		if (buffer.empty() || !ddsktx_parse(&tc, &buffer[0], (int)buffer.size(), NULL))
 			return false;
 
-		this->texture_type = GL_TEXTURE_2D;
-		if (tc.flags & DDSKTX_TEXTURE_FLAG_CUBEMAP)
-			this->texture_type = GL_TEXTURE_CUBE_MAP;
-		else if (tc.flags & DDSKTX_TEXTURE_FLAG_VOLUME)
-			this->texture_type = GL_TEXTURE_3D;
+		//2D block compressed only (the ones written by compressToKTX)
+		unsigned int gl_format = 0;
+		switch (tc.format)
+		{
+		case DDSKTX_FORMAT_BC1: gl_format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
+		case DDSKTX_FORMAT_BC3: gl_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+		case DDSKTX_FORMAT_BC4: gl_format = GL_COMPRESSED_RED_RGTC1; break;
+		case DDSKTX_FORMAT_BC5: gl_format = GL_COMPRESSED_RG_RGTC2; break;
+		default: break;
+		}
+		if (!gl_format || (tc.flags & (DDSKTX_TEXTURE_FLAG_CUBEMAP | DDSKTX_TEXTURE_FLAG_VOLUME)))
+		{
+			std::cout << TermColor::RED << "[ERROR] KTX format not supported" << TermColor::DEFAULT << std::endl;
+			return false;
+		}
 
-		if (texture_id == 0)
-			glGenTextures(1, &texture_id); //we need to create an unique ID for the texture
-		glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
+		if (pending_uploads)
+			UploadManager::get()->cancel(&pending_uploads);
+		TextureStreamer::release(this);
 
-		for (int mip = 0; mip < tc.num_mips; mip++) {
+		this->texture_type = GL_TEXTURE_2D;
+		this->width = (float)tc.width;
+		this->height = (float)tc.height;
+		this->depth = 0;
+		this->format = tc.format == DDSKTX_FORMAT_BC3 ? GL_RGBA : GL_RGB;
+		this->type = GL_UNSIGNED_BYTE;
+		this->internal_format = gl_format;
+		this->mipmaps = tc.num_mips > 1;
+		this->num_mips = tc.num_mips;
+		this->base_mip = std::max(0, std::min(first_mip, tc.num_mips - 1));
+
+		//the storage is immutable, a new texture is created every time
+		if (texture_id)
+		{
+			forgetTexture(texture_id);
+			glDeleteTextures(1, &texture_id);
+		}
+		texture_id = allocCompressedLevels(base_mip);
+
+		for (int mip = base_mip; mip < tc.num_mips; mip++)
+		{
 			ddsktx_sub_data sub_data;
-			ddsktx_get_sub(&tc, &sub_data, &buffer[0], buffer.size(), 0, 0, mip);
-			// Fill/Set texture sub resource data (mips in this case)
-			/*
-			if (ddsktx_format_compressed(tc.format))
-				//glCompressedTexImage2D(this->texture_type,mip,
-			else
-				glTexImage2D(this->texture_type, mip, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
-				//glTexImage2D(..);
-			*/
+			ddsktx_get_sub(&tc, &sub_data, &buffer[0], (int)buffer.size(), 0, 0, mip);
+			glCompressedTexSubImage2D(this->texture_type, mip - base_mip, 0, 0, sub_data.width, sub_data.height, gl_format, sub_data.size_bytes, sub_data.buff);
 		}
 
+		bindTexture(this->texture_type, 0);
+		assert(checkGLErrors() && "Error uploading KTX");
 		return true;
 	}
 
+	GLuint Texture::allocCompressedLevels(int first_mip)
+	{
+		assert(internal_format && first_mip < num_mips);
+		GLuint id = 0;
+		glGenTextures(1, &id);
+		bindTexture(GL_TEXTURE_2D, id);
+		int levels = num_mips - first_mip;
+		glTexStorage2D(GL_TEXTURE_2D, levels, internal_format, std::max(1, (int)width >> first_mip), std::max(1, (int)height >> first_mip));
+
+		//single channel data reads the same in every component, like the uncompressed greyscale images
+		if (internal_format == GL_COMPRESSED_RED_RGTC1)
+		{
+			GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+			glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+		}
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? Texture::default_min_filter : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		return id;
+	}
+
 
 	void Texture::bind()
 	{
 		//glEnable(this->texture_type); //enable the textures 
-		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+		bindTexture(this->texture_type, pending_uploads ? getGreyTexture()->texture_id : texture_id);	//enable the id of the texture we are going to use
 	}
 
 	void Texture::unbind()
 	{
 		//glDisable(this->texture_type); //disable the textures 
-		glBindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
+		bindTexture(this->texture_type, 0);	//disable the id of the texture we are going to use
 	}
 
 	void Texture::UnbindAll()
@@ -606,9 +792,30 @@ namespace GFX
 		glDisable(GL_TEXTURE_CUBE_MAP);
 		glDisable(GL_TEXTURE_2D);
 		glDisable(GL_TEXTURE_3D);
-		glBindTexture(GL_TEXTURE_2D, 0);
-		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-		glBindTexture(GL_TEXTURE_3D, 0);
+		bindTexture(GL_TEXTURE_2D, 0);
+		bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+		bindTexture(GL_TEXTURE_3D, 0);
+	}
+
+	size_t Texture::getVRAMBytes()
+	{
+		size_t w = (size_t)width, h = (size_t)height;
+		//compressed: blocks of 4x4 of the resident levels
+		if (internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || internal_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+			internal_format == GL_COMPRESSED_RED_RGTC1 || internal_format == GL_COMPRESSED_RG_RGTC2)
+		{
+			size_t block_size = (internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || internal_format == GL_COMPRESSED_RED_RGTC1) ? 8 : 16;
+			size_t total = 0;
+			for (int mip = base_mip; mip < num_mips; ++mip)
+				total += ((std::max<size_t>(1, w >> mip) + 3) / 4) * ((std::max<size_t>(1, h >> mip) + 3) / 4) * block_size;
+			return total;
+		}
+		size_t channels = (format == GL_RED || format == GL_DEPTH_COMPONENT) ? 1 : (format == GL_RG ? 2 : (format == GL_RGB ? 3 : 4));
+		size_t channel_bytes = type == GL_FLOAT ? 4 : (type == GL_HALF_FLOAT ? 2 : 1);
+		size_t bytes = w * h * std::max<size_t>(1, (size_t)depth) * channels * channel_bytes;
+		if (texture_type == GL_TEXTURE_CUBE_MAP)
+			bytes *= 6;
+		return mipmaps ? bytes + bytes / 3 : bytes;
 	}
 
 	void Texture::generateMipmaps()
@@ -617,7 +824,7 @@ namespace GFX
 		if (!glGenerateMipmapEXT)
 			return;
 
-		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+		bindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter); //set the mag filter
 		if (this->texture_type == GL_TEXTURE_CUBE_MAP)
 		{
@@ -626,7 +833,7 @@ namespace GFX
 		}
 		glGenerateMipmapEXT(this->texture_type);
 #else
-		glBindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
+		bindTexture(this->texture_type, texture_id);	//enable the id of the texture we are going to use
 		glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
 		glGenerateMipmap(this->texture_type);
 #endif
@@ -642,8 +849,7 @@ namespace GFX
 		if (shader->getUniformLocation("u_texture") != -1)
 			shader->setUniform("u_texture", this, 0);
 		assert(glGetError() == GL_NO_ERROR);
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_CULL_FACE);
+		setGPUState(getGPUState() & ~(GFX_STATE_DEPTH_TEST_MASK | GFX_STATE_CULL_MASK));
 		quad->render(GL_TRIANGLES);
 		assert(glGetError() == GL_NO_ERROR);
 		shader->disable();
@@ -677,41 +883,52 @@ namespace GFX
 		return white;
 	}
 
+	Texture* Texture::getGreyTexture()
+	{
+		static Texture* grey = NULL;
+		if (grey)
+			return grey;
+		const Uint8 data[3] = { 128,128,128 };
+		grey = new Texture(1, 1, GL_RGB, GL_UNSIGNED_BYTE, true, (Uint8*)data);
+		return grey;
+	}
+
 	void Texture::copyTo(Texture* destination, Shader* shader)
 	{
+		//the depth is written ignoring the test, every fragment should update it
+		uint64 previous_state = getGPUState();
+		uint64 depth_state = GFX_STATE_WRITE_Z | GFX_STATE_DEPTH_TEST_ALWAYS | (previous_state & GFX_STATE_FRONT_CCW);
+
 		if (!destination) //to current viewport
 		{
-			if (format == GL_DEPTH_COMPONENT) //to clone depth buffer
+			if (format == GL_DEPTH_COMPONENT) //to clone depth buffer, without drawing the colors
 			{
-				glEnable(GL_DEPTH_TEST); //we need to use the depth buffer
-				glDepthFunc(GL_ALWAYS); //but ignore the test, every fragment should update the depth
-				glColorMask(false, false, false, false); //block drawing to colors
+				setGPUState(depth_state);
 				if (!shader)
 					shader = Shader::getDefaultShader("screen_depth");
 			}
-			else if (!shader)
-				shader = Shader::getDefaultShader("texture");
+			else
+			{
+				setGPUState(previous_state & ~GFX_STATE_CULL_MASK);
+				if (!shader)
+					shader = Shader::getDefaultShader("texture");
+			}
 			Mesh* quad = Mesh::getQuad();
 			shader->enable();
 			shader->setUniform("u_texture", this, 0);
 			shader->setUniform("u_color", Vector4f(1, 1, 1, 1));
-			glDisable(GL_CULL_FACE);
 			quad->render(GL_TRIANGLES);
-			glColorMask(true, true, true, true);
-			glDisable(GL_DEPTH_TEST);
-			glDepthFunc(GL_LESS);
+			setGPUState(previous_state);
 			return;
 		}
 
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_BLEND);
+		setGPUState(previous_state & ~(GFX_STATE_DEPTH_TEST_MASK | GFX_STATE_BLEND_MASK));
 		FBO* fbo = getGlobalFBO(destination);
 		fbo->bind();
 		if (!shader && format == GL_DEPTH_COMPONENT)
 		{
 			shader = Shader::getDefaultShader("screen_depth");
-			glDepthFunc(GL_ALWAYS);
-			glEnable(GL_DEPTH_TEST);
+			setGPUState(depth_state | GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A);
 			Mesh* quad = Mesh::getQuad();
 			shader->enable();
 			if (shader->getUniformLocation("u_texture") != -1)
@@ -722,8 +939,7 @@ namespace GFX
 		else
 			toViewport(shader);
 		fbo->unbind();
-		glDisable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
+		setGPUState(previous_state);
 	}
 
 };
@@ -873,6 +1089,44 @@ bool Image::loadTGA(const char* filename)
 #include <iostream>
 #include <fstream>
 
+std::mutex pixels_pool_mutex;
+std::multimap<size_t, uint8*> pixels_pool;
+size_t pixels_pool_bytes = 0;
+const size_t max_pixels_pool_bytes = 128 * 1024 * 1024;
+
+uint8* Image::allocPixels(size_t size)
+{
+	{
+		const std::lock_guard<std::mutex> lock(pixels_pool_mutex);
+		auto it = pixels_pool.find(size);
+		if (it != pixels_pool.end())
+		{
+			uint8* pixels = it->second;
+			pixels_pool.erase(it);
+			pixels_pool_bytes -= size;
+			return pixels;
+		}
+	}
+	return new uint8[size];
+}
+
+void Image::recyclePixels()
+{
+	if (!data)
+		return;
+	size_t size = (size_t)width * height * num_channels;
+	{
+		const std::lock_guard<std::mutex> lock(pixels_pool_mutex);
+		if (pixels_pool_bytes + size <= max_pixels_pool_bytes)
+		{
+			pixels_pool.insert(std::make_pair(size, data));
+			pixels_pool_bytes += size;
+			data = NULL;
+		}
+	}
+	clear();
+}
+
 bool Image::loadPNG(const char* filename, bool flip_y)
 {
 	std::vector<unsigned char> buffer;
@@ -883,19 +1137,29 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 
 bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-    std::vector<unsigned char> out_image;
+	int width;
+	int height;
+	int channels;
 
-	if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
+	//decoded straight into the final buffer (stb allocates with allocPixels), unless it has to be flipped
+	unsigned char* image_data = buffer.empty() ? NULL : stbi_load_from_memory((stbi_uc*)&buffer[0], (int)buffer.size(), &width, &height, &channels, STBI_rgb_alpha);
+	if (!image_data)
 		return false;
+	this->width = (unsigned int)width;
+	this->height = (unsigned int)height;
+	this->num_channels = 4;
+	if (!flip_y)
+	{
+		data = image_data;
+		return true;
+	}
 
-	data = new Uint8[out_image.size()];
-	memcpy(data, &out_image[0], out_image.size());
-	num_channels = 4;
-
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
-
+	//flipped while copied, instead of swapping the rows in place afterwards like stb does
+	size_t row_size = (size_t)width * 4;
+	data = allocPixels(row_size * height);
+	for (int y = 0; y < height; ++y)
+		memcpy(data + (size_t)y * row_size, image_data + (size_t)(height - 1 - y) * row_size, row_size);
+	stbi_image_free(image_data);
 	return true;
 }
 
@@ -909,32 +1173,85 @@ bool Image::loadJPG(const char* filename, bool flip_y)
 
 bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 {
-	std::vector<unsigned char> out_image;
-
 	int width;
 	int height;
-	int actual_comps;
 	int channels;
 
-	//stb_image
-	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb);
+	//stb_image only uses its SIMD colour conversion when asked for 4 channels, it is faster to decode RGBA and drop the alpha
+	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb_alpha);
 	if (!image_data)
 		return false;
 	this->width = (unsigned int)width;
 	this->height = (unsigned int)height;
-	this->num_channels = 3;// (unsigned int)channels;
+	this->num_channels = 3;
 
-	//clone
-	data = new unsigned char[width * height * this->num_channels];
-	memcpy(data, image_data, width * height * this->num_channels);
+	//pack to RGB, flipping the rows in the same pass
+	data = allocPixels(width * height * this->num_channels);
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8* src = image_data + (size_t)(flip_y ? height - 1 - y : y) * width * 4;
+		uint8* dst = data + (size_t)y * width * 3;
+		for (int x = 0; x < width; ++x, src += 4, dst += 3)
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
 
 	stbi_image_free(image_data);
+	return true;
+}
 
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
+void Image::benchmarkDecoding(const char* filename, int iterations)
+{
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer))
+		return;
+	bool is_png = toLowerCase(getExtension(filename)) == "png";
+
+	//best time of every decoder in ms, picopng and jpgd are kept only to compare
+	typedef std::chrono::high_resolution_clock Clock;
+	auto elapsed = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+	double best_stb = 1e10, best_other = 1e10;
+	unsigned int width = 0, height = 0;
+	bool other_failed = false; //the old decoders do not support every variant (16 bits, progressive...)
+	for (int i = 0; i < iterations; ++i)
+	{
+		Image image;
+		Clock::time_point start = Clock::now();
+		if (!(is_png ? image.loadPNG(buffer) : image.loadJPG(buffer)))
+			return;
+		best_stb = std::min(best_stb, elapsed(start));
+		width = image.width;
+		height = image.height;
+		image.recyclePixels();
+
+		if (other_failed)
+			continue;
+		start = Clock::now();
+		if (is_png)
+		{
+			std::vector<unsigned char> out_image;
+			unsigned int w, h;
+			other_failed = decodePNG(out_image, w, h, &buffer[0], buffer.size(), true) != 0;
+		}
+		else
+		{
+			int w, h, comps;
+			unsigned char* pixels = jpgd::decompress_jpeg_image_from_memory(&buffer[0], (int)buffer.size(), &w, &h, &comps, 3);
+			other_failed = pixels == NULL;
+			free(pixels);
+		}
+		best_other = std::min(best_other, elapsed(start));
+	}
 
-	return true;
+	double megapixels = width * (double)height / 1000000.0;
+	std::cout << " * " << filename << " " << width << "x" << height << ": stb " << best_stb << "ms (" << megapixels / (best_stb * 0.001) << " MP/s), " << (is_png ? "picopng " : "jpgd ");
+	if (other_failed)
+		std::cout << "cannot decode it" << std::endl;
+	else
+		std::cout << best_other << "ms (" << megapixels / (best_other * 0.001) << " MP/s), stb is " << best_other / best_stb << "x faster" << std::endl;
 }
 
 // Saves the image to a TGA file
@@ -1081,52 +1398,104 @@ GFX::Texture* CubemapFromHDRE(const char* filename, GFX::Texture* output)
 	if (!hdre)
 		return NULL;
 
+	//always half floats (mapped from the file when it is stored as half), the prefiltered levels are the mipmaps
 	GFX::Texture* texture = output ? output : new GFX::Texture();
-	if (hdre->getFacesf(0))
-	{
-		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
-			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
-		for (int i = 1; i < hdre->levels; ++i)
-			texture->uploadCubemap(texture->format, texture->type, false,
-				(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
-	}
-	else
-		if (hdre->getFacesh(0))
-		{
-			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
-				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
-			for (int i = 1; i < hdre->levels; ++i)
-				texture->uploadCubemap(texture->format, texture->type, false,
-					(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
-		}
+	unsigned int format = hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA;
+	unsigned int internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+	int num_levels = 1;
+	while (num_levels < hdre->getNumStoredLevels() && hdre->getLevelWidth(num_levels) == (hdre->width >> num_levels))
+		num_levels++;
+
+	texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0), format, GL_HALF_FLOAT, num_levels > 1, internal_format);
+	for (int i = 1; i < num_levels; ++i)
+		texture->uploadCubemap(format, GL_HALF_FLOAT, false, (Uint8**)hdre->getFacesh(i), internal_format, i);
+	//the levels not stored in the file are never sampled
+	GFX::bindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+	GFX::bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	hdre->freeConverted(); //flipped copies are not needed once in VRAM
 	return texture;
 }
 
 
 //*********************
 
-LoadTextureTask::LoadTextureTask(const char* str)
+size_t LoadTextureTask::max_bytes_in_flight = 256 * 1024 * 1024;
+size_t UploadTextureTask::frame_budget = 32 * 1024 * 1024;
+
+//bytes of the images being decoded or waiting to be uploaded
+std::mutex decode_memory_mutex;
+std::condition_variable decode_memory_condition;
+size_t decode_bytes_in_flight = 0;
+
+//blocks the decoding thread until the image fits in the budget (a single image always fits)
+static void reserveDecodeMemory(size_t bytes)
+{
+	std::unique_lock<std::mutex> lock(decode_memory_mutex);
+	decode_memory_condition.wait(lock, [bytes]() { return decode_bytes_in_flight == 0 || decode_bytes_in_flight + bytes <= LoadTextureTask::max_bytes_in_flight; });
+	decode_bytes_in_flight += bytes;
+}
+
+static void releaseDecodeMemory(size_t bytes)
+{
+	{
+		const std::lock_guard<std::mutex> lock(decode_memory_mutex);
+		decode_bytes_in_flight -= bytes;
+	}
+	decode_memory_condition.notify_all();
+}
+
+LoadTextureTask::LoadTextureTask(const char* str, eTextureUsage usage)
 {
 	filename = str;
 	image = NULL;
+	this->usage = usage;
 }
 
-LoadTextureTask::LoadTextureTask(const char* filename, std::vector<uint8>& buffer)
+LoadTextureTask::LoadTextureTask(const char* filename, std::vector<uint8>& buffer, eTextureUsage usage)
 {
 	this->filename = filename;
 	image = NULL;
 	this->buffer = buffer;
+	this->usage = usage;
 }
 
 void LoadTextureTask::onExecute()
 {
+	//compressed at a previous import, no decoding needed
+	bool compress = usage != TEXTURE_USAGE_NONE && GFX::Texture::use_compression;
+	std::string cache = compress ? GFX::Texture::getCompressedCachePath(filename, usage) : "";
+	std::vector<uint8> ktx;
+	if (cache.size() && readFileBin(cache, ktx) && isKTXForUsage(ktx, usage))
+	{
+		UploadTextureTask::add(filename.c_str(), NULL, 0, &ktx, NULL, usage);
+		return;
+	}
+
+	//png and jpg are read first so the decoded size is known before decoding
+	std::string ext = toLowerCase(getExtension(filename));
+	bool from_memory = ext == "png" || ext == "jpg" || ext == "jpeg";
+	if (from_memory && buffer.empty() && !readFileBin(filename, buffer))
+	{
+		std::cout << TermColor::RED << " [ERROR]: Texture not found " << TermColor::DEFAULT << filename << std::endl;
+		return;
+	}
+
+	size_t reserved_bytes = 0;
+	int width, height, channels;
+	if (buffer.size() && stbi_info_from_memory(&buffer[0], (int)buffer.size(), &width, &height, &channels))
+		reserved_bytes = (size_t)width * height * 4;
+	if (GFX::Texture::cpu_mipmaps)
+		reserved_bytes += reserved_bytes / 3 + reserved_bytes; //mipmaps and the float copy of the first level used to filter them
+	reserveDecodeMemory(reserved_bytes);
+
 	image = new Image();
 
 	if (buffer.size())
 	{
 		double time = getTime();
 		std::cout << " + Image decoding: " << TermColor::YELLOW << filename << TermColor::DEFAULT << " ... ";
-		std::string ext = toLowerCase(getExtension(filename));
 		if(ext == "png")
 			image->loadPNG(buffer);
 		else if(ext == "jpg" || ext == "jpeg")
@@ -1135,6 +1504,7 @@ void LoadTextureTask::onExecute()
 		{
 			delete image;
 			image = NULL;
+			releaseDecodeMemory(reserved_bytes);
 			std::cout << TermColor::RED << "[ERROR]: unsupported format" << TermColor::DEFAULT << std::endl;
 			return;
 		}
@@ -1144,51 +1514,127 @@ void LoadTextureTask::onExecute()
 	{
 		delete image;
 		image = NULL;
+		releaseDecodeMemory(reserved_bytes);
 		return;
 	}
 
+	//encode it here, in the decoding thread, and keep it for the next runs
+	if (compress)
+	{
+		double time = getTime();
+		if (compressToKTX(image->data, image->width, image->height, image->num_channels, usage, ktx))
+		{
+			std::string cache_path = getKTXCacheName(filename, usage);
+			FILE* f = fopen(cache_path.c_str(), "wb");
+			if (f)
+			{
+				fwrite(&ktx[0], 1, ktx.size(), f);
+				fclose(f);
+			}
+			std::cout << " + Texture compressed: " << TermColor::YELLOW << cache_path << TermColor::DEFAULT << " " << ktx.size() / 1024 << "KB Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+			image->recyclePixels();
+			delete image;
+			image = NULL;
+			UploadTextureTask::add(filename.c_str(), NULL, reserved_bytes, &ktx, NULL, usage);
+			return;
+		}
+	}
+
+	//mipmaps filtered here too, the main thread only uploads them
+	std::vector<Image*> levels;
+	if (GFX::Texture::cpu_mipmaps)
+	{
+		if (isPowerOfTwo(image->width) && isPowerOfTwo(image->height))
+			generateMipChain(image, levels, getMipFlags(usage), MIP_FILTER_BOX, 1);
+		else
+			std::cout << "[WARN] CPU mipmaps need a power of two size, using glGenerateMipmap: " << filename << std::endl;
+	}
+
 	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
-	TaskManager::foreground.addTask(upload_task);
+	UploadTextureTask::add(filename.c_str(), image, reserved_bytes, NULL, &levels, usage);
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+struct sDecodedImage {
+	std::string filename;
+	Image* image; //NULL when ktx is used
+	std::vector<uint8> ktx;
+	std::vector<Image*> levels;
+	size_t reserved_bytes;
+	eTextureUsage usage;
+};
+
+std::mutex decoded_images_mutex;
+std::list<sDecodedImage> decoded_images;
+bool upload_task_scheduled = false;
+
+void UploadTextureTask::add(const char* filename, Image* image, size_t reserved_bytes, std::vector<uint8>* ktx, std::vector<Image*>* levels, eTextureUsage usage)
 {
-	this->filename = filename;
-	this->image = image;
-	assert(image && "image cannot be null");
+	assert((image || ktx) && "image cannot be null");
+	const std::lock_guard<std::mutex> lock(decoded_images_mutex);
+	decoded_images.push_back({ filename, image, std::vector<uint8>(), std::vector<Image*>(), reserved_bytes, usage });
+	if (ktx)
+		decoded_images.back().ktx.swap(*ktx);
+	if (levels)
+		decoded_images.back().levels.swap(*levels);
+	//a single task uploads all the images ready when it runs
+	if (!upload_task_scheduled)
+	{
+		upload_task_scheduled = true;
+		TaskManager::foreground.addTask(new UploadTextureTask());
+	}
 }
 
 void UploadTextureTask::onExecute()
 {
-	GFX::Texture* texture = NULL;
-	if (!image)
+	//take the images of this frame, at least one
+	std::list<sDecodedImage> batch;
 	{
-		std::cerr << "Image is null: " << filename << std::endl;
-		return;
+		const std::lock_guard<std::mutex> lock(decoded_images_mutex);
+		size_t bytes = 0;
+		while (decoded_images.size() && (batch.empty() || bytes < frame_budget))
+		{
+			const sDecodedImage& decoded = decoded_images.front();
+			size_t image_bytes = decoded.image ? (size_t)decoded.image->width * decoded.image->height * decoded.image->num_channels : decoded.ktx.size();
+			bytes += decoded.levels.size() ? image_bytes + image_bytes / 3 : image_bytes;
+			batch.splice(batch.end(), decoded_images, decoded_images.begin());
+		}
+		//the rest waits for the next frame
+		if (decoded_images.size())
+			TaskManager::foreground.addTask(new UploadTextureTask());
+		else
+			upload_task_scheduled = false;
 	}
-	assert(image && "image cant be null");
 
-	//in case somehow it got loaded while I was loading it in the background
-	auto it = GFX::Texture::sTexturesLoaded.find(filename);
-	if (it == GFX::Texture::sTexturesLoaded.end())
+	for (sDecodedImage& decoded : batch)
 	{
-		/*
-		//create texture
-		if (!texture)
-			texture = new Texture();
-		*/
-		delete image;
-		std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
-		return;
-	}
+		Image* image = decoded.image;
 
-	texture = it->second;
+		//in case somehow it got loaded while I was loading it in the background
+		GFX::Texture* texture = GFX::Texture::Find(decoded.filename.c_str());
+		if (!texture)
+			std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
+		else
+		{
+			//upload to GPU
+			if (image)
+				texture->loadFromImage(image, true, true, GL_UNSIGNED_BYTE, &decoded.levels, decoded.usage);
+			else
+				GFX::TextureStreamer::get()->load(texture, decoded.ktx, GFX::Texture::getCompressedCachePath(decoded.filename, decoded.usage));
+			texture->loading = false;
+			GFX::Texture::sTexturesLoaded.setBytes(texture, texture->getVRAMBytes());
+		}
 
-	//upload to GPU
-	texture->loadFromImage(image);
-	texture->loading = false;
+		//the pixels go back to the pool for the next decode
+		if (image)
+		{
+			image->recyclePixels();
+			delete image;
+		}
+		for (Image* level : decoded.levels)
+			delete level;
+		releaseDecodeMemory(decoded.reserved_bytes);
 
-	//delete image
-	delete image;
+		const std::lock_guard<std::mutex> lock(GFX::needed_mutex);
+		GFX::needed_textures.erase(decoded.filename);
+	}
 }
@@ -7,6 +7,8 @@
 #include "../core/includes.h"
 #include "../core/math.h"
 #include "../core/task.h"
+#include "../core/assets.h"
+#include "texturecompress.h"
 #include <map>
 #include <set>
 #include <string>
@@ -78,6 +80,11 @@ public:
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
 	bool saveTGA(const char* filename, bool flip_y = false);
+	static void benchmarkDecoding(const char* filename, int iterations = 10); //prints the decode time and MP/s of stb and the old decoder (png or jpg)
+
+	//pixel buffers of decoded images are reused between images of the same size
+	static uint8* allocPixels(size_t size);
+	void recyclePixels(); //gives data to the pool, the image is left empty
 };
 
 class FloatImage : public tImage<float>
@@ -112,11 +119,13 @@ namespace GFX {
 		static int default_mag_filter;
 		static int default_min_filter;
 		static FBO* global_fbo;
+		static bool use_compression; //textures loaded with a usage are block compressed and cached as .ktx
+		static bool cpu_mipmaps; //filtered in linear space by generateMipChain instead of glGenerateMipmap
 
 		//a general struct to store all the information about a TGA file
 
-		//textures manager
-		static std::map<std::string, Texture*> sTexturesLoaded;
+		//textures manager, materials hold references to their textures
+		static CORE::AssetRegistry<Texture> sTexturesLoaded;
 		static std::map<unsigned int, Texture*> sTextures;
 		static unsigned int s_last_index;
 
@@ -126,6 +135,7 @@ namespace GFX {
 		float depth;	//Optional for 3dTexture or 2dTexture array
 		std::string filename;
 		bool loading;
+		int pending_uploads; //rows still being streamed by the UploadManager, a placeholder is bound meanwhile
 		vec2 near_far; //used for depth textures
 		unsigned int index;
 
@@ -134,6 +144,8 @@ namespace GFX {
 		unsigned int internal_format;
 		unsigned int texture_type; //GL_TEXTURE_2D, GL_TEXTURE_CUBE, GL_TEXTURE_2D_ARRAY
 		bool mipmaps;
+		int num_mips; //compressed textures, levels of the source
+		int base_mip; //compressed textures, level of the source in the GL level 0 (the TextureStreamer drops the big ones)
 
 		unsigned int wrapS;
 		unsigned int wrapT;
@@ -152,18 +164,21 @@ namespace GFX {
 		void clear();
 
 		void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
-		//void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void createCubemap(unsigned int width, unsigned int height, Uint8** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, unsigned int internal_format = 0);
 
 		void upload(::Image* img);
 		void upload(::FloatImage* img);
 		void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, const Uint8* data = NULL, unsigned int internal_format = 0);
-		//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
+		void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 		void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 		void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
+		//allocates (data can be NULL) a level of a 2D texture created without mipmaps data
+		void uploadLevel(int level, unsigned int width, unsigned int height, const void* data);
 
 		bool loadKTX(const char* filename);
-		bool loadKTX(std::vector<unsigned char>& buffer);
+		bool loadKTX(std::vector<unsigned char>& buffer, int first_mip = 0); //levels before first_mip are not uploaded
+		GLuint allocCompressedLevels(int first_mip); //new texture (left bound) with storage for the levels from first_mip
 
 		void bind();
 		void unbind();
@@ -175,18 +190,25 @@ namespace GFX {
 		void operator = (const Texture& tex) { assert("textures cannot be cloned like this!"); }
 
 		//load without using the manager
-		bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
-		void loadFromImage(::Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE);
+		bool load(const char* filename, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE, eTextureUsage usage = TEXTURE_USAGE_NONE);
+		//levels: mipmaps already filtered (see generateMipChain), otherwise they are filtered here
+		void loadFromImage(::Image* image, bool mipmaps = true, bool wrap = true, unsigned int type = GL_UNSIGNED_BYTE, const std::vector<::Image*>* levels = NULL, eTextureUsage usage = TEXTURE_USAGE_NONE);
 
 		//load using the manager (caching loaded ones to avoid reloading them)
-		static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
-		static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true);
-		static Texture* DecodeAsync(const char* filename, std::vector<uint8>& buffer, bool mipmaps = true, bool wrap = true);
+		static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true, eTextureUsage usage = TEXTURE_USAGE_NONE);
+		static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true, eTextureUsage usage = TEXTURE_USAGE_NONE);
+		static Texture* DecodeAsync(const char* filename, std::vector<uint8>& buffer, bool mipmaps = true, bool wrap = true, eTextureUsage usage = TEXTURE_USAGE_NONE);
+		static std::string getCompressedCachePath(const std::string& filename, eTextureUsage usage); //.ktx of the usage next to the source, empty if missing or outdated
 		static Texture* Find(const char* filename);
+		//textures used while loading are decoded first
+		void markNeeded();
+		static bool IsNeeded(const std::string& filename);
 		void setName(const char* name) {
 			filename = name;
-			sTexturesLoaded[filename] = this;
+			sTexturesLoaded.add(filename, this);
+			sTexturesLoaded.setBytes(this, getVRAMBytes());
 		}
+		size_t getVRAMBytes(); //estimated from the size and format
 
 		void generateMipmaps();
 
@@ -198,6 +220,7 @@ namespace GFX {
 		static FBO* getGlobalFBO(Texture* texture);
 		static Texture* getBlackTexture();
 		static Texture* getWhiteTexture();
+		static Texture* getGreyTexture(); //placeholder while loading
 	};
 
 };
@@ -211,23 +234,29 @@ bool isPowerOfTwo(int n);
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
 //uploads to GPU. While loading a fake 1x1 texture is created
 
+//decodes an image in the TaskManager::decoding threads
 class LoadTextureTask : public Task {
 public:
+	static size_t max_bytes_in_flight; //decoded images waiting to be uploaded, decoders wait when it is reached
+
 	std::string filename;
 	std::vector<uint8> buffer;
 	Image* image;
+	eTextureUsage usage;
 
-	LoadTextureTask(const char* filename);
-	LoadTextureTask(const char* filename, std::vector<uint8>& buffer);
+	LoadTextureTask(const char* filename, eTextureUsage usage = TEXTURE_USAGE_NONE);
+	LoadTextureTask(const char* filename, std::vector<uint8>& buffer, eTextureUsage usage = TEXTURE_USAGE_NONE);
 	void onExecute();
+	float getPriority() { return GFX::Texture::IsNeeded(filename) ? 1.0f : 0.0f; }
 };
 
+//uploads in the main thread the images decoded by LoadTextureTask, several per frame
 class UploadTextureTask : public Task {
 public:
-	std::string filename;
-	Image* image;
+	static size_t frame_budget; //bytes of decoded images uploaded per frame
 
-	UploadTextureTask(const char* filename, Image* image);
+	//ktx (optional) is uploaded instead of the image, its content is moved, levels are the mipmaps of the image (deleted after upload)
+	static void add(const char* filename, Image* image, size_t reserved_bytes, std::vector<uint8>* ktx = NULL, std::vector<Image*>* levels = NULL, eTextureUsage usage = TEXTURE_USAGE_NONE);
 	void onExecute();
 };
 
@@ -0,0 +1,369 @@
+#include "texturecompress.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include "mipmaps.h"
+#include "texture.h"
+
+#define KTX_COMPRESSED_RGB_S3TC_DXT1 0x83F0
+#define KTX_COMPRESSED_RGBA_S3TC_DXT5 0x83F3
+#define KTX_COMPRESSED_LUMINANCE_LATC1 0x8C70 //same blocks as RGTC1, it is what dds-ktx expects for BC4
+#define KTX_COMPRESSED_LUMINANCE_ALPHA_LATC2 0x8C72 //same blocks as RGTC2 (BC5)
+#define KTX_RED 0x1903
+#define KTX_RG 0x8227
+#define KTX_RGB 0x1907
+#define KTX_RGBA 0x1908
+
+static inline uint16 packRGB565(const float* c)
+{
+	int r = (int)clamp(roundf(c[0] * (31.0f / 255.0f)), 0.0f, 31.0f);
+	int g = (int)clamp(roundf(c[1] * (63.0f / 255.0f)), 0.0f, 63.0f);
+	int b = (int)clamp(roundf(c[2] * (31.0f / 255.0f)), 0.0f, 31.0f);
+	return (uint16)((r << 11) | (g << 5) | b);
+}
+
+static inline void unpackRGB565(uint16 v, float* c)
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	c[0] = (float)((r << 3) | (r >> 2));
+	c[1] = (float)((g << 2) | (g >> 4));
+	c[2] = (float)((b << 3) | (b >> 2));
+}
+
+//indices of the nearest palette color, returns the squared error
+static float selectBC1Indices(const uint8* rgba, uint16 c0, uint16 c1, uint32& indices)
+{
+	float palette[4][3];
+	unpackRGB565(c0, palette[0]);
+	unpackRGB565(c1, palette[1]);
+	for (int k = 0; k < 3; ++k)
+	{
+		palette[2][k] = (2.0f * palette[0][k] + palette[1][k]) / 3.0f;
+		palette[3][k] = (palette[0][k] + 2.0f * palette[1][k]) / 3.0f;
+	}
+	int num_colors = c0 > c1 ? 4 : 1; //equal endpoints: a single color
+
+	indices = 0;
+	float error = 0.0f;
+	for (int i = 0; i < 16; ++i)
+	{
+		const uint8* p = rgba + i * 4;
+		int best = 0;
+		float best_dist = 1e20f;
+		for (int j = 0; j < num_colors; ++j)
+		{
+			float dr = p[0] - palette[j][0], dg = p[1] - palette[j][1], db = p[2] - palette[j][2];
+			float dist = dr * dr + dg * dg + db * db;
+			if (dist < best_dist)
+			{
+				best_dist = dist;
+				best = j;
+			}
+		}
+		indices |= (uint32)best << (i * 2);
+		error += best_dist;
+	}
+	return error;
+}
+
+//least squares endpoints for the current indices
+static bool refineBC1Endpoints(const uint8* rgba, uint32 indices, float* e0, float* e1)
+{
+	static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f }; //of c0
+	float aa = 0, ab = 0, bb = 0;
+	float ap[3] = { 0,0,0 }, bp[3] = { 0,0,0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		float a = weights[(indices >> (i * 2)) & 3];
+		float b = 1.0f - a;
+		aa += a * a; ab += a * b; bb += b * b;
+		for (int k = 0; k < 3; ++k)
+		{
+			ap[k] += a * rgba[i * 4 + k];
+			bp[k] += b * rgba[i * 4 + k];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f)
+		return false;
+	float inv = 1.0f / det;
+	for (int k = 0; k < 3; ++k)
+	{
+		e0[k] = clamp((bb * ap[k] - ab * bp[k]) * inv, 0.0f, 255.0f);
+		e1[k] = clamp((aa * bp[k] - ab * ap[k]) * inv, 0.0f, 255.0f);
+	}
+	return true;
+}
+
+static void writeBC1(uint8* out, uint16 c0, uint16 c1, uint32 indices)
+{
+	out[0] = c0 & 0xFF; out[1] = c0 >> 8;
+	out[2] = c1 & 0xFF; out[3] = c1 >> 8;
+	memcpy(out + 4, &indices, 4); //little endian
+}
+
+void encodeBC1Block(const uint8* rgba, uint8* out)
+{
+	float mean[3] = { 0,0,0 };
+	for (int i = 0; i < 16; ++i)
+		for (int k = 0; k < 3; ++k)
+			mean[k] += rgba[i * 4 + k];
+	for (int k = 0; k < 3; ++k)
+		mean[k] /= 16.0f;
+
+	//principal axis of the colors (power iteration on the covariance)
+	float cov[6] = { 0,0,0,0,0,0 }; //xx xy xz yy yz zz
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = rgba[i * 4] - mean[0], g = rgba[i * 4 + 1] - mean[1], b = rgba[i * 4 + 2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int it = 0; it < 8; ++it)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = sqrtf(x * x + y * y + z * z);
+		if (len < 1e-6f)
+			break;
+		axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+	}
+
+	float tmin = 1e20f, tmax = -1e20f;
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = (rgba[i * 4] - mean[0]) * axis[0] + (rgba[i * 4 + 1] - mean[1]) * axis[1] + (rgba[i * 4 + 2] - mean[2]) * axis[2];
+		tmin = std::min(tmin, t);
+		tmax = std::max(tmax, t);
+	}
+	//inset the endpoints, extremes are better approximated by the interpolated colors
+	float inset = (tmax - tmin) / 16.0f;
+	tmin += inset;
+	tmax -= inset;
+
+	float e0[3], e1[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		e0[k] = clamp(mean[k] + axis[k] * tmax, 0.0f, 255.0f);
+		e1[k] = clamp(mean[k] + axis[k] * tmin, 0.0f, 255.0f);
+	}
+
+	uint16 c0 = packRGB565(e0), c1 = packRGB565(e1);
+	if (c0 < c1)
+		std::swap(c0, c1);
+	uint32 indices;
+	float error = selectBC1Indices(rgba, c0, c1, indices);
+
+	//one least squares pass, kept only if it improves
+	if (c0 != c1 && refineBC1Endpoints(rgba, indices, e0, e1))
+	{
+		uint16 r0 = packRGB565(e0), r1 = packRGB565(e1);
+		if (r0 < r1)
+			std::swap(r0, r1);
+		uint32 refined_indices;
+		float refined_error = selectBC1Indices(rgba, r0, r1, refined_indices);
+		if (refined_error < error)
+		{
+			c0 = r0; c1 = r1;
+			indices = refined_indices;
+		}
+	}
+
+	writeBC1(out, c0, c1, indices);
+}
+
+void encodeBC4Block(const uint8* values, int stride, uint8* out)
+{
+	int min_value = 255, max_value = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		min_value = std::min(min_value, (int)values[i * stride]);
+		max_value = std::max(max_value, (int)values[i * stride]);
+	}
+
+	//a0 > a1 selects the 8 values mode
+	float palette[8];
+	palette[0] = (float)max_value;
+	palette[1] = (float)min_value;
+	for (int i = 2; i < 8; ++i)
+		palette[i] = ((8 - i) * palette[0] + (i - 1) * palette[1]) / 7.0f;
+	int num_values = max_value > min_value ? 8 : 1;
+
+	uint64 indices = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		float v = values[i * stride];
+		int best = 0;
+		float best_dist = 1e20f;
+		for (int j = 0; j < num_values; ++j)
+		{
+			float dist = fabsf(v - palette[j]);
+			if (dist < best_dist)
+			{
+				best_dist = dist;
+				best = j;
+			}
+		}
+		indices |= (uint64)best << (i * 3);
+	}
+
+	out[0] = (uint8)max_value;
+	out[1] = (uint8)min_value;
+	for (int i = 0; i < 6; ++i)
+		out[2 + i] = (uint8)(indices >> (i * 8));
+}
+
+eBlockFormat chooseBlockFormat(const uint8* pixels, int width, int height, int num_channels, eTextureUsage usage)
+{
+	size_t num_pixels = (size_t)width * height;
+	if (usage == TEXTURE_USAGE_NORMAL)
+		return BLOCK_BC5;
+	if (usage == TEXTURE_USAGE_DATA)
+	{
+		if (num_channels < 3)
+			return BLOCK_BC4;
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			const uint8* p = pixels + i * num_channels;
+			if (p[0] != p[1] || p[0] != p[2])
+				return BLOCK_BC1;
+		}
+		return BLOCK_BC4;
+	}
+	if (num_channels == 4)
+		for (size_t i = 0; i < num_pixels; ++i)
+			if (pixels[i * 4 + 3] != 255)
+				return BLOCK_BC3;
+	return BLOCK_BC1;
+}
+
+int getBlockSize(eBlockFormat format)
+{
+	return (format == BLOCK_BC1 || format == BLOCK_BC4) ? 8 : 16;
+}
+
+void compressImageLevel(const uint8* pixels, int width, int height, int num_channels, eBlockFormat format, std::vector<uint8>& out)
+{
+	int blocks_x = (width + 3) / 4;
+	int blocks_y = (height + 3) / 4;
+	int block_size = getBlockSize(format);
+	size_t start = out.size();
+	out.resize(start + (size_t)blocks_x * blocks_y * block_size);
+	uint8* dst = &out[start];
+
+	uint8 rgba[16 * 4];
+	for (int by = 0; by < blocks_y; ++by)
+		for (int bx = 0; bx < blocks_x; ++bx)
+		{
+			for (int y = 0; y < 4; ++y)
+				for (int x = 0; x < 4; ++x)
+				{
+					int px = std::min(bx * 4 + x, width - 1);
+					int py = std::min(by * 4 + y, height - 1);
+					const uint8* p = pixels + ((size_t)py * width + px) * num_channels;
+					uint8* q = rgba + (y * 4 + x) * 4;
+					q[0] = p[0];
+					q[1] = num_channels > 1 ? p[1] : p[0];
+					q[2] = num_channels > 2 ? p[2] : p[0];
+					q[3] = num_channels > 3 ? p[3] : 255;
+				}
+
+			switch (format)
+			{
+			case BLOCK_BC1: encodeBC1Block(rgba, dst); break;
+			case BLOCK_BC3: encodeBC4Block(rgba + 3, 4, dst); encodeBC1Block(rgba, dst + 8); break;
+			case BLOCK_BC4: encodeBC4Block(rgba, 4, dst); break;
+			case BLOCK_BC5: encodeBC4Block(rgba, 4, dst); encodeBC4Block(rgba + 1, 4, dst + 8); break;
+			}
+			dst += block_size;
+		}
+}
+
+static void appendUint32(std::vector<uint8>& out, uint32 v)
+{
+	out.insert(out.end(), (uint8*)&v, (uint8*)&v + 4);
+}
+
+bool compressToKTX(const uint8* pixels, int width, int height, int num_channels, eTextureUsage usage, std::vector<uint8>& ktx)
+{
+	if (usage == TEXTURE_USAGE_NONE || !pixels || width <= 0 || height <= 0)
+		return false;
+
+	eBlockFormat format = chooseBlockFormat(pixels, width, height, num_channels, usage);
+	uint32 internal_format = 0, base_format = 0;
+	switch (format)
+	{
+	case BLOCK_BC1: internal_format = KTX_COMPRESSED_RGB_S3TC_DXT1; base_format = KTX_RGB; break;
+	case BLOCK_BC3: internal_format = KTX_COMPRESSED_RGBA_S3TC_DXT5; base_format = KTX_RGBA; break;
+	case BLOCK_BC4: internal_format = KTX_COMPRESSED_LUMINANCE_LATC1; base_format = KTX_RED; break;
+	case BLOCK_BC5: internal_format = KTX_COMPRESSED_LUMINANCE_ALPHA_LATC2; base_format = KTX_RG; break;
+	}
+
+	int num_mips = 1;
+	while ((std::max(width, height) >> num_mips) > 0)
+		num_mips++;
+
+	//KTX 1.1 header
+	static const uint8 identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+	ktx.assign(identifier, identifier + 12);
+	appendUint32(ktx, 0x04030201); //endianness
+	appendUint32(ktx, 0); //type (compressed)
+	appendUint32(ktx, 1); //type size
+	appendUint32(ktx, 0); //format (compressed)
+	appendUint32(ktx, internal_format);
+	appendUint32(ktx, base_format);
+	appendUint32(ktx, width);
+	appendUint32(ktx, height);
+	appendUint32(ktx, 0); //depth
+	appendUint32(ktx, 0); //array elements
+	appendUint32(ktx, 1); //faces
+	appendUint32(ktx, num_mips);
+	appendUint32(ktx, 0); //key value data
+
+	//encoded once, so the sharper filter is worth it (called from the decoding threads, no extra threads)
+	std::vector<Image*> levels;
+	generateMipChain(pixels, width, height, num_channels, getMipFlags(usage), MIP_FILTER_KAISER, levels, 1);
+	assert(levels.size() + 1 == (size_t)num_mips);
+
+	for (int mip = 0; mip < num_mips; ++mip)
+	{
+		size_t size_pos = ktx.size();
+		appendUint32(ktx, 0);
+		if (mip == 0)
+			compressImageLevel(pixels, width, height, num_channels, format, ktx);
+		else
+			compressImageLevel(levels[mip - 1]->data, levels[mip - 1]->width, levels[mip - 1]->height, num_channels, format, ktx);
+		uint32 image_size = (uint32)(ktx.size() - size_pos - 4);
+		memcpy(&ktx[size_pos], &image_size, 4); //blocks are 8 or 16 bytes, no padding needed
+	}
+
+	for (Image* level : levels)
+		delete level;
+	return true;
+}
+
+std::string getKTXCacheName(const std::string& source, eTextureUsage usage)
+{
+	static const char* usage_names[] = { "none", "color", "normal", "data" };
+	return source + "." + usage_names[usage] + ".ktx";
+}
+
+bool isKTXForUsage(const std::vector<uint8>& ktx, eTextureUsage usage)
+{
+	//internal format after the identifier, endianness, type, type size and format
+	if (ktx.size() < 32)
+		return false;
+	uint32 internal_format;
+	memcpy(&internal_format, &ktx[28], 4);
+	switch (usage)
+	{
+	case TEXTURE_USAGE_COLOR: return internal_format == KTX_COMPRESSED_RGB_S3TC_DXT1 || internal_format == KTX_COMPRESSED_RGBA_S3TC_DXT5;
+	case TEXTURE_USAGE_NORMAL: return internal_format == KTX_COMPRESSED_LUMINANCE_ALPHA_LATC2;
+	case TEXTURE_USAGE_DATA: return internal_format == KTX_COMPRESSED_LUMINANCE_LATC1 || internal_format == KTX_COMPRESSED_RGB_S3TC_DXT1;
+	default: return false;
+	}
+}
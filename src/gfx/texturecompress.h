@@ -0,0 +1,41 @@
+#pragma once
+
+#include "../core/math.h"
+#include <vector>
+#include <string>
+
+//CPU block compression (S3TC/RGTC), textures are encoded once at import and cached as .ktx next to the source
+
+enum eBlockFormat {
+	BLOCK_BC1, //rgb, 4 bits per pixel
+	BLOCK_BC3, //rgba, 8 bits per pixel
+	BLOCK_BC4, //single channel, 4 bits per pixel (loaded with a RRR1 swizzle)
+	BLOCK_BC5  //two channels, 8 bits per pixel (normal maps store XY, Z must be rebuilt in the shader)
+};
+
+//what the texture is used for, decides the block format
+enum eTextureUsage {
+	TEXTURE_USAGE_NONE, //not compressed
+	TEXTURE_USAGE_COLOR, //albedo, emissive: BC1 or BC3 if it has alpha
+	TEXTURE_USAGE_NORMAL, //BC5, gbuffer_fill.fs rebuilds Z
+	TEXTURE_USAGE_DATA //roughness, occlusion: BC4 if it is greyscale, BC1 otherwise
+};
+
+//rgba: 16 pixels of 4 bytes, out: 8 bytes
+void encodeBC1Block(const uint8* rgba, uint8* out);
+//values: 16 bytes separated by stride, out: 8 bytes
+void encodeBC4Block(const uint8* values, int stride, uint8* out);
+
+eBlockFormat chooseBlockFormat(const uint8* pixels, int width, int height, int num_channels, eTextureUsage usage);
+int getBlockSize(eBlockFormat format); //bytes per 4x4 block
+
+//encodes one level, blocks on the borders repeat the last row/column
+void compressImageLevel(const uint8* pixels, int width, int height, int num_channels, eBlockFormat format, std::vector<uint8>& out);
+
+//compressed mip chain stored as a KTX file, returns false if the usage is not compressed
+bool compressToKTX(const uint8* pixels, int width, int height, int num_channels, eTextureUsage usage, std::vector<uint8>& ktx);
+
+//<source>.<usage>.ktx, the same image compressed for another usage has other block formats
+std::string getKTXCacheName(const std::string& source, eTextureUsage usage);
+//the header has a block format that compressToKTX writes for this usage
+bool isKTXForUsage(const std::vector<uint8>& ktx, eTextureUsage usage);
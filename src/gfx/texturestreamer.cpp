@@ -0,0 +1,260 @@
+#include "texturestreamer.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <iostream>
+#include "texture.h"
+#include "gfx.h"
+#include "../core/task.h"
+#include "../utils/utils.h"
+#include "../extra/dds-ktx.h"
+
+//reads some levels of a ktx in the decoding threads and gives them to the streamer in the main thread
+class LoadLevelsTask : public Task {
+public:
+	GFX::Texture* texture;
+	std::string path;
+	int first;
+	int last;
+
+	LoadLevelsTask(GFX::Texture* texture, const std::string& path, int first, int last) : texture(texture), path(path), first(first), last(last) {}
+
+	void onExecute()
+	{
+		std::vector<std::vector<uint8>> levels;
+		std::vector<uint8> buffer;
+		ddsktx_texture_info tc = { 0 };
+		if (readFileBin(path, buffer) && ddsktx_parse(&tc, &buffer[0], (int)buffer.size(), NULL) && tc.num_mips >= last)
+			for (int mip = first; mip < last; ++mip)
+			{
+				ddsktx_sub_data sub_data;
+				ddsktx_get_sub(&tc, &sub_data, &buffer[0], (int)buffer.size(), 0, 0, mip);
+				levels.push_back(std::vector<uint8>((const uint8*)sub_data.buff, (const uint8*)sub_data.buff + sub_data.size_bytes));
+			}
+
+		GFX::Texture* texture = this->texture;
+		int first = this->first, last = this->last;
+		TaskManager::foreground.addTask(new Task([texture, first, last, levels = std::move(levels)]() mutable {
+			GFX::TextureStreamer::get()->onLevelsLoaded(texture, first, last, levels);
+		}));
+	}
+
+	float getPriority() { return 0.5f; } //after the textures that are being waited for
+};
+
+namespace GFX
+{
+	TextureStreamer* global_texture_streamer = nullptr;
+	bool TextureStreamer::enabled = true;
+	unsigned int TextureStreamer::initial_size = 128;
+
+	TextureStreamer::TextureStreamer()
+	{
+		vram_budget = 512 * 1024 * 1024;
+		mip_bias = 0;
+		max_loads = 4;
+		frame = 0;
+		resident_bytes = 0;
+	}
+
+	TextureStreamer* TextureStreamer::get()
+	{
+		if (!global_texture_streamer)
+			global_texture_streamer = new TextureStreamer();
+		return global_texture_streamer;
+	}
+
+	void TextureStreamer::release(Texture* texture)
+	{
+		if (!global_texture_streamer)
+			return;
+		TextureStreamer* streamer = global_texture_streamer;
+		auto it = streamer->entries.find(texture);
+		if (it == streamer->entries.end())
+			return;
+		streamer->resident_bytes -= streamer->getLevelsBytes(texture, it->second.resident_mip, texture->num_mips);
+		streamer->entries.erase(it); //levels being read are discarded when they arrive
+	}
+
+	size_t TextureStreamer::getLevelsBytes(Texture* texture, int first, int last)
+	{
+		size_t block_size = (texture->internal_format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || texture->internal_format == GL_COMPRESSED_RED_RGTC1) ? 8 : 16;
+		size_t total = 0;
+		for (int mip = first; mip < last; ++mip)
+		{
+			size_t w = std::max(1, (int)texture->width >> mip), h = std::max(1, (int)texture->height >> mip);
+			total += ((w + 3) / 4) * ((h + 3) / 4) * block_size;
+		}
+		return total;
+	}
+
+	int TextureStreamer::getNumLoading()
+	{
+		int num = 0;
+		for (auto& it : entries)
+			num += it.second.loading_mip != -1;
+		return num;
+	}
+
+	bool TextureStreamer::load(Texture* texture, std::vector<uint8>& ktx, const std::string& path)
+	{
+		ddsktx_texture_info tc = { 0 };
+		if (!enabled || path.empty() || ktx.empty() || !ddsktx_parse(&tc, &ktx[0], (int)ktx.size(), NULL))
+			return texture->loadKTX(ktx);
+
+		int first = 0;
+		while (first + 1 < tc.num_mips && (unsigned int)(std::max(tc.width, tc.height) >> first) > initial_size)
+			first++;
+		if (!texture->loadKTX(ktx, first))
+			return false;
+		if (first == 0)
+			return true; //small enough, nothing to stream
+
+		entries[texture] = { texture, path, first, first, texture->num_mips, frame, -1 };
+		resident_bytes += getLevelsBytes(texture, first, texture->num_mips);
+		return true;
+	}
+
+	void TextureStreamer::request(Texture* texture, float uv_per_pixel)
+	{
+		auto it = entries.find(texture);
+		if (it == entries.end())
+			return;
+		sEntry& entry = it->second;
+		//one texel per pixel
+		float texels_per_pixel = uv_per_pixel * std::max(texture->width, texture->height);
+		int mip = (texels_per_pixel > 1.0f ? (int)floor(log2(texels_per_pixel)) : 0) + mip_bias;
+		entry.wanted_mip = std::min(entry.wanted_mip, std::max(0, std::min(mip, texture->num_mips - 1)));
+		entry.last_used_frame = frame;
+	}
+
+	bool TextureStreamer::evict(Texture* keep)
+	{
+		//least recently used one with levels it doesn't need, textures not requested this frame go back to the initial levels
+		sEntry* victim = nullptr;
+		int victim_target = 0;
+		for (auto& it : entries)
+		{
+			sEntry& entry = it.second;
+			if (entry.texture == keep || entry.loading_mip != -1)
+				continue;
+			int target = entry.last_used_frame == frame ? std::min(entry.wanted_mip, entry.initial_mip) : entry.initial_mip;
+			if (target <= entry.resident_mip)
+				continue;
+			if (!victim || entry.last_used_frame < victim->last_used_frame)
+			{
+				victim = &entry;
+				victim_target = target;
+			}
+		}
+		if (!victim)
+			return false;
+		setResidentMip(*victim, victim_target, nullptr);
+		return true;
+	}
+
+	void TextureStreamer::update()
+	{
+		//everything resident, whatever the budget
+		if (!enabled)
+			for (auto& it : entries)
+				it.second.wanted_mip = 0;
+		size_t budget = enabled ? vram_budget : SIZE_MAX;
+
+		//bytes that will arrive from the loads in flight
+		size_t loading_bytes = 0;
+		int num_loading = 0;
+		std::vector<sEntry*> candidates;
+		for (auto& it : entries)
+		{
+			sEntry& entry = it.second;
+			if (entry.loading_mip != -1)
+			{
+				loading_bytes += getLevelsBytes(entry.texture, entry.loading_mip, entry.resident_mip);
+				num_loading++;
+			}
+			else if (entry.wanted_mip < entry.resident_mip)
+				candidates.push_back(&entry);
+		}
+
+		//the ones missing more levels first
+		std::sort(candidates.begin(), candidates.end(), [](const sEntry* a, const sEntry* b) {
+			return a->resident_mip - a->wanted_mip > b->resident_mip - b->wanted_mip;
+		});
+
+		for (sEntry* entry : candidates)
+		{
+			if (num_loading >= max_loads)
+				break;
+			//make room, when nothing else can be dropped load less levels
+			int mip = entry->wanted_mip;
+			while (mip < entry->resident_mip && resident_bytes + loading_bytes + getLevelsBytes(entry->texture, mip, entry->resident_mip) > budget)
+				if (!evict(entry->texture))
+					mip++;
+			if (mip >= entry->resident_mip)
+				continue;
+
+			entry->loading_mip = mip;
+			loading_bytes += getLevelsBytes(entry->texture, mip, entry->resident_mip);
+			num_loading++;
+			TaskManager::decoding.addTask(new LoadLevelsTask(entry->texture, entry->path, mip, entry->resident_mip));
+		}
+
+		//the budget may have been lowered
+		while (resident_bytes > budget && evict(nullptr))
+			;
+
+		//requests of the next frame
+		for (auto& it : entries)
+			it.second.wanted_mip = it.first->num_mips;
+		frame++;
+	}
+
+	void TextureStreamer::onLevelsLoaded(Texture* texture, int first, int last, std::vector<std::vector<uint8>>& levels)
+	{
+		//released or reloaded meanwhile
+		auto it = entries.find(texture);
+		if (it == entries.end() || it->second.loading_mip != first || it->second.resident_mip != last)
+			return;
+		sEntry& entry = it->second;
+		entry.loading_mip = -1;
+		if ((int)levels.size() != last - first)
+		{
+			std::cout << TermColor::RED << "[ERROR] cannot stream mips from " << entry.path << TermColor::DEFAULT << std::endl;
+			release(texture); //stays with the levels it has
+			return;
+		}
+		setResidentMip(entry, first, &levels);
+	}
+
+	void TextureStreamer::setResidentMip(sEntry& entry, int mip, std::vector<std::vector<uint8>>* levels)
+	{
+		Texture* texture = entry.texture;
+		assert(mip >= 0 && mip < texture->num_mips && (mip >= entry.resident_mip || levels));
+		GLuint old_id = texture->texture_id;
+		GLuint id = texture->allocCompressedLevels(mip);
+		for (int level = mip; level < texture->num_mips; ++level)
+		{
+			int w = std::max(1, (int)texture->width >> level), h = std::max(1, (int)texture->height >> level);
+			if (level < entry.resident_mip)
+			{
+				const std::vector<uint8>& data = (*levels)[level - mip];
+				glCompressedTexSubImage2D(GL_TEXTURE_2D, level - mip, 0, 0, w, h, texture->internal_format, (GLsizei)data.size(), &data[0]);
+			}
+			else //already in VRAM
+				glCopyImageSubData(old_id, GL_TEXTURE_2D, level - entry.resident_mip, 0, 0, 0, id, GL_TEXTURE_2D, level - mip, 0, 0, 0, w, h, 1);
+		}
+		bindTexture(GL_TEXTURE_2D, 0);
+		forgetTexture(old_id);
+		glDeleteTextures(1, &old_id);
+		checkGLErrors();
+
+		resident_bytes -= getLevelsBytes(texture, entry.resident_mip, texture->num_mips);
+		resident_bytes += getLevelsBytes(texture, mip, texture->num_mips);
+		texture->texture_id = id;
+		texture->base_mip = mip;
+		entry.resident_mip = mip;
+	}
+};
@@ -0,0 +1,70 @@
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <vector>
+#include <map>
+#include <string>
+
+namespace GFX {
+
+	class Texture;
+
+	//Streams the mips of the compressed textures (the .ktx cache) on demand under a VRAM budget.
+	//Textures start with the small mips only, every frame the renderer requests the level each draw
+	//needs (from the projected uv density) and the missing ones are read in the decoding threads.
+	//When the budget is exceeded the top levels of the least recently used textures are dropped.
+	//The GL texture only holds the resident levels (immutable storage, the levels already in VRAM are
+	//copied with glCopyImageSubData when it is reallocated), so the sampler never reads a missing level.
+	class TextureStreamer {
+	public:
+		struct sEntry {
+			Texture* texture;
+			std::string path; //ktx file with all the mips
+			int resident_mip; //first level in VRAM
+			int initial_mip; //never dropped below this one
+			int wanted_mip; //biggest level requested since the last update
+			long last_used_frame;
+			int loading_mip; //first level being read, -1 if none
+		};
+
+		static bool enabled; //when disabled the textures already streamed load all their levels
+		static unsigned int initial_size; //textures start with the levels of this size or smaller
+
+		size_t vram_budget; //bytes of streamed levels
+		int mip_bias; //positive values request smaller levels
+		int max_loads; //files read at the same time
+
+		TextureStreamer();
+
+		static TextureStreamer* get(); //global one, created on first use
+		static void release(Texture* texture); //forgets the texture (it is being cleared)
+
+		//uploads the small levels and keeps the path to stream the rest (everything if disabled or path is empty)
+		bool load(Texture* texture, std::vector<uint8>& ktx, const std::string& path);
+		//uv_per_pixel: texture coordinates covered by one pixel of the screen
+		void request(Texture* texture, float uv_per_pixel);
+		//starts the loads and evictions, call it once per frame
+		void update();
+		//called when the decoding thread has read the levels [first, last)
+		void onLevelsLoaded(Texture* texture, int first, int last, std::vector<std::vector<uint8>>& levels);
+
+		//stats
+		size_t getResidentBytes() { return resident_bytes; }
+		int getNumLoading();
+		int getNumTextures() { return (int)entries.size(); }
+
+	private:
+		std::map<Texture*, sEntry> entries;
+		long frame;
+		size_t resident_bytes;
+
+		size_t getLevelsBytes(Texture* texture, int first, int last); //levels [first, last)
+		void setResidentMip(sEntry& entry, int mip, std::vector<std::vector<uint8>>* levels);
+		bool evict(Texture* keep); //drops levels from the least recently used texture, false if none can be dropped
+	};
+
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "uploadmanager.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include "texture.h"
+#include "gfx.h"
+#include "../utils/utils.h"
+
+namespace GFX
+{
+	UploadManager* global_upload_manager = nullptr;
+	bool UploadManager::enabled = true;
+	unsigned int UploadManager::min_async_size = 64 * 1024;
+
+	//glBufferStorage is core in GL 4.4 (or ARB_buffer_storage), we target 4.3 so it is loaded at runtime
+	typedef void (APIENTRY* BufferStorageFunc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+	static BufferStorageFunc getBufferStorage()
+	{
+		static bool checked = false;
+		static BufferStorageFunc func = nullptr;
+		if (checked)
+			return func;
+		checked = true;
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		if ((major > 4 || (major == 4 && minor >= 4)) || SDL_GL_ExtensionSupported("GL_ARB_buffer_storage"))
+			func = (BufferStorageFunc)SDL_GL_GetProcAddress("glBufferStorage");
+		return func;
+	}
+
+	static int levelSize(float size, int level)
+	{
+		return std::max(1, (int)size >> level);
+	}
+
+	//bytes of a row of the texture level in the staging memory (rows are tightly packed)
+	static size_t rowBytes(Texture* texture, int level)
+	{
+		int channels = texture->format == GL_RGBA ? 4 : (texture->format == GL_RGB ? 3 : (texture->format == GL_RG ? 2 : 1));
+		int type_size = texture->type == GL_FLOAT ? 4 : (texture->type == GL_HALF_FLOAT ? 2 : 1);
+		return (size_t)levelSize(texture->width, level) * channels * type_size;
+	}
+
+	UploadManager::UploadManager()
+	{
+		frame_budget = 8 * 1024 * 1024;
+		staging_buffer_id = 0;
+		mapped = nullptr;
+		persistent = false;
+		segment_size = 0;
+		current_segment = 0;
+		for (int i = 0; i < NUM_SEGMENTS; ++i)
+			fences[i] = 0;
+		bytes_this_second = 0;
+		second_start = getTime();
+		mb_per_second = 0.0f;
+	}
+
+	UploadManager::~UploadManager()
+	{
+		for (sRequest* request : requests)
+			delete request;
+		for (int i = 0; i < NUM_SEGMENTS; ++i)
+			if (fences[i])
+				glDeleteSync(fences[i]);
+		if (staging_buffer_id)
+			glDeleteBuffers(1, &staging_buffer_id);
+	}
+
+	UploadManager* UploadManager::get()
+	{
+		if (!global_upload_manager)
+			global_upload_manager = new UploadManager();
+		return global_upload_manager;
+	}
+
+	void UploadManager::createStaging()
+	{
+		for (int i = 0; i < NUM_SEGMENTS; ++i)
+			if (fences[i])
+			{
+				glDeleteSync(fences[i]);
+				fences[i] = 0;
+			}
+		if (staging_buffer_id)
+		{
+			if (mapped)
+			{
+				glBindBuffer(GL_COPY_READ_BUFFER, staging_buffer_id);
+				glUnmapBuffer(GL_COPY_READ_BUFFER);
+				mapped = nullptr;
+			}
+			glDeleteBuffers(1, &staging_buffer_id); //GL keeps it alive until pending copies are done
+		}
+
+		segment_size = frame_budget;
+		current_segment = 0;
+		size_t ring_size = (size_t)segment_size * NUM_SEGMENTS;
+		glGenBuffers(1, &staging_buffer_id);
+		glBindBuffer(GL_COPY_READ_BUFFER, staging_buffer_id);
+		persistent = false;
+		BufferStorageFunc buffer_storage = getBufferStorage();
+		if (buffer_storage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			buffer_storage(GL_COPY_READ_BUFFER, ring_size, NULL, flags);
+			mapped = (uint8*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, ring_size, flags);
+			persistent = mapped != nullptr;
+			if (!persistent) //immutable storage cannot be respecified with glBufferData
+			{
+				glDeleteBuffers(1, &staging_buffer_id);
+				glGenBuffers(1, &staging_buffer_id);
+				glBindBuffer(GL_COPY_READ_BUFFER, staging_buffer_id);
+			}
+		}
+		if (!persistent)
+			glBufferData(GL_COPY_READ_BUFFER, ring_size, NULL, GL_STREAM_COPY);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		checkGLErrors();
+	}
+
+	void UploadManager::uploadBuffer(int* pending, GLuint* buffer_id, size_t offset, const void* data, size_t size)
+	{
+		assert(pending && buffer_id && *buffer_id);
+		sRequest* request = new sRequest();
+		request->pending = pending;
+		request->buffer_id = buffer_id;
+		request->offset = offset;
+		request->texture = nullptr;
+		request->level = 0;
+		request->generate_mipmaps = false;
+		request->data.assign((const uint8*)data, (const uint8*)data + size);
+		request->done = 0;
+		requests.push_back(request);
+		(*pending)++;
+	}
+
+	void UploadManager::uploadTexture(Texture* texture, const void* data, int level, bool generate_mipmaps)
+	{
+		assert(texture->texture_id && texture->texture_type == GL_TEXTURE_2D);
+		size_t row = rowBytes(texture, level);
+		assert(row <= frame_budget && "rows must fit in a frame");
+		sRequest* request = new sRequest();
+		request->pending = &texture->pending_uploads;
+		request->buffer_id = nullptr;
+		request->offset = 0;
+		request->texture = texture;
+		request->level = level;
+		request->generate_mipmaps = generate_mipmaps;
+		request->data.assign((const uint8*)data, (const uint8*)data + row * (size_t)levelSize(texture->height, level));
+		request->done = 0;
+		requests.push_back(request);
+		texture->pending_uploads++;
+	}
+
+	void UploadManager::cancel(int* pending)
+	{
+		for (auto it = requests.begin(); it != requests.end();)
+		{
+			if ((*it)->pending != pending)
+			{
+				++it;
+				continue;
+			}
+			delete *it;
+			it = requests.erase(it);
+		}
+		*pending = 0;
+	}
+
+	size_t UploadManager::getQueuedBytes()
+	{
+		size_t total = 0;
+		for (sRequest* request : requests)
+			total += request->data.size() - request->done;
+		return total;
+	}
+
+	void UploadManager::finish(sRequest* request)
+	{
+		(*request->pending)--;
+		if (request->texture && request->texture->mipmaps && request->generate_mipmaps)
+		{
+			request->texture->generateMipmaps();
+			bindTexture(GL_TEXTURE_2D, 0);
+		}
+		delete request;
+	}
+
+	void UploadManager::update()
+	{
+		long now = getTime();
+		if (now - second_start >= 1000)
+		{
+			mb_per_second = (float)(bytes_this_second / (1024.0 * 1024.0) / ((now - second_start) * 0.001));
+			bytes_this_second = 0;
+			second_start = now;
+		}
+
+		if (requests.empty())
+			return;
+		if (!staging_buffer_id || segment_size != frame_budget)
+			createStaging();
+
+		//the GPU may still be reading this segment, try again next frame instead of stalling
+		GLsync& fence = fences[current_segment];
+		if (fence)
+		{
+			if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				return;
+			glDeleteSync(fence);
+			fence = 0;
+		}
+
+		size_t segment_start = (size_t)current_segment * segment_size;
+		glBindBuffer(GL_COPY_READ_BUFFER, staging_buffer_id);
+		uint8* dst = persistent ? mapped + segment_start :
+			(uint8*)glMapBufferRange(GL_COPY_READ_BUFFER, segment_start, segment_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (!dst)
+		{
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			return;
+		}
+
+		//fill the segment in request order, textures only take whole rows
+		struct sChunk { sRequest* request; size_t staging_offset; size_t start; size_t size; };
+		std::vector<sChunk> chunks;
+		size_t used = 0;
+		for (sRequest* request : requests)
+		{
+			size_t size = std::min((size_t)segment_size - used, request->data.size() - request->done);
+			if (request->texture)
+				size -= size % rowBytes(request->texture, request->level);
+			if (!size)
+				break;
+			memcpy(dst + used, &request->data[request->done], size);
+			chunks.push_back({ request, segment_start + used, request->done, size });
+			request->done += size;
+			used = std::min((size_t)segment_size, (used + size + 15) & ~(size_t)15); //keep the offsets aligned for float data
+			if (used == segment_size)
+				break;
+		}
+		if (!persistent)
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+
+		for (const sChunk& chunk : chunks)
+		{
+			sRequest* request = chunk.request;
+			if (request->texture)
+			{
+				Texture* texture = request->texture;
+				size_t row = rowBytes(texture, request->level);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer_id);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+				bindTexture(GL_TEXTURE_2D, texture->texture_id);
+				glTexSubImage2D(GL_TEXTURE_2D, request->level, 0, (GLint)(chunk.start / row), levelSize(texture->width, request->level), (GLsizei)(chunk.size / row),
+					texture->format, texture->type, (void*)chunk.staging_offset);
+				glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			else
+			{
+				glBindBuffer(GL_COPY_WRITE_BUFFER, *request->buffer_id);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, chunk.staging_offset, request->offset + chunk.start, chunk.size);
+			}
+		}
+		bindTexture(GL_TEXTURE_2D, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		current_segment = (current_segment + 1) % NUM_SEGMENTS;
+		bytes_this_second += used;
+
+		for (auto it = requests.begin(); it != requests.end();)
+		{
+			if ((*it)->done < (*it)->data.size())
+			{
+				++it;
+				continue;
+			}
+			finish(*it);
+			it = requests.erase(it);
+		}
+		checkGLErrors();
+	}
+};
@@ -0,0 +1,79 @@
+#ifndef UPLOADMANAGER_H
+#define UPLOADMANAGER_H
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include <vector>
+#include <list>
+
+namespace GFX {
+
+	class Texture;
+
+	//Streams buffer and texture data to the GPU in chunks, limited to frame_budget bytes per frame,
+	//so loading big assets (like dropping a prefab in the editor) doesn't stall the frame.
+	//The data goes through a staging ring split in one segment per frame in flight, a fence
+	//protects every segment until the GPU has consumed it (the ring is persistently mapped
+	//when ARB_buffer_storage is available, otherwise every segment is mapped unsynchronized).
+	//Resources with pending uploads must not be used: meshes are skipped and textures bind a placeholder.
+	class UploadManager {
+	public:
+		struct sRequest {
+			int* pending; //counter of the owner, decreased when the request is done
+			GLuint* buffer_id; //buffer requests, a pointer so the buffer can be recreated meanwhile (see MegaBuffer::reserve)
+			size_t offset; //in the destination buffer
+			Texture* texture; //texture requests, uploaded by rows
+			int level; //mipmap level of the texture
+			bool generate_mipmaps; //when the texture is complete (false if the levels come from the CPU)
+			std::vector<uint8> data;
+			size_t done; //bytes already sent
+		};
+
+		static const int NUM_SEGMENTS = 3; //frames in flight
+		static bool enabled;
+		static unsigned int min_async_size; //smaller uploads are done immediately
+
+		unsigned int frame_budget; //bytes per frame
+
+		UploadManager();
+		~UploadManager();
+
+		static UploadManager* get(); //global one, created on first use
+
+		//the buffer must be already allocated with at least offset + size bytes
+		void uploadBuffer(int* pending, GLuint* buffer_id, size_t offset, const void* data, size_t size);
+		//the texture (and the level) must be already created without data,
+		//mipmaps are generated when it is complete unless the levels are uploaded too
+		void uploadTexture(Texture* texture, const void* data, int level = 0, bool generate_mipmaps = true);
+		//removes the requests of an owner (when it is destroyed or uploaded again)
+		void cancel(int* pending);
+
+		//sends the data of this frame, call it once per frame
+		void update();
+
+		//stats
+		int getQueueDepth() { return (int)requests.size(); }
+		size_t getQueuedBytes();
+		float getMBPerSecond() { return mb_per_second; }
+
+	private:
+		std::list<sRequest*> requests;
+
+		GLuint staging_buffer_id;
+		uint8* mapped; //whole ring when persistently mapped
+		bool persistent;
+		unsigned int segment_size;
+		int current_segment;
+		GLsync fences[NUM_SEGMENTS];
+
+		size_t bytes_this_second;
+		long second_start;
+		float mb_per_second;
+
+		void createStaging();
+		void finish(sRequest* request);
+	};
+
+};
+
+#endif
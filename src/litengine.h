@@ -20,5 +20,6 @@
 #include "pipeline/scene.h"
 #include "pipeline/renderer.h"
 #include "pipeline/light.h"
+#include "pipeline/irradiance.h"
 
 
@@ -0,0 +1,60 @@
+#include "dynamicresolution.h"
+
+#include <cmath>
+
+#include "../core/includes.h"
+#include "../core/math.h"
+#include "../gfx/gfx.h"
+
+#define AVERAGE_FRAMES 8
+
+float SCN::DynamicResolution::update()
+{
+	if (!enabled)
+		return scale;
+
+	//the queries are read some frames later, only new samples move the controller
+	int pos = GFX::gpu_frame_history_pos;
+	if (pos == last_history_pos)
+		return scale;
+	last_history_pos = pos;
+
+	//average of the last frames so a spike does not change the scale
+	long total = 0;
+	int count = 0;
+	for (int i = 1; i <= AVERAGE_FRAMES; ++i)
+	{
+		long sample = GFX::gpu_frame_microseconds_history[(pos - i + GPU_FRAME_HISTORY_SIZE) % GPU_FRAME_HISTORY_SIZE];
+		if (!sample) //not measured yet
+			continue;
+		total += sample;
+		count++;
+	}
+	if (!count)
+		return scale;
+	frame_ms = total / (count * 1000.0f);
+
+	//positive while there is time left
+	float error = (target_ms - frame_ms) / target_ms;
+	headroom = error;
+	if (fabs(error) < dead_band)
+		error = 0.0f;
+
+	//velocity form, the controller moves the scale instead of setting it, so the clamp does not wind it up
+	raw_scale += kp * (error - previous_error) + ki * error + kd * (error - 2.0f * previous_error + previous_error2);
+	raw_scale = clamp(raw_scale, min_scale, max_scale);
+	previous_error2 = previous_error;
+	previous_error = error;
+
+	//changes once it is most of a step away, so it does not flip between two steps
+	if (fabs(raw_scale - scale) > step * 0.75f)
+		scale = clamp(roundf(raw_scale / step) * step, min_scale, max_scale);
+	return scale;
+}
+
+void SCN::DynamicResolution::reset()
+{
+	scale = raw_scale = clamp(scale, min_scale, max_scale);
+	previous_error = previous_error2 = 0.0f;
+	last_history_pos = -1;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+namespace SCN {
+
+	//Internal resolution of the frame driven by the GPU frame time (GFX::gpu_frame_microseconds_history): an incremental
+	//PID on how far the last frames are from the target, with a dead band around it and the scale changed in steps,
+	//since every new scale reallocates the targets. The renderer upscales the result to the window.
+	class DynamicResolution
+	{
+	public:
+		bool enabled = false;
+		float target_ms = 15.0f; //under the 16.6ms of 60fps, the UI and the swap are not measured
+		float min_scale = 0.5f;
+		float max_scale = 1.0f;
+		float step = 0.05f;
+		float dead_band = 0.05f; //fraction of the target where the error is ignored
+
+		float kp = 0.1f;
+		float ki = 0.04f;
+		float kd = 0.02f;
+
+		float scale = 1.0f; //of the window size, the one to render with
+		float frame_ms = 0.0f; //average of the last frames
+		float headroom = 0.0f; //fraction of the target left, negative when over it
+
+		//once per frame, returns the scale
+		float update();
+		void reset();
+
+	private:
+		float raw_scale = 1.0f; //continuous output of the controller
+		float previous_error = 0.0f;
+		float previous_error2 = 0.0f;
+		int last_history_pos = -1;
+	};
+
+};
@@ -0,0 +1,199 @@
+#include "irradiance.h"
+
+#include <cstdio>
+#include <iostream>
+#include <cstring>
+
+#include "../core/includes.h"
+#include "../gfx/texture.h"
+#include "../utils/utils.h"
+#include "../extra/cJSON.h"
+
+SCN::IrradianceVolumeEntity::IrradianceVolumeEntity()
+{
+	dims[0] = dims[1] = dims[2] = 4;
+	cubemap_size = 32;
+	probes_per_frame = 8;
+	near_distance = 0.1f;
+	far_distance = 1000.0f;
+	baked_probes = 0;
+	baking = false;
+	texture = nullptr;
+}
+
+SCN::IrradianceVolumeEntity::~IrradianceVolumeEntity()
+{
+	delete texture;
+}
+
+void SCN::IrradianceVolumeEntity::operator = (const IrradianceVolumeEntity& entity)
+{
+	BaseEntity::operator = (entity);
+	memcpy(dims, entity.dims, sizeof(dims));
+	cubemap_size = entity.cubemap_size;
+	probes_per_frame = entity.probes_per_frame;
+	near_distance = entity.near_distance;
+	far_distance = entity.far_distance;
+	filename = entity.filename;
+	probes = entity.probes;
+	baked_probes = entity.baking ? 0 : entity.baked_probes;
+	baking = false;
+	if (entity.texture)
+		uploadTexture();
+	else
+	{
+		delete texture;
+		texture = nullptr;
+	}
+}
+
+void SCN::IrradianceVolumeEntity::configure(cJSON* json)
+{
+	Vector3f size = readJSONVector3(json, "dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	for (int i = 0; i < 3; ++i)
+		dims[i] = std::max(1, (int)size[i]);
+	cubemap_size = (int)readJSONNumber(json, "cubemap_size", (float)cubemap_size);
+	probes_per_frame = (int)readJSONNumber(json, "probes_per_frame", (float)probes_per_frame);
+	near_distance = readJSONNumber(json, "near_dist", near_distance);
+	far_distance = readJSONNumber(json, "far_dist", far_distance);
+	filename = readJSONString(json, "filename", filename.c_str());
+
+	if (filename.size() && scene)
+	{
+		std::string fullpath = scene->base_folder + "/" + filename;
+		if (load(fullpath.c_str()))
+			uploadTexture();
+	}
+}
+
+void SCN::IrradianceVolumeEntity::serialize(cJSON* json)
+{
+	writeJSONVector3(json, "dims", Vector3f((float)dims[0], (float)dims[1], (float)dims[2]));
+	writeJSONNumber(json, "cubemap_size", (float)cubemap_size);
+	writeJSONNumber(json, "probes_per_frame", (float)probes_per_frame);
+	writeJSONNumber(json, "near_dist", near_distance);
+	writeJSONNumber(json, "far_dist", far_distance);
+	if (filename.size())
+		writeJSONString(json, "filename", filename.c_str());
+}
+
+Vector3f SCN::IrradianceVolumeEntity::getProbePosition(int index)
+{
+	int coord[3] = { index % dims[0], (index / dims[0]) % dims[1], index / (dims[0] * dims[1]) };
+	Vector3f local;
+	for (int i = 0; i < 3; ++i)
+		local[i] = dims[i] > 1 ? coord[i] / (float)(dims[i] - 1) - 0.5f : 0.0f;
+	return root.getGlobalMatrix() * local;
+}
+
+Matrix44 SCN::IrradianceVolumeEntity::getInverseModel()
+{
+	Matrix44 inverse = root.getGlobalMatrix();
+	inverse.inverse();
+	return inverse;
+}
+
+void SCN::IrradianceVolumeEntity::startBake()
+{
+	probes.resize(getNumProbes());
+	baked_probes = 0;
+	baking = true;
+}
+
+void SCN::IrradianceVolumeEntity::finishBake()
+{
+	baking = false;
+	uploadTexture();
+
+	if (filename.empty())
+		filename = (name.size() ? name : std::string("irradiance")) + ".irr";
+	if (scene)
+	{
+		std::string fullpath = scene->base_folder + "/" + filename;
+		save(fullpath.c_str());
+	}
+}
+
+bool SCN::IrradianceVolumeEntity::load(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		std::cout << " - Irradiance file not found: " << TermColor::RED << path << TermColor::DEFAULT << std::endl;
+		return false;
+	}
+
+	sIrradianceHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.signature, "IRRV", 4) == 0 &&
+		header.version == 1 && header.num_coeffs == 9 && header.dims[0] > 0 && header.dims[1] > 0 && header.dims[2] > 0;
+	std::vector<uint16> values;
+	if (ok)
+	{
+		values.resize((size_t)header.dims[0] * header.dims[1] * header.dims[2] * 9 * 3);
+		ok = fread(&values[0], sizeof(uint16), values.size(), file) == values.size();
+	}
+	fclose(file);
+	if (!ok)
+	{
+		std::cout << " - Irradiance file has errors: " << TermColor::RED << path << TermColor::DEFAULT << std::endl;
+		return false;
+	}
+
+	//the grid of the file wins over the one of the scene, the probes would not match otherwise
+	memcpy(dims, header.dims, sizeof(dims));
+	probes.resize(getNumProbes());
+	const uint16* value = &values[0];
+	for (SphericalHarmonics& sh : probes)
+		for (int i = 0; i < 9; ++i)
+			for (int j = 0; j < 3; ++j)
+				sh.coeffs[i][j] = halfToFloat(*value++);
+	baked_probes = (int)probes.size();
+	return true;
+}
+
+bool SCN::IrradianceVolumeEntity::save(const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	sIrradianceHeader header;
+	memcpy(header.signature, "IRRV", 4);
+	header.version = 1;
+	memcpy(header.dims, dims, sizeof(dims));
+	header.num_coeffs = 9;
+
+	std::vector<uint16> values;
+	values.reserve(probes.size() * 9 * 3);
+	for (SphericalHarmonics& sh : probes)
+		for (int i = 0; i < 9; ++i)
+			for (int j = 0; j < 3; ++j)
+				values.push_back(floatToHalf(sh.coeffs[i][j]));
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(&values[0], sizeof(uint16), values.size(), file) == values.size();
+	fclose(file);
+	std::cout << " + Irradiance saved: " << path << " (" << probes.size() << " probes)" << std::endl;
+	return ok;
+}
+
+void SCN::IrradianceVolumeEntity::uploadTexture()
+{
+	if ((int)probes.size() != getNumProbes())
+		return;
+
+	//coefficient k of probe (x,y,z) goes to the texel (x, y, k * dims[2] + z)
+	size_t num_probes = probes.size();
+	std::vector<uint16> texels(num_probes * 9 * 3);
+	for (int k = 0; k < 9; ++k)
+		for (size_t i = 0; i < num_probes; ++i)
+			for (int j = 0; j < 3; ++j)
+				texels[(k * num_probes + i) * 3 + j] = floatToHalf(probes[i].coeffs[k][j]);
+
+	if (!texture)
+	{
+		texture = new GFX::Texture();
+		texture->filename = "Irradiance Volume";
+	}
+	texture->create3D(dims[0], dims[1], dims[2] * 9, GL_RGB, GL_HALF_FLOAT, false, (Uint8*)&texels[0], GL_RGB16F);
+}
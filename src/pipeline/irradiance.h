@@ -0,0 +1,61 @@
+#pragma once
+
+#include "scene.h"
+#include "../gfx/sphericalharmonics.h"
+
+namespace GFX {
+	class Texture;
+}
+
+namespace SCN {
+
+	//header of the baked .irr file, followed by the 27 half floats (9 RGB coefficients) of every probe (x first, then y, then z)
+	struct sIrradianceHeader {
+		char signature[4]; //IRRV
+		int version;
+		int dims[3];
+		int num_coeffs;
+	};
+
+	//Grid of probes inside the box of the entity (the model scales a cube of size 1), every probe stores the
+	//L2 spherical harmonics of the light that reaches it. The Renderer bakes a few probes per frame and the
+	//deferred ambient pass samples the coefficients trilinearly from a 3D texture.
+	class IrradianceVolumeEntity : public BaseEntity
+	{
+	public:
+		int dims[3]; //probes per axis
+		int cubemap_size; //of every face captured in the bake
+		int probes_per_frame;
+		float near_distance;
+		float far_distance;
+		std::string filename; //baked probes, relative to the scene folder
+
+		std::vector<SphericalHarmonics> probes;
+		int baked_probes; //progress of the bake, probes.size() when done
+		bool baking;
+
+		//9 slabs of dims[2] slices, one per coefficient, so the filtering never mixes coefficients
+		GFX::Texture* texture;
+
+		ENTITY_METHODS(IrradianceVolumeEntity, IRRADIANCE_VOLUME, 12, 4);
+
+		IrradianceVolumeEntity();
+		~IrradianceVolumeEntity();
+		void operator = (const IrradianceVolumeEntity& entity); //clones have their own texture
+
+		void configure(cJSON* json);
+		void serialize(cJSON* json);
+
+		int getNumProbes() { return dims[0] * dims[1] * dims[2]; }
+		Vector3f getProbePosition(int index);
+		Matrix44 getInverseModel(); //world to the box, from -0.5 to 0.5
+
+		void startBake();
+		void finishBake(); //uploads and saves the probes
+
+		bool load(const char* path);
+		bool save(const char* path);
+		void uploadTexture();
+	};
+
+};
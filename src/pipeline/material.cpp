@@ -2,52 +2,54 @@
 #include "material.h"
 
 #include "../core/includes.h"
+#include "../gfx/gfx.h"
 #include "../gfx/texture.h"
 #include "../gfx/shader.h"
 
 using namespace SCN;
 
-std::map<std::string, Material*> Material::sMaterials;
+CORE::AssetRegistry<Material> Material::sMaterials(1024 * 1024);
 uint32 Material::s_last_index = 0;
 Material Material::default_material;
 
 const char* SCN::texture_channel_str[] = { "ALBEDO","EMISSIVE","OPACITY","METALLIC_ROUGHNESS","OCCLUSION","NORMALMAP" };
+const char* SCN::material_feature_macros[] = { "ALPHA_MASK","ALPHA_BLEND","TWO_SIDED",
+	"USE_ALBEDO_TEXTURE","USE_EMISSIVE_TEXTURE","USE_OPACITY_TEXTURE","USE_METALLIC_ROUGHNESS_TEXTURE","USE_OCCLUSION_TEXTURE","USE_NORMALMAP_TEXTURE" };
+static_assert(sizeof(SCN::material_feature_macros) / sizeof(const char*) == NUM_MATERIAL_FEATURES, "a macro for every material feature");
 
 
 Material* Material::Get(const char* name)
 {
 	assert(name);
-	std::map<std::string, Material*>::iterator it = sMaterials.find(name);
-	if (it != sMaterials.end())
-		return it->second;
-	return NULL;
+	return sMaterials.find(name);
 }
 
 void Material::registerMaterial(const char* name)
 {
 	this->name = name;
-	sMaterials[name] = this;
+	sMaterials.add(name, this);
+	sMaterials.setBytes(this, sizeof(Material));
 }
 
 Material::~Material()
 {
-	if (name.size())
-	{
-		auto it = sMaterials.find(name);
-		if (it != sMaterials.end())
-			sMaterials.erase(it);
-	}
+	sMaterials.remove(this);
+	for (int i = 0; i < eTextureChannel::ALL; ++i)
+		GFX::Texture::sTexturesLoaded.release(textures[i].texture);
+}
+
+void Material::setTexture(eTextureChannel channel, GFX::Texture* texture, int uv_channel)
+{
+	GFX::Texture::sTexturesLoaded.addRef(texture);
+	GFX::Texture::sTexturesLoaded.release(textures[channel].texture);
+	textures[channel].texture = texture;
+	textures[channel].uv_channel = uv_channel;
 }
 
 void Material::Release()
 {
 	std::vector<Material *>mats;
-
-	for (auto mp : sMaterials)
-	{
-		Material *m = mp.second;
-		mats.push_back(m);
-	}
+	sMaterials.getAll(mats);
 
 	for (Material *m : mats)
 	{
@@ -56,23 +58,37 @@ void Material::Release()
 	sMaterials.clear();
 }
 
+uint32 Material::getFeatures() const
+{
+	uint32 features = 0;
+	if (alpha_mode == MASK)
+		features |= 1 << FEATURE_ALPHA_MASK;
+	else if (alpha_mode == BLEND)
+		features |= 1 << FEATURE_ALPHA_BLEND;
+	if (two_sided)
+		features |= 1 << FEATURE_TWO_SIDED;
+	for (int i = 0; i < eTextureChannel::ALL; ++i)
+		if (textures[i].texture)
+			features |= 1 << (FEATURE_TEXTURE + i);
+	return features;
+}
+
+uint64 Material::getRenderState() const
+{
+	uint64 state = 0;
+	if (alpha_mode == SCN::eAlphaMode::BLEND)
+		state |= GFX_STATE_BLEND_ALPHA;
+	if (!two_sided)
+		state |= GFX_STATE_CULL_CW;
+	return state;
+}
+
 void Material::bind(GFX::Shader* shader) {
 	// First, configure the OpenGL state with the material settings =======================
 	{
-		// Select the blending
-		if (alpha_mode == SCN::eAlphaMode::BLEND)
-		{
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		}
-		else
-			glDisable(GL_BLEND);
-
-		// Select if render both sides of the triangles
-		if (two_sided)
-			glDisable(GL_CULL_FACE);
-		else
-			glEnable(GL_CULL_FACE);
+		// Select the blending and if render both sides of the triangles, the rest is the state of the pass
+		uint64 pass_state = GFX::getGPUState() & ~(GFX_STATE_BLEND_MASK | GFX_STATE_BLEND_EQUATION_MASK | GFX_STATE_CULL_MASK);
+		GFX::setGPUState(pass_state | getRenderState());
 
 		// Check if any error
 		assert(glGetError() == GL_NO_ERROR);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../core/math.h"
+#include "../core/assets.h"
 #include <cassert>
 #include <map>
 #include <string>
@@ -40,12 +41,24 @@ namespace SCN {
 
 	extern const char* texture_channel_str[];
 
+	//flags of a material that change the code of the shaders, material_feature_macros has the macro of each one
+	//(see GFX::Shader::SetFeatureMacros), the textures follow the order of eTextureChannel
+	enum eMaterialFeature {
+		FEATURE_ALPHA_MASK,
+		FEATURE_ALPHA_BLEND,
+		FEATURE_TWO_SIDED,
+		FEATURE_TEXTURE, //first texture channel
+		NUM_MATERIAL_FEATURES = FEATURE_TEXTURE + eTextureChannel::ALL
+	};
+
+	extern const char* material_feature_macros[NUM_MATERIAL_FEATURES];
+
 	//this class contains all info relevant of how something must be rendered
 	class Material {
 	public:
 
-		//static manager to reuse materials
-		static std::map<std::string, Material*> sMaterials;
+		//static manager to reuse materials, nodes hold references to their materials
+		static CORE::AssetRegistry<Material> sMaterials;
 		static Material* Get(const char* name);
 		static uint32 s_last_index;
 		static Material default_material;
@@ -76,6 +89,9 @@ namespace SCN {
 		virtual ~Material();
 
 		void bind(GFX::Shader *shader);
+		uint32 getFeatures() const; //a bit per eMaterialFeature
+		uint64 getRenderState() const; //the GFX_STATE_* blend and cull bits
+		void setTexture(eTextureChannel channel, GFX::Texture* texture, int uv_channel = 0); //keeps a reference to the texture
 
 		static void Release();
 	};
@@ -18,7 +18,7 @@ using namespace SCN;
 int Node::s_NodeID = 0;
 Node* Node::s_selected = nullptr;
 
-Node::Node() : parent(nullptr), mesh(nullptr), material(nullptr), visible(true)
+Node::Node() : parent(nullptr), mesh(nullptr), material(nullptr), visible(true), lod_level(0)
 {
 	m_Id = s_NodeID++;
 }
@@ -28,12 +28,9 @@ Node::~Node()
 	assert(parent == nullptr); //cannot delete a node that has a parent
 	clear();
 
-	//cant delete mesh, material or skeleton as it is a shared resource
-	//delete mesh;
-	//delete material;
-
-	mesh = nullptr;
-	material = nullptr;
+	//cant delete mesh, material or skeleton as it is a shared resource, the registries delete them when unused
+	setMesh(nullptr);
+	setMaterial(nullptr);
 
 	if (s_selected == this)
 		s_selected = nullptr;
@@ -126,13 +123,27 @@ bool Node::testRay(const Ray& ray, Vector3f& result, int layers, float max_dist)
 	return collided;
 }
 
+void Node::setMesh(GFX::Mesh* mesh)
+{
+	GFX::Mesh::sMeshesLoaded.addRef(mesh);
+	GFX::Mesh::sMeshesLoaded.release(this->mesh);
+	this->mesh = mesh;
+}
+
+void Node::setMaterial(Material* material)
+{
+	Material::sMaterials.addRef(material);
+	Material::sMaterials.release(this->material);
+	this->material = material;
+}
+
 void Node::operator = (const Node& node)
 {
 	Node* old_parent = parent;
 	clear(); //remove any children
 
-	mesh = node.mesh;
-	material = node.material;
+	setMesh(node.mesh);
+	setMaterial(node.material);
 	name = node.name;
 	visible = node.visible;
 	model = node.model;
@@ -154,12 +165,7 @@ Prefab::Prefab()
 
 Prefab::~Prefab()
 {
-	if (name.size())
-	{
-		auto it = sPrefabsLoaded.find(name);
-		if (it != sPrefabsLoaded.end())
-			sPrefabsLoaded.erase(it);
-	}
+	sPrefabsLoaded.remove(this);
 }
 
 void Prefab::updateBounding()
@@ -167,14 +173,14 @@ void Prefab::updateBounding()
 	bounding = root.getBoundingBox();
 }
 
-std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
+CORE::AssetRegistry<Prefab> Prefab::sPrefabsLoaded(16 * 1024 * 1024);
 
 Prefab* Prefab::Get(const char* filename)
 {
 	assert(filename);
-	std::map<std::string, Prefab*>::iterator it = sPrefabsLoaded.find(filename);
-	if (it != sPrefabsLoaded.end())
-		return it->second;
+	Prefab* cached = sPrefabsLoaded.find(filename);
+	if (cached)
+		return cached;
 
 	Prefab* prefab = nullptr;
 	{
@@ -192,10 +198,20 @@ Prefab* Prefab::Get(const char* filename)
 	return prefab;
 }
 
+//the memory of a prefab is estimated from its number of nodes
+int getNumNodes(Node* node)
+{
+	int num = 1;
+	for (Node* child : node->children)
+		num += getNumNodes(child);
+	return num;
+}
+
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
-	sPrefabsLoaded[name] = this;
+	sPrefabsLoaded.add(name, this);
+	sPrefabsLoaded.setBytes(this, getNumNodes(&root) * sizeof(Node));
 }
 
 Node* Prefab::getNodeByName(const char* name)
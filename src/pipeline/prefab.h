@@ -5,6 +5,7 @@
 #include <string>
 
 #include "../core/math.h"
+#include "../core/assets.h"
 #include "material.h"
 
 //forward declaration
@@ -35,13 +36,14 @@ namespace SCN {
 		std::string name;
 		bool visible;
 
-		GFX::Mesh* mesh;
+		GFX::Mesh* mesh; //use setMesh and setMaterial, the node keeps a reference to them
 		Material* material;
 
 		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
 		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
 
 		BoundingBox aabb; //node bounding box in world space
+		int lod_level; //chosen for the main camera last frame, see Renderer::selectLOD
 
 		//info to create the tree
 		Node* parent;
@@ -67,6 +69,9 @@ namespace SCN {
 		}
 		void removeChild(Node* child);
 
+		void setMesh(GFX::Mesh* mesh);
+		void setMaterial(Material* material);
+
 		//compute the global matrix taking into account its parent
 		Matrix44 getGlobalMatrix(bool fast = false) { 
 			if (parent)
@@ -104,8 +109,8 @@ namespace SCN {
 		void updateNodesByName();
 		Node* getNodeByName(const char* name);
 
-		//Manager to cache loaded prefabs
-		static std::map<std::string, Prefab*> sPrefabsLoaded;
+		//Manager to cache loaded prefabs, the entities using them hold references
+		static CORE::AssetRegistry<Prefab> sPrefabsLoaded;
 		static Prefab* Get(const char* filename);
 		void registerPrefab(std::string name);
 	};
@@ -8,8 +8,14 @@
 #include "../gfx/mesh.h"
 #include "../gfx/texture.h"
 #include "../gfx/fbo.h"
+#include "../gfx/rendergraph.h"
+#include "../gfx/megabuffer.h"
+#include "../gfx/uploadmanager.h"
+#include "../gfx/texturestreamer.h"
+#include "../gfx/sphericalharmonics.h"
 #include "../pipeline/prefab.h"
 #include "../pipeline/light.h"
+#include "../pipeline/irradiance.h"
 
 #include "../pipeline/material.h"
 #include "../pipeline/animation.h"
@@ -17,6 +23,7 @@
 #include "../extra/hdre.h"
 #include "../core/ui.h"
 #include "../core/core.h"
+#include "../core/task.h"
 
 #include "scene.h"
 
@@ -28,22 +35,32 @@ struct sDrawCommand {
 	float distance_to_camera;
 	SCN::BaseEntity* entity = nullptr;
 	SCN::Node* node = nullptr;
+	std::vector<uint8> visible_meshlets; //one flag per meshlet, empty if the mesh is drawn whole
 
 };
 
 std::vector<sDrawCommand> draw_command_list;
+
+//its geometry is in the MegaBuffer, so it can be merged in a multi draw
+static bool isMultiDrawable(const sDrawCommand& command)
+{
+	return command.material && command.mesh->mega_base_vertex != -1 && !command.mesh->pending_uploads;
+}
 std::vector<SCN::LightEntity*> light_list;
 std::vector<GFX::FBO*> shadow_fbos;
 
-GFX::FBO* motion_blur_fbo;
-GFX::FBO* velocity_fbo;
-GFX::FBO* tonemap_fbo;
 Matrix44 prev_view_projection;
 Matrix44 current_view_projection;
 
 
 Camera light_camera;
 
+//render states of the passes (GFX_STATE_* in gfx.h), GFX::setGPUState only calls GL for what changes between them
+#define STATE_QUAD (GFX_STATE_DEFAULT & ~GFX_STATE_CULL_MASK) //fullscreen quad on a cleared target
+#define STATE_QUAD_OVER_DEPTH (GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_DEPTH_TEST_LEQUAL | GFX_STATE_FRONT_CCW | GFX_STATE_MSAA) //depth copied from the gbuffer, not written
+#define STATE_NO_DEPTH (GFX_STATE_WRITE_RGB | GFX_STATE_WRITE_A | GFX_STATE_FRONT_CCW | GFX_STATE_MSAA)
+#define STATE_LIGHT_VOLUME ((STATE_QUAD_OVER_DEPTH & ~GFX_STATE_DEPTH_TEST_MASK) | GFX_STATE_DEPTH_TEST_GREATER | GFX_STATE_BLEND_ADD | GFX_STATE_CULL_CCW)
+
 using namespace SCN;
 
 //some globals
@@ -65,8 +82,11 @@ Renderer::Renderer(const char* shader_atlas_filename)
 	motion_blur_samples = 4;
 	use_motion_blur = false;
 
+	//before the atlas so its ubershaders know the material features
+	GFX::Shader::SetFeatureMacros(SCN::material_feature_macros, SCN::NUM_MATERIAL_FEATURES);
 	if (!GFX::Shader::LoadAtlas(shader_atlas_filename))
 		exit(1);
+	GFX::Shader::LoadPermutationManifest((std::string(shader_atlas_filename) + ".permutations").c_str());
 	GFX::checkGLErrors();
 
 	sphere.createSphere(1.0f);
@@ -81,13 +101,19 @@ Renderer::Renderer(const char* shader_atlas_filename)
 		shadow_fbos.push_back(shadow_fbo);
 	}
 
+	//the other targets of the frame are transient, created and shared by the passes of the graph
+	render_graph = new GFX::RenderGraph();
+
 	//Assigment 2.1 Generate G-Buffer
 	gbuffer_fbo = new GFX::FBO();
 
 	Vector2ui size = CORE::getWindowSize();
-	int width = size.x;
-	int height = size.y;
+	resizeTargets(size.x, size.y);
+}
 
+//the targets of the graph are reallocated when the passes use them with the new size
+void Renderer::resizeTargets(int width, int height)
+{
 	gbuffer_fbo->create(width, height, 3, GL_RGBA, GL_UNSIGNED_BYTE, true);
 
 	gbuffer_fbo->color_textures[0]->filename = "G-Buffer Albedo";
@@ -96,41 +122,18 @@ Renderer::Renderer(const char* shader_atlas_filename)
 
 	gbuffer_fbo->depth_texture->filename = "G-Buffer Depth";
 
-	lighting_fbo = new GFX::FBO();
-	lighting_fbo->create(width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, true);
-	lighting_fbo->color_textures[0]->filename = "Lighting Result";
-	lighting_fbo->depth_texture->filename = "Lighting Depth";
-
-	// 2.1 assignment 5
-	ssao_fbo = new GFX::FBO();
-	ssao_fbo->create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
-	ssao_fbo->color_textures[0]->filename = "SSAO Texture";
-
-	// 3.1 assignment 6
-	hdr_fbo = new GFX::FBO();
-	hdr_fbo->create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
-	hdr_fbo->color_textures[0]->filename = "HDR Result";
-
-	tonemap_fbo = new GFX::FBO();
-	tonemap_fbo->create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
-	tonemap_fbo->color_textures[0]->filename = "Tonemap Result";
-
-	//Lab3 - Motion Blur
-	motion_blur_fbo = new GFX::FBO();
-	motion_blur_fbo->create(width, height, 1, GL_RGB, GL_UNSIGNED_BYTE, false);
-	motion_blur_fbo->color_textures[0]->filename = "Motion Blur Result";
-
-	velocity_fbo = new GFX::FBO();
-	velocity_fbo->create(width, height, 1, GL_RG, GL_FLOAT, true); // RG para X,Y velocity
-	velocity_fbo->color_textures[0]->filename = "Velocity Buffer";
+	render_graph->setSize(width, height);
 }
 
 void Renderer::setupScene()
 {
+	GFX::Texture* skybox = nullptr;
 	if (scene->skybox_filename.size())
-		skybox_cubemap = GFX::Texture::Get(std::string(scene->base_folder + "/" + scene->skybox_filename).c_str());
-	else
-		skybox_cubemap = nullptr;
+		skybox = GFX::Texture::Get(std::string(scene->base_folder + "/" + scene->skybox_filename).c_str());
+	//referenced, so trimming the registry does not delete it while the scene uses it
+	GFX::Texture::sTexturesLoaded.addRef(skybox);
+	GFX::Texture::sTexturesLoaded.release(skybox_cubemap);
+	skybox_cubemap = skybox;
 }
 
 void Renderer::parseNodes(SCN::Node* node, Camera* cam, BaseEntity* entity) {
@@ -154,6 +157,11 @@ void Renderer::parseNodes(SCN::Node* node, Camera* cam, BaseEntity* entity) {
 		if (cam->testBoxInFrustum(world_bounding.center, world_bounding.halfsize)) {
 			sDrawCommand draw_com;
 			draw_com.mesh = node->mesh;
+			if (use_lods && node->mesh->lods.size())
+			{
+				draw_com.mesh = node->mesh->getLOD(selectLOD(node, cam, world_bounding));
+				lod_triangles_saved += node->mesh->getNumTriangles() - draw_com.mesh->getNumTriangles();
+			}
 			draw_com.material = node->material;
 			draw_com.model = model;
 			draw_com.name = node->name;
@@ -175,6 +183,105 @@ void Renderer::parseNodes(SCN::Node* node, Camera* cam, BaseEntity* entity) {
 
 }
 
+//chooses the level by projected size, keeping the previous level while inside the hysteresis margin
+int Renderer::selectLOD(SCN::Node* node, Camera* cam, const BoundingBox& world_bounding)
+{
+	int num_levels = (int)node->mesh->lods.size();
+	float screen_size = cam->getProjectedScale(world_bounding.center, world_bounding.halfsize.length());
+	int level = cam == main_camera ? std::min(node->lod_level, num_levels) : 0;
+
+	//threshold to enter level L
+	auto threshold = [&](int L) { return lod_screen_size * pow(0.5f, (float)(L - 1)); };
+
+	while (level < num_levels && screen_size < threshold(level + 1) * (1.0f - lod_hysteresis))
+		level++;
+	while (level > 0 && screen_size > threshold(level) * (1.0f + lod_hysteresis))
+		level--;
+	if (cam == main_camera)
+		node->lod_level = level;
+	return level;
+}
+
+//tests every meshlet of the visible nodes against the frustum and its normal cone, in parallel
+void Renderer::cullMeshlets(Camera* camera)
+{
+	const unsigned int meshlets_per_job = 1024;
+
+	struct sCullJob {
+		sDrawCommand* command;
+		unsigned int first;
+		unsigned int last;
+	};
+	std::vector<sCullJob> jobs;
+	unsigned int total = 0;
+	for (sDrawCommand& command : draw_command_list)
+	{
+		unsigned int num_meshlets = (unsigned int)command.mesh->meshlets.size();
+		command.visible_meshlets.clear();
+		if (!num_meshlets)
+			continue;
+		command.visible_meshlets.resize(num_meshlets);
+		for (unsigned int first = 0; first < num_meshlets; first += meshlets_per_job)
+			jobs.push_back({ &command, first, std::min(first + meshlets_per_job, num_meshlets) });
+		total += num_meshlets;
+	}
+
+	std::atomic<int> culled(0);
+	parallelFor((int)jobs.size(), [&](int i) {
+		sCullJob& job = jobs[i];
+		sDrawCommand& command = *job.command;
+		Matrix44& model = command.model;
+		Vector3f scale = model.getScale();
+		float max_scale = std::max(scale.x, std::max(scale.y, scale.z));
+		//two sided materials show the back faces too
+		bool test_cone = !command.material || !command.material->two_sided;
+		int job_culled = 0;
+		for (unsigned int j = job.first; j < job.last; ++j)
+		{
+			const sMeshlet& meshlet = command.mesh->meshlets[j];
+			Vector3f center = model * meshlet.center;
+			float radius = meshlet.radius * max_scale;
+			bool visible = camera->testSphereInFrustum(center, radius) != CLIP_OUTSIDE;
+			if (visible && test_cone && meshlet.cone_cutoff < 1.0f)
+			{
+				Vector3f axis = model.rotateVector(meshlet.cone_axis);
+				axis.normalize();
+				visible = !isMeshletBackfacing(center, radius, axis, meshlet.cone_cutoff, camera->eye);
+			}
+			command.visible_meshlets[j] = visible;
+			job_culled += !visible;
+		}
+		culled += job_culled;
+	}, total > 8 * meshlets_per_job ? 0 : 1); //not worth waking threads for a few meshlets
+
+	meshlets_culled = culled;
+}
+
+//asks the TextureStreamer for the level every visible draw needs, from the uv units covered by a pixel at the closest point
+void Renderer::requestTextureMips(Camera* camera)
+{
+	GFX::TextureStreamer* streamer = GFX::TextureStreamer::get();
+	Vector2ui size = CORE::getWindowSize();
+	float pixel_size = 2.0f * tan(camera->fov * 0.5f * DEG2RAD) / std::max(1u, size.y); //world units covered by a pixel at distance 1
+
+	for (sDrawCommand& command : draw_command_list)
+	{
+		if (!command.material)
+			continue;
+		float uv_density = command.mesh->getUVDensity();
+		if (uv_density <= 0.0f)
+			continue;
+		Vector3f scale = command.model.getScale();
+		float max_scale = std::max(scale.x, std::max(scale.y, scale.z));
+		float radius = command.mesh->box.halfsize.length() * max_scale;
+		float distance = std::max(camera->near_plane, command.distance_to_camera - radius);
+		float uv_per_pixel = distance * pixel_size / max_scale * uv_density;
+		for (int i = 0; i < SCN::eTextureChannel::ALL; ++i)
+			if (command.material->textures[i].texture)
+				streamer->request(command.material->textures[i].texture, uv_per_pixel);
+	}
+}
+
 void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam) {
 	// HERE =====================
 	// TODO: GENERATE RENDERABLES
@@ -196,6 +303,11 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam) {
 		else if (entity->getType() == eEntityType::LIGHT) {
 			light_list.push_back((LightEntity*)entity);
 		}
+		else if (entity->getType() == eEntityType::IRRADIANCE_VOLUME) {
+			IrradianceVolumeEntity* volume = (IrradianceVolumeEntity*)entity;
+			if (!irradiance_volume && volume->texture && !volume->baking && (int)volume->probes.size() == volume->getNumProbes())
+				irradiance_volume = volume;
+		}
 		
 		if (entity->name == "car1")
 		{
@@ -214,16 +326,98 @@ void Renderer::parseSceneEntities(SCN::Scene* scene, Camera* cam) {
 	}
 }
 
+void Renderer::bakeIrradianceProbes(IrradianceVolumeEntity* volume)
+{
+	Camera* previous_camera = Camera::current;
+	int size = volume->cubemap_size;
+	if (!probe_fbo || probe_fbo->width != size)
+	{
+		delete probe_fbo;
+		probe_fbo = new GFX::FBO();
+		probe_fbo->create(size, size, 1, GL_RGBA, GL_FLOAT, true);
+	}
+
+	int first = volume->baked_probes;
+	int count = std::min(volume->probes_per_frame, volume->getNumProbes() - first);
+	std::vector<FloatImage> faces(count * 6);
+
+	//the faces are rendered with the forward single pass (lights and skybox), without the ambient of the volume
+	bool multipass = use_multipass;
+	use_multipass = false;
+	Camera probe_camera;
+	probe_camera.setPerspective(90.0f, 1.0f, volume->near_distance, volume->far_distance);
+	for (int i = 0; i < count; ++i)
+	{
+		Vector3f position = volume->getProbePosition(first + i);
+		for (int f = 0; f < 6; ++f)
+		{
+			//same axis than computeSH, up is the opposite of the vertical axis of the face
+			probe_camera.lookAt(position, position + cubemapFaceNormals[f][2], cubemapFaceNormals[f][1] * -1.0f);
+			probe_camera.enable();
+			draw_command_list.clear();
+			light_list.clear();
+			parseSceneEntities(scene, &probe_camera);
+
+			probe_fbo->bind();
+			GFX::setGPUState(GFX_STATE_DEFAULT);
+			glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (skybox_cubemap)
+				renderSkybox(skybox_cubemap);
+			for (const sDrawCommand& command : draw_command_list)
+				if (command.material && command.material->alpha_mode != SCN::eAlphaMode::BLEND)
+					renderMeshWithMaterial(command.model, command.mesh, command.material);
+
+			FloatImage& face = faces[i * 6 + f];
+			face.resize(size, size, 3);
+			glReadPixels(0, 0, size, size, GL_RGB, GL_FLOAT, face.data);
+			probe_fbo->unbind();
+
+			//rows come bottom to top and the camera sees the face mirrored, so the first texel of computeSH is the last one read
+			float* first_texel = face.data;
+			float* last_texel = face.data + (size * size - 1) * 3;
+			for (; first_texel < last_texel; first_texel += 3, last_texel -= 3)
+				for (int j = 0; j < 3; ++j)
+					std::swap(first_texel[j], last_texel[j]);
+		}
+	}
+	use_multipass = multipass;
+	previous_camera->enable();
+	draw_command_list.clear();
+	light_list.clear();
+
+	//one probe per thread, the faces are small
+	parallelFor(count, [&](int i) {
+		volume->probes[first + i] = computeSH(&faces[i * 6], false, 1);
+	});
+	volume->baked_probes += count;
+	if (volume->baked_probes == volume->getNumProbes())
+		volume->finishBake();
+}
+
 void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 {
 	this->scene = scene;
+	main_camera = camera;
 	setupScene();
 
+	//a few probes per frame, before the lists are filled for the main camera
+	for (BaseEntity* entity : scene->entities)
+		if (entity->getType() == eEntityType::IRRADIANCE_VOLUME && ((IrradianceVolumeEntity*)entity)->baking)
+			bakeIrradianceProbes((IrradianceVolumeEntity*)entity);
+
 	// Clear previous frame data
 	draw_command_list.clear();
 	light_list.clear();
+	irradiance_volume = nullptr;
+	lod_triangles_saved = 0;
+	meshlets_culled = 0;
 
 	parseSceneEntities(scene, camera);
+	if (use_meshlet_culling)
+		cullMeshlets(camera);
+	if (GFX::TextureStreamer::enabled)
+		requestTextureMips(camera);
 	renderShadowMap(scene); // 3.2.2 ASSIGNMENT 3
 
 	GFX::Shader* quad_texture = GFX::Shader::Get("quad_texture");
@@ -252,63 +446,88 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 	}
 
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	GFX::checkGLErrors();
 
-	renderToGBuffer();
+	if (dynamic_resolution.enabled)
+		render_scale = dynamic_resolution.update();
+
+	//in the first frame with a new window size or scale (not while minimized)
+	Vector2ui window_size = CORE::getWindowSize();
+	int width = std::max(1, (int)(window_size.x * render_scale));
+	int height = std::max(1, (int)(window_size.y * render_scale));
+	if (window_size.x && window_size.y && (gbuffer_fbo->width != width || gbuffer_fbo->height != height))
+		resizeTargets(width, height);
+
+	//at a lower resolution the passes draw the frame in a target that the last one upscales
+	bool upscale = gbuffer_fbo->width != (int)window_size.x || gbuffer_fbo->height != (int)window_size.y;
+	const char* output = upscale ? "scene" : "backbuffer";
+
+	//the passes only declare what they read and write, the graph culls the ones whose result is not shown
+	//and the transient targets not alive at the same time share their textures
+	GFX::RenderGraph* graph = render_graph;
+	graph->clear();
+	graph->importTarget("gbuffer", gbuffer_fbo);
+	graph->importTarget("backbuffer", NULL);
+	graph->setOutput("backbuffer");
+
+	//sizes relative to the gbuffer
+	GFX::RenderGraph::sTargetDesc desc;
+	desc.format = GL_RGBA;
+	graph->createTarget("lighting", desc);
+	desc.format = GL_RGB;
+	graph->createTarget("hdr", desc);
+	graph->createTarget("tonemap", desc);
+	graph->createTarget("motion_blur", desc);
+	desc.scale = ssao_scale;
+	desc.linear = true;
+	graph->createTarget("ssao", desc);
+	desc.scale = 1.0f;
+	desc.format = GL_RGBA;
+	graph->createTarget("scene", desc);
+	desc.linear = false;
+	desc.format = GL_RG; // RG para X,Y velocity
+	desc.type = GL_FLOAT;
+	graph->createTarget("velocity", desc);
+
+	auto toScreen = [&](const char* name, const char* source) {
+		graph->addPass(name, output, { source }, [&, source]() { renderToScreen(graph->getTexture(source), quad_texture); });
+	};
+
+	graph->addPass("gbuffer", "gbuffer", {}, [&]() { renderToGBuffer(); });
 
 	// Mostrar G-buffer si no hay más pasos (debug)
-	// gbuffer_fbo->color_textures[0]->toViewport();
-	renderFBOToScreen(gbuffer_fbo, quad_texture);
+	toScreen("gbuffer_debug", "gbuffer");
 
-	renderMotionVectors();
-	renderFBOToScreen(velocity_fbo, quad_texture);
+	graph->addPass("motion_vectors", "velocity", {}, [&]() { renderMotionVectors(); });
+	toScreen("velocity_debug", "velocity");
 
 	// Render skybox
 	if (skybox_cubemap)
-		renderSkybox(skybox_cubemap);
+		graph->addPass("skybox", output, {}, [&]() { renderSkybox(skybox_cubemap); }).load = true;
 
 	if (use_deferred)
 	{
+		const char* color = nullptr; //lit image the motion blur reads
+
 		if (light_volume)
 		{
-			copyDepthBuffer(gbuffer_fbo, lighting_fbo);
-
-			lighting_fbo->bind();
-			glClear(GL_COLOR_BUFFER_BIT);
-			glDisable(GL_BLEND);
-			glDepthMask(GL_FALSE);
-			glDepthFunc(GL_LEQUAL);
-
-			if (skybox_cubemap)
-				renderSkybox(skybox_cubemap);
-
-			renderDeferredAmbientPass();
-			renderDirectionalLights();
-			renderLightVolumes(camera);
-			lighting_fbo->unbind();
-
-			renderFBOToScreen(lighting_fbo, quad_texture);
-
-			if (use_motion_blur)
-			{
-				motion_blur_fbo->bind();
+			//the volumes test against the depth of the gbuffer, attached to the pass instead of copied
+			graph->addPass("lighting", "lighting", { "gbuffer" }, [&]() {
+				GFX::setGPUState(STATE_QUAD_OVER_DEPTH);
 				glClear(GL_COLOR_BUFFER_BIT);
-				glDisable(GL_BLEND);
-				glDepthMask(GL_FALSE);
-				glDepthFunc(GL_LEQUAL);
-				lighting_fbo->color_textures[0]->toViewport();
 
-				applyMotionBlur();
+				if (skybox_cubemap)
+					renderSkybox(skybox_cubemap);
 
-				motion_blur_fbo->unbind();
-				renderFBOToScreen(motion_blur_fbo, quad_texture);
-			}
+				renderDeferredAmbientPass();
+				renderDirectionalLights();
+				renderLightVolumes(camera);
+			}).depth_from = "gbuffer";
+
+			toScreen("lighting_to_screen", "lighting");
+			color = "lighting";
 		}
 		else if (use_ssao)
 		{
-			copyDepthBuffer(gbuffer_fbo, ssao_fbo);
-
 			if (ssao_kernel_size != last_ssao_kernel_size ||
 				ssao_radius != last_ssao_radius ||
 				use_ssao_plus != last_ssao_plus)
@@ -319,179 +538,139 @@ void Renderer::renderScene(SCN::Scene* scene, Camera* camera)
 				last_ssao_plus = use_ssao_plus;
 			}
 
-			ssao_fbo->bind();
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			glDisable(GL_BLEND);
-			glDepthMask(GL_FALSE);
-			glDepthFunc(GL_LEQUAL);
+			graph->addPass("ssao", "ssao", { "gbuffer" }, [&]() { renderSSAO(Camera::current); });
 
-			if (skybox_cubemap)
-				renderSkybox(skybox_cubemap);
-
-			renderSSAO(Camera::current);
-			ssao_fbo->unbind();
-
-			glDepthMask(GL_TRUE);
-			glDepthFunc(GL_LESS);
-
-			renderFBOToScreen(ssao_fbo, quad_texture);
+			toScreen("ssao_to_screen", "ssao");
 
 			if (ssao_plus_deferred)
 			{
-				glBindFramebuffer(GL_FRAMEBUFFER, 0);
-				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-				glDepthMask(GL_TRUE);
-				glDepthFunc(GL_LESS);
-				glDisable(GL_BLEND);
+				graph->addPass("deferred_lighting", output, { "gbuffer", "ssao" }, [&]() {
+					GFX::setGPUState(STATE_QUAD);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-				if (skybox_cubemap)
-					renderSkybox(skybox_cubemap);
+					if (skybox_cubemap)
+						renderSkybox(skybox_cubemap);
 
-				renderDeferredSinglePass();
+					renderDeferredSinglePass();
+				});
 			}
 		}
 		else if (use_hdr)
 		{
-			copyDepthBuffer(gbuffer_fbo, hdr_fbo);
-
-			hdr_fbo->bind();
-			glClearColor(0, 0, 0, 1);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			glDepthMask(GL_TRUE);
-			glDepthFunc(GL_LESS);
-			glDisable(GL_BLEND);
-
-			renderDeferredSinglePass();
-			hdr_fbo->unbind();
-
-			copyDepthBuffer(hdr_fbo, tonemap_fbo);
-
-			tonemap_fbo->bind();
-			glClear(GL_COLOR_BUFFER_BIT);
-			glDisable(GL_BLEND);
-			glDepthMask(GL_FALSE);
-			glDepthFunc(GL_LEQUAL);
-
-			hdr_fbo->color_textures[0]->toViewport();
-
-			renderToTonemap();
-			tonemap_fbo->unbind();
+			graph->addPass("hdr", "hdr", { "gbuffer" }, [&]() {
+				GFX::setGPUState(STATE_QUAD);
+				glClearColor(0, 0, 0, 1);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-			renderFBOToScreen(tonemap_fbo, quad_texture);
+				renderDeferredSinglePass();
+			});
 
-			if (use_motion_blur)
-			{
-				motion_blur_fbo->bind();
+			graph->addPass("tonemap", "tonemap", { "hdr" }, [&]() {
+				GFX::setGPUState(STATE_NO_DEPTH);
 				glClear(GL_COLOR_BUFFER_BIT);
-				glDisable(GL_BLEND);
-				glDepthMask(GL_FALSE);
-				glDepthFunc(GL_LEQUAL);
-				tonemap_fbo->color_textures[0]->toViewport();
 
-				applyMotionBlur();
+				renderToTonemap();
+			});
 
-				motion_blur_fbo->unbind();
-				renderFBOToScreen(motion_blur_fbo, quad_texture);
-			}
+			toScreen("tonemap_to_screen", "tonemap");
+			color = "tonemap";
 		}
 		else
 		{
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
-			glViewport(0, 0, gbuffer_fbo->width, gbuffer_fbo->height);  
+			graph->addPass("deferred_lighting", output, { "gbuffer" }, [&]() {
+				glViewport(0, 0, gbuffer_fbo->width, gbuffer_fbo->height);
 
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+				GFX::setGPUState(GFX_STATE_DEFAULT);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-			glDepthMask(GL_TRUE);
-			glDepthFunc(GL_LESS);
-
-			glDisable(GL_BLEND);
-			glEnable(GL_CULL_FACE);
-			glCullFace(GL_BACK);
-
-			if (skybox_cubemap)
-				renderSkybox(skybox_cubemap);
+				if (skybox_cubemap)
+					renderSkybox(skybox_cubemap);
 
-			renderDeferredSinglePass();
+				renderDeferredSinglePass();
+			});
+		}
 
+		if (use_motion_blur && color)
+		{
+			graph->addPass("motion_blur", "motion_blur", { color, "velocity", "gbuffer" }, [&, color]() {
+				GFX::setGPUState(STATE_NO_DEPTH);
+				applyMotionBlur(graph->getTexture(color));
+			});
 
+			toScreen("motion_blur_to_screen", "motion_blur");
 		}
 
 		// Blending ON para objetos transparentes
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-		std::vector<sDrawCommand> transparent_commands;
-		std::sort(transparent_commands.begin(), transparent_commands.end(), [](const sDrawCommand& a, const sDrawCommand& b) {
-			return a.distance_to_camera > b.distance_to_camera;
-			});
+		graph->addPass("transparent", output, {}, [&]() {
+			GFX::setGPUState(GFX_STATE_DEFAULT | GFX_STATE_BLEND_ALPHA);
 
-		for (const sDrawCommand& command : transparent_commands)
-			renderMeshWithMaterial(command.model, command.mesh, command.material);
+			std::vector<sDrawCommand> transparent_commands;
+			std::sort(transparent_commands.begin(), transparent_commands.end(), [](const sDrawCommand& a, const sDrawCommand& b) {
+				return a.distance_to_camera > b.distance_to_camera;
+				});
 
-		glDisable(GL_BLEND);
+			for (const sDrawCommand& command : transparent_commands)
+				renderMeshWithMaterial(command.model, command.mesh, command.material, &command.visible_meshlets);
+		}).load = true;
 	}
 	else
 	{
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glDepthMask(GL_TRUE);
-		glDepthFunc(GL_LESS);
-		glDisable(GL_BLEND);
-
-		std::vector<sDrawCommand> opaque_commands;
-		std::vector<sDrawCommand> transparent_commands;
+		graph->addPass("forward", output, {}, [&]() {
+			GFX::setGPUState(GFX_STATE_DEFAULT);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		for (const sDrawCommand& command : draw_command_list)
-		{
-			if (command.material && command.material->alpha_mode == SCN::eAlphaMode::BLEND)
-				transparent_commands.push_back(command);
-			else
-				opaque_commands.push_back(command);
-		}
+			std::vector<sDrawCommand> opaque_commands;
+			std::vector<sDrawCommand> transparent_commands;
 
-		std::sort(opaque_commands.begin(), opaque_commands.end(), [](const sDrawCommand& a, const sDrawCommand& b) {
-			return a.distance_to_camera < b.distance_to_camera;
-			});
-		std::sort(transparent_commands.begin(), transparent_commands.end(), [](const sDrawCommand& a, const sDrawCommand& b) {
-			return a.distance_to_camera > b.distance_to_camera;
-			});
+			for (const sDrawCommand& command : draw_command_list)
+			{
+				if (command.material && command.material->alpha_mode == SCN::eAlphaMode::BLEND)
+					transparent_commands.push_back(command);
+				else
+					opaque_commands.push_back(command);
+			}
 
-		for (const sDrawCommand& command : opaque_commands)
-			renderMeshWithMaterial(command.model, command.mesh, command.material);
+			std::sort(opaque_commands.begin(), opaque_commands.end(), [](const sDrawCommand& a, const sDrawCommand& b) {
+				return a.distance_to_camera < b.distance_to_camera;
+				});
+			std::sort(transparent_commands.begin(), transparent_commands.end(), [](const sDrawCommand& a, const sDrawCommand& b) {
+				return a.distance_to_camera > b.distance_to_camera;
+				});
 
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			for (const sDrawCommand& command : opaque_commands)
+				renderMeshWithMaterial(command.model, command.mesh, command.material, &command.visible_meshlets);
 
-		for (const sDrawCommand& command : transparent_commands)
-			renderMeshWithMaterial(command.model, command.mesh, command.material);
+			GFX::setGPUState(GFX_STATE_DEFAULT | GFX_STATE_BLEND_ALPHA);
 
-		glDisable(GL_BLEND);
+			for (const sDrawCommand& command : transparent_commands)
+				renderMeshWithMaterial(command.model, command.mesh, command.material, &command.visible_meshlets);
+		});
 	}
 
+	if (upscale)
+		graph->addPass("upscale", "backbuffer", { "scene" }, [&]() { renderToScreen(graph->getTexture("scene"), quad_texture); });
+
+	if (graph->compile())
+		graph->execute();
+	GFX::checkGLErrors();
+	GFX::Shader::SavePermutationManifest(); //new permutations are precompiled in the next run
+
 	prev_view_projection = current_view_projection;
 }
 
 
-void Renderer::renderFBOToScreen(GFX::FBO* fbo, GFX::Shader* shader)
+void Renderer::renderToScreen(GFX::Texture* texture, GFX::Shader* shader)
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	GFX::setGPUState(STATE_QUAD);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glDepthMask(GL_TRUE);
-	glDepthFunc(GL_LESS);
-	glDisable(GL_BLEND);
 
 	// Render quad con el shader
 	GFX::Mesh* quad = GFX::Mesh::getQuad();
 
 	shader->enable();
-	shader->setTexture("u_texture", fbo->color_textures[0], 0);
+	shader->setTexture("u_texture", texture, 0);
 	quad->render(GL_TRIANGLES);
 	shader->disable();
-
-	// Restaurar estados para render normal
-	glEnable(GL_DEPTH_TEST);
-	glDepthMask(GL_TRUE);
-	glDepthFunc(GL_LESS);
 }
 
 
@@ -514,16 +693,16 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 {
 	Camera* camera = Camera::current;
 
-	glDisable(GL_BLEND);
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GFX::Shader* shader = GFX::Shader::Get("skybox");
+	if (!shader)
+		return;
+
+	uint64 previous_state = GFX::getGPUState();
+	GFX::setGPUState(STATE_NO_DEPTH);
 
 	if (render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-	GFX::Shader* shader = GFX::Shader::Get("skybox");
-	if (!shader)
-		return;
 	shader->enable();
 
 	// Center the skybox at the camera, with a big sphere
@@ -542,12 +721,21 @@ void Renderer::renderSkybox(GFX::Texture* cubemap)
 
 	shader->disable();
 
-	// Return opengl state to default
+	// Return opengl state to the one of the pass
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	glEnable(GL_DEPTH_TEST);
+	GFX::setGPUState(previous_state);
 }
 
-void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material)
+//draws only the visible meshlets when the command was culled per cluster
+static void renderCulledMesh(GFX::Mesh* mesh, const std::vector<uint8>* visible_meshlets)
+{
+	if (visible_meshlets && visible_meshlets->size())
+		mesh->renderMeshlets(GL_TRIANGLES, *visible_meshlets);
+	else
+		mesh->render(GL_TRIANGLES);
+}
+
+void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<uint8>* visible_meshlets)
 {
 	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
@@ -555,7 +743,6 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 	assert(glGetError() == GL_NO_ERROR);
 
 	Camera* camera = Camera::current;
-	glEnable(GL_DEPTH_TEST);
 
 	if (use_multipass)
 	{
@@ -572,17 +759,13 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 			ambient_shader->setUniform("u_ambient_light", scene->ambient_light);
 			ambient_shader->setUniform("u_alpha_cutoff", material->alpha_cutoff);
 
-			if (material->alpha_mode == SCN::eAlphaMode::BLEND) {
-				glDepthMask(GL_FALSE);
-				glEnable(GL_BLEND);
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			}
-			else {
-				glDepthMask(GL_TRUE);
-				glDisable(GL_BLEND);
-			}
+			uint64 state = GFX::getGPUState() & ~(GFX_STATE_WRITE_Z | GFX_STATE_BLEND_MASK);
+			if (material->alpha_mode == SCN::eAlphaMode::BLEND)
+				GFX::setGPUState(state | GFX_STATE_BLEND_ALPHA);
+			else
+				GFX::setGPUState(state | GFX_STATE_WRITE_Z);
 
-			mesh->render(GL_TRIANGLES);
+			renderCulledMesh(mesh, visible_meshlets);
 			ambient_shader->disable();
 		}
 
@@ -601,10 +784,8 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 				light_shader->setUniform("u_alpha_cutoff", material->alpha_cutoff);
 
 				// Additive blending
-				glEnable(GL_BLEND);
-				glBlendFunc(GL_ONE, GL_ONE);
-				glDepthFunc(GL_EQUAL);
-				glDepthMask(GL_FALSE);
+				uint64 state = GFX::getGPUState();
+				GFX::setGPUState((state & ~(GFX_STATE_WRITE_Z | GFX_STATE_DEPTH_TEST_MASK | GFX_STATE_BLEND_MASK)) | GFX_STATE_DEPTH_TEST_EQUAL | GFX_STATE_BLEND_ADD);
 
 				for (LightEntity* light : light_list)
 				{
@@ -615,14 +796,12 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 					light_shader->setUniform("u_light_dir", light->root.model.frontVector());
 					light_shader->setUniform("u_light_cone", light->cone_info);
 
-					mesh->render(GL_TRIANGLES);
+					renderCulledMesh(mesh, visible_meshlets);
 				}
 
 				light_shader->disable();
 
-				glDepthFunc(GL_LESS);
-				glDepthMask(GL_TRUE);
-				glDisable(GL_BLEND);
+				GFX::setGPUState(state);
 			}
 		}
 
@@ -718,13 +897,12 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN
 			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		renderCulledMesh(mesh, visible_meshlets);
 
 		//disable shader
 		shader->disable();
 
 		//set the render state as it was before to avoid problems with future renders
-		glDisable(GL_BLEND);
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
 	}
@@ -762,24 +940,31 @@ void Renderer::renderShadowMap(SCN::Scene* scene)
 		// Prepara el FBO para solo profundidad
 		shadow_fbos[i]->bind();
 		glViewport(0, 0, 1024, 1024);
-		glClear(GL_DEPTH_BUFFER_BIT);
 
-		// Desactiva color writes
-		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		// Solo profundidad, sin color writes
+		uint64 shadow_state = GFX_STATE_WRITE_Z | GFX_STATE_DEPTH_TEST_LESS | GFX_STATE_FRONT_CCW | GFX_STATE_MSAA;
+		if (front_face_culling)
+			shadow_state |= GFX_STATE_CULL_CCW; // culling reverso para evitar shadow acne
+		GFX::setGPUState(shadow_state);
+		glClear(GL_DEPTH_BUFFER_BIT);
 
-		// Configura profundidad y culling
-		glEnable(GL_DEPTH_TEST);
-		glDepthFunc(GL_LESS);
-		glDepthMask(GL_TRUE);
+		auto useMask = [](const sDrawCommand& command) {
+			return command.material->alpha_mode == SCN::MASK && command.material->textures[SCN::OPACITY].texture;
+		};
 
-		if (front_face_culling)
+		// Sin mascara y en el MegaBuffer: todos en una sola llamada
+		GFX::Shader* mdi_shader = use_multidraw ? GFX::Shader::Get("plain_mdi") : nullptr;
+		if (mdi_shader)
 		{
-			glEnable(GL_CULL_FACE);
-			glFrontFace(GL_CW); // culling reverso para evitar shadow acne
-		}
-		else
-		{
-			glDisable(GL_CULL_FACE);
+			GFX::MegaBuffer* mega_buffer = GFX::MegaBuffer::get();
+			mdi_shader->enable();
+			mdi_shader->setUniform("u_viewprojection", light->view_projection);
+			mdi_shader->setUniform("u_mask", 0);
+			for (const sDrawCommand& command : draw_command_list)
+				if (command.material->alpha_mode != eAlphaMode::BLEND && !useMask(command) && isMultiDrawable(command))
+					mega_buffer->addDraw(command.mesh, command.model);
+			mega_buffer->render(GL_TRIANGLES);
+			mdi_shader->disable();
 		}
 
 		// Dibujar cada comando sin blending
@@ -787,6 +972,8 @@ void Renderer::renderShadowMap(SCN::Scene* scene)
 		{
 			if (command.material->alpha_mode == eAlphaMode::BLEND)
 				continue; // no sombras para objetos transparentes
+			if (mdi_shader && !useMask(command) && isMultiDrawable(command))
+				continue; // ya dibujado
 
 			GFX::Shader* plain_shader = GFX::Shader::Get("plain");
 			plain_shader->enable();
@@ -794,63 +981,115 @@ void Renderer::renderShadowMap(SCN::Scene* scene)
 			plain_shader->setUniform("u_viewprojection", light->view_projection);
 
 			// Soporte para alpha masking
-			bool useMask = (command.material->alpha_mode == SCN::MASK &&
-				command.material->textures[SCN::OPACITY].texture);
+			bool mask = useMask(command);
 
-			plain_shader->setUniform("u_mask", (int)useMask);
+			plain_shader->setUniform("u_mask", (int)mask);
 			plain_shader->setUniform("u_alpha_cutoff", command.material->alpha_cutoff);
 
-			if (useMask)
+			if (mask)
 				plain_shader->setUniform("u_op_map", command.material->textures[SCN::OPACITY].texture, 0);
 
 			command.mesh->render(GL_TRIANGLES);
 			plain_shader->disable();
 		}
 
-		// Restaurar estado de OpenGL
-		glFrontFace(GL_CCW);
-		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 		shadow_fbos[i]->unbind();
 	}
 }
 
 void Renderer::renderToGBuffer()
 {
-	// Bind G-Buffer FBO
-	gbuffer_fbo->bind();
-
 	// Clear all buffers
+	GFX::setGPUState(GFX_STATE_DEFAULT);
 	glClearColor(0, 0, 0, 1);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	// Get GBuffer fill shader
 	GFX::Shader* shader = GFX::Shader::Get("gbuffer_fill");
 
-	shader->enable();
+	// Meshes in the MegaBuffer: grouped by the permutation of their material features, so opaque
+	// materials skip the alpha test, and one multi draw per material inside it (textures are bound per material)
+	GFX::Shader::UberShader* mdi_ubershader = use_multidraw ? GFX::Shader::GetUberShader("@gbuffer_fill_mdi") : nullptr;
+	if (mdi_ubershader)
+	{
+		std::vector<std::pair<uint64, const sDrawCommand*>> batched;
+		for (const sDrawCommand& command : draw_command_list)
+			if (isMultiDrawable(command) && command.material->alpha_mode != SCN::eAlphaMode::BLEND)
+				batched.push_back({ mdi_ubershader->getFeatureKey(command.material->getFeatures()), &command });
+		std::sort(batched.begin(), batched.end(), [](const std::pair<uint64, const sDrawCommand*>& a, const std::pair<uint64, const sDrawCommand*>& b) {
+			return a.first != b.first ? a.first < b.first : a.second->material < b.second->material;
+			});
+
+		GFX::MegaBuffer* mega_buffer = GFX::MegaBuffer::get();
+		GFX::Shader* mdi_enabled = nullptr;
+		for (size_t i = 0; i < batched.size(); )
+		{
+			uint64 key = batched[i].first;
+			SCN::Material* material = batched[i].second->material;
+			size_t end = i;
+			while (end < batched.size() && batched[end].first == key && batched[end].second->material == material)
+				++end;
+
+			GFX::Shader* permutation = mdi_ubershader->getReady(key); //nullptr only if even the base one failed
+			if (permutation)
+			{
+				if (mdi_enabled != permutation)
+				{
+					if (mdi_enabled)
+						mdi_enabled->disable();
+					mdi_enabled = permutation;
+					mdi_enabled->enable();
+					mdi_enabled->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
+				}
+				material->bind(permutation);
+				for (size_t j = i; j < end; ++j)
+					mega_buffer->addDraw(batched[j].second->mesh, batched[j].second->model, &batched[j].second->visible_meshlets);
+				mega_buffer->render(GL_TRIANGLES);
+			}
+			i = end;
+		}
+		if (mdi_enabled)
+			mdi_enabled->disable();
+	}
+
+	// One permutation per combination of material features, the base one while it compiles
+	GFX::Shader::UberShader* ubershader = GFX::Shader::GetUberShader("@gbuffer_fill");
+	GFX::Shader* enabled = nullptr;
 
 	// Render all opaque objects
 	for (const sDrawCommand& command : draw_command_list)
 	{
 		if (command.material && command.material->alpha_mode == SCN::eAlphaMode::BLEND)
 			continue; // Skip transparent objects
+		if (mdi_ubershader && isMultiDrawable(command))
+			continue; // Already in a multi draw
+
+		GFX::Shader* permutation = ubershader ? ubershader->getReady(ubershader->getFeatureKey(command.material->getFeatures())) : nullptr;
+		if (!permutation)
+			permutation = shader;
+		if (enabled != permutation)
+		{
+			enabled = permutation;
+			enabled->enable();
+			enabled->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
+		}
 
 		// Set model matrix
-		shader->setUniform("u_model", command.model);
-		shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
+		enabled->setUniform("u_model", command.model);
 
 		// Bind material properties
-		command.material->bind(shader);
+		command.material->bind(enabled);
 
 		// Render mesh
-		command.mesh->render(GL_TRIANGLES);
+		renderCulledMesh(command.mesh, &command.visible_meshlets);
 	}
 
-	shader->disable();
-	gbuffer_fbo->unbind();
+	if (enabled)
+		enabled->disable();
 }
 
 void Renderer::renderMotionVectors() {
-	velocity_fbo->bind();
+	GFX::setGPUState(GFX_STATE_DEFAULT);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -886,17 +1125,15 @@ void Renderer::renderMotionVectors() {
 		velocity_shader->setUniform("u_prev_mvp", prev_mvp);
 
 		command.material->bind(velocity_shader);
-		command.mesh->render(GL_TRIANGLES);
+		renderCulledMesh(command.mesh, &command.visible_meshlets);
 	}
 
 	velocity_shader->disable();
-	velocity_fbo->unbind();
 }
 
-void Renderer::applyMotionBlur() {
+void Renderer::applyMotionBlur(GFX::Texture* color_texture) {
 	if (!use_motion_blur) return;
 
-	//motion_blur_fbo->bind();
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	GFX::Shader* motion_blur_shader = GFX::Shader::Get("motion_blur");
@@ -905,9 +1142,8 @@ void Renderer::applyMotionBlur() {
 	motion_blur_shader->enable();
 
 	// Bind textures
-	motion_blur_shader->setTexture("u_color_texture",
-		use_hdr ? tonemap_fbo->color_textures[0] : lighting_fbo->color_textures[0], 0);
-	motion_blur_shader->setTexture("u_velocity_texture", velocity_fbo->color_textures[0], 1);
+	motion_blur_shader->setTexture("u_color_texture", color_texture, 0);
+	motion_blur_shader->setTexture("u_velocity_texture", render_graph->getTexture("velocity"), 1);
 	motion_blur_shader->setTexture("u_depth_texture", gbuffer_fbo->depth_texture, 2);
 
 	// Uniforms
@@ -915,15 +1151,13 @@ void Renderer::applyMotionBlur() {
 	motion_blur_shader->setUniform("u_motion_blur_samples", motion_blur_samples);
 	motion_blur_shader->setUniform("u_use_object_motion_blur", use_object_motion_blur);
 
-	Vector2ui size = CORE::getWindowSize();
 	motion_blur_shader->setUniform("u_texel_size",
-		Vector2f(1.0f / size.x, 1.0f / size.y));
+		Vector2f(1.0f / color_texture->width, 1.0f / color_texture->height));
 
 	// Render fullscreen quad
 	GFX::Mesh::getQuad()->render(GL_TRIANGLES);
 
 	motion_blur_shader->disable();
-	//motion_blur_fbo->unbind();
 }
 
 void Renderer::renderDeferredSinglePass()
@@ -995,9 +1229,10 @@ void Renderer::renderDeferredSinglePass()
 	delete[] shadow_mat;
 
 	// Bind SSAO texture if enabled
-	if (ssao_plus_deferred)
+	GFX::Texture* ssao_texture = render_graph->getTexture("ssao");
+	if (ssao_plus_deferred && ssao_texture)
 	{
-		shader->setTexture("u_ssao_map", ssao_fbo->color_textures[0], texture_slots++);
+		shader->setTexture("u_ssao_map", ssao_texture, texture_slots++);
 	}
 	else
 	{
@@ -1197,6 +1432,7 @@ void Renderer::renderDeferredAmbientPass() {
 	GFX::Shader* ambient_shader = GFX::Shader::Get("deferred_ambient");
 	if (!ambient_shader) return;
 
+	GFX::setGPUState(STATE_QUAD_OVER_DEPTH);
 	ambient_shader->enable();
 
 	// Bind GBuffer textures
@@ -1206,6 +1442,13 @@ void Renderer::renderDeferredAmbientPass() {
 
 	// Set uniforms
 	ambient_shader->setUniform("u_ambient_light", scene->ambient_light);
+	ambient_shader->setUniform("u_use_irradiance", irradiance_volume ? 1 : 0);
+	if (irradiance_volume)
+	{
+		ambient_shader->setTexture("u_irradiance_texture", irradiance_volume->texture, 3);
+		ambient_shader->setUniform("u_irradiance_inverse_model", irradiance_volume->getInverseModel());
+		ambient_shader->setUniform("u_irradiance_dims", Vector3f((float)irradiance_volume->dims[0], (float)irradiance_volume->dims[1], (float)irradiance_volume->dims[2]));
+	}
 	ambient_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 	ambient_shader->setUniform("u_camera_position", Camera::current->eye);
 
@@ -1253,15 +1496,16 @@ void Renderer::renderSSAO(Camera* camera)
 	GFX::Mesh* quad = GFX::Mesh::getQuad();
 
 
-	if (!use_ssao || !ssao_shader) return;
+	GFX::Texture* target = render_graph->getTexture("ssao");
+	if (!use_ssao || !ssao_shader || !target) return;
 
-	glViewport(0, 0, ssao_fbo->width, ssao_fbo->height);
+	GFX::setGPUState(STATE_NO_DEPTH);
 	glClearColor(1.0, 1.0, 1.0, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	ssao_shader->enable();
 
-	ssao_shader->setUniform("u_res_inv", Vector2f(1.0f / ssao_fbo->width, 1.0f / ssao_fbo->height));
+	ssao_shader->setUniform("u_res_inv", Vector2f(1.0f / target->width, 1.0f / target->height));
 	ssao_shader->setUniform("u_sample_count", ssao_kernel_size);
 	ssao_shader->setUniform("u_sample_radius", ssao_radius);
 
@@ -1294,12 +1538,10 @@ void Renderer::renderSSAO(Camera* camera)
 	ssao_shader->setUniform("u_far", camera->far_plane);
 
 
-	glDisable(GL_DEPTH_TEST);
+	GFX::setGPUState(STATE_NO_DEPTH);
 	// Draw quad
 	quad->render(GL_TRIANGLES);
 
-	glEnable(GL_DEPTH_TEST);
-
 	ssao_shader->disable();
 
 	delete[] ssao_pos;
@@ -1314,7 +1556,7 @@ void Renderer::renderToTonemap()
 
 	shader->enable();
 	shader->setUniform("u_exposure", exposure);
-	shader->setTexture("u_hdr_texture", hdr_fbo->color_textures[0], 0);
+	shader->setTexture("u_hdr_texture", render_graph->getTexture("hdr"), 0);
 	shader->setUniform("u_apply_gamma", apply_gamma);
 	shader->setUniform("u_tone_operator", tone_operator);
 
@@ -1325,32 +1567,13 @@ void Renderer::renderToTonemap()
 
 }
 
-void Renderer::copyDepthBuffer(GFX::FBO* source, GFX::FBO* dest) {
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, source->fbo_id);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dest->fbo_id);
-	glBlitFramebuffer(0, 0, source->width, source->height,
-		0, 0, dest->width, dest->height,
-		GL_DEPTH_BUFFER_BIT, GL_NEAREST);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-}
-
 void Renderer::setLightVolumeRenderState() {
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE); // Blending aditivo
-	glDepthFunc(GL_GREATER); // Solo renderizar detr�s de la geometr�a
-	glDepthMask(GL_FALSE); // No escribir en depth buffer
-	glCullFace(GL_FRONT); // Renderizar solo back faces (GL_CW)
+	// Blending aditivo, solo detr�s de la geometr�a, sin escribir en depth buffer y solo back faces
+	GFX::setGPUState(STATE_LIGHT_VOLUME);
 }
 
 void Renderer::restoreDefaultRenderState() {
-	glDisable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ZERO);
-
-	glDepthFunc(GL_LESS);
-	glDepthMask(GL_TRUE);
-
-	glCullFace(GL_BACK);
-	glFrontFace(GL_CCW);
+	GFX::setGPUState(GFX_STATE_DEFAULT);
 
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
@@ -1365,6 +1588,73 @@ void Renderer::showUI()
 	ImGui::SliderFloat("Shadow Bias", &shadow_bias, 0.0f, 0.01f);
 	ImGui::Checkbox("Front Face Culling", &front_face_culling);
 
+	ImGui::Checkbox("Use LODs", &use_lods);
+	if (use_lods)
+	{
+		ImGui::Indent();
+		ImGui::SliderFloat("LOD Screen Size", &lod_screen_size, 10.0f, 1000.0f);
+		ImGui::SliderFloat("LOD Hysteresis", &lod_hysteresis, 0.0f, 0.5f);
+		ImGui::Text("LOD triangles saved: %d", lod_triangles_saved);
+		ImGui::Unindent();
+	}
+
+	ImGui::Checkbox("Meshlet Culling", &use_meshlet_culling);
+	ImGui::Checkbox("Multi Draw Indirect", &use_multidraw);
+	ImGui::Checkbox("Use VAOs", &GFX::Mesh::use_vao); //compare CPU/DC in the stats
+	ImGui::Checkbox("Profile CPU/DC", &GFX::Mesh::profile_render);
+
+	GFX::UploadManager* uploads = GFX::UploadManager::get();
+	ImGui::Checkbox("Async Uploads", &GFX::UploadManager::enabled);
+	ImGui::Checkbox("CPU Mipmaps", &GFX::Texture::cpu_mipmaps); //linear space filtering, affects textures loaded after
+	int budget_mb = uploads->frame_budget / (1024 * 1024);
+	if (ImGui::SliderInt("Upload Budget (MB/frame)", &budget_mb, 1, 64))
+		uploads->frame_budget = budget_mb * 1024 * 1024;
+	ImGui::Text("Upload queue: %d (%.1f MB) %.1f MB/s", uploads->getQueueDepth(), uploads->getQueuedBytes() / (1024.0f * 1024.0f), uploads->getMBPerSecond());
+
+	GFX::TextureStreamer* streamer = GFX::TextureStreamer::get();
+	ImGui::Checkbox("Texture Streaming", &GFX::TextureStreamer::enabled);
+	int streaming_budget_mb = (int)(streamer->vram_budget / (1024 * 1024));
+	if (ImGui::SliderInt("Texture Budget (MB)", &streaming_budget_mb, 16, 2048))
+		streamer->vram_budget = (size_t)streaming_budget_mb * 1024 * 1024;
+	ImGui::SliderInt("Mip Bias", &streamer->mip_bias, -2, 4);
+	ImGui::Text("Streamed textures: %d (%.1f MB) loading %d", streamer->getNumTextures(), streamer->getResidentBytes() / (1024.0f * 1024.0f), streamer->getNumLoading());
+	if (use_meshlet_culling)
+		ImGui::Text("Meshlets culled: %d", meshlets_culled);
+
+	if (ImGui::Checkbox("Dynamic Resolution", &dynamic_resolution.enabled))
+	{
+		dynamic_resolution.scale = render_scale; //starts from the current one
+		dynamic_resolution.reset();
+	}
+	ImGui::Indent();
+	if (dynamic_resolution.enabled)
+	{
+		ImGui::SliderFloat("Target GPU Time (ms)", &dynamic_resolution.target_ms, 4.0f, 33.0f);
+		bool bounds_changed = ImGui::SliderFloat("Min Scale", &dynamic_resolution.min_scale, 0.25f, 1.0f);
+		bounds_changed |= ImGui::SliderFloat("Max Scale", &dynamic_resolution.max_scale, 0.25f, 1.0f);
+		if (bounds_changed)
+		{
+			//the one not being dragged follows, and the controller starts again inside the new range
+			if (dynamic_resolution.min_scale > dynamic_resolution.max_scale)
+			{
+				if (ImGui::IsItemActive())
+					dynamic_resolution.min_scale = dynamic_resolution.max_scale;
+				else
+					dynamic_resolution.max_scale = dynamic_resolution.min_scale;
+			}
+			dynamic_resolution.reset();
+		}
+		ImGui::Text("GPU: %.2f ms, headroom %.0f%%", dynamic_resolution.frame_ms, dynamic_resolution.headroom * 100.0f);
+	}
+	else
+		ImGui::SliderFloat("Render Scale", &render_scale, 0.25f, 1.0f);
+	ImGui::Text("Scale: %.2f (%dx%d)", render_scale, gbuffer_fbo->width, gbuffer_fbo->height);
+	ImGui::Unindent();
+
+	GFX::RenderGraph::sStats& graph_stats = render_graph->stats;
+	ImGui::Text("Render graph: %d passes (%d culled), %d targets in %d allocations", graph_stats.num_passes, graph_stats.culled_passes, graph_stats.num_targets, graph_stats.num_allocations);
+	ImGui::Text("Render graph: %.1f MB allocated, %.1f MB saved, %d depth copies removed", graph_stats.allocated_bytes / (1024.0f * 1024.0f), graph_stats.saved_bytes / (1024.0f * 1024.0f), graph_stats.blits_removed);
+
 	// Modos de renderizado: Deferred o Multipass (mutuamente excluyentes)
 	bool deferred_selected = use_deferred;
 	bool multipass_selected = use_multipass;
@@ -1422,6 +1712,13 @@ void Renderer::showUI()
 			ImGui::Checkbox("SSAO+", &use_ssao_plus);
 			ImGui::SliderFloat("SSAO Radius", &ssao_radius, 0.01f, 2.0f);
 			ImGui::SliderInt("SSAO Samples", &ssao_kernel_size, 1, 64);
+			{
+				//a few sizes only, every new one is another target allocated by the render graph
+				const char* ssao_resolutions[] = { "Full", "Half", "Quarter" };
+				int ssao_resolution = ssao_scale > 0.75f ? 0 : (ssao_scale > 0.375f ? 1 : 2);
+				if (ImGui::Combo("SSAO Resolution", &ssao_resolution, ssao_resolutions, IM_ARRAYSIZE(ssao_resolutions)))
+					ssao_scale = 1.0f / (1 << ssao_resolution);
+			}
 
 			if (use_ssao_plus)
 			{
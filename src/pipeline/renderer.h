@@ -4,6 +4,7 @@
 #include "camera.h"
 #define M_PI 3.14159265358979323846
 #include "light.h"
+#include "dynamicresolution.h"
 
 //forward declarations
 class Camera;
@@ -12,12 +13,14 @@ namespace GFX {
 	class Shader;
 	class Mesh;
 	class FBO;
+	class RenderGraph;
 }
 
 namespace SCN {
 
 	class Prefab;
 	class Material;
+	class IrradianceVolumeEntity;
 
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
@@ -30,16 +33,20 @@ namespace SCN {
 
 		GFX::Texture* shadow_map = nullptr;
 		GFX::FBO* shadow_fbo = nullptr;
-		GFX::FBO* lighting_fbo = nullptr;
 
 		GFX::FBO* gbuffer_fbo = nullptr;
 		bool use_deferred = false;
 
-		GFX::FBO* hdr_fbo = nullptr;
+		//internal resolution of the frame, the gbuffer and the targets of the graph, upscaled to the window
+		float render_scale = 1.0f;
+		DynamicResolution dynamic_resolution; //sets render_scale from the GPU frame time
+
+		//passes of the frame and their transient targets (lighting, ssao, hdr, tonemap, velocity, motion blur)
+		GFX::RenderGraph* render_graph = nullptr;
 
 		std::vector<GFX::FBO*> shadow_fbos;
 
-		GFX::Texture* skybox_cubemap;
+		GFX::Texture* skybox_cubemap; //holds a reference in Texture::sTexturesLoaded
 
 		SCN::Scene* scene;
 
@@ -75,11 +82,11 @@ namespace SCN {
 
 
 		// In Renderer.h
-		GFX::FBO* ssao_fbo;
 		GFX::FBO* ssao_blur_fbo;
 		std::vector<vec3> ssao_samples;
 		//GLuint ssao_noise_texture;
 		float ssao_radius = 0.5f;
+		float ssao_scale = 0.5f; //of the gbuffer resolution (1, 1/2 or 1/4), upscaled when read
 		int ssao_kernel_size = 32;
 		bool use_ssao = false;
 		bool use_hdr = false;
@@ -100,12 +107,31 @@ namespace SCN {
 
 		float ambient_intensity = 0.3f;
 
+		//levels of detail
+		bool use_lods = true;
+		float lod_screen_size = 200.0f; //projected size where level 1 starts, every level halves it
+		float lod_hysteresis = 0.15f; //margin to avoid popping back and forth
+		int lod_triangles_saved = 0;
+		Camera* main_camera = nullptr; //the only one that keeps the levels between frames (the probes choose without hysteresis)
+
+		//meshlet culling
+		bool use_meshlet_culling = true;
+		int meshlets_culled = 0;
+
+		//meshes in the MegaBuffer drawn with glMultiDrawElementsIndirect (gbuffer and shadows)
+		bool use_multidraw = true;
+
+		//irradiance volume sampled by the deferred ambient pass (the first visible one baked)
+		IrradianceVolumeEntity* irradiance_volume = nullptr;
+		GFX::FBO* probe_fbo = nullptr; //faces of the probes being baked
+
 
 		//updated every frame
 		Renderer(const char* shaders_atlas_filename );
 
 		//just to be sure we have everything ready for the rendering
 		void setupScene();
+		void resizeTargets(int width, int height);
 
 		//add here your functions
 		//...
@@ -113,7 +139,11 @@ namespace SCN {
 		void setupLight(SCN::LightEntity* light); // 3.2.1 ASSIGNMENT 3
 		void renderShadowMap(SCN::Scene* scene); // 3.2.2 ASSIGNMENT 3
 		void parseNodes(SCN::Node* node, Camera* cam, BaseEntity* entity);
+		int selectLOD(SCN::Node* node, Camera* cam, const BoundingBox& world_bounding);
+		void cullMeshlets(Camera* camera);
+		void requestTextureMips(Camera* camera);
 		void parseSceneEntities(SCN::Scene* scene, Camera* camera);
+		void bakeIrradianceProbes(IrradianceVolumeEntity* volume); //the next probes_per_frame probes of the volume
 
 		//renders several elements of the scene
 		void renderScene(SCN::Scene* scene, Camera* camera);
@@ -122,14 +152,11 @@ namespace SCN {
 		void renderSkybox(GFX::Texture* cubemap);
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material);
+		void renderMeshWithMaterial(const Matrix44 model, GFX::Mesh* mesh, SCN::Material* material, const std::vector<uint8>* visible_meshlets = nullptr);
 		void renderToGBuffer();
 		void renderDeferredSinglePass();
 		void renderDirectionalLights();
 
-		void copyDepthBuffer(GFX::FBO* source, GFX::FBO* dest);
-
-
 		void restoreDefaultRenderState();
 
 		void setLightVolumeRenderState();
@@ -146,10 +173,10 @@ namespace SCN {
 		
 		void renderMotionVectors();
 
-		void renderFBOToScreen(GFX::FBO* fbo, GFX::Shader* shader);
+		void renderToScreen(GFX::Texture* texture, GFX::Shader* shader);
 
 
-		void applyMotionBlur();
+		void applyMotionBlur(GFX::Texture* color_texture);
 
 
 
@@ -269,6 +269,20 @@ SCN::PrefabEntity::PrefabEntity()
 	prefab = NULL;
 }
 
+SCN::PrefabEntity::~PrefabEntity()
+{
+	SCN::Prefab::sPrefabsLoaded.release(prefab);
+}
+
+void SCN::PrefabEntity::operator = (const PrefabEntity& entity)
+{
+	BaseEntity::operator = (entity);
+	filename = entity.filename;
+	SCN::Prefab::sPrefabsLoaded.addRef(entity.prefab);
+	SCN::Prefab::sPrefabsLoaded.release(prefab);
+	prefab = entity.prefab;
+}
+
 void SCN::PrefabEntity::configure(cJSON* json)
 {
 	if (cJSON_GetObjectItem(json, "filename"))
@@ -287,7 +301,10 @@ void SCN::PrefabEntity::loadPrefab(const char* filename)
 {
 	assert(scene && "Cannot assign filename without scene (to extract base folder)");
 	std::string fullpath = scene->base_folder + "/" + filename;
-	prefab = SCN::Prefab::Get(fullpath.c_str());
+	SCN::Prefab* new_prefab = SCN::Prefab::Get(fullpath.c_str());
+	SCN::Prefab::sPrefabsLoaded.addRef(new_prefab);
+	SCN::Prefab::sPrefabsLoaded.release(prefab);
+	prefab = new_prefab;
 	if (!prefab)
 		return;
 	
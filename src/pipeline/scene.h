@@ -95,9 +95,11 @@ namespace SCN {
 	{
 	public:
 		std::string filename;
-		Prefab* prefab;
+		Prefab* prefab; //referenced while the entity uses it
 		
 		PrefabEntity();
+		~PrefabEntity();
+		void operator = (const PrefabEntity& entity); //clones keep their own reference to the prefab
 
 		ENTITY_METHODS(PrefabEntity, PREFAB, 11,0);
 
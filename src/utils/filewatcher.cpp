@@ -0,0 +1,136 @@
+#include "filewatcher.h"
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <filesystem>
+
+#include "utils.h"
+
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#include <unistd.h>
+
+//folder and name, the folder of "file.txt" is "."
+static void splitPath(const std::string& filename, std::string& folder, std::string& name)
+{
+	size_t pos = filename.find_last_of('/');
+	folder = pos == std::string::npos ? "." : (pos == 0 ? "/" : filename.substr(0, pos));
+	name = pos == std::string::npos ? filename : filename.substr(pos + 1);
+}
+#endif
+
+static long getModificationTime(const std::string& filename)
+{
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0)
+		return 0;
+	return (long)info.st_mtime;
+}
+
+//ms since the last write, st_mtime only has seconds
+static long getModificationAge(const std::string& filename)
+{
+	std::error_code error;
+	std::filesystem::file_time_type time = std::filesystem::last_write_time(filename, error);
+	if (error)
+		return 0;
+	long age = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::filesystem::file_time_type::clock::now() - time).count();
+	return std::max(age, 0L);
+}
+
+FileWatcher::FileWatcher()
+{
+	last_poll = 0;
+	latency = 0;
+#ifdef __linux__
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+FileWatcher::~FileWatcher()
+{
+#ifdef __linux__
+	if (inotify_fd != -1)
+		close(inotify_fd);
+#endif
+}
+
+void FileWatcher::add(const std::string& filename)
+{
+	std::string path = cleanPath(filename);
+	if (files.find(path) != files.end())
+		return;
+	files[path] = getModificationTime(path);
+
+#ifdef __linux__
+	std::string folder, name;
+	splitPath(path, folder, name);
+	if (inotify_fd == -1)
+		return;
+	for (auto& it : folders)
+		if (it.second == folder)
+			return;
+	int wd = inotify_add_watch(inotify_fd, folder.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if (wd != -1)
+		folders[wd] = folder;
+#endif
+}
+
+void FileWatcher::clear()
+{
+	files.clear();
+#ifdef __linux__
+	for (auto& it : folders)
+		inotify_rm_watch(inotify_fd, it.first);
+	folders.clear();
+#endif
+}
+
+bool FileWatcher::poll(std::vector<std::string>& changed)
+{
+	changed.clear();
+	latency = 0;
+
+#ifdef __linux__
+	if (inotify_fd != -1)
+	{
+		//every read returns whole events, several per buffer
+		char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t size;
+		while ((size = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+		{
+			for (char* ptr = buffer; ptr < buffer + size; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+			{
+				struct inotify_event* event = (struct inotify_event*)ptr;
+				auto folder = folders.find(event->wd);
+				if (!event->len || folder == folders.end())
+					continue;
+				std::string path = folder->second == "." ? event->name : (folder->second == "/" ? "/" : folder->second + "/") + event->name;
+				if (files.find(path) != files.end() && std::find(changed.begin(), changed.end(), path) == changed.end())
+					changed.push_back(path);
+			}
+		}
+		for (std::string& path : changed)
+			files[path] = getModificationTime(path);
+		return !changed.empty(); //notified right away, latency stays 0
+	}
+#endif
+
+	//without notifications, the stat of every file every half second
+	long now = getTime();
+	if (now - last_poll < 500)
+		return false;
+	long since_last_poll = now - last_poll;
+	last_poll = now;
+	for (auto& it : files)
+	{
+		long time = getModificationTime(it.first);
+		if (time == it.second)
+			continue;
+		it.second = time;
+		changed.push_back(it.first);
+		//written after the previous poll, an older time is a copied file that kept it
+		latency = std::max(latency, std::min(getModificationAge(it.first), since_last_poll));
+	}
+	return !changed.empty();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+//Tells which files changed since the last poll, without blocking. In Linux it uses inotify on the folders of the
+//files (editors usually save writing a new file and renaming it, so watching the file itself is not enough),
+//in other systems it compares the modification time of every file a couple of times per second.
+class FileWatcher {
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	void add(const std::string& filename);
+	void clear();
+	bool poll(std::vector<std::string>& changed); //true if any file changed
+	long getLatency() { return latency; } //ms from the last write of the changed files to the poll that found them
+
+private:
+	std::map<std::string, long> files; //filename and modification time
+	long last_poll;
+	long latency;
+#ifdef __linux__
+	int inotify_fd;
+	std::map<int, std::string> folders; //watch descriptor and folder
+#endif
+};
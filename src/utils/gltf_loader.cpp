@@ -10,8 +10,10 @@
 #include "../pipeline/material.h"
 #include "../pipeline/prefab.h"
 #include "../utils/utils.h"
+#include "../core/task.h"
 
 #include <iostream>
+#include <algorithm>
 
 //** PARSING GLTF IS UGLY
 std::string base_folder;
@@ -36,6 +38,7 @@ void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* ac
 	int num_elements = acc->count;
 	std::vector<Vector4f> unindexed;
 	unindexed.resize(num_elements);
+	size_t acc_stride = acc->stride; //accessors can be shared between primitives parsed in parallel, do not modify them
 
 	std::vector<float> values;
 
@@ -81,12 +84,12 @@ void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* ac
 		else
 			return;
 
-		acc->stride = sizeof(Vector4f);
+		acc_stride = sizeof(Vector4f);
 		data = (unsigned char*)&values[0];
 	}
 
 	//assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec4);
-	if (acc->stride == sizeof(Vector4f))
+	if (acc_stride == sizeof(Vector4f))
 		memcpy(&unindexed[0], data, num_elements * sizeof(Vector4f));
 	else
 	{
@@ -94,7 +97,7 @@ void parseGLTFBufferVector4(std::vector<Vector4f>& container, cgltf_accessor* ac
 		for (int i = 0; i < num_elements; ++i)
 		{
 			memcpy(&unindexed[i], data, sizeof(Vector4f));
-			data += acc->stride;
+			data += acc_stride;
 		}
 	}
 
@@ -258,8 +261,88 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
+//results of the parallel import (see prepareGLTFResources), only valid while loading a file
+std::map<cgltf_mesh*, std::vector<GFX::Mesh*>> gltf_parsed_meshes;
+std::map<std::pair<cgltf_image*, eTextureUsage>, GFX::Texture*> gltf_decoded_textures;
+
+//of the embedded bytes and the usage, as the mips (and the compression) of the texture depend on it
+uint64 hashGLTFImage(cgltf_image* image, eTextureUsage usage)
+{
+	uint64 hashes[2] = { hashData((char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size), (uint64)usage };
+	return hashData(hashes, sizeof(hashes));
+}
+
+std::string getGLTFSubmeshName(cgltf_mesh* meshdata, const char* basename, size_t index)
+{
+	return std::string(basename) + std::string("::") + std::string(meshdata->name) + std::string("::") + std::to_string(index);
+}
+
+//fills the CPU streams of the mesh, no GL calls here so it can be called from a worker thread
+void parseGLTFPrimitive(cgltf_primitive* primitive, GFX::Mesh* mesh)
+{
+	//streams
+	for (size_t j = 0; j < primitive->attributes_count; ++j)
+	{
+		cgltf_attribute* attr = &primitive->attributes[j];
+
+		//std::string attrname = attr->name;
+		if (attr->type == cgltf_attribute_type_position)
+		{
+			parseGLTFBufferVector3(mesh->vertices, attr->data);
+			if (attr->data->has_min && attr->data->has_max)
+			{
+				mesh->aabb_min = attr->data->min;
+				mesh->aabb_max = attr->data->max;
+				mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+				mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+			}
+			else
+				mesh->updateBoundingBox();
+		}
+		else
+		if (attr->type == cgltf_attribute_type_normal)
+			parseGLTFBufferVector3(mesh->normals, attr->data);
+		else
+		if (attr->type == cgltf_attribute_type_texcoord)
+		{
+			if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
+				parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
+			else
+				parseGLTFBufferVector2(mesh->uvs, attr->data);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_color)
+		{
+			parseGLTFBufferVector4(mesh->colors, attr->data);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_weights)
+		{
+			parseGLTFBufferVector4(mesh->weights, attr->data);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_joints)
+		{
+			//parseGLTFBufferVector4(mesh->bones, attr->data);
+		}
+	}
+
+	if (primitive->indices && primitive->indices->count)
+		parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+
+	if (GFX::Mesh::generate_lods)
+		mesh->generateLODs();
+	if (GFX::Mesh::build_meshlets)
+		mesh->buildMeshlets();
+}
+
 std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 {
+	//already converted and uploaded by the parallel import
+	auto it = gltf_parsed_meshes.find(meshdata);
+	if (it != gltf_parsed_meshes.end())
+		return it->second;
+
 	std::vector<GFX::Mesh*> result;
 
 	//if (meshdata->name)
@@ -274,7 +357,7 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 		std::string submesh_name;
 		if (meshdata->name)
 		{
-			submesh_name = std::string(basename) + std::string("::") + std::string(meshdata->name) + std::string("::") + std::to_string(i);
+			submesh_name = getGLTFSubmeshName(meshdata, basename, i);
 			mesh = GFX::Mesh::Get(submesh_name.c_str(), true);
 			if (mesh)
 			{
@@ -284,57 +367,8 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 		}
 
 		mesh = new GFX::Mesh();
-
-        //streams
-		for (size_t j = 0; j < primitive->attributes_count; ++j)
-		{
-			cgltf_attribute* attr = &primitive->attributes[j];
-
-            //std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
-			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
-			}
-			else
-			if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else
-			if (attr->type == cgltf_attribute_type_texcoord)
-			{
-				if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
-					parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
-			}
-			else
-			if (attr->type == cgltf_attribute_type_color)
-			{
-				parseGLTFBufferVector4(mesh->colors, attr->data);
-			}
-			else
-			if (attr->type == cgltf_attribute_type_weights)
-			{
-				parseGLTFBufferVector4(mesh->weights, attr->data);
-			}
-			else
-			if (attr->type == cgltf_attribute_type_joints)
-			{
-				//parseGLTFBufferVector4(mesh->bones, attr->data);
-			}
-
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
-		}
-		mesh->uploadToVRAM();
+		parseGLTFPrimitive(primitive, mesh);
+		mesh->uploadToVRAM(GFX::Mesh::use_packed_vertices);
 		if (meshdata->name)
 			mesh->registerMesh(submesh_name);
 		result.push_back(mesh);
@@ -345,23 +379,42 @@ std::vector<GFX::Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename
 
 int GLTF_TEXTURE_LAST_ID = 1;
 
-GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+//decodes an image embedded in the glb, no GL calls here so it can be called from a worker thread
+bool decodeGLTFImage(cgltf_image* image, Image& img)
+{
+	if (!image->buffer_view || !image->mime_type)
+		return false;
+
+	std::vector<unsigned char> buffer;
+	buffer.resize(image->buffer_view->size);
+	memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
+
+	if (!strcmp(image->mime_type, "image/png"))
+		img.loadPNG(buffer);
+	else if (!strcmp(image->mime_type, "image/jpeg"))
+		img.loadJPG(buffer);
+	else
+		return false;
+	return img.width != 0;
+}
+
+GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename, eTextureUsage usage = TEXTURE_USAGE_NONE)
 {
 	if (!load_textures || !image )
 		return NULL;
 
+	//already decoded and uploaded by the parallel import
+	auto it = gltf_decoded_textures.find(std::make_pair(image, usage));
+	if (it != gltf_decoded_textures.end())
+		return it->second;
+
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return GFX::Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str());
+		return GFX::Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str(), true, true, usage);
 	else
 	if (filename)
-	{
 		fullpath = std::string(base_folder) + "/" + filename;
-		GFX::Texture* tex = GFX::Texture::Find(fullpath.c_str());
-		if (tex)
-			return tex;
-	}
 	else
 	{
 		std::stringstream ss;
@@ -371,27 +424,26 @@ GFX::Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 
 	if (image->buffer_view)
 	{
-		Image img;
-		std::vector<unsigned char> buffer;
-		buffer.resize(image->buffer_view->size);
-		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
-
-		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
-		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
-		else
+		//same bytes embedded in another file, or in this one and used the same way
+		uint64 hash = hashGLTFImage(image, usage);
+		GFX::Texture* tex = GFX::Texture::sTexturesLoaded.findByHash(hash);
+		if (tex)
 		{
-			stdlog(std::string("image format not supported: ") + image->mime_type);
-			return NULL;
+			if (filename)
+				GFX::Texture::sTexturesLoaded.add(fullpath, tex);
+			return tex;
 		}
-		if (!img.width)
+
+		Image img;
+		if (!decodeGLTFImage(image, img))
 		{
-			stdlog(std::string("image encoding has error: ") + image->mime_type);
+			stdlog(std::string("image format not supported or encoding has error: ") + (image->mime_type ? image->mime_type : ""));
 			return NULL;
 		}
-		GFX::Texture* tex = new GFX::Texture();
-		tex->loadFromImage(&img);
+		tex = new GFX::Texture();
+		tex->loadFromImage(&img, true, true, GL_UNSIGNED_BYTE, NULL, usage);
+		GFX::Texture::sTexturesLoaded.add("", tex, hash);
+		GFX::Texture::sTexturesLoaded.setBytes(tex, tex->getVRAMBytes());
 		if (filename)
 		{
 			tex->setName(fullpath.c_str());
@@ -430,25 +482,19 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 
 	//normalmap
 	if (matdata->normal_texture.texture)
-	{
-		material->textures[SCN::eTextureChannel::NORMALMAP].texture = parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name);
-		material->textures[SCN::eTextureChannel::NORMALMAP].uv_channel = matdata->normal_texture.texcoord;
-	}
+		material->setTexture(SCN::eTextureChannel::NORMALMAP, parseGLTFTexture( matdata->normal_texture.texture->image, matdata->normal_texture.texture->name, TEXTURE_USAGE_NORMAL), matdata->normal_texture.texcoord);
 
 	//emissive
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
-	{
-		material->textures[SCN::eTextureChannel::EMISSIVE].texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
-		material->textures[SCN::eTextureChannel::EMISSIVE].uv_channel = matdata->emissive_texture.texcoord;
-	}
+		material->setTexture(SCN::eTextureChannel::EMISSIVE, parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name, TEXTURE_USAGE_COLOR), matdata->emissive_texture.texcoord);
 
 
 	//pbr
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
+			material->setTexture(SCN::eTextureChannel::ALBEDO, parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name, TEXTURE_USAGE_COLOR));
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -459,23 +505,14 @@ SCN::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 		if (load_textures)
 		{
 			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
-			{
-				material->textures[SCN::eTextureChannel::ALBEDO].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
-				material->textures[SCN::eTextureChannel::ALBEDO].uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
-			}
+				material->setTexture(SCN::eTextureChannel::ALBEDO, parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name, TEXTURE_USAGE_COLOR), matdata->pbr_metallic_roughness.base_color_texture.texcoord);
 			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
-			{
-				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].texture = parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name);
-				material->textures[SCN::eTextureChannel::METALLIC_ROUGHNESS].uv_channel = matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord;
-			}
+				material->setTexture(SCN::eTextureChannel::METALLIC_ROUGHNESS, parseGLTFTexture(matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->image, matdata->pbr_metallic_roughness.metallic_roughness_texture.texture->name, TEXTURE_USAGE_DATA), matdata->pbr_metallic_roughness.metallic_roughness_texture.texcoord);
 		}
 	}
 
 	if (matdata->occlusion_texture.texture)
-	{
-		material->textures[SCN::eTextureChannel::OCCLUSION].texture = parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name);
-		material->textures[SCN::eTextureChannel::OCCLUSION].uv_channel = matdata->occlusion_texture.texcoord;
-	}
+		material->setTexture(SCN::eTextureChannel::OCCLUSION, parseGLTFTexture(matdata->occlusion_texture.texture->image, matdata->occlusion_texture.texture->name, TEXTURE_USAGE_DATA), matdata->occlusion_texture.texcoord);
 
 	return material;
 }
@@ -525,16 +562,16 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 			for (size_t i = 0; i < node->mesh->primitives_count; ++i)
 			{
 				SCN::Node* subnode = new SCN::Node();
-				subnode->mesh = meshes[i];
+				subnode->setMesh(meshes[i]);
 				if (node->mesh->primitives[i].material)
-					subnode->material = parseGLTFMaterial(node->mesh->primitives[i].material, basename );
+					subnode->setMaterial(parseGLTFMaterial(node->mesh->primitives[i].material, basename ));
 				scenenode->addChild(subnode);
 			}
 		}
 		else //single primitive
 		{
 			if (node->mesh->name)
-				scenenode->mesh = GFX::Mesh::Get(node->mesh->name, true);
+				scenenode->setMesh(GFX::Mesh::Get(node->mesh->name, true));
 
 			if (!scenenode->mesh)
 			{
@@ -543,11 +580,11 @@ SCN::Node* parseGLTFNode(cgltf_node* node, SCN::Node* scenenode = NULL, const ch
 				//printf("Parsed GLTF mesh %s (success)\n", node->name);
 				//return nullptr;
 				if(meshes.size())
-					scenenode->mesh = meshes[0];
+					scenenode->setMesh(meshes[0]);
 			}
 
 			if (node->mesh->primitives->material)
-				scenenode->material = parseGLTFMaterial(node->mesh->primitives->material, basename );
+				scenenode->setMaterial(parseGLTFMaterial(node->mesh->primitives->material, basename ));
 		}
 	}
 
@@ -585,8 +622,177 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 	return cgltf_result_success;
 }
 
+void collectGLTFMeshes(cgltf_node* node, std::vector<cgltf_mesh*>& meshes)
+{
+	if (node->mesh && std::find(meshes.begin(), meshes.end(), node->mesh) == meshes.end())
+		meshes.push_back(node->mesh);
+	for (size_t i = 0; i < node->children_count; ++i)
+		collectGLTFMeshes(node->children[i], meshes);
+}
+
+//how the first material using the image samples it, in the order of parseGLTFMaterial
+eTextureUsage getGLTFImageUsage(cgltf_data* data, cgltf_image* image)
+{
+	auto uses = [image](cgltf_texture_view& view) { return view.texture && view.texture->image == image; };
+	for (size_t i = 0; i < data->materials_count; ++i)
+	{
+		cgltf_material& material = data->materials[i];
+		if (uses(material.normal_texture))
+			return TEXTURE_USAGE_NORMAL;
+		if (uses(material.occlusion_texture) || (material.has_pbr_metallic_roughness && uses(material.pbr_metallic_roughness.metallic_roughness_texture)))
+			return TEXTURE_USAGE_DATA;
+		if (uses(material.emissive_texture) || (material.has_pbr_metallic_roughness && uses(material.pbr_metallic_roughness.base_color_texture)) || (material.has_pbr_specular_glossiness && uses(material.pbr_specular_glossiness.diffuse_texture)))
+			return TEXTURE_USAGE_COLOR;
+	}
+	return TEXTURE_USAGE_NONE;
+}
+
+//PARALLEL IMPORT: converts accessors and decodes embedded images of the scene in worker threads,
+//then creates all the GL objects from the main thread in one batch.
+//Nodes are built afterwards in the usual order and just fetch the results, so the hierarchy is the same as a serial load
+void prepareGLTFResources(cgltf_data* data, cgltf_scene* scene, const char* basename)
+{
+	struct sPrimitiveJob {
+		cgltf_primitive* primitive;
+		GFX::Mesh* mesh;
+		std::string name;
+	};
+	struct sImageJob {
+		cgltf_image* image;
+		eTextureUsage usage; //for the mipmaps
+		Image img;
+		bool decoded;
+		uint64 hash; //of the encoded bytes and the usage
+		GFX::Texture* texture; //already loaded with the same bytes, no need to decode it
+		int same_as; //previous job with the same bytes, -1 if none
+	};
+
+	double time = getTime();
+
+	//main thread: the registry is not thread safe
+	std::vector<cgltf_mesh*> meshes;
+	for (size_t i = 0; i < scene->nodes_count; ++i)
+		collectGLTFMeshes(scene->nodes[i], meshes);
+
+	std::vector<sPrimitiveJob> primitive_jobs;
+	for (cgltf_mesh* meshdata : meshes)
+	{
+		std::vector<GFX::Mesh*>& result = gltf_parsed_meshes[meshdata];
+		for (size_t i = 0; i < meshdata->primitives_count; ++i)
+		{
+			std::string submesh_name;
+			if (meshdata->name)
+			{
+				submesh_name = getGLTFSubmeshName(meshdata, basename, i);
+				GFX::Mesh* mesh = GFX::Mesh::Get(submesh_name.c_str(), true);
+				if (mesh)
+				{
+					result.push_back(mesh);
+					continue;
+				}
+			}
+			GFX::Mesh* mesh = new GFX::Mesh();
+			result.push_back(mesh);
+			primitive_jobs.push_back({ &meshdata->primitives[i], mesh, submesh_name });
+		}
+	}
+
+	std::vector<sImageJob> image_jobs(load_textures ? data->images_count : 0);
+	std::map<uint64, size_t> first_job_by_hash; //images repeated inside this file
+	for (size_t i = 0; i < image_jobs.size(); ++i)
+	{
+		sImageJob& job = image_jobs[i];
+		job.image = &data->images[i];
+		job.usage = getGLTFImageUsage(data, job.image);
+		job.decoded = false;
+		job.hash = 0;
+		job.texture = NULL;
+		job.same_as = -1;
+		if (job.image->uri || !job.image->buffer_view)
+			continue;
+		//identical payloads (the same image embedded in several glbs) are decoded once per usage
+		job.hash = hashGLTFImage(job.image, job.usage);
+		job.texture = GFX::Texture::sTexturesLoaded.findByHash(job.hash);
+		auto first = first_job_by_hash.insert(std::make_pair(job.hash, i));
+		if (!job.texture && !first.second)
+			job.same_as = (int)first.first->second;
+	}
+
+	//workers: images first as they are the slowest jobs
+	int num_images = (int)image_jobs.size();
+	parallelFor(num_images + (int)primitive_jobs.size(), [&](int i) {
+		if (i < num_images)
+		{
+			sImageJob& job = image_jobs[i];
+			if (!job.image->uri && !job.texture && job.same_as == -1)
+				job.decoded = decodeGLTFImage(job.image, job.img);
+		}
+		else
+		{
+			sPrimitiveJob& job = primitive_jobs[i - num_images];
+			parseGLTFPrimitive(job.primitive, job.mesh);
+		}
+	});
+
+	//main thread: upload everything
+	for (sPrimitiveJob& job : primitive_jobs)
+	{
+		job.mesh->uploadToVRAM(GFX::Mesh::use_packed_vertices);
+		if (job.name.size())
+			job.mesh->registerMesh(job.name);
+	}
+
+	for (sImageJob& job : image_jobs)
+	{
+		if (job.image->uri)
+			continue; //external files go through Texture::GetAsync
+		//name it after the first texture using it
+		const char* texname = NULL;
+		for (size_t j = 0; j < data->textures_count && !texname; ++j)
+			if (data->textures[j].image == job.image)
+				texname = data->textures[j].name;
+		std::string fullpath = texname ? std::string(base_folder) + "/" + texname : "";
+
+		//same bytes as a texture already loaded or as a previous image of this file
+		GFX::Texture* tex = job.texture;
+		if (!tex && job.same_as != -1)
+			tex = gltf_decoded_textures[std::make_pair(image_jobs[job.same_as].image, job.usage)];
+		if (tex)
+		{
+			if (texname) //another name for the same texture
+				GFX::Texture::sTexturesLoaded.add(fullpath, tex);
+		}
+		else if (job.decoded)
+		{
+			tex = new GFX::Texture();
+			tex->loadFromImage(&job.img, true, true, GL_UNSIGNED_BYTE, NULL, job.usage);
+			GFX::Texture::sTexturesLoaded.add("", tex, job.hash);
+			if (texname)
+				tex->setName(fullpath.c_str());
+			else
+				GFX::Texture::sTexturesLoaded.setBytes(tex, tex->getVRAMBytes());
+		}
+		else
+			stdlog(std::string("image format not supported or encoding has error: ") + (job.image->mime_type ? job.image->mime_type : ""));
+		job.img.clear();
+		gltf_decoded_textures[std::make_pair(job.image, job.usage)] = tex; //other usages of the image are decoded by parseGLTFTexture
+	}
+
+	std::cout << " + GLTF resources: " << primitive_jobs.size() << " primitives, " << num_images << " images. Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+}
+
+//the caches are keyed by the cgltf data of one load, emptied on every return so the next load does not find them
+struct sGLTFCacheGuard {
+	~sGLTFCacheGuard()
+	{
+		gltf_parsed_meshes.clear();
+		gltf_decoded_textures.clear();
+	}
+};
+
 SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
 {
+	sGLTFCacheGuard cache_guard;
 	cgltf_result result;
 
 	if (data->scenes_count > 1)
@@ -608,10 +814,13 @@ SCN::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 		result = cgltf_load_buffers(&options, data, filename);
 		if (result != cgltf_result_success) {
 			stdlog(std::string("[BIN NOT FOUND]:") + filename);
+			cgltf_free(data);
 			return NULL;
 		}
 	}
 
+	prepareGLTFResources(data, scene, filename);
+
 	SCN::Prefab* prefab = new SCN::Prefab();
 
 	{
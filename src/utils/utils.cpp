@@ -1,6 +1,7 @@
 #include "utils.h"
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 
@@ -118,6 +119,24 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+uint64 hashData(const void* data, size_t size)
+{
+	//FNV-1a eight bytes at a time, with a shift to mix the high bits into the low ones
+	const uint8* bytes = (const uint8*)data;
+	uint64 hash = 14695981039346656037ULL ^ (uint64)size;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64 word;
+		memcpy(&word, bytes + i, 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash ? hash : 1; //0 means unknown
+}
+
 bool writeFile(const std::string& filename, std::string& content)
 {
 	FILE* f = fopen(filename.c_str(), "w");